@@ -39,6 +39,11 @@ LOCAL_MULTILIB := 32
 
 LOCAL_CFLAGS += -Wall -Wextra -Wno-unused-parameter
 
+# Natives only called by BluetoothProfileTests, left out of user builds.
+ifneq ($(TARGET_BUILD_VARIANT),user)
+LOCAL_CFLAGS += -DBT_JNI_TEST_HOOKS
+endif
+
 LOCAL_MODULE := libbluetooth_jni
 LOCAL_MODULE_TAGS := optional
 
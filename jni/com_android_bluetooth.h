@@ -32,6 +32,79 @@ const bt_interface_t* getBluetoothInterface();
 
 JNIEnv* getCallbackEnv();
 
+// Number of local references every callback may create without managing
+// them; more are allowed, this only sizes the initial frame.
+#define CALLBACK_LOCAL_FRAME_SIZE 16
+
+/**
+ * Scoped context for a callback from the stack. It checks that it runs on
+ * the JNI callback thread and pushes a local reference frame, so callbacks
+ * do not delete the references they create. On scope exit any pending Java
+ * exception is logged and cleared and the frame is popped.
+ *
+ *     CallbackEnv sCallbackEnv(__func__);
+ *     if (!sCallbackEnv.valid()) return;
+ */
+class CallbackEnv {
+  public:
+    explicit CallbackEnv(const char* methodName);
+    ~CallbackEnv();
+
+    bool valid() const { return mValid; }
+
+    JNIEnv* operator->() const { return mEnv; }
+    JNIEnv* get() const { return mEnv; }
+    operator JNIEnv*() const { return mEnv; }
+
+    // Returns |bd_addr| as a new byte array local to this callback. Java may
+    // keep or modify it. Returns NULL on allocation failure.
+    jbyteArray bdaddr(const bt_bdaddr_t* bd_addr);
+
+  private:
+    CallbackEnv(const CallbackEnv&);
+    CallbackEnv& operator=(const CallbackEnv&);
+
+    const char* mName;
+    JNIEnv* mEnv;
+    bool mValid;
+};
+
+/**
+ * Callback instrumentation
+ *
+ * Every callback from the stack declares a CALLBACK_TIMER() once it has
+ * checked its environment and calls CALLBACK_UPCALL() right before it calls
+ * into Java. Time before the upcall mark is accounted as preparation (JNI
+ * allocations and conversions), the rest as upcall time. Counters and log2
+ * latency histograms are kept per callback without locks and printed by
+ * dumpCallbackStats() as part of the adapter dump.
+ */
+struct CallbackStats;
+
+class CallbackTimer {
+  public:
+    CallbackTimer(const char* name, const char* file);
+    ~CallbackTimer();
+
+    // Marks the start of the Java upcall. Only the first call counts.
+    void upcall();
+
+  private:
+    CallbackStats* mStats;
+    int64_t mStartNs;
+    int64_t mUpcallNs;
+    CallbackTimer* mPrevious;
+};
+
+// Marks the upcall of the callback running on the current thread, for
+// helpers that make the Java call on behalf of a callback.
+void markCallbackUpcall();
+
+void dumpCallbackStats(int fd);
+
+#define CALLBACK_TIMER() CallbackTimer callbackTimer(__func__, __FILE__)
+#define CALLBACK_UPCALL() markCallbackUpcall()
+
 int register_com_android_bluetooth_hfp(JNIEnv* env);
 
 int register_com_android_bluetooth_hfpclient(JNIEnv* env);
@@ -38,76 +38,52 @@ static jmethodID method_onReconfigA2dpTriggered;
 
 static const btav_interface_t *sBluetoothA2dpInterface = NULL;
 static jobject mCallbacksObj = NULL;
-static JNIEnv *sCallbackEnv = NULL;
-
 static pthread_mutex_t mMutex = PTHREAD_MUTEX_INITIALIZER;
 
-static bool checkCallbackThread() {
-    // Always fetch the latest callbackEnv from AdapterService.
-    // Caching this could cause this sCallbackEnv to go out-of-sync
-    // with the AdapterService's ENV if an ASSOCIATE/DISASSOCIATE event
-    // is received
-    //if (sCallbackEnv == NULL) {
-    sCallbackEnv = getCallbackEnv();
-    //}
-
-    JNIEnv* env = AndroidRuntime::getJNIEnv();
-    if (sCallbackEnv != env || sCallbackEnv == NULL) return false;
-    return true;
-}
-
 static void bta2dp_connection_state_callback(btav_connection_state_t state, bt_bdaddr_t* bd_addr) {
     ALOGI("%s", __func__);
     CallbackEnv sCallbackEnv(__func__);
     if (!sCallbackEnv.valid()) return;
+    CALLBACK_TIMER();
 
-    jbyteArray addr = sCallbackEnv->NewByteArray(sizeof(bt_bdaddr_t));
+    jbyteArray addr = sCallbackEnv.bdaddr(bd_addr);
     if (!addr) {
         ALOGE("Fail to new jbyteArray bd addr for connection state");
-        checkAndClearExceptionFromCallback(sCallbackEnv, __FUNCTION__);
         return;
     }
 
-    sCallbackEnv->SetByteArrayRegion(addr, 0, sizeof(bt_bdaddr_t), (jbyte*) bd_addr);
-
     pthread_mutex_lock(&mMutex);
     if (mCallbacksObj != NULL) {
+        CALLBACK_UPCALL();
         sCallbackEnv->CallVoidMethod(mCallbacksObj, method_onConnectionStateChanged,
                         (jint) state, addr);
     } else {
         ALOGE("Callbacks Obj is no more valid: '%s", __FUNCTION__);
     }
     pthread_mutex_unlock(&mMutex);
-
-    checkAndClearExceptionFromCallback(sCallbackEnv, __FUNCTION__);
-    sCallbackEnv->DeleteLocalRef(addr);
 }
 
 static void bta2dp_audio_state_callback(btav_audio_state_t state, bt_bdaddr_t* bd_addr) {
     ALOGI("%s", __func__);
     CallbackEnv sCallbackEnv(__func__);
     if (!sCallbackEnv.valid()) return;
+    CALLBACK_TIMER();
 
-    jbyteArray addr = sCallbackEnv->NewByteArray(sizeof(bt_bdaddr_t));
+    jbyteArray addr = sCallbackEnv.bdaddr(bd_addr);
     if (!addr) {
         ALOGE("Fail to new jbyteArray bd addr for connection state");
-        checkAndClearExceptionFromCallback(sCallbackEnv, __FUNCTION__);
         return;
     }
 
-    sCallbackEnv->SetByteArrayRegion(addr, 0, sizeof(bt_bdaddr_t), (jbyte*) bd_addr);
-
     pthread_mutex_lock(&mMutex);
     if (mCallbacksObj != NULL) {
+        CALLBACK_UPCALL();
         sCallbackEnv->CallVoidMethod(mCallbacksObj, method_onAudioStateChanged,
                         (jint) state, addr);
     } else {
         ALOGE("Callbacks Obj is no more valid: '%s", __FUNCTION__);
     }
     pthread_mutex_unlock(&mMutex);
-
-    checkAndClearExceptionFromCallback(sCallbackEnv, __FUNCTION__);
-    sCallbackEnv->DeleteLocalRef(addr);
 }
 
 static void bta2dp_connection_priority_callback(bt_bdaddr_t* bd_addr) {
@@ -115,69 +91,67 @@ static void bta2dp_connection_priority_callback(bt_bdaddr_t* bd_addr) {
 
     ALOGI("%s", __FUNCTION__);
 
-    if (!checkCallbackThread()) {                                       \
-        ALOGE("Callback: '%s' is not called on the correct thread", __FUNCTION__); \
-        return;                                                         \
-    }
-    addr = sCallbackEnv->NewByteArray(sizeof(bt_bdaddr_t));
+    CallbackEnv sCallbackEnv(__func__);
+    if (!sCallbackEnv.valid()) return;
+    CALLBACK_TIMER();
+    addr = sCallbackEnv.bdaddr(bd_addr);
     if (!addr) {
         ALOGE("Fail to new jbyteArray bd addr for connection state");
-        checkAndClearExceptionFromCallback(sCallbackEnv, __FUNCTION__);
         return;
     }
 
-    sCallbackEnv->SetByteArrayRegion(addr, 0, sizeof(bt_bdaddr_t), (jbyte*) bd_addr);
-
     pthread_mutex_lock(&mMutex);
     if (mCallbacksObj != NULL) {
+        CALLBACK_UPCALL();
         sCallbackEnv->CallVoidMethod(mCallbacksObj, method_onCheckConnectionPriority,
                         addr);
     } else {
         ALOGE("Callbacks Obj is no more valid: '%s", __FUNCTION__);
     }
     pthread_mutex_unlock(&mMutex);
-
-    checkAndClearExceptionFromCallback(sCallbackEnv, __FUNCTION__);
-    sCallbackEnv->DeleteLocalRef(addr);
 }
 
 static void bta2dp_multicast_enabled_callback(int state) {
 
     ALOGI("%s", __FUNCTION__);
 
-    if (!checkCallbackThread()) {                                       \
-        ALOGE("Callback: '%s' is not called on the correct thread", __FUNCTION__); \
-        return;                                                         \
-    }
+    CallbackEnv sCallbackEnv(__func__);
+    if (!sCallbackEnv.valid()) return;
+    CALLBACK_TIMER();
 
     pthread_mutex_lock(&mMutex);
     if (mCallbacksObj != NULL) {
+        CALLBACK_UPCALL();
         sCallbackEnv->CallVoidMethod(mCallbacksObj, method_onMulticastStateChanged,
                         state);
     } else {
         ALOGE("Callbacks Obj is no more valid: '%s", __FUNCTION__);
     }
     pthread_mutex_unlock(&mMutex);
-
-    checkAndClearExceptionFromCallback(sCallbackEnv, __FUNCTION__);
 }
 
 static void bta2dp_reconfig_a2dp_trigger_callback(int reason, bt_bdaddr_t* bd_addr) {
-    jbyteArray addr;
     ALOGI("%s",__FUNCTION__);
 
-    addr = sCallbackEnv->NewByteArray(sizeof(bt_bdaddr_t));
+    CallbackEnv sCallbackEnv(__func__);
+    if (!sCallbackEnv.valid()) return;
+    CALLBACK_TIMER();
+    jbyteArray addr = sCallbackEnv.bdaddr(bd_addr);
     if (!addr) {
         ALOGE("Fail to new jbyteArray bd addr for connection state");
-        checkAndClearExceptionFromCallback(sCallbackEnv, __FUNCTION__);
         return;
     }
 
-    sCallbackEnv->SetByteArrayRegion(addr, 0, sizeof(bt_bdaddr_t), (jbyte*) bd_addr);
-    sCallbackEnv->CallVoidMethod(mCallbacksObj, method_onReconfigA2dpTriggered, reason, addr);
-    checkAndClearExceptionFromCallback(sCallbackEnv, __FUNCTION__);
-    sCallbackEnv->DeleteLocalRef(addr);
+    pthread_mutex_lock(&mMutex);
+    if (mCallbacksObj != NULL) {
+        CALLBACK_UPCALL();
+        sCallbackEnv->CallVoidMethod(mCallbacksObj, method_onReconfigA2dpTriggered, reason, addr);
+    } else {
+        ALOGE("Callbacks Obj is no more valid: '%s", __FUNCTION__);
+    }
+    pthread_mutex_unlock(&mMutex);
 }
+
 static btav_callbacks_t sBluetoothA2dpCallbacks = {
     sizeof(sBluetoothA2dpCallbacks),
     bta2dp_connection_state_callback,
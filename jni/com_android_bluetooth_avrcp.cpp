@@ -53,19 +53,6 @@ static jmethodID method_getTotalNumberOfItems;
 
 static const btrc_interface_t *sBluetoothMultiAvrcpInterface = NULL;
 static jobject mCallbacksObj = NULL;
-static JNIEnv *sCallbackEnv = NULL;
-
-static bool checkCallbackThread() {
-    // Always fetch the latest callbackEnv from AdapterService.
-    // Caching this could cause this sCallbackEnv to go out-of-sync
-    // with the AdapterService's ENV if an ASSOCIATE/DISASSOCIATE event
-    // is received
-    sCallbackEnv = getCallbackEnv();
-
-    JNIEnv* env = AndroidRuntime::getJNIEnv();
-    if (sCallbackEnv != env || sCallbackEnv == NULL) return false;
-    return true;
-}
 
 static void btavrcp_remote_features_callback(bt_bdaddr_t* bd_addr,
         btrc_remote_features_t features) {
@@ -73,46 +60,41 @@ static void btavrcp_remote_features_callback(bt_bdaddr_t* bd_addr,
     ALOGI("%s", __func__);
     CallbackEnv sCallbackEnv(__func__);
     if (!sCallbackEnv.valid()) return;
+    CALLBACK_TIMER();
 
-    jbyteArray addr = sCallbackEnv->NewByteArray(sizeof(bt_bdaddr_t));
+    jbyteArray addr = sCallbackEnv.bdaddr(bd_addr);
     if (!addr) {
         ALOGE("Fail to new jbyteArray bd addr for remote features");
-        checkAndClearExceptionFromCallback(sCallbackEnv, __FUNCTION__);
         return;
     }
 
     if (mCallbacksObj) {
-        sCallbackEnv->SetByteArrayRegion(addr, 0, sizeof(bt_bdaddr_t), (jbyte*) bd_addr);
+        CALLBACK_UPCALL();
         sCallbackEnv->CallVoidMethod(mCallbacksObj, method_getRcFeatures, addr,
                                                          (jint)features, addr);
     } else {
         ALOGE("%s: mCallbacksObj is null", __FUNCTION__);
     }
-
-    checkAndClearExceptionFromCallback(sCallbackEnv, __FUNCTION__);
-    sCallbackEnv->DeleteLocalRef(addr);
 }
 
 static void btavrcp_get_play_status_callback(bt_bdaddr_t* bd_addr) {
     ALOGI("%s", __func__);
     CallbackEnv sCallbackEnv(__func__);
     if (!sCallbackEnv.valid()) return;
+    CALLBACK_TIMER();
 
-    jbyteArray addr = sCallbackEnv->NewByteArray(sizeof(bt_bdaddr_t));
+    jbyteArray addr = sCallbackEnv.bdaddr(bd_addr);
     if (!addr) {
         ALOGE("Fail to new jbyteArray bd addr for get play status");
-        checkAndClearExceptionFromCallback(sCallbackEnv, __FUNCTION__);
         return;
     }
-    sCallbackEnv->SetByteArrayRegion(addr, 0, sizeof(bt_bdaddr_t), (jbyte*) bd_addr);
 
     if (mCallbacksObj) {
+        CALLBACK_UPCALL();
         sCallbackEnv->CallVoidMethod(mCallbacksObj, method_getPlayStatus, addr);
     } else {
         ALOGE("%s: mCallbacksObj is null", __FUNCTION__);
     }
-    checkAndClearExceptionFromCallback(sCallbackEnv, __FUNCTION__);
-    sCallbackEnv->DeleteLocalRef(addr);
 }
 
 static void btavrcp_get_element_attr_callback(uint8_t num_attr, btrc_media_attr_t *p_attrs,
@@ -120,8 +102,9 @@ static void btavrcp_get_element_attr_callback(uint8_t num_attr, btrc_media_attr_
     ALOGI("%s", __func__);
     CallbackEnv sCallbackEnv(__func__);
     if (!sCallbackEnv.valid()) return;
+    CALLBACK_TIMER();
 
-    jbyteArray addr = sCallbackEnv->NewByteArray(sizeof(bt_bdaddr_t));
+    jbyteArray addr = sCallbackEnv.bdaddr(bd_addr);
     if (!addr) {
         ALOGE("Fail to new jbyteArray bd addr for get_element_attr command");
         return;
@@ -130,19 +113,16 @@ static void btavrcp_get_element_attr_callback(uint8_t num_attr, btrc_media_attr_
     jintArray attrs = (jintArray)sCallbackEnv->NewIntArray(num_attr);
     if (!attrs) {
         ALOGE("Fail to new jintArray for attrs");
-        sCallbackEnv->DeleteLocalRef(addr);
         return;
     }
-    sCallbackEnv->SetByteArrayRegion(addr, 0, sizeof(bt_bdaddr_t), (jbyte*) bd_addr);
 
     if (mCallbacksObj) {
+        CALLBACK_UPCALL();
         sCallbackEnv->CallVoidMethod(mCallbacksObj ,method_onListPlayerAttributeValues,
                                     (jbyte)player_att, addr);
     } else {
         ALOGE("%s: mCallbacksObj is null", __FUNCTION__);
     }
-    checkAndClearExceptionFromCallback(sCallbackEnv, __FUNCTION__);
-    sCallbackEnv->DeleteLocalRef(addr);
 }
 
 static void btavrcp_register_notification_callback(btrc_event_id_t event_id, uint32_t param,
@@ -150,22 +130,20 @@ static void btavrcp_register_notification_callback(btrc_event_id_t event_id, uin
 
     CallbackEnv sCallbackEnv(__func__);
     if (!sCallbackEnv.valid()) return;
+    CALLBACK_TIMER();
 
-    jbyteArray addr = sCallbackEnv->NewByteArray(sizeof(bt_bdaddr_t));
+    jbyteArray addr = sCallbackEnv.bdaddr(bd_addr);
     if (!addr) {
         ALOGE("Fail to new jbyteArray bd addr for player attribute");
-        checkAndClearExceptionFromCallback(sCallbackEnv, __FUNCTION__);
         return;
     }
-    sCallbackEnv->SetByteArrayRegion(addr, 0, sizeof(bt_bdaddr_t), (jbyte*) bd_addr);
 
     if (mCallbacksObj) {
+        CALLBACK_UPCALL();
         sCallbackEnv->CallVoidMethod(mCallbacksObj,method_onListPlayerAttributeRequest, addr);
     } else {
         ALOGE("%s: mCallbacksObj is null", __FUNCTION__);
     }
-    checkAndClearExceptionFromCallback(sCallbackEnv, __FUNCTION__);
-    sCallbackEnv->DeleteLocalRef(addr);
 }
 
 static void btavrcp_volume_change_callback(uint8_t volume, uint8_t ctype,
@@ -174,32 +152,28 @@ static void btavrcp_volume_change_callback(uint8_t volume, uint8_t ctype,
     ALOGI("%s", __func__);
     CallbackEnv sCallbackEnv(__func__);
     if (!sCallbackEnv.valid()) return;
+    CALLBACK_TIMER();
 
-    jbyteArray addr = sCallbackEnv->NewByteArray(sizeof(bt_bdaddr_t));
+    jbyteArray addr = sCallbackEnv.bdaddr(bd_addr);
     if (!addr) {
         ALOGE("Fail to new jbyteArray bd addr for player app setting");
-        checkAndClearExceptionFromCallback(sCallbackEnv, __FUNCTION__);
         return;
     }
-    sCallbackEnv->SetByteArrayRegion(addr, 0, sizeof(bt_bdaddr_t), (jbyte*) bd_addr);
     attrs = (jintArray)sCallbackEnv->NewIntArray(num_attr);
     if (!attrs) {
         ALOGE("Fail to new jintArray for attrs");
-        checkAndClearExceptionFromCallback(sCallbackEnv, __FUNCTION__);
         return;
     }
     sCallbackEnv->SetIntArrayRegion(attrs, 0, num_attr, (jint *)p_attrs);
 
     if (mCallbacksObj) {
+        CALLBACK_UPCALL();
         sCallbackEnv->CallVoidMethod(mCallbacksObj,method_onGetPlayerAttributeValues,
                                      (jbyte)num_attr,attrs, addr);
     }
     else {
         ALOGE("%s: mCallbacksObj is null", __FUNCTION__);
     }
-    checkAndClearExceptionFromCallback(sCallbackEnv, __FUNCTION__);
-    sCallbackEnv->DeleteLocalRef(attrs);
-    sCallbackEnv->DeleteLocalRef(addr);
 }
 
 static void btavrcp_set_playerapp_setting_value_callback(btrc_player_settings_t *attr,
@@ -210,40 +184,33 @@ static void btavrcp_set_playerapp_setting_value_callback(btrc_player_settings_t
     ALOGV("%s", __FUNCTION__);
     jbyteArray addr;
 
-    if (!checkCallbackThread()) {
-        ALOGE("Callback: '%s' is not called on the correct thread", __FUNCTION__);
-        return;
-    }
-    addr = sCallbackEnv->NewByteArray(sizeof(bt_bdaddr_t));
+    CallbackEnv sCallbackEnv(__func__);
+    if (!sCallbackEnv.valid()) return;
+    CALLBACK_TIMER();
+    addr = sCallbackEnv.bdaddr(bd_addr);
     if (!addr) {
         ALOGE("Fail to new jbyteArray bd addr for set playerapp");
-        checkAndClearExceptionFromCallback(sCallbackEnv, __FUNCTION__);
         return;
     }
-    sCallbackEnv->SetByteArrayRegion(addr, 0, sizeof(bt_bdaddr_t), (jbyte*) bd_addr);
     attrs_ids   = (jbyteArray)sCallbackEnv->NewByteArray(attr->num_attr);
     if (!attrs_ids) {
         ALOGE("Fail to new jintArray for attrs");
-        checkAndClearExceptionFromCallback(sCallbackEnv, __FUNCTION__);
         return;
     }
     sCallbackEnv->SetByteArrayRegion(attrs_ids, 0, attr->num_attr, (jbyte *)attr->attr_ids);
     attrs_value = (jbyteArray)sCallbackEnv->NewByteArray(attr->num_attr);
     if (!attrs_value) {
         ALOGE("Fail to new jintArray for attrs");
-        checkAndClearExceptionFromCallback(sCallbackEnv, __FUNCTION__);
         return;
     }
     sCallbackEnv->SetByteArrayRegion(attrs_value, 0, attr->num_attr, (jbyte *)attr->attr_values);
     if (mCallbacksObj) {
+        CALLBACK_UPCALL();
         sCallbackEnv->CallVoidMethod(mCallbacksObj, method_setPlayerAppSetting,
                             (jbyte)attr->num_attr ,attrs_ids ,attrs_value, addr);
     } else {
         ALOGE("%s: mCallbacksObj is null", __FUNCTION__);
     }
-    sCallbackEnv->DeleteLocalRef(attrs_ids);
-    sCallbackEnv->DeleteLocalRef(attrs_value);
-    sCallbackEnv->DeleteLocalRef(addr);
 }
 
 static void btavrcp_set_addressed_player_callback(uint16_t player_id,
@@ -252,57 +219,52 @@ static void btavrcp_set_addressed_player_callback(uint16_t player_id,
     ALOGI("%s", __func__);
     CallbackEnv sCallbackEnv(__func__);
     if (!sCallbackEnv.valid()) return;
+    CALLBACK_TIMER();
 
-    jbyteArray addr = sCallbackEnv->NewByteArray(sizeof(bt_bdaddr_t));
+    jbyteArray addr = sCallbackEnv.bdaddr(bd_addr);
     if (!addr) {
         ALOGE("Fail to new jbyteArray bd addr for getPlayer app");
-        checkAndClearExceptionFromCallback(sCallbackEnv, __FUNCTION__);
         return;
     }
-    sCallbackEnv->SetByteArrayRegion(addr, 0, sizeof(bt_bdaddr_t), (jbyte*) bd_addr);
     attrs   = (jbyteArray)sCallbackEnv->NewByteArray(num);
     if (!attrs) {
         ALOGE("Fail to new jintArray for attrs");
-        checkAndClearExceptionFromCallback(sCallbackEnv, __FUNCTION__);
         return;
     }
     sCallbackEnv->SetByteArrayRegion(attrs, 0, num, (jbyte *)att);
     if (mCallbacksObj) {
+        CALLBACK_UPCALL();
         sCallbackEnv->CallVoidMethod(mCallbacksObj, method_getplayerattribute_text,
                                      (jbyte) num ,attrs, addr);
     } else {
         ALOGE("%s: mCallbacksObj is null", __FUNCTION__);
     }
-    sCallbackEnv->DeleteLocalRef(attrs);
-    sCallbackEnv->DeleteLocalRef(addr);
 }
 
 static void btavrcp_set_browsed_player_callback(uint16_t player_id, bt_bdaddr_t *bd_addr) {
     ALOGI("%s", __func__);
     CallbackEnv sCallbackEnv(__func__);
     if (!sCallbackEnv.valid()) return;
+    CALLBACK_TIMER();
 
-    jbyteArray addr = sCallbackEnv->NewByteArray(sizeof(bt_bdaddr_t));
+    jbyteArray addr = sCallbackEnv.bdaddr(bd_addr);
     if (!addr) {
         ALOGE("Fail to new jbyteArray bd addr for getPlayer app");
-        checkAndClearExceptionFromCallback(sCallbackEnv, __FUNCTION__);
         return;
     }
-    sCallbackEnv->SetByteArrayRegion(addr, 0, sizeof(bt_bdaddr_t), (jbyte*) bd_addr);
     Attr_Value   = (jbyteArray)sCallbackEnv->NewByteArray(num_val);
     if (!Attr_Value) {
         ALOGE("Fail to new jintArray for attrs");
-        checkAndClearExceptionFromCallback(sCallbackEnv, __FUNCTION__);
         return;
     }
     sCallbackEnv->SetByteArrayRegion(Attr_Value, 0, num_val, (jbyte *)value);
     if (mCallbacksObj) {
+        CALLBACK_UPCALL();
         sCallbackEnv->CallVoidMethod(mCallbacksObj, method_getplayervalue_text,(jbyte) attr_id,
                                      (jbyte) num_val , Attr_Value, addr);
     } else {
         ALOGE("%s: mCallbacksObj is null", __FUNCTION__);
     }
-    sCallbackEnv->DeleteLocalRef(Attr_Value);
 }
 
 static void btavrcp_get_folder_items_callback(uint8_t scope, uint32_t start_item,
@@ -310,22 +272,21 @@ static void btavrcp_get_folder_items_callback(uint8_t scope, uint32_t start_item
     ALOGI("%s", __func__);
     CallbackEnv sCallbackEnv(__func__);
     if (!sCallbackEnv.valid()) return;
+    CALLBACK_TIMER();
 
     if (!mCallbacksObj) {
         ALOGE("%s: mCallbacksObj is null", __func__);
         return;
     }
 
-    jbyteArray addr = sCallbackEnv->NewByteArray(sizeof(bt_bdaddr_t));
+    jbyteArray addr = sCallbackEnv.bdaddr(bd_addr);
     if (!addr) {
         ALOGE("Fail to new jbyteArray bd addr for element attr");
-        checkAndClearExceptionFromCallback(sCallbackEnv, __FUNCTION__);
         return;
     }
 
     uint32_t *puiAttr = (uint32_t *)p_attr_ids;
     jintArray attr_ids = NULL;
-    sCallbackEnv->SetByteArrayRegion(addr, 0, sizeof(bt_bdaddr_t), (jbyte*) bd_addr);
 
     /* check number of attributes requested by remote device */
     if ((num_attr != BTRC_NUM_ATTR_ALL) && (num_attr != BTRC_NUM_ATTR_NONE)) {
@@ -333,17 +294,16 @@ static void btavrcp_get_folder_items_callback(uint8_t scope, uint32_t start_item
         attr_ids = (jintArray)sCallbackEnv->NewIntArray(num_attr);
         if (!attr_ids) {
             ALOGE("Fail to allocate new jintArray for attrs");
-            sCallbackEnv->DeleteLocalRef(addr);
             return;
         }
         sCallbackEnv->SetIntArrayRegion(attr_ids, 0, num_attr, (jint *)puiAttr);
     }
 
+    CALLBACK_UPCALL();
     sCallbackEnv->CallVoidMethod(mCallbacksObj, method_getFolderItemsCallback, addr,
             (jbyte) scope, (jint) start_item, (jint) end_item, (jbyte) num_attr, attr_ids);
 
     if (attr_ids != NULL) sCallbackEnv->DeleteLocalRef(attr_ids);
-    sCallbackEnv->DeleteLocalRef(addr);
 }
 
 static void btavrcp_change_path_callback(uint8_t direction, uint8_t* folder_uid,
@@ -351,6 +311,7 @@ static void btavrcp_change_path_callback(uint8_t direction, uint8_t* folder_uid,
     ALOGI("%s", __func__);
     CallbackEnv sCallbackEnv(__func__);
     if (!sCallbackEnv.valid()) return;
+    CALLBACK_TIMER();
 
     if (!mCallbacksObj) {
         ALOGE("%s: mCallbacksObj is null", __func__);
@@ -363,21 +324,17 @@ static void btavrcp_change_path_callback(uint8_t direction, uint8_t* folder_uid,
         return;
     }
 
-    jbyteArray addr = sCallbackEnv->NewByteArray(sizeof(bt_bdaddr_t));
+    jbyteArray addr = sCallbackEnv.bdaddr(bd_addr);
     if (!addr) {
         ALOGE("Fail to new jbyteArray bd addr for volume change");
-        checkAndClearExceptionFromCallback(sCallbackEnv, __FUNCTION__);
         return;
     }
 
-    sCallbackEnv->SetByteArrayRegion(addr, 0, sizeof(bt_bdaddr_t), (jbyte*) bd_addr);
     sCallbackEnv->SetByteArrayRegion(
             attrs, 0, sizeof(uint8_t)*BTRC_UID_SIZE, (jbyte *)folder_uid);
+    CALLBACK_UPCALL();
     sCallbackEnv->CallVoidMethod(mCallbacksObj, method_changePathCallback, addr,
          (jbyte) direction, attrs);
-
-    checkAndClearExceptionFromCallback(sCallbackEnv, __FUNCTION__);
-    sCallbackEnv->DeleteLocalRef(addr);
 }
 
 static void btavrcp_get_item_attr_callback( uint8_t scope, uint8_t* uid, uint16_t uid_counter,
@@ -386,6 +343,7 @@ static void btavrcp_get_item_attr_callback( uint8_t scope, uint8_t* uid, uint16_
     ALOGI("%s", __func__);
     CallbackEnv sCallbackEnv(__func__);
     if (!sCallbackEnv.valid()) return;
+    CALLBACK_TIMER();
 
     if (mCallbacksObj) {
         ALOGE("%s: mCallbacksObj is null", __func__);
@@ -398,13 +356,11 @@ static void btavrcp_get_item_attr_callback( uint8_t scope, uint8_t* uid, uint16_
         return;
     }
 
-    jbyteArray addr = sCallbackEnv->NewByteArray(sizeof(bt_bdaddr_t));
+    jbyteArray addr = sCallbackEnv.bdaddr(bd_addr);
     if (!addr) {
         ALOGE("Fail to new jbyteArray bd addr for get folder items");
-        checkAndClearExceptionFromCallback(sCallbackEnv, __FUNCTION__);
         return;
     }
-    sCallbackEnv->SetByteArrayRegion(addr, 0, sizeof(bt_bdaddr_t), (jbyte*) bd_addr);
     if (num_attr == 0xff) {
         num_attr = 0; // 0xff signifies no attribute required in response
     } else if (num_attr == 0) {
@@ -414,27 +370,23 @@ static void btavrcp_get_item_attr_callback( uint8_t scope, uint8_t* uid, uint16_
     jintArray attrs = (jintArray)sCallbackEnv->NewIntArray(num_attr);
     if (!attrs) {
         ALOGE("Fail to new jintArray for attrs");
-        checkAndClearExceptionFromCallback(sCallbackEnv, __FUNCTION__);
         return;
     }
     sCallbackEnv->SetIntArrayRegion(attrs, 0, num_attr, (jint *)param->attrs);
 
-    sCallbackEnv->SetByteArrayRegion(addr, 0, sizeof(bt_bdaddr_t), (jbyte*) bd_addr);
     sCallbackEnv->SetIntArrayRegion(attrs, 0, num_attr, (jint *)p_attrs);
     sCallbackEnv->SetByteArrayRegion(attr_uid, 0, sizeof(uint8_t)*BTRC_UID_SIZE, (jbyte *)uid);
 
+    CALLBACK_UPCALL();
     sCallbackEnv->CallVoidMethod(mCallbacksObj, method_getItemAttrCallback, addr,
         (jbyte) scope, attr_uid, (jint) uid_counter, (jbyte)num_attr, attrs);
-
-    checkAndClearExceptionFromCallback(sCallbackEnv, __FUNCTION__);
-    sCallbackEnv->DeleteLocalRef(attrs);
-    sCallbackEnv->DeleteLocalRef(addr);
 }
 
 static void btavrcp_play_item_callback(uint8_t scope, uint16_t uid_counter, uint8_t* uid,
     bt_bdaddr_t *bd_addr) {
     CallbackEnv sCallbackEnv(__func__);
     if (!sCallbackEnv.valid()) return;
+    CALLBACK_TIMER();
 
     if (!mCallbacksObj) {
         ALOGE("%s: mCallbacksObj is null", __func__);
@@ -447,66 +399,44 @@ static void btavrcp_play_item_callback(uint8_t scope, uint16_t uid_counter, uint
         return;
     }
 
-    jbyteArray addr = sCallbackEnv->NewByteArray(sizeof(bt_bdaddr_t));
+    jbyteArray addr = sCallbackEnv.bdaddr(bd_addr);
     if (!addr) {
         ALOGE("Fail to new jbyteArray bd addr for set addressed player");
-        checkAndClearExceptionFromCallback(sCallbackEnv, __FUNCTION__);
         return;
     }
-    sCallbackEnv->SetByteArrayRegion(addr, 0, sizeof(bt_bdaddr_t), (jbyte*) bd_addr);
 
-    sCallbackEnv->SetByteArrayRegion(addr, 0, sizeof(bt_bdaddr_t), (jbyte*) bd_addr);
     sCallbackEnv->SetByteArrayRegion(attrs, 0, sizeof(uint8_t)*BTRC_UID_SIZE, (jbyte *)uid);
+    CALLBACK_UPCALL();
     sCallbackEnv->CallVoidMethod(mCallbacksObj, method_playItemCallback, addr,
                 (jbyte) scope, (jint) uid_counter, attrs);
-
-    checkAndClearExceptionFromCallback(sCallbackEnv, __FUNCTION__);
-    sCallbackEnv->DeleteLocalRef(addr);
 }
 
 static void btavrcp_get_total_num_items_callback(uint8_t scope, bt_bdaddr_t *bd_addr) {
     CallbackEnv sCallbackEnv(__func__);
     if (!sCallbackEnv.valid()) return;
+    CALLBACK_TIMER();
 
     if (!mCallbacksObj) {
         ALOGE("%s: mCallbacksObj is null", __func__);
         return;
     }
 
-    jbyteArray addr = sCallbackEnv->NewByteArray(sizeof(bt_bdaddr_t));
+    jbyteArray addr = sCallbackEnv.bdaddr(bd_addr);
     if (!addr) {
-        ALOGE("Fail to new jbyteArray bd addr for change path");
-        checkAndClearExceptionFromCallback(sCallbackEnv, __FUNCTION__);
+        ALOGE("Fail to new jbyteArray bd addr for get total num items");
         return;
     }
-    sCallbackEnv->SetByteArrayRegion(addr, 0, sizeof(bt_bdaddr_t), (jbyte*) bd_addr);
-    if (mCallbacksObj) {
-        sCallbackEnv->CallVoidMethod(mCallbacksObj, method_changePath, (jbyte)direction,
-                                     (jlong)uid, addr);
-    } else {
-        ALOGE("%s: mCallbacksObj is null", __FUNCTION__);
-    }
-    checkAndClearExceptionFromCallback(sCallbackEnv, __FUNCTION__);
-    sCallbackEnv->DeleteLocalRef(addr);
-}
 
-static void btavrcp_play_item_callback(uint8_t scope, uint64_t uid, bt_bdaddr_t* bd_addr) {
-    jbyteArray addr;
-    ALOGV("%s", __FUNCTION__);
-    ALOGV("scope: %d, uid: %lu", scope, uid);
-
-    sCallbackEnv->SetByteArrayRegion(addr, 0, sizeof(bt_bdaddr_t), (jbyte*) bd_addr);
+    CALLBACK_UPCALL();
     sCallbackEnv->CallVoidMethod(
-            mCallbacksObj, method_getTotalNumOfItemsCallback, addr, (jbyte) scope);
-
-    checkAndClearExceptionFromCallback(sCallbackEnv, __FUNCTION__);
-    sCallbackEnv->DeleteLocalRef(addr);
+            mCallbacksObj, method_getTotalNumberOfItems, (jbyte) scope, addr);
 }
 
 static void btavrcp_search_callback(uint16_t charset_id, uint16_t str_len, uint8_t* p_str,
     bt_bdaddr_t *bd_addr) {
     CallbackEnv sCallbackEnv(__func__);
     if (!sCallbackEnv.valid()) return;
+    CALLBACK_TIMER();
     if (!mCallbacksObj) {
         ALOGE("%s: mCallbacksObj is null", __func__);
         return;
@@ -518,22 +448,17 @@ static void btavrcp_search_callback(uint16_t charset_id, uint16_t str_len, uint8
         return;
     }
 
-    jbyteArray addr = sCallbackEnv->NewByteArray(sizeof(bt_bdaddr_t));
+    jbyteArray addr = sCallbackEnv.bdaddr(bd_addr);
     if (!addr) {
         ALOGE("Fail to new jbyteArray bd addr for get item attr");
-        checkAndClearExceptionFromCallback(sCallbackEnv, __FUNCTION__);
         return;
     }
 
-    sCallbackEnv->SetByteArrayRegion(addr, 0, sizeof(bt_bdaddr_t), (jbyte*) bd_addr);
     sCallbackEnv->SetByteArrayRegion(
             attrs, 0, str_len*sizeof(uint8_t), (jbyte *)p_str);
+    CALLBACK_UPCALL();
     sCallbackEnv->CallVoidMethod(
             mCallbacksObj, method_searchCallback, addr, (jint) charset_id, attrs);
-
-    checkAndClearExceptionFromCallback(sCallbackEnv, __FUNCTION__);
-    sCallbackEnv->DeleteLocalRef(attrs);
-    sCallbackEnv->DeleteLocalRef(addr);
 }
 
 static void btavrcp_add_to_play_list_callback(uint8_t scope,
@@ -541,32 +466,28 @@ static void btavrcp_add_to_play_list_callback(uint8_t scope,
 
     CallbackEnv sCallbackEnv(__func__);
     if (!sCallbackEnv.valid()) return;
+    CALLBACK_TIMER();
     if (!mCallbacksObj) {
         ALOGE("%s: mCallbacksObj is null", __func__);
         return;
     }
 
-    jbyteArray addr = sCallbackEnv->NewByteArray(sizeof(bt_bdaddr_t));
+    jbyteArray addr = sCallbackEnv.bdaddr(bd_addr);
     if (!addr) {
         ALOGE("Fail to new jbyteArray bd addr for connection state");
-        checkAndClearExceptionFromCallback(sCallbackEnv, __FUNCTION__);
         return;
     }
 
     jbyteArray attrs = sCallbackEnv->NewByteArray(BTRC_UID_SIZE);
     if (!attrs) {
         ALOGE("Fail to new jByteArray for attrs");
-        sCallbackEnv->DeleteLocalRef(addr);
         return;
     }
 
-    sCallbackEnv->SetByteArrayRegion(addr, 0, sizeof(bt_bdaddr_t), (jbyte*) bd_addr);
     sCallbackEnv->SetByteArrayRegion(attrs, 0, sizeof(uint8_t)*BTRC_UID_SIZE, (jbyte *)uid);
+    CALLBACK_UPCALL();
     sCallbackEnv->CallVoidMethod(mCallbacksObj, method_addToPlayListCallback, addr,
                  (jbyte) scope, attrs, (jint) uid_counter);
-
-    sCallbackEnv->DeleteLocalRef(attrs);
-    sCallbackEnv->DeleteLocalRef(addr);
 }
 
 static btrc_callbacks_t sBluetoothAvrcpCallbacks = {
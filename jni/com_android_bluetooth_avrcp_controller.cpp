@@ -42,35 +42,28 @@ static jmethodID method_handleGroupNavigationRsp;
 
 static const btrc_ctrl_interface_t *sBluetoothAvrcpInterface = NULL;
 static jobject mCallbacksObj = NULL;
-static JNIEnv *sCallbackEnv = NULL;
 
 static void btavrcp_passthrough_response_callback(bt_bdaddr_t* bd_addr, int id, int pressed)  {
     ALOGI("%s: id: %d, pressed: %d", __func__, id, pressed);
     CallbackEnv sCallbackEnv(__func__);
     if (!sCallbackEnv.valid()) return;
+    CALLBACK_TIMER();
 
-    jbyteArray addr = sCallbackEnv->NewByteArray(sizeof(bt_bdaddr_t));
-    if (!addr) {
-        ALOGE("Fail to new jbyteArray bd addr for passthrough response");
-        return;
-    }
-
+    CALLBACK_UPCALL();
     sCallbackEnv->CallVoidMethod(mCallbacksObj, method_handlePassthroughRsp, (jint)id,
                                                                              (jint)pressed);
-    checkAndClearExceptionFromCallback(sCallbackEnv, __FUNCTION__);
 }
 
 static void btavrcp_groupnavigation_response_callback(int id, int pressed) {
     ALOGI("%s", __FUNCTION__);
 
-    if (!checkCallbackThread()) {
-        ALOGE("Callback: '%s' is not called on the correct thread", __FUNCTION__);
-        return;
-    }
+    CallbackEnv sCallbackEnv(__func__);
+    if (!sCallbackEnv.valid()) return;
+    CALLBACK_TIMER();
 
+    CALLBACK_UPCALL();
     sCallbackEnv->CallVoidMethod(mCallbacksObj, method_handleGroupNavigationRsp, (jint)id,
                                                                              (jint)pressed);
-    checkAndClearExceptionFromCallback(sCallbackEnv, __FUNCTION__);
 }
 
 static void btavrcp_connection_state_callback(bool state, bt_bdaddr_t* bd_addr) {
@@ -79,41 +72,35 @@ static void btavrcp_connection_state_callback(bool state, bt_bdaddr_t* bd_addr)
     ALOGI("%s", __FUNCTION__);
     ALOGI("conn state: %d", state);
 
-    if (!checkCallbackThread()) {                                       \
-        ALOGE("Callback: '%s' is not called on the correct thread", __FUNCTION__); \
-        return;                                                         \
-    }
+    CallbackEnv sCallbackEnv(__func__);
+    if (!sCallbackEnv.valid()) return;
+    CALLBACK_TIMER();
 
-    addr = sCallbackEnv->NewByteArray(sizeof(bt_bdaddr_t));
+    addr = sCallbackEnv.bdaddr(bd_addr);
     if (!addr) {
         ALOGE("Fail to new jbyteArray bd addr for connection state");
-        checkAndClearExceptionFromCallback(sCallbackEnv, __FUNCTION__);
         return;
     }
 
-    sCallbackEnv->SetByteArrayRegion(addr, 0, sizeof(bt_bdaddr_t), (jbyte*) bd_addr);
+    CALLBACK_UPCALL();
     sCallbackEnv->CallVoidMethod(mCallbacksObj, method_onConnectionStateChanged, (jboolean) state,
                                  addr);
-    checkAndClearExceptionFromCallback(sCallbackEnv, __FUNCTION__);
-    sCallbackEnv->DeleteLocalRef(addr);
 }
 
 static void btavrcp_get_rcfeatures_callback(bt_bdaddr_t *bd_addr, int features) {
     ALOGV("%s", __func__);
     CallbackEnv sCallbackEnv(__func__);
     if (!sCallbackEnv.valid()) return;
+    CALLBACK_TIMER();
 
-    jbyteArray addr = sCallbackEnv->NewByteArray(sizeof(bt_bdaddr_t));
+    jbyteArray addr = sCallbackEnv.bdaddr(bd_addr);
     if (!addr) {
         ALOGE("Fail to new jbyteArray bd addr ");
-        checkAndClearExceptionFromCallback(sCallbackEnv, __FUNCTION__);
         return;
     }
 
-    sCallbackEnv->SetByteArrayRegion(addr, 0, sizeof(bt_bdaddr_t), (jbyte*) bd_addr);
+    CALLBACK_UPCALL();
     sCallbackEnv->CallVoidMethod(mCallbacksObj, method_getRcFeatures, addr, (jint)features);
-    checkAndClearExceptionFromCallback(sCallbackEnv, __FUNCTION__);
-    sCallbackEnv->DeleteLocalRef(addr);
 }
 
 static void btavrcp_setplayerapplicationsetting_rsp_callback(bt_bdaddr_t *bd_addr,
@@ -121,18 +108,16 @@ static void btavrcp_setplayerapplicationsetting_rsp_callback(bt_bdaddr_t *bd_add
     ALOGV("%s", __func__);
     CallbackEnv sCallbackEnv(__func__);
     if (!sCallbackEnv.valid()) return;
+    CALLBACK_TIMER();
 
-    jbyteArray addr = sCallbackEnv->NewByteArray(sizeof(bt_bdaddr_t));
+    jbyteArray addr = sCallbackEnv.bdaddr(bd_addr);
     if (!addr) {
         ALOGE("Fail to new jbyteArray bd addr ");
-        checkAndClearExceptionFromCallback(sCallbackEnv, __FUNCTION__);
         return;
     }
 
-    sCallbackEnv->SetByteArrayRegion(addr, 0, sizeof(bt_bdaddr_t), (jbyte*) bd_addr);
+    CALLBACK_UPCALL();
     sCallbackEnv->CallVoidMethod(mCallbacksObj, method_setplayerappsettingrsp, addr, (jint)accepted);
-    checkAndClearExceptionFromCallback(sCallbackEnv, __FUNCTION__);
-    sCallbackEnv->DeleteLocalRef(addr);
 }
 
 static void btavrcp_playerapplicationsetting_callback(bt_bdaddr_t *bd_addr, uint8_t num_attr,
@@ -141,14 +126,13 @@ static void btavrcp_playerapplicationsetting_callback(bt_bdaddr_t *bd_addr, uint
     ALOGI("%s", __func__);
     CallbackEnv sCallbackEnv(__func__);
     if (!sCallbackEnv.valid()) return;
+    CALLBACK_TIMER();
 
-    jbyteArray addr = sCallbackEnv->NewByteArray(sizeof(bt_bdaddr_t));
+    jbyteArray addr = sCallbackEnv.bdaddr(bd_addr);
     if (!addr) {
         ALOGE("Fail to new jbyteArray bd addr ");
-        checkAndClearExceptionFromCallback(sCallbackEnv, __FUNCTION__);
         return;
     }
-    sCallbackEnv->SetByteArrayRegion(addr, 0, sizeof(bt_bdaddr_t), (jbyte*)bd_addr);
     /* TODO ext attrs
      * Flattening defined attributes: <id,num_values,values[]>
      */
@@ -162,7 +146,6 @@ static void btavrcp_playerapplicationsetting_callback(bt_bdaddr_t *bd_addr, uint
     jbyteArray playerattribs = sCallbackEnv->NewByteArray(arraylen);
     if (!playerattribs) {
         ALOGE("Fail to new jbyteArray playerattribs ");
-        checkAndClearExceptionFromCallback(sCallbackEnv, __FUNCTION__);
         sCallbackEnv->DeleteLocalRef(addr);
         return;
     }
@@ -176,9 +159,9 @@ static void btavrcp_playerapplicationsetting_callback(bt_bdaddr_t *bd_addr, uint
                 (jbyte*)(app_attrs[i].attr_val));
         k = k + app_attrs[i].num_val;
     }
+    CALLBACK_UPCALL();
     sCallbackEnv->CallVoidMethod(mCallbacksObj, method_handleplayerappsetting, addr,
             playerattribs, (jint)arraylen);
-    checkAndClearExceptionFromCallback(sCallbackEnv, __FUNCTION__);
     sCallbackEnv->DeleteLocalRef(addr);
     sCallbackEnv->DeleteLocalRef(playerattribs);
 }
@@ -188,20 +171,18 @@ static void btavrcp_playerapplicationsetting_changed_callback(bt_bdaddr_t *bd_ad
     ALOGI("%s", __func__);
     CallbackEnv sCallbackEnv(__func__);
     if (!sCallbackEnv.valid()) return;
+    CALLBACK_TIMER();
 
-    jbyteArray addr = sCallbackEnv->NewByteArray(sizeof(bt_bdaddr_t));
+    jbyteArray addr = sCallbackEnv.bdaddr(bd_addr);
     if (!addr) {
         ALOGE("Fail to get new array ");
-        checkAndClearExceptionFromCallback(sCallbackEnv, __FUNCTION__);
         return;
     }
-    sCallbackEnv->SetByteArrayRegion(addr, 0, sizeof(bt_bdaddr_t), (jbyte*)bd_addr);
 
     int arraylen = p_vals->num_attr*2;
     jbyteArray playerattribs = sCallbackEnv->NewByteArray(arraylen);
     if (!playerattribs) {
         ALOGE("Fail to new jbyteArray playerattribs ");
-        checkAndClearExceptionFromCallback(sCallbackEnv, __FUNCTION__);
         sCallbackEnv->DeleteLocalRef(addr);
         return;
     }
@@ -214,9 +195,9 @@ static void btavrcp_playerapplicationsetting_changed_callback(bt_bdaddr_t *bd_ad
         sCallbackEnv->SetByteArrayRegion(playerattribs, k, 1, (jbyte*)&(p_vals->attr_values[i]));
         k++;
     }
+    CALLBACK_UPCALL();
     sCallbackEnv->CallVoidMethod(mCallbacksObj, method_handleplayerappsettingchanged, addr,
             playerattribs, (jint)arraylen);
-    checkAndClearExceptionFromCallback(sCallbackEnv, __FUNCTION__);
     sCallbackEnv->DeleteLocalRef(addr);
     sCallbackEnv->DeleteLocalRef(playerattribs);
 }
@@ -226,38 +207,34 @@ static void btavrcp_set_abs_vol_cmd_callback(bt_bdaddr_t *bd_addr, uint8_t abs_v
     ALOGI("%s", __func__);
     CallbackEnv sCallbackEnv(__func__);
     if (!sCallbackEnv.valid()) return;
+    CALLBACK_TIMER();
 
-    jbyteArray addr = sCallbackEnv->NewByteArray(sizeof(bt_bdaddr_t));
+    jbyteArray addr = sCallbackEnv.bdaddr(bd_addr);
     if (!addr) {
         ALOGE("Fail to get new array ");
-        checkAndClearExceptionFromCallback(sCallbackEnv, __FUNCTION__);
         return;
     }
 
-    sCallbackEnv->SetByteArrayRegion(addr, 0, sizeof(bt_bdaddr_t), (jbyte*)bd_addr);
+    CALLBACK_UPCALL();
     sCallbackEnv->CallVoidMethod(mCallbacksObj, method_handleSetAbsVolume, addr, (jbyte)abs_vol,
                                  (jbyte)label);
-    checkAndClearExceptionFromCallback(sCallbackEnv, __FUNCTION__);
-    sCallbackEnv->DeleteLocalRef(addr);
 }
 
 static void btavrcp_register_notification_absvol_callback(bt_bdaddr_t *bd_addr, uint8_t label) {
     ALOGI("%s", __func__);
     CallbackEnv sCallbackEnv(__func__);
     if (!sCallbackEnv.valid()) return;
+    CALLBACK_TIMER();
 
-    jbyteArray addr = sCallbackEnv->NewByteArray(sizeof(bt_bdaddr_t));
+    jbyteArray addr = sCallbackEnv.bdaddr(bd_addr);
     if (!addr) {
         ALOGE("Fail to get new array ");
-        checkAndClearExceptionFromCallback(sCallbackEnv, __FUNCTION__);
         return;
     }
 
-    sCallbackEnv->SetByteArrayRegion(addr, 0, sizeof(bt_bdaddr_t), (jbyte*)bd_addr);
+    CALLBACK_UPCALL();
     sCallbackEnv->CallVoidMethod(mCallbacksObj, method_handleRegisterNotificationAbsVol, addr,
                                  (jbyte)label);
-    checkAndClearExceptionFromCallback(sCallbackEnv, __FUNCTION__);
-    sCallbackEnv->DeleteLocalRef(addr);
 }
 
 static void btavrcp_track_changed_callback(bt_bdaddr_t *bd_addr, uint8_t num_attr,
@@ -269,30 +246,24 @@ static void btavrcp_track_changed_callback(bt_bdaddr_t *bd_addr, uint8_t num_att
     ALOGI("%s", __func__);
     CallbackEnv sCallbackEnv(__func__);
     if (!sCallbackEnv.valid()) return;
+    CALLBACK_TIMER();
 
-    jbyteArray addr = sCallbackEnv->NewByteArray(sizeof(bt_bdaddr_t));
+    jbyteArray addr = sCallbackEnv.bdaddr(bd_addr);
     if (!addr) {
         ALOGE("Fail to get new array ");
-        checkAndClearExceptionFromCallback(sCallbackEnv, __FUNCTION__);
         return;
     }
 
     jintArray attribIds = sCallbackEnv->NewIntArray(num_attr);
     if (!attribIds) {
         ALOGE(" failed to set new array for attribIds");
-        checkAndClearExceptionFromCallback(sCallbackEnv, __FUNCTION__);
-        sCallbackEnv->DeleteLocalRef(addr);
         return;
     }
-    sCallbackEnv->SetByteArrayRegion(addr, 0, sizeof(bt_bdaddr_t), (jbyte*)bd_addr);
 
     jclass strclazz = sCallbackEnv->FindClass("java/lang/String");
     jobjectArray stringArray = sCallbackEnv->NewObjectArray((jint)num_attr, strclazz, 0);
     if (!stringArray) {
         ALOGE(" failed to get String array");
-        checkAndClearExceptionFromCallback(sCallbackEnv, __FUNCTION__);
-        sCallbackEnv->DeleteLocalRef(addr);
-        sCallbackEnv->DeleteLocalRef(attribIds);
         return;
     }
 
@@ -300,9 +271,6 @@ static void btavrcp_track_changed_callback(bt_bdaddr_t *bd_addr, uint8_t num_att
         jstring str = sCallbackEnv->NewStringUTF((char*)(p_attrs[i].text));
         if (!str) {
             ALOGE("Unable to get str");
-            sCallbackEnv->DeleteLocalRef(addr);
-            sCallbackEnv->DeleteLocalRef(attribIds);
-            sCallbackEnv->DeleteLocalRef(stringArray);
             return;
         }
         sCallbackEnv->SetIntArrayRegion(attribIds, i, 1, (jint*)&(p_attrs[i].attr_id));
@@ -310,14 +278,9 @@ static void btavrcp_track_changed_callback(bt_bdaddr_t *bd_addr, uint8_t num_att
         sCallbackEnv->DeleteLocalRef(str);
     }
 
+    CALLBACK_UPCALL();
     sCallbackEnv->CallVoidMethod(mCallbacksObj, method_handletrackchanged, addr,
          (jbyte)(num_attr), attribIds, stringArray);
-    checkAndClearExceptionFromCallback(sCallbackEnv, __FUNCTION__);
-    sCallbackEnv->DeleteLocalRef(addr);
-    sCallbackEnv->DeleteLocalRef(attribIds);
-    /* TODO check do we need to delete str seperately or not */
-    sCallbackEnv->DeleteLocalRef(stringArray);
-    sCallbackEnv->DeleteLocalRef(strclazz);
 }
 
 static void btavrcp_play_position_changed_callback(bt_bdaddr_t *bd_addr, uint32_t song_len,
@@ -325,17 +288,16 @@ static void btavrcp_play_position_changed_callback(bt_bdaddr_t *bd_addr, uint32_
     ALOGI("%s", __func__);
     CallbackEnv sCallbackEnv(__func__);
     if (!sCallbackEnv.valid()) return;
+    CALLBACK_TIMER();
 
-    jbyteArray addr = sCallbackEnv->NewByteArray(sizeof(bt_bdaddr_t));
+    jbyteArray addr = sCallbackEnv.bdaddr(bd_addr);
     if (!addr) {
         ALOGE("Fail to get new array ");
-        checkAndClearExceptionFromCallback(sCallbackEnv, __FUNCTION__);
         return;
     }
-    sCallbackEnv->SetByteArrayRegion(addr, 0, sizeof(bt_bdaddr_t), (jbyte*) bd_addr);
+    CALLBACK_UPCALL();
     sCallbackEnv->CallVoidMethod(mCallbacksObj, method_handleplaypositionchanged, addr,
          (jint)(song_len), (jint)song_pos, (jbyte)play_status);
-    sCallbackEnv->DeleteLocalRef(addr);
 }
 
 static void btavrcp_play_status_changed_callback(bt_bdaddr_t *bd_addr,
@@ -343,17 +305,16 @@ static void btavrcp_play_status_changed_callback(bt_bdaddr_t *bd_addr,
     ALOGI("%s", __func__);
     CallbackEnv sCallbackEnv(__func__);
     if (!sCallbackEnv.valid()) return;
+    CALLBACK_TIMER();
 
-    jbyteArray addr = sCallbackEnv->NewByteArray(sizeof(bt_bdaddr_t));
+    jbyteArray addr = sCallbackEnv.bdaddr(bd_addr);
     if (!addr) {
         ALOGE("Fail to get new array ");
-        checkAndClearExceptionFromCallback(sCallbackEnv, __FUNCTION__);
         return;
     }
-    sCallbackEnv->SetByteArrayRegion(addr, 0, sizeof(bt_bdaddr_t), (jbyte*) bd_addr);
+    CALLBACK_UPCALL();
     sCallbackEnv->CallVoidMethod(mCallbacksObj, method_handleplaystatuschanged, addr,
              (jbyte)play_status);
-    sCallbackEnv->DeleteLocalRef(addr);
 }
 
 static void btavrcp_get_folder_items_callback(bt_bdaddr_t *bd_addr,
@@ -365,6 +326,7 @@ static void btavrcp_get_folder_items_callback(bt_bdaddr_t *bd_addr,
     ALOGV("%s count %d", __func__, count);
     CallbackEnv sCallbackEnv(__func__);
     if (!sCallbackEnv.valid()) return;
+    CALLBACK_TIMER();
 
     // Inspect if the first element is a folder/item or player listing. They are
     // always exclusive.
@@ -419,6 +381,7 @@ static void btavrcp_get_folder_items_callback(bt_bdaddr_t *bd_addr,
                     sCallbackEnv->DeleteLocalRef(attrValStr);
                 }
 
+                CALLBACK_UPCALL();
                 jobject mediaObj = (jobject) sCallbackEnv->CallObjectMethod(
                     sCallbacksObj, method_createFromNativeMediaItem, uidByteArray,
                     (jint) item->media.type, mediaName, attrIdArray, attrValArray);
@@ -515,7 +478,9 @@ static void btavrcp_change_path_callback(bt_bdaddr_t *bd_addr, uint8_t count) {
     ALOGI("%s count %d", __func__, count);
     CallbackEnv sCallbackEnv(__func__);
     if (!sCallbackEnv.valid()) return;
+    CALLBACK_TIMER();
 
+    CALLBACK_UPCALL();
     sCallbackEnv->CallVoidMethod(sCallbacksObj, method_handleChangeFolderRsp, (jint) count);
 }
 
@@ -524,7 +489,9 @@ static void btavrcp_set_browsed_player_callback(
     ALOGI("%s items %d depth %d", __func__, num_items, depth);
     CallbackEnv sCallbackEnv(__func__);
     if (!sCallbackEnv.valid()) return;
+    CALLBACK_TIMER();
 
+    CALLBACK_UPCALL();
     sCallbackEnv->CallVoidMethod(
         sCallbacksObj, method_handleSetBrowsedPlayerRsp, (jint) num_items, (jint) depth);
 }
@@ -535,7 +502,9 @@ static void btavrcp_set_addressed_player_callback(
 
     CallbackEnv sCallbackEnv(__func__);
     if (!sCallbackEnv.valid()) return;
+    CALLBACK_TIMER();
 
+    CALLBACK_UPCALL();
     sCallbackEnv->CallVoidMethod(
         sCallbacksObj, method_handleSetAddressedPlayerRsp, (jint) status);
 }
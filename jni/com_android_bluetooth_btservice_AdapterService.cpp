@@ -25,21 +25,32 @@
 
 #include <hardware/vendor.h>
 
+#include <errno.h>
 #include <string.h>
 #include <pthread.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
 
+#include <atomic>
+#include <unordered_map>
+#include <vector>
+
+#include <sys/eventfd.h>
 #include <sys/stat.h>
+#include <sys/timerfd.h>
 #include <fcntl.h>
 
 namespace android {
 
 #define OOB_TK_SIZE 16
 
-#define ADDITIONAL_NREFS 50
 static jmethodID method_stateChangeCallback;
 static jmethodID method_adapterPropertyChangedCallback;
 static jmethodID method_devicePropertyChangedCallback;
 static jmethodID method_deviceFoundCallback;
+static jmethodID method_deviceFoundWithPropertiesCallback;
+static jmethodID method_devicesFoundCallback;
 static jmethodID method_pinRequestCallback;
 static jmethodID method_sspRequestCallback;
 static jmethodID method_bondStateChangeCallback;
@@ -50,11 +61,6 @@ static jmethodID method_acquireWakeLock;
 static jmethodID method_releaseWakeLock;
 static jmethodID method_energyInfo;
 
-static struct {
-    jclass clazz;
-    jmethodID constructor;
-} android_bluetooth_UidTraffic;
-
 static const bt_interface_t *sBluetoothInterface = NULL;
 static const btsock_interface_t *sBluetoothSocketInterface = NULL;
 static const btvendor_interface_t *sBluetoothVendorInterface = NULL;
@@ -64,6 +70,154 @@ static jobject sJniAdapterServiceObj = NULL;
 static jobject sJniCallbacksObj = NULL;
 static jfieldID sJniCallbacksField;
 
+/**
+ * Callback instrumentation, see CallbackTimer in com_android_bluetooth.h.
+ *
+ * Stats live in a fixed open addressing table keyed by the callback's
+ * __func__ pointer; slots are claimed with a compare-and-swap so the
+ * callback thread never takes a lock. Histogram bucket i counts calls that
+ * took less than 2^i microseconds, the last bucket everything slower.
+ */
+
+#define CALLBACK_STATS_SLOTS 512
+#define CALLBACK_STATS_BUCKETS 16
+
+struct CallbackStats {
+    std::atomic<const char*> name;
+    std::atomic<const char*> file;
+    std::atomic<uint64_t> calls;
+    std::atomic<uint64_t> upcalls;
+    std::atomic<uint64_t> prep_ns;
+    std::atomic<uint64_t> prep_max_ns;
+    std::atomic<uint64_t> upcall_ns;
+    std::atomic<uint64_t> upcall_max_ns;
+    std::atomic<uint32_t> prep_hist[CALLBACK_STATS_BUCKETS];
+    std::atomic<uint32_t> upcall_hist[CALLBACK_STATS_BUCKETS];
+};
+
+static CallbackStats sCallbackStats[CALLBACK_STATS_SLOTS];
+static thread_local CallbackTimer* sCurrentCallbackTimer = NULL;
+
+static int64_t monotonic_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static CallbackStats* callbackStatsFor(const char* name, const char* file) {
+    uint64_t hash = (uintptr_t) name;
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+
+    for (int n = 0; n < CALLBACK_STATS_SLOTS; n++) {
+        CallbackStats* stats = &sCallbackStats[(hash + n) & (CALLBACK_STATS_SLOTS - 1)];
+        const char* current = stats->name.load(std::memory_order_acquire);
+        if (current == NULL) {
+            if (stats->name.compare_exchange_strong(current, name)) {
+                stats->file.store(file, std::memory_order_release);
+                return stats;
+            }
+        }
+        if (current == name) return stats;
+    }
+    return NULL;
+}
+
+static void recordLatency(std::atomic<uint64_t>& total, std::atomic<uint64_t>& max,
+                          std::atomic<uint32_t>* hist, int64_t ns) {
+    uint64_t us = ns / 1000;
+    int bucket = us == 0 ? 0 : 64 - __builtin_clzll(us);
+    if (bucket >= CALLBACK_STATS_BUCKETS) bucket = CALLBACK_STATS_BUCKETS - 1;
+
+    total.fetch_add(ns, std::memory_order_relaxed);
+    hist[bucket].fetch_add(1, std::memory_order_relaxed);
+    uint64_t prev = max.load(std::memory_order_relaxed);
+    while ((uint64_t) ns > prev &&
+           !max.compare_exchange_weak(prev, ns, std::memory_order_relaxed)) {
+    }
+}
+
+CallbackTimer::CallbackTimer(const char* name, const char* file)
+    : mStats(callbackStatsFor(name, file)),
+      mStartNs(monotonic_ns()),
+      mUpcallNs(0),
+      mPrevious(sCurrentCallbackTimer) {
+    sCurrentCallbackTimer = this;
+}
+
+CallbackTimer::~CallbackTimer() {
+    sCurrentCallbackTimer = mPrevious;
+    if (mStats == NULL) return;
+
+    int64_t end = monotonic_ns();
+    mStats->calls.fetch_add(1, std::memory_order_relaxed);
+    recordLatency(mStats->prep_ns, mStats->prep_max_ns, mStats->prep_hist,
+                  (mUpcallNs ? mUpcallNs : end) - mStartNs);
+    if (mUpcallNs) {
+        mStats->upcalls.fetch_add(1, std::memory_order_relaxed);
+        recordLatency(mStats->upcall_ns, mStats->upcall_max_ns, mStats->upcall_hist,
+                      end - mUpcallNs);
+    }
+}
+
+void CallbackTimer::upcall() {
+    if (mUpcallNs == 0) mUpcallNs = monotonic_ns();
+}
+
+void markCallbackUpcall() {
+    if (sCurrentCallbackTimer != NULL) sCurrentCallbackTimer->upcall();
+}
+
+// "jni/com_android_bluetooth_hfp.cpp" -> "hfp"
+static void callbackModuleName(const char* file, char* out, size_t len) {
+    const char* prefix = "com_android_bluetooth_";
+    const char* base = file ? strrchr(file, '/') : NULL;
+    base = base ? base + 1 : (file ? file : "?");
+    if (strncmp(base, prefix, strlen(prefix)) == 0) base += strlen(prefix);
+    snprintf(out, len, "%s", base);
+    char* ext = strrchr(out, '.');
+    if (ext) *ext = '\0';
+}
+
+static void dumpHistogram(int fd, const char* label, std::atomic<uint32_t>* hist) {
+    dprintf(fd, "      %-7s", label);
+    for (int i = 0; i < CALLBACK_STATS_BUCKETS; i++) {
+        uint32_t count = hist[i].load(std::memory_order_relaxed);
+        if (count == 0) continue;
+        if (i == CALLBACK_STATS_BUCKETS - 1) {
+            dprintf(fd, " >=%uus:%u", 1u << (i - 1), count);
+        } else {
+            dprintf(fd, " <%uus:%u", 1u << i, count);
+        }
+    }
+    dprintf(fd, "\n");
+}
+
+void dumpCallbackStats(int fd) {
+    dprintf(fd, "\nNative callbacks (prep = JNI setup before the upcall, times in us)\n");
+    dprintf(fd, "  %-20s %-48s %9s %9s %9s %9s %9s\n", "module", "callback", "calls",
+            "prep avg", "prep max", "call avg", "call max");
+
+    for (int i = 0; i < CALLBACK_STATS_SLOTS; i++) {
+        CallbackStats& stats = sCallbackStats[i];
+        const char* name = stats.name.load(std::memory_order_acquire);
+        uint64_t calls = stats.calls.load(std::memory_order_relaxed);
+        if (name == NULL || calls == 0) continue;
+
+        uint64_t upcalls = stats.upcalls.load(std::memory_order_relaxed);
+        char module[32];
+        callbackModuleName(stats.file.load(std::memory_order_acquire), module, sizeof(module));
+        dprintf(fd, "  %-20s %-48s %9llu %9llu %9llu %9llu %9llu\n", module, name,
+                (unsigned long long) calls,
+                (unsigned long long) (stats.prep_ns.load() / calls / 1000),
+                (unsigned long long) (stats.prep_max_ns.load() / 1000),
+                (unsigned long long) (upcalls ? stats.upcall_ns.load() / upcalls / 1000 : 0),
+                (unsigned long long) (stats.upcall_max_ns.load() / 1000));
+        dumpHistogram(fd, "prep", stats.prep_hist);
+        if (upcalls) dumpHistogram(fd, "call", stats.upcall_hist);
+    }
+}
 
 const bt_interface_t* getBluetoothInterface() {
     return sBluetoothInterface;
@@ -82,27 +236,180 @@ void checkAndClearExceptionFromCallback(JNIEnv* env,
     }
 }
 
-static bool checkCallbackThread() {
+/**
+ * CallbackEnv, see com_android_bluetooth.h.
+ */
+
+CallbackEnv::CallbackEnv(const char* methodName)
+    : mName(methodName), mEnv(callbackEnv), mValid(false) {
     JNIEnv* env = AndroidRuntime::getJNIEnv();
-    if (callbackEnv != env || callbackEnv == NULL) {
-        ALOGE("Callback env check fail: env: %p, callback: %p", env, callbackEnv);
-        return false;
+    if (mEnv == NULL || mEnv != env) {
+        ALOGE("%s: Callback env check fail: env: %p, callback: %p", mName, env, mEnv);
+        return;
     }
-    return true;
+    if (mEnv->PushLocalFrame(CALLBACK_LOCAL_FRAME_SIZE) != JNI_OK) {
+        ALOGE("%s: Unable to push a local frame", mName);
+        mEnv->ExceptionClear();
+        return;
+    }
+    mValid = true;
 }
 
-static void adapter_state_change_callback(bt_state_t status) {
-    if (!checkCallbackThread()) {
-       ALOGE("Callback: '%s' is not called on the correct thread", __FUNCTION__);
-       return;
+CallbackEnv::~CallbackEnv() {
+    if (!mValid) return;
+    checkAndClearExceptionFromCallback(mEnv, mName);
+    mEnv->PopLocalFrame(NULL);
+}
+
+jbyteArray CallbackEnv::bdaddr(const bt_bdaddr_t* bd_addr) {
+    jbyteArray array = mEnv->NewByteArray(sizeof(bt_bdaddr_t));
+    if (array == NULL) {
+        ALOGE("%s: Unable to allocate address array", mName);
+        return NULL;
     }
+    mEnv->SetByteArrayRegion(array, 0, sizeof(bt_bdaddr_t), (const jbyte*) bd_addr);
+    return array;
+}
+
+/**
+ * Remote device property store
+ *
+ * Remembers, per remote device, the length and a hash of the last value of
+ * each property passed up to RemoteDevices, so remote device property
+ * events only carry the properties that changed. During inquiry the same
+ * names, classes and UUID lists come back for every device on every pass;
+ * those are now dropped here, and an event left with no property costs no
+ * upcall at all. UUIDs reported outside inquiry are always passed up, as
+ * their arrival completes a service discovery RemoteDevices is waiting for.
+ *
+ * The store is a set associative cache; a device that falls out of it, or
+ * that RemoteDevices forgets through forgetRemoteDevicePropertiesNative(),
+ * simply gets all its properties passed up again next time.
+ */
+
+#define REMOTE_PROP_SETS 128
+#define REMOTE_PROP_WAYS 4
+#define REMOTE_PROP_MAX_TYPES 24
+
+typedef struct {
+    int type;
+    int len;
+    uint32_t hash;
+} remote_prop_digest_t;
+
+typedef struct {
+    bool in_use;
+    bt_bdaddr_t address;
+    uint64_t last_used;
+    int count;
+    remote_prop_digest_t props[REMOTE_PROP_MAX_TYPES];
+} remote_prop_entry_t;
+
+static pthread_mutex_t sRemotePropLock = PTHREAD_MUTEX_INITIALIZER;
+static remote_prop_entry_t sRemoteProps[REMOTE_PROP_SETS][REMOTE_PROP_WAYS];
+static uint64_t sRemotePropTick;
+static uint64_t sRemotePropForwarded;
+static uint64_t sRemotePropDropped;
+static uint64_t sRemotePropEventsDropped;
+
+static uint32_t remotePropHash(const uint8_t* data, int len) {
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < len; i++) hash = (hash ^ data[i]) * 16777619u;
+    return hash;
+}
+
+// Must be called with sRemotePropLock held.
+static remote_prop_entry_t* remotePropEntry(const bt_bdaddr_t* address, bool create) {
+    uint32_t hash = remotePropHash(address->address, sizeof(address->address));
+    remote_prop_entry_t* set = sRemoteProps[hash % REMOTE_PROP_SETS];
+    remote_prop_entry_t* victim = &set[0];
+    for (int i = 0; i < REMOTE_PROP_WAYS; i++) {
+        remote_prop_entry_t* entry = &set[i];
+        if (entry->in_use && !memcmp(&entry->address, address, sizeof(bt_bdaddr_t)))
+            return entry;
+        if (!entry->in_use || (victim->in_use && entry->last_used < victim->last_used))
+            victim = entry;
+    }
+    if (!create) return NULL;
+
+    memset(victim, 0, sizeof(remote_prop_entry_t));
+    victim->in_use = true;
+    victim->address = *address;
+    return victim;
+}
+
+// Forgets what was passed up for |address|, or for every device if it is
+// null.
+static void remotePropForget(const bt_bdaddr_t* address) {
+    pthread_mutex_lock(&sRemotePropLock);
+    if (address == NULL) {
+        memset(sRemoteProps, 0, sizeof(sRemoteProps));
+    } else {
+        remote_prop_entry_t* entry = remotePropEntry(address, false);
+        if (entry != NULL) entry->in_use = false;
+    }
+    pthread_mutex_unlock(&sRemotePropLock);
+}
+
+// Copies the properties of |address| that differ from what was last passed
+// up into |changed|, which holds REMOTE_PROP_MAX_TYPES entries, and records
+// them as passed up. Returns the number copied.
+static int remotePropFilter(const bt_bdaddr_t* address, int num_properties,
+                            const bt_property_t* properties, bool inquiry,
+                            bt_property_t* changed) {
+    int count = 0;
+    pthread_mutex_lock(&sRemotePropLock);
+    remote_prop_entry_t* entry = remotePropEntry(address, true);
+    entry->last_used = ++sRemotePropTick;
+    for (int i = 0; i < num_properties; i++) {
+        const bt_property_t& prop = properties[i];
+        uint32_t hash = remotePropHash((const uint8_t*) prop.val, prop.len);
+
+        remote_prop_digest_t* digest = NULL;
+        for (int j = 0; j < entry->count; j++) {
+            if (entry->props[j].type == prop.type) digest = &entry->props[j];
+        }
+        bool always = !inquiry && prop.type == BT_PROPERTY_UUIDS;
+        if (digest != NULL && digest->len == prop.len && digest->hash == hash && !always) {
+            sRemotePropDropped++;
+            continue;
+        }
+        if (digest == NULL && entry->count < REMOTE_PROP_MAX_TYPES) {
+            digest = &entry->props[entry->count++];
+            digest->type = prop.type;
+        }
+        if (digest != NULL) {
+            digest->len = prop.len;
+            digest->hash = hash;
+        }
+        if (count < REMOTE_PROP_MAX_TYPES) changed[count++] = prop;
+        sRemotePropForwarded++;
+    }
+    if (count == 0) sRemotePropEventsDropped++;
+    pthread_mutex_unlock(&sRemotePropLock);
+    return count;
+}
+
+static void dumpRemotePropStats(int fd) {
+    pthread_mutex_lock(&sRemotePropLock);
+    dprintf(fd, "\nRemote device properties\n");
+    dprintf(fd, "  forwarded: %llu, unchanged: %llu, events dropped: %llu\n",
+            (unsigned long long) sRemotePropForwarded, (unsigned long long) sRemotePropDropped,
+            (unsigned long long) sRemotePropEventsDropped);
+    pthread_mutex_unlock(&sRemotePropLock);
+}
+
+static void adapter_state_change_callback(bt_state_t status) {
+    CallbackEnv sCallbackEnv(__func__);
+    if (!sCallbackEnv.valid()) return;
+    CALLBACK_TIMER();
     ALOGV("%s: Status is: %d", __FUNCTION__, status);
     if(sJniCallbacksObj) {
-       callbackEnv->CallVoidMethod(sJniCallbacksObj, method_stateChangeCallback, (jint)status);
+       CALLBACK_UPCALL();
+       sCallbackEnv->CallVoidMethod(sJniCallbacksObj, method_stateChangeCallback, (jint)status);
     } else {
        ALOGE("JNI ERROR : JNI reference already cleaned : adapter_state_change_callback", __FUNCTION__);
     }
-    checkAndClearExceptionFromCallback(callbackEnv, __FUNCTION__);
 }
 
 static int get_properties(int num_properties, bt_property_t *properties, jintArray *types,
@@ -130,6 +437,7 @@ static void adapter_properties_callback(bt_status_t status, int num_properties,
                                         bt_property_t *properties) {
     CallbackEnv sCallbackEnv(__func__);
     if (!sCallbackEnv.valid()) return;
+    CALLBACK_TIMER();
 
     ALOGV("%s: Status is: %d, Properties: %d", __func__, status, num_properties);
 
@@ -161,47 +469,365 @@ static void adapter_properties_callback(bt_status_t status, int num_properties,
         ALOGE("%s: Error allocating int Array for values", __func__);
         return;
     }
-    // Delete the reference to val and mclass
-    callbackEnv->DeleteLocalRef(mclass);
-    callbackEnv->DeleteLocalRef(val);
 
     if (get_properties(num_properties, properties, &types, &props) < 0) {
-        if (props) callbackEnv->DeleteLocalRef(props);
-        if (types) callbackEnv->DeleteLocalRef(types);
         return;
     }
 
     if (sJniCallbacksObj) {
-        callbackEnv->CallVoidMethod(sJniCallbacksObj, method_adapterPropertyChangedCallback, types,
+        CALLBACK_UPCALL();
+        sCallbackEnv->CallVoidMethod(sJniCallbacksObj, method_adapterPropertyChangedCallback, types,
                                     props);
     }
-    checkAndClearExceptionFromCallback(callbackEnv, __FUNCTION__);
-    callbackEnv->DeleteLocalRef(props);
-    callbackEnv->DeleteLocalRef(types);
-    return;
+}
+
+/**
+ * Discovery batching
+ *
+ * While enabled, devices found by classic discovery are not passed up one
+ * by one but collected here and passed up in a single devicesFoundCallback()
+ * at most |interval| ms after the first of them was found, or right away
+ * when discovery stops, which also turns batching off until the next
+ * discovery. A device found again before its batch goes up is merged into
+ * its entry, found through an index on the address, the later value of
+ * each property winning.
+ *
+ * A batch is flat: addresses holds six bytes per device and the properties
+ * of device i are types/values[offsets[i]] up to offsets[i + 1]. Deadlines
+ * are served by a thread attached to the VM for as long as batching is on.
+ * Batches are passed up with sDiscoveryDeliverLock held. Property changes
+ * go up under the same lock after flushing the pending batch, and bond,
+ * ACL, PIN and SSP callbacks flush it before going up, so Java sees the
+ * events of a device in order whichever thread passes them up.
+ */
+
+typedef struct {
+    int type;
+    int len;
+    size_t offset;
+} discovery_prop_t;
+
+typedef struct {
+    bt_bdaddr_t address;
+    std::vector<discovery_prop_t> props;
+} discovery_device_t;
+
+typedef struct {
+    std::vector<discovery_device_t> devices;
+    // Address to index in |devices|.
+    std::unordered_map<uint64_t, size_t> index;
+    std::vector<uint8_t> values;
+    int num_props;
+} discovery_batch_t;
+
+static pthread_mutex_t sDiscoveryLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t sDiscoveryDeliverLock = PTHREAD_MUTEX_INITIALIZER;
+// Serializes starting and stopping the batching thread.
+static pthread_mutex_t sDiscoveryThreadLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sDiscoveryCond;
+static pthread_t sDiscoveryThread;
+static bool sDiscoveryThreadRunning;
+static bool sDiscoveryThreadStop;
+static int sDiscoveryIntervalMs;
+static int64_t sDiscoveryDeadlineNs;
+static discovery_batch_t sDiscoveryBatch;
+static uint64_t sDiscoveryBatches;
+static uint64_t sDiscoveryDevices;
+static uint64_t sDiscoveryMerged;
+static size_t sDiscoveryLargestBatch;
+#ifdef BT_JNI_TEST_HOOKS
+// Gets batches in place of RemoteDevices while a test runs. Guarded by
+// sDiscoveryDeliverLock.
+static jobject sDiscoveryTestSink;
+static jmethodID sDiscoveryTestSinkMethod;
+#endif
+
+static void discoveryBatchAdd(discovery_batch_t* batch, const bt_bdaddr_t* address,
+                              int num_properties, const bt_property_t* properties) {
+    uint64_t key = 0;
+    for (size_t i = 0; i < sizeof(address->address); i++) key = (key << 8) | address->address[i];
+
+    discovery_device_t* device;
+    std::unordered_map<uint64_t, size_t>::iterator it = batch->index.find(key);
+    if (it != batch->index.end()) {
+        device = &batch->devices[it->second];
+        sDiscoveryMerged++;
+    } else {
+        batch->index[key] = batch->devices.size();
+        batch->devices.push_back(discovery_device_t());
+        device = &batch->devices.back();
+        device->address = *address;
+    }
 
+    for (int i = 0; i < num_properties; i++) {
+        discovery_prop_t prop = { properties[i].type, properties[i].len,
+                                  batch->values.size() };
+        const uint8_t* val = (const uint8_t*) properties[i].val;
+        batch->values.insert(batch->values.end(), val, val + prop.len);
+
+        // A superseded value stays in |values| until the batch goes up.
+        size_t j = 0;
+        while (j < device->props.size() && device->props[j].type != prop.type) j++;
+        if (j < device->props.size()) {
+            device->props[j] = prop;
+        } else {
+            device->props.push_back(prop);
+            batch->num_props++;
+        }
+    }
 }
 
-static void remote_device_properties_callback(bt_status_t status, bt_bdaddr_t *bd_addr,
-                                              int num_properties, bt_property_t *properties) {
-    if (!checkCallbackThread()) {
-       ALOGE("Callback: '%s' is not called on the correct thread", __FUNCTION__);
-       return;
+// Forgets what remotePropFilter() recorded for the devices in |batch|, for
+// a batch that never goes up, so their properties are passed up in full next
+// time. Must not be called with sDiscoveryLock held.
+static void discoveryBatchForget(const discovery_batch_t& batch) {
+    for (size_t i = 0; i < batch.devices.size(); i++) {
+        remotePropForget(&batch.devices[i].address);
     }
+}
 
-    ALOGV("%s: Status is: %d, Properties: %d", __func__, status, num_properties);
+// Converts |batch| to the arrays of devicesFoundCallback(). Returns false
+// if an allocation failed.
+static bool discoveryBatchToJava(JNIEnv* env, const discovery_batch_t& batch,
+                                 jbyteArray* addresses, jintArray* offsets, jintArray* types,
+                                 jobjectArray* values) {
+    int count = batch.devices.size();
+    *addresses = env->NewByteArray(count * sizeof(bt_bdaddr_t));
+    *offsets = env->NewIntArray(count + 1);
+    *types = env->NewIntArray(batch.num_props);
+    jclass byteArrayClass = env->FindClass("[B");
+    *values = byteArrayClass ? env->NewObjectArray(batch.num_props, byteArrayClass, NULL) : NULL;
+    if (!*addresses || !*offsets || !*types || !*values) return false;
+
+    std::vector<jint> c_offsets(count + 1);
+    std::vector<jint> c_types(batch.num_props);
+    int n = 0;
+    for (int i = 0; i < count; i++) {
+        const discovery_device_t& device = batch.devices[i];
+        env->SetByteArrayRegion(*addresses, i * sizeof(bt_bdaddr_t), sizeof(bt_bdaddr_t),
+                                (const jbyte*) device.address.address);
+        c_offsets[i] = n;
+        for (size_t j = 0; j < device.props.size(); j++) {
+            const discovery_prop_t& prop = device.props[j];
+            jbyteArray val = env->NewByteArray(prop.len);
+            if (val == NULL) return false;
+            env->SetByteArrayRegion(val, 0, prop.len, (const jbyte*) &batch.values[prop.offset]);
+            env->SetObjectArrayElement(*values, n, val);
+            env->DeleteLocalRef(val);
+            c_types[n++] = prop.type;
+        }
+    }
+    c_offsets[count] = n;
+    env->SetIntArrayRegion(*offsets, 0, count + 1, &c_offsets[0]);
+    if (n > 0) env->SetIntArrayRegion(*types, 0, n, &c_types[0]);
+    return true;
+}
 
-    if (status != BT_STATUS_SUCCESS) {
-        ALOGE("%s: Status %d is incorrect", __func__, status);
+// Passes the pending batch up, if any. Must be called with
+// sDiscoveryDeliverLock held.
+static void discoveryBatchDeliver(JNIEnv* env) {
+    discovery_batch_t batch;
+    batch.num_props = 0;
+    pthread_mutex_lock(&sDiscoveryLock);
+    batch.devices.swap(sDiscoveryBatch.devices);
+    batch.values.swap(sDiscoveryBatch.values);
+    sDiscoveryBatch.index.clear();
+    batch.num_props = sDiscoveryBatch.num_props;
+    sDiscoveryBatch.num_props = 0;
+    sDiscoveryDeadlineNs = 0;
+    if (!batch.devices.empty()) {
+        sDiscoveryBatches++;
+        sDiscoveryDevices += batch.devices.size();
+        if (batch.devices.size() > sDiscoveryLargestBatch) {
+            sDiscoveryLargestBatch = batch.devices.size();
+        }
+    }
+    pthread_mutex_unlock(&sDiscoveryLock);
+    if (batch.devices.empty()) return;
+
+    if (env->PushLocalFrame(CALLBACK_LOCAL_FRAME_SIZE) < 0) {
+        ALOGE("%s: unable to push local frame, dropping %zu devices", __func__,
+              batch.devices.size());
+        env->ExceptionClear();
+        discoveryBatchForget(batch);
         return;
     }
+    jobject target = sJniCallbacksObj;
+    jmethodID method = method_devicesFoundCallback;
+#ifdef BT_JNI_TEST_HOOKS
+    if (sDiscoveryTestSink != NULL) {
+        target = sDiscoveryTestSink;
+        method = sDiscoveryTestSinkMethod;
+    }
+#endif
+    jbyteArray addresses;
+    jintArray offsets;
+    jintArray types;
+    jobjectArray values;
+    if (!discoveryBatchToJava(env, batch, &addresses, &offsets, &types, &values)) {
+        ALOGE("%s: allocation failed, dropping %zu devices", __func__, batch.devices.size());
+        discoveryBatchForget(batch);
+    } else if (target) {
+        CALLBACK_UPCALL();
+        env->CallVoidMethod(target, method, addresses, offsets, types, values);
+    } else {
+        discoveryBatchForget(batch);
+    }
+    checkAndClearExceptionFromCallback(env, __func__);
+    env->PopLocalFrame(NULL);
+}
 
-    callbackEnv->PushLocalFrame(ADDITIONAL_NREFS);
+// Passes the pending batch up, if any, for callbacks that must do so before
+// passing up anything else.
+static void discoveryBatchFlush(JNIEnv* env) {
+    pthread_mutex_lock(&sDiscoveryDeliverLock);
+    discoveryBatchDeliver(env);
+    pthread_mutex_unlock(&sDiscoveryDeliverLock);
+}
+
+// Adds a found device to the pending batch. Returns false if batching is
+// off, in which case the caller passes the device up itself.
+static bool discoveryBatchFound(const bt_bdaddr_t* address, int num_properties,
+                                const bt_property_t* properties) {
+    bt_property_t changed[REMOTE_PROP_MAX_TYPES];
+    pthread_mutex_lock(&sDiscoveryLock);
+    bool enabled = sDiscoveryIntervalMs > 0;
+    pthread_mutex_unlock(&sDiscoveryLock);
+    if (!enabled) return false;
+
+    num_properties = remotePropFilter(address, num_properties, properties, true, changed);
+
+    pthread_mutex_lock(&sDiscoveryLock);
+    enabled = sDiscoveryIntervalMs > 0;
+    if (enabled) {
+        discoveryBatchAdd(&sDiscoveryBatch, address, num_properties, changed);
+        if (sDiscoveryDeadlineNs == 0) {
+            sDiscoveryDeadlineNs = monotonic_ns() + sDiscoveryIntervalMs * 1000000LL;
+            pthread_cond_signal(&sDiscoveryCond);
+        }
+    }
+    pthread_mutex_unlock(&sDiscoveryLock);
+    if (!enabled) {
+        // Batching was turned off meanwhile. Undo the filter so the caller
+        // passes the device up in full.
+        remotePropForget(address);
+    }
+    return enabled;
+}
 
+static void* discoveryBatchThread(void* arg) {
+    JavaVM* vm = AndroidRuntime::getJavaVM();
+    JNIEnv* env = NULL;
+    JavaVMAttachArgs args = { JNI_VERSION_1_6, (char*) "BT Discovery Batch", NULL };
+    if (vm->AttachCurrentThread(&env, &args) != 0) {
+        ALOGE("%s: unable to attach thread to VM", __func__);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&sDiscoveryLock);
+    while (!sDiscoveryThreadStop) {
+        if (sDiscoveryDeadlineNs == 0) {
+            pthread_cond_wait(&sDiscoveryCond, &sDiscoveryLock);
+            continue;
+        }
+        int64_t deadline = sDiscoveryDeadlineNs;
+        if (monotonic_ns() < deadline) {
+            struct timespec ts;
+            ts.tv_sec = deadline / 1000000000LL;
+            ts.tv_nsec = deadline % 1000000000LL;
+            pthread_cond_timedwait(&sDiscoveryCond, &sDiscoveryLock, &ts);
+            continue;
+        }
+
+        pthread_mutex_unlock(&sDiscoveryLock);
+        CALLBACK_TIMER();
+        discoveryBatchFlush(env);
+        pthread_mutex_lock(&sDiscoveryLock);
+    }
+    pthread_mutex_unlock(&sDiscoveryLock);
+
+    vm->DetachCurrentThread();
+    return NULL;
+}
+
+static void discoveryBatchStopThread() {
+    pthread_mutex_lock(&sDiscoveryThreadLock);
+    pthread_mutex_lock(&sDiscoveryLock);
+    bool running = sDiscoveryThreadRunning;
+    sDiscoveryThreadStop = true;
+    sDiscoveryIntervalMs = 0;
+    pthread_cond_signal(&sDiscoveryCond);
+    pthread_mutex_unlock(&sDiscoveryLock);
+    if (running) pthread_join(sDiscoveryThread, NULL);
+
+    discovery_batch_t dropped;
+    pthread_mutex_lock(&sDiscoveryLock);
+    if (running) pthread_cond_destroy(&sDiscoveryCond);
+    sDiscoveryThreadRunning = false;
+    dropped.devices.swap(sDiscoveryBatch.devices);
+    sDiscoveryBatch.index.clear();
+    sDiscoveryBatch.values.clear();
+    sDiscoveryBatch.num_props = 0;
+    sDiscoveryDeadlineNs = 0;
+    pthread_mutex_unlock(&sDiscoveryLock);
+    pthread_mutex_unlock(&sDiscoveryThreadLock);
+    discoveryBatchForget(dropped);
+}
+
+// Batches found devices for up to |interval_ms|, starting the thread if
+// needed. Returns false if the thread could not be started.
+static bool discoveryBatchStart(int interval_ms) {
+    pthread_mutex_lock(&sDiscoveryThreadLock);
+    pthread_mutex_lock(&sDiscoveryLock);
+    sDiscoveryIntervalMs = interval_ms;
+    bool started = sDiscoveryThreadRunning;
+    if (!started) {
+        pthread_condattr_t attr;
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&sDiscoveryCond, &attr);
+        pthread_condattr_destroy(&attr);
+        sDiscoveryThreadStop = false;
+        started = pthread_create(&sDiscoveryThread, NULL, discoveryBatchThread, NULL) == 0;
+        sDiscoveryThreadRunning = started;
+        if (!started) {
+            sDiscoveryIntervalMs = 0;
+            pthread_cond_destroy(&sDiscoveryCond);
+        }
+    }
+    pthread_mutex_unlock(&sDiscoveryLock);
+    pthread_mutex_unlock(&sDiscoveryThreadLock);
+
+    if (!started) ALOGE("%s: unable to start batching thread", __func__);
+    return started;
+}
+
+// Passes the pending batch up and turns batching off.
+static void discoveryBatchStop(JNIEnv* env) {
+    discoveryBatchFlush(env);
+    discoveryBatchStopThread();
+}
+
+static void dumpDiscoveryBatchStats(int fd) {
+    pthread_mutex_lock(&sDiscoveryLock);
+    dprintf(fd, "\nDiscovery batching (interval %d ms)\n", sDiscoveryIntervalMs);
+    dprintf(fd, "  batches: %llu, devices: %llu, merged: %llu, largest batch: %zu\n",
+            (unsigned long long) sDiscoveryBatches, (unsigned long long) sDiscoveryDevices,
+            (unsigned long long) sDiscoveryMerged, sDiscoveryLargestBatch);
+    pthread_mutex_unlock(&sDiscoveryLock);
+}
+
+// Passes the changed properties of |bd_addr| up to RemoteDevices, together
+// with the found notification if |found|. Nothing goes up if no property
+// changed, unless the device was found.
+// Passes |properties| up. Returns false if they could not be.
+static bool send_remote_properties_changed(CallbackEnv& sCallbackEnv, bt_bdaddr_t *bd_addr,
+                                           int num_properties, bt_property_t *properties,
+                                           bool found) {
     jbyteArray val = (jbyteArray) sCallbackEnv->NewByteArray(num_properties);
     if (val == NULL) {
         ALOGE("%s: Error allocating byteArray", __func__);
-        return;
+        return false;
     }
 
     jclass mclass = sCallbackEnv->GetObjectClass(val);
@@ -213,71 +839,76 @@ static void remote_device_properties_callback(bt_status_t status, bt_bdaddr_t *b
                                              NULL);
     if (props == NULL) {
         ALOGE("%s: Error allocating object Array for properties", __func__);
-        return;
+        return false;
     }
 
     jintArray types = (jintArray)sCallbackEnv->NewIntArray(num_properties);
     if (types == NULL) {
         ALOGE("%s: Error allocating int Array for values", __func__);
-        return;
+        return false;
     }
-    // Delete the reference to val and mclass
-    sCallbackEnv->DeleteLocalRef(mclass);
-    sCallbackEnv->DeleteLocalRef(val);
 
-    jbyteArray addr = sCallbackEnv->NewByteArray(sizeof(bt_bdaddr_t));
+    jbyteArray addr = sCallbackEnv.bdaddr(bd_addr);
     if (addr == NULL) {
       ALOGE("Error while allocation byte array in %s", __func__);
-      return;
+      return false;
     }
 
-    addr = callbackEnv->NewByteArray(sizeof(bt_bdaddr_t));
-    if (addr == NULL) goto Fail;
-    if (addr) callbackEnv->SetByteArrayRegion(addr, 0, sizeof(bt_bdaddr_t), (jbyte*)bd_addr);
-
     if (get_properties(num_properties, properties, &types, &props) < 0) {
-        if (props) callbackEnv->DeleteLocalRef(props);
-        if (types) callbackEnv->DeleteLocalRef(types);
-        callbackEnv->PopLocalFrame(NULL);
-        return;
+        return false;
     }
 
-    if (sJniCallbacksObj) {
-        callbackEnv->CallVoidMethod(sJniCallbacksObj, method_devicePropertyChangedCallback, addr,
-                                    types, props);
+    if (!sJniCallbacksObj) return false;
+    CALLBACK_UPCALL();
+    sCallbackEnv->CallVoidMethod(sJniCallbacksObj,
+                                 found ? method_deviceFoundWithPropertiesCallback
+                                       : method_devicePropertyChangedCallback,
+                                 addr, types, props);
+    return true;
+}
+
+// Passes up the properties of |bd_addr| that changed since they last went
+// up. If they cannot go up, forgets them so they all go up next time.
+static void send_remote_properties(CallbackEnv& sCallbackEnv, bt_bdaddr_t *bd_addr,
+                                   int num_properties, bt_property_t *properties, bool found) {
+    bt_property_t changed[REMOTE_PROP_MAX_TYPES];
+    num_properties = remotePropFilter(bd_addr, num_properties, properties, found, changed);
+    if (num_properties == 0 && !found) return;
+    if (!send_remote_properties_changed(sCallbackEnv, bd_addr, num_properties, changed, found)) {
+        remotePropForget(bd_addr);
     }
-    checkAndClearExceptionFromCallback(callbackEnv, __FUNCTION__);
-    callbackEnv->DeleteLocalRef(props);
-    callbackEnv->DeleteLocalRef(types);
-    callbackEnv->DeleteLocalRef(addr);
-    callbackEnv->PopLocalFrame(NULL);
-    return;
+}
 
-Fail:
-    ALOGE("Error while allocation byte array in %s", __FUNCTION__);
+static void remote_device_properties_callback(bt_status_t status, bt_bdaddr_t *bd_addr,
+                                              int num_properties, bt_property_t *properties) {
+    CallbackEnv sCallbackEnv(__func__);
+    if (!sCallbackEnv.valid()) return;
+    CALLBACK_TIMER();
+
+    ALOGV("%s: Status is: %d, Properties: %d", __func__, status, num_properties);
+
+    if (status != BT_STATUS_SUCCESS) {
+        ALOGE("%s: Status %d is incorrect", __func__, status);
+        return;
+    }
+
+    pthread_mutex_lock(&sDiscoveryDeliverLock);
+    discoveryBatchDeliver(sCallbackEnv);
+    send_remote_properties(sCallbackEnv, bd_addr, num_properties, properties, false);
+    pthread_mutex_unlock(&sDiscoveryDeliverLock);
 }
 
 
 static void device_found_callback(int num_properties, bt_property_t *properties) {
     CallbackEnv sCallbackEnv(__func__);
     if (!sCallbackEnv.valid()) return;
+    CALLBACK_TIMER();
 
-    jbyteArray addr = NULL;
-    int addr_index;
+    int addr_index = -1;
     for (int i = 0; i < num_properties; i++) {
-        if (properties[i].type == BT_PROPERTY_BDADDR) {
-            addr = callbackEnv->NewByteArray(properties[i].len);
-            if (addr) {
-                callbackEnv->SetByteArrayRegion(addr, 0, properties[i].len,
-                                                (jbyte*)properties[i].val);
-                addr_index = i;
-            } else {
-                ALOGE("Address is NULL (unable to allocate) in %s", __func__);
-                return;
-            }
-        }
+        if (properties[i].type == BT_PROPERTY_BDADDR) addr_index = i;
     }
-    if (addr == NULL) {
+    if (addr_index < 0) {
         ALOGE("Address is NULL in %s", __func__);
         return;
     }
@@ -285,39 +916,38 @@ static void device_found_callback(int num_properties, bt_property_t *properties)
     ALOGV("%s: Properties: %d, Address: %s", __func__, num_properties,
         (const char *)properties[addr_index].val);
 
-    remote_device_properties_callback(BT_STATUS_SUCCESS, (bt_bdaddr_t *)properties[addr_index].val,
-                                      num_properties, properties);
+    bt_bdaddr_t *bd_addr = (bt_bdaddr_t *)properties[addr_index].val;
+    if (discoveryBatchFound(bd_addr, num_properties, properties)) return;
 
-    if (sJniCallbacksObj) {
-        callbackEnv->CallVoidMethod(sJniCallbacksObj, method_deviceFoundCallback, addr);
-    }
-    checkAndClearExceptionFromCallback(callbackEnv, __FUNCTION__);
-    callbackEnv->DeleteLocalRef(addr);
+    // One upcall carries both the changed properties and the found
+    // notification.
+    send_remote_properties(sCallbackEnv, bd_addr, num_properties, properties, true);
 }
 
 static void bond_state_changed_callback(bt_status_t status, bt_bdaddr_t *bd_addr,
                                         bt_bond_state_t state) {
     CallbackEnv sCallbackEnv(__func__);
     if (!sCallbackEnv.valid()) return;
+    CALLBACK_TIMER();
 
     if (!bd_addr) {
         ALOGE("Address is null in %s", __func__);
         return;
     }
 
-    jbyteArray addr = sCallbackEnv->NewByteArray(sizeof(bt_bdaddr_t));
+    discoveryBatchFlush(sCallbackEnv);
+
+    jbyteArray addr = sCallbackEnv.bdaddr(bd_addr);
     if (addr == NULL) {
        ALOGE("Address allocation failed in %s", __func__);
        return;
     }
-    callbackEnv->SetByteArrayRegion(addr, 0, sizeof(bt_bdaddr_t), (jbyte *)bd_addr);
 
     if (sJniCallbacksObj) {
-        callbackEnv->CallVoidMethod(sJniCallbacksObj, method_bondStateChangeCallback, (jint) status,
+        CALLBACK_UPCALL();
+        sCallbackEnv->CallVoidMethod(sJniCallbacksObj, method_bondStateChangeCallback, (jint) status,
                                     addr, (jint)state);
     }
-    checkAndClearExceptionFromCallback(callbackEnv, __FUNCTION__);
-    callbackEnv->DeleteLocalRef(addr);
 }
 
 static void acl_state_changed_callback(bt_status_t status, bt_bdaddr_t *bd_addr,
@@ -330,35 +960,39 @@ static void acl_state_changed_callback(bt_status_t status, bt_bdaddr_t *bd_addr,
 
     CallbackEnv sCallbackEnv(__func__);
     if (!sCallbackEnv.valid()) return;
+    CALLBACK_TIMER();
+
+    discoveryBatchFlush(sCallbackEnv);
 
-    jbyteArray addr = sCallbackEnv->NewByteArray(sizeof(bt_bdaddr_t));
+    jbyteArray addr = sCallbackEnv.bdaddr(bd_addr);
     if (addr == NULL) {
        ALOGE("Address allocation failed in %s", __func__);
        return;
     }
-    callbackEnv->SetByteArrayRegion(addr, 0, sizeof(bt_bdaddr_t), (jbyte *)bd_addr);
 
     if (sJniCallbacksObj) {
-        callbackEnv->CallVoidMethod(sJniCallbacksObj, method_aclStateChangeCallback, (jint) status,
+        CALLBACK_UPCALL();
+        sCallbackEnv->CallVoidMethod(sJniCallbacksObj, method_aclStateChangeCallback, (jint) status,
                                     addr, (jint)state);
     }
-    checkAndClearExceptionFromCallback(callbackEnv, __FUNCTION__);
-    callbackEnv->DeleteLocalRef(addr);
 }
 
 static void discovery_state_changed_callback(bt_discovery_state_t state) {
-    if (!checkCallbackThread()) {
-       ALOGE("Callback: '%s' is not called on the correct thread", __FUNCTION__);
-       return;
-    }
+    CallbackEnv sCallbackEnv(__func__);
+    if (!sCallbackEnv.valid()) return;
+    CALLBACK_TIMER();
 
     ALOGV("%s: DiscoveryState:%d ", __func__, state);
 
+    // Devices found by this discovery go up before it is reported stopped.
+    // startDiscovery() turns batching back on for the next one.
+    if (state == BT_DISCOVERY_STOPPED) discoveryBatchStop(sCallbackEnv);
+
     if (sJniCallbacksObj) {
-        callbackEnv->CallVoidMethod(sJniCallbacksObj, method_discoveryStateChangeCallback,
+        CALLBACK_UPCALL();
+        sCallbackEnv->CallVoidMethod(sJniCallbacksObj, method_discoveryStateChangeCallback,
                                     (jint)state);
     }
-    checkAndClearExceptionFromCallback(callbackEnv, __FUNCTION__);
 }
 
 static void pin_request_callback(bt_bdaddr_t *bd_addr, bt_bdname_t *bdname, uint32_t cod,
@@ -370,29 +1004,29 @@ static void pin_request_callback(bt_bdaddr_t *bd_addr, bt_bdname_t *bdname, uint
 
     CallbackEnv sCallbackEnv(__func__);
     if (!sCallbackEnv.valid()) return;
+    CALLBACK_TIMER();
+
+    discoveryBatchFlush(sCallbackEnv);
 
-    jbyteArray addr = sCallbackEnv->NewByteArray(sizeof(bt_bdaddr_t));
+    jbyteArray addr = sCallbackEnv.bdaddr(bd_addr);
     if (addr == NULL) {
         ALOGE("Error while allocating in: %s", __func__);
         return;
     }
 
-    sCallbackEnv->SetByteArrayRegion(addr, 0, sizeof(bt_bdaddr_t), (jbyte*)bd_addr);
-
     jbyteArray devname = sCallbackEnv->NewByteArray(sizeof(bt_bdname_t));
     if (devname == NULL) {
         ALOGE("Error while allocating in: %s", __func__);
-        sCallbackEnv->DeleteLocalRef(addr);
         return;
     }
 
-    callbackEnv->SetByteArrayRegion(devname, 0, sizeof(bt_bdname_t), (jbyte*)bdname);
+    sCallbackEnv->SetByteArrayRegion(devname, 0, sizeof(bt_bdname_t), (jbyte*)bdname);
 
     if (sJniCallbacksObj) {
-    callbackEnv->CallVoidMethod(sJniCallbacksObj, method_pinRequestCallback, addr, devname, cod,
-            min_16_digits);
-    sCallbackEnv->DeleteLocalRef(addr);
-    sCallbackEnv->DeleteLocalRef(devname);
+        CALLBACK_UPCALL();
+        sCallbackEnv->CallVoidMethod(sJniCallbacksObj, method_pinRequestCallback, addr, devname,
+                                     cod, min_16_digits);
+    }
 }
 
 static void ssp_request_callback(bt_bdaddr_t *bd_addr, bt_bdname_t *bdname, uint32_t cod,
@@ -402,17 +1036,20 @@ static void ssp_request_callback(bt_bdaddr_t *bd_addr, bt_bdname_t *bdname, uint
         return;
     }
 
-    jbyteArray addr = sCallbackEnv->NewByteArray(sizeof(bt_bdaddr_t));
+    CallbackEnv sCallbackEnv(__func__);
+    if (!sCallbackEnv.valid()) return;
+    CALLBACK_TIMER();
+
+    discoveryBatchFlush(sCallbackEnv);
+
+    jbyteArray addr = sCallbackEnv.bdaddr(bd_addr);
     if (addr == NULL)  {
         ALOGE("Error while allocating in: %s", __func__);
         return;
     }
 
-    sCallbackEnv->SetByteArrayRegion(addr, 0, sizeof(bt_bdaddr_t), (jbyte *)bd_addr);
-
     jbyteArray devname = sCallbackEnv->NewByteArray(sizeof(bt_bdname_t));
     if (devname == NULL) {
-        sCallbackEnv->DeleteLocalRef(addr);
         ALOGE("Error while allocating in: %s", __func__);
         return;
     }
@@ -420,12 +1057,10 @@ static void ssp_request_callback(bt_bdaddr_t *bd_addr, bt_bdname_t *bdname, uint
     sCallbackEnv->SetByteArrayRegion(devname, 0, sizeof(bt_bdname_t), (jbyte*)bdname);
 
     if (sJniCallbacksObj) {
-        callbackEnv->CallVoidMethod(sJniCallbacksObj, method_sspRequestCallback, addr, devname, cod,
-                                    (jint) pairing_variant, pass_key);
+        CALLBACK_UPCALL();
+        sCallbackEnv->CallVoidMethod(sJniCallbacksObj, method_sspRequestCallback, addr, devname,
+                                     cod, (jint) pairing_variant, pass_key);
     }
-
-    sCallbackEnv->DeleteLocalRef(addr);
-    sCallbackEnv->DeleteLocalRef(devname);
 }
 
 static void callback_thread_event(bt_cb_thread_evt event) {
@@ -455,40 +1090,84 @@ static void le_test_mode_recv_callback (bt_status_t status, uint16_t packet_coun
     ALOGV("%s: status:%d packet_count:%d ", __func__, status, packet_count);
 }
 
+/**
+ * UID traffic ledger
+ *
+ * The controller reports the bytes each app UID sent and received since
+ * its previous energy report. Those are summed here, in an array sorted by
+ * UID, instead of passing a UidTraffic object per UID up with each report;
+ * AdapterService reads the traffic when it builds an activity report, as a
+ * packed long[] from getUidTrafficNative().
+ *
+ * A read returns the traffic since the read that returned |cursor|, with
+ * a new cursor. A stale cursor, e.g. after the ledger was reset, returns
+ * all traffic since the reset. Only one reader is supported.
+ */
+
+#define UID_TRAFFIC_FIELDS 3
+
+typedef struct {
+    int uid;
+    int64_t rx_bytes;
+    int64_t tx_bytes;
+    // Totals as of the last read.
+    int64_t rx_read;
+    int64_t tx_read;
+} uid_traffic_t;
+
+static pthread_mutex_t sUidTrafficLock = PTHREAD_MUTEX_INITIALIZER;
+static std::vector<uid_traffic_t> sUidTraffic;
+static int64_t sUidTrafficCursor;
+static uint64_t sUidTrafficReports;
+static uint64_t sUidTrafficUpdates;
+
+// Must be called with sUidTrafficLock held.
+static uid_traffic_t* uidTrafficFor(int uid) {
+    size_t low = 0;
+    size_t high = sUidTraffic.size();
+    while (low < high) {
+        size_t mid = (low + high) / 2;
+        if (sUidTraffic[mid].uid < uid) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    if (low == sUidTraffic.size() || sUidTraffic[low].uid != uid) {
+        uid_traffic_t entry;
+        memset(&entry, 0, sizeof(entry));
+        entry.uid = uid;
+        sUidTraffic.insert(sUidTraffic.begin() + low, entry);
+    }
+    return &sUidTraffic[low];
+}
+
 static void energy_info_recv_callback(bt_activity_energy_info *p_energy_info,
                                       bt_uid_traffic_t* uid_data)
 {
-    if (!checkCallbackThread()) {
-       ALOGE("Callback: '%s' is not called on the correct thread", __FUNCTION__);
-       return;
-    }
-
-    jsize len = 0;
-    for (bt_uid_traffic_t* data = uid_data; data->app_uid != -1; data++) {
-        len++;
-    }
+    CallbackEnv sCallbackEnv(__func__);
+    if (!sCallbackEnv.valid()) return;
+    CALLBACK_TIMER();
 
-    jobjectArray array = callbackEnv->NewObjectArray(len, android_bluetooth_UidTraffic.clazz, NULL);
-    jsize i = 0;
-    for (bt_uid_traffic_t* data = uid_data; data->app_uid != -1; data++) {
-        jobject uidObj = callbackEnv->NewObject(android_bluetooth_UidTraffic.clazz,
-                                                android_bluetooth_UidTraffic.constructor,
-                                                (jint) data->app_uid, (jlong) data->rx_bytes,
-                                                (jlong) data->tx_bytes);
-        callbackEnv->SetObjectArrayElement(array, i++, uidObj);
-        callbackEnv->DeleteLocalRef(uidObj);
+    pthread_mutex_lock(&sUidTrafficLock);
+    sUidTrafficReports++;
+    for (bt_uid_traffic_t* data = uid_data; data && data->app_uid != -1; data++) {
+        if (data->rx_bytes == 0 && data->tx_bytes == 0) continue;
+        uid_traffic_t* entry = uidTrafficFor(data->app_uid);
+        entry->rx_bytes += data->rx_bytes;
+        entry->tx_bytes += data->tx_bytes;
+        sUidTrafficUpdates++;
     }
+    pthread_mutex_unlock(&sUidTrafficLock);
 
     if (sJniAdapterServiceObj) {
-        callbackEnv->CallVoidMethod(sJniAdapterServiceObj, method_energyInfo, p_energy_info->status,
+        CALLBACK_UPCALL();
+        sCallbackEnv->CallVoidMethod(sJniAdapterServiceObj, method_energyInfo, p_energy_info->status,
             p_energy_info->ctrl_state, p_energy_info->tx_time, p_energy_info->rx_time,
-            p_energy_info->idle_time, p_energy_info->energy_used, array);
+            p_energy_info->idle_time, p_energy_info->energy_used);
     } else {
        ALOGE("JNI ERROR : JNI reference already cleaned : energy_info_recv_callback", __FUNCTION__);
     }
-
-    checkAndClearExceptionFromCallback(callbackEnv, __FUNCTION__);
-    callbackEnv->DeleteLocalRef(array);
 }
 
 static bt_callbacks_t sBluetoothCallbacks = {
@@ -509,20 +1188,262 @@ static bt_callbacks_t sBluetoothCallbacks = {
     NULL
 };
 
-// The callback to call when the wake alarm fires.
-static alarm_cb sAlarmCallback;
-
-// The data to pass to the wake alarm callback.
-static void *sAlarmCallbackData;
-
 static JavaVMAttachArgs sAttachArgs = {
   .version = JNI_VERSION_1_6,
   .name = "bluetooth wake",
   .group = NULL
 };
 
-static bool set_wake_alarm_callout(uint64_t delay_millis, bool should_wake,
-        alarm_cb cb, void *data) {
+/**
+ * Alarm scheduler
+ *
+ * The stack keeps one alarm set at a time, each set replacing the previous
+ * one. Alarms are served by a timerfd on CLOCK_BOOTTIME, the clock behind
+ * the elapsed realtime used by AdapterService, read by a native thread, so
+ * setting and firing an alarm does not go through Java. Only waking alarms
+ * also need an AlarmManager alarm, to bring the device out of suspend, and
+ * AdapterService is asked for one only when no wake alarm is already set
+ * there for the deadline or earlier. Whichever of the two fires first runs
+ * the callback; a Java alarm that fires with nothing due re-arms itself for
+ * the pending waking alarm, if any, and is otherwise ignored. When the
+ * timerfd runs a waking alarm, the stack's wake lock is held around the
+ * callback, as AlarmManager holds one around its own.
+ */
+
+// Java alarms have millisecond resolution.
+#define ALARM_SLACK_NS 1000000LL
+// Latencies are bucketed by powers of two of microseconds.
+#define ALARM_HIST_BUCKETS 20
+
+typedef struct alarm_scheduler_t alarm_scheduler_t;
+
+struct alarm_scheduler_t {
+    pthread_mutex_t lock;
+    int timer_fd;
+    int event_fd;
+    pthread_t thread;
+    bool running;
+    // Sets a wake alarm in AdapterService.
+    bool (*set_java_alarm)(alarm_scheduler_t* scheduler, uint64_t delay_millis);
+    // Takes or drops a wake lock around native fires of waking alarms.
+    void (*hold_wake_lock)(alarm_scheduler_t* scheduler, bool hold);
+    void* context;
+
+    alarm_cb cb;
+    void* data;
+    // CLOCK_BOOTTIME deadline of the pending alarm, 0 if none.
+    int64_t deadline_ns;
+    bool should_wake;
+    // Deadline of the wake alarm set in AdapterService, 0 if none.
+    int64_t java_deadline_ns;
+
+    uint64_t sets;
+    uint64_t java_sets;
+    // Alarms that ran, whichever way they fired.
+    uint64_t fires;
+    uint64_t native_fires;
+    uint64_t java_fires;
+    uint64_t stale_java_fires;
+    int64_t set_ns;
+    int64_t set_max_ns;
+    int64_t late_ns;
+    int64_t late_max_ns;
+    uint32_t set_hist[ALARM_HIST_BUCKETS];
+    uint32_t late_hist[ALARM_HIST_BUCKETS];
+};
+
+static int64_t boottime_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_BOOTTIME, &ts);
+    return (int64_t) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void alarmRecord(int64_t ns, int64_t* total, int64_t* max, uint32_t* hist) {
+    if (ns < 0) ns = 0;
+    uint64_t us = ns / 1000;
+    int bucket = us == 0 ? 0 : 64 - __builtin_clzll(us);
+    if (bucket >= ALARM_HIST_BUCKETS) bucket = ALARM_HIST_BUCKETS - 1;
+    *total += ns;
+    if (ns > *max) *max = ns;
+    hist[bucket]++;
+}
+
+// Must be called with the scheduler lock held.
+static void alarmArm(alarm_scheduler_t* scheduler, int64_t deadline_ns) {
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    spec.it_value.tv_sec = deadline_ns / 1000000000LL;
+    spec.it_value.tv_nsec = deadline_ns % 1000000000LL;
+    if (timerfd_settime(scheduler->timer_fd, TFD_TIMER_ABSTIME, &spec, NULL) < 0) {
+        ALOGE("%s: unable to arm timer: %s", __func__, strerror(errno));
+    }
+}
+
+// Runs the pending alarm if it is due. |from_java| tells whether the wake
+// alarm set in AdapterService fired, rather than the timerfd.
+static void alarmFire(alarm_scheduler_t* scheduler, bool from_java) {
+    int64_t now = boottime_ns();
+    alarm_cb cb = NULL;
+    void* data = NULL;
+    uint64_t rearm_millis = 0;
+    bool hold_wake_lock = false;
+
+    pthread_mutex_lock(&scheduler->lock);
+    if (from_java) {
+        scheduler->java_fires++;
+        scheduler->java_deadline_ns = 0;
+    }
+    if (scheduler->cb != NULL && now + ALARM_SLACK_NS >= scheduler->deadline_ns) {
+        cb = scheduler->cb;
+        data = scheduler->data;
+        alarmRecord(now - scheduler->deadline_ns, &scheduler->late_ns, &scheduler->late_max_ns,
+                    scheduler->late_hist);
+        scheduler->fires++;
+        if (!from_java) scheduler->native_fires++;
+        hold_wake_lock = !from_java && scheduler->should_wake &&
+                scheduler->hold_wake_lock != NULL;
+        scheduler->cb = NULL;
+        scheduler->data = NULL;
+        scheduler->deadline_ns = 0;
+        alarmArm(scheduler, 0);
+    } else if (from_java && scheduler->cb != NULL && scheduler->should_wake) {
+        // Fired early, as it was set for an earlier alarm that got replaced.
+        rearm_millis = (scheduler->deadline_ns - now + 999999) / 1000000;
+        scheduler->java_deadline_ns = scheduler->deadline_ns;
+        scheduler->java_sets++;
+    } else if (from_java) {
+        scheduler->stale_java_fires++;
+    }
+    pthread_mutex_unlock(&scheduler->lock);
+
+    if (rearm_millis > 0 && !scheduler->set_java_alarm(scheduler, rearm_millis)) {
+        pthread_mutex_lock(&scheduler->lock);
+        scheduler->java_deadline_ns = 0;
+        pthread_mutex_unlock(&scheduler->lock);
+    }
+    if (cb == NULL) return;
+    if (hold_wake_lock) scheduler->hold_wake_lock(scheduler, true);
+    cb(data);
+    if (hold_wake_lock) scheduler->hold_wake_lock(scheduler, false);
+}
+
+static void* alarmThread(void* arg) {
+    alarm_scheduler_t* scheduler = (alarm_scheduler_t*) arg;
+    struct pollfd fds[2];
+    fds[0].fd = scheduler->timer_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = scheduler->event_fd;
+    fds[1].events = POLLIN;
+
+    while (true) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            ALOGE("%s: poll failed: %s", __func__, strerror(errno));
+            break;
+        }
+        if (fds[1].revents) break;
+        if (fds[0].revents) {
+            uint64_t expirations;
+            if (read(scheduler->timer_fd, &expirations, sizeof(expirations)) < 0 &&
+                errno != EAGAIN) {
+                ALOGE("%s: timer read failed: %s", __func__, strerror(errno));
+            }
+            alarmFire(scheduler, false);
+        }
+    }
+    return NULL;
+}
+
+static bool alarmSchedulerStart(alarm_scheduler_t* scheduler) {
+    if (scheduler->running) return true;
+
+    scheduler->timer_fd = timerfd_create(CLOCK_BOOTTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+    scheduler->event_fd = eventfd(0, EFD_CLOEXEC);
+    if (scheduler->timer_fd < 0 || scheduler->event_fd < 0 ||
+        pthread_create(&scheduler->thread, NULL, alarmThread, scheduler) != 0) {
+        ALOGE("%s: unable to start alarm thread: %s", __func__, strerror(errno));
+        if (scheduler->timer_fd >= 0) close(scheduler->timer_fd);
+        if (scheduler->event_fd >= 0) close(scheduler->event_fd);
+        scheduler->timer_fd = -1;
+        scheduler->event_fd = -1;
+        return false;
+    }
+    scheduler->running = true;
+    return true;
+}
+
+static void alarmSchedulerStop(alarm_scheduler_t* scheduler) {
+    if (!scheduler->running) return;
+
+    uint64_t one = 1;
+    if (write(scheduler->event_fd, &one, sizeof(one)) < 0) {
+        ALOGE("%s: unable to stop alarm thread: %s", __func__, strerror(errno));
+    }
+    pthread_join(scheduler->thread, NULL);
+    close(scheduler->timer_fd);
+    close(scheduler->event_fd);
+    scheduler->timer_fd = -1;
+    scheduler->event_fd = -1;
+
+    pthread_mutex_lock(&scheduler->lock);
+    scheduler->running = false;
+    scheduler->cb = NULL;
+    scheduler->data = NULL;
+    scheduler->deadline_ns = 0;
+    scheduler->java_deadline_ns = 0;
+    pthread_mutex_unlock(&scheduler->lock);
+}
+
+static bool alarmSchedulerSet(alarm_scheduler_t* scheduler, uint64_t delay_millis,
+                              bool should_wake, alarm_cb cb, void* data) {
+    int64_t start = boottime_ns();
+    int64_t deadline = start + delay_millis * 1000000LL;
+
+    pthread_mutex_lock(&scheduler->lock);
+    if (!scheduler->running) {
+        pthread_mutex_unlock(&scheduler->lock);
+        ALOGE("%s: alarm thread is not running", __func__);
+        return false;
+    }
+    scheduler->sets++;
+    scheduler->cb = cb;
+    scheduler->data = data;
+    scheduler->deadline_ns = deadline;
+    scheduler->should_wake = should_wake;
+    alarmArm(scheduler, deadline);
+
+    int64_t java_deadline = scheduler->java_deadline_ns;
+    bool set_java = should_wake && (java_deadline == 0 || java_deadline < start ||
+                                    java_deadline > deadline + ALARM_SLACK_NS);
+    if (set_java) {
+        scheduler->java_deadline_ns = deadline;
+        scheduler->java_sets++;
+    }
+    pthread_mutex_unlock(&scheduler->lock);
+
+    bool ret = true;
+    if (set_java && !scheduler->set_java_alarm(scheduler, delay_millis)) {
+        ALOGE("%s setWakeAlarm failed", __func__);
+        pthread_mutex_lock(&scheduler->lock);
+        scheduler->java_deadline_ns = 0;
+        if (scheduler->cb == cb && scheduler->data == data) {
+            scheduler->cb = NULL;
+            scheduler->data = NULL;
+            scheduler->deadline_ns = 0;
+            alarmArm(scheduler, 0);
+        }
+        pthread_mutex_unlock(&scheduler->lock);
+        ret = false;
+    }
+
+    pthread_mutex_lock(&scheduler->lock);
+    alarmRecord(boottime_ns() - start, &scheduler->set_ns, &scheduler->set_max_ns,
+                scheduler->set_hist);
+    pthread_mutex_unlock(&scheduler->lock);
+    return ret;
+}
+
+static bool set_java_wake_alarm(alarm_scheduler_t* scheduler, uint64_t delay_millis) {
     JNIEnv *env;
     JavaVM *vm = AndroidRuntime::getJavaVM();
     jint status = vm->GetEnv((void **)&env, JNI_VERSION_1_6);
@@ -538,21 +1459,12 @@ static bool set_wake_alarm_callout(uint64_t delay_millis, bool should_wake,
         return false;
     }
 
-    sAlarmCallback = cb;
-    sAlarmCallbackData = data;
-
-    jboolean jshould_wake = should_wake ? JNI_TRUE : JNI_FALSE;
     if (sJniAdapterServiceObj) {
         ret = env->CallBooleanMethod(sJniAdapterServiceObj, method_setWakeAlarm,
-            (jlong)delay_millis, jshould_wake);
+            (jlong)delay_millis, JNI_TRUE);
+        checkAndClearExceptionFromCallback(env, __func__);
     } else {
-       ALOGE("JNI ERROR : JNI reference already cleaned : set_wake_alarm_callout", __FUNCTION__);
-    }
-
-    if (!ret) {
-        ALOGE("%s setWakeAlarm failed:ret= %d ", __func__, ret);
-        sAlarmCallback = NULL;
-        sAlarmCallbackData = NULL;
+       ALOGE("JNI ERROR : JNI reference already cleaned : set_java_wake_alarm", __FUNCTION__);
     }
 
     if (status == JNI_EDETACHED) {
@@ -562,43 +1474,289 @@ static bool set_wake_alarm_callout(uint64_t delay_millis, bool should_wake,
     return !!ret;
 }
 
-static int acquire_wake_lock_callout(const char *lock_name) {
-    JNIEnv *env;
-    JavaVM *vm = AndroidRuntime::getJavaVM();
-    jint status = vm->GetEnv((void **)&env, JNI_VERSION_1_6);
-    if (status != JNI_OK && status != JNI_EDETACHED) {
-        ALOGE("%s unable to get environment for JNI call", __func__);
-        return BT_STATUS_JNI_ENVIRONMENT_ERROR;
-    }
-    if (status == JNI_EDETACHED && vm->AttachCurrentThread(&env, &sAttachArgs) != 0) {
-        ALOGE("%s unable to attach thread to VM", __func__);
-        return BT_STATUS_JNI_THREAD_ATTACH_ERROR;
-    }
+// Defined with the wake lock callouts below.
+static int wake_lock_update(const char *lock_name, bool acquire);
+
+// The name the stack takes its wake lock under. AdapterService has a single
+// wake lock, so sharing the name keeps the stack's releases from dropping it
+// while an alarm runs.
+#define ALARM_WAKE_LOCK_NAME "bluetooth_timer"
+
+static void hold_alarm_wake_lock(alarm_scheduler_t* scheduler, bool hold) {
+    wake_lock_update(ALARM_WAKE_LOCK_NAME, hold);
+}
+
+static alarm_scheduler_t sAlarmScheduler = {
+    PTHREAD_MUTEX_INITIALIZER, -1, -1, 0, false, set_java_wake_alarm, hold_alarm_wake_lock,
+    NULL,
+};
+
+static bool set_wake_alarm_callout(uint64_t delay_millis, bool should_wake,
+        alarm_cb cb, void *data) {
+    return alarmSchedulerSet(&sAlarmScheduler, delay_millis, should_wake, cb, data);
+}
 
-    jint ret = BT_STATUS_SUCCESS;
-    jstring lock_name_jni = env->NewStringUTF(lock_name);
-    if (lock_name_jni) {
-        if (sJniAdapterServiceObj) {
-            bool acquired = env->CallBooleanMethod(sJniAdapterServiceObj,
-                                   method_acquireWakeLock, lock_name_jni);
-            if (!acquired) ret = BT_STATUS_WAKELOCK_ERROR;
-            env->DeleteLocalRef(lock_name_jni);
+static void dumpLog2Histogram(int fd, const char* label, const uint32_t* hist, int buckets,
+                              const char* unit) {
+    dprintf(fd, "      %-7s", label);
+    for (int i = 0; i < buckets; i++) {
+        if (hist[i] == 0) continue;
+        if (i == buckets - 1) {
+            dprintf(fd, " >=%u%s:%u", 1u << (i - 1), unit, hist[i]);
         } else {
-            ALOGE("JNI ERROR : JNI reference already cleaned : acquire_wake_lock_callout", __FUNCTION__);
+            dprintf(fd, " <%u%s:%u", 1u << i, unit, hist[i]);
         }
+    }
+    dprintf(fd, "\n");
+}
+
+static void dumpAlarmStats(int fd) {
+    alarm_scheduler_t* scheduler = &sAlarmScheduler;
+    pthread_mutex_lock(&scheduler->lock);
+    uint64_t fires = scheduler->fires;
+    dprintf(fd, "\nAlarms (times in us)\n");
+    dprintf(fd, "  sets: %llu, java sets: %llu, fires: %llu, native fires: %llu, "
+            "java fires: %llu, stale java fires: %llu\n",
+            (unsigned long long) scheduler->sets, (unsigned long long) scheduler->java_sets,
+            (unsigned long long) fires, (unsigned long long) scheduler->native_fires,
+            (unsigned long long) scheduler->java_fires,
+            (unsigned long long) scheduler->stale_java_fires);
+    dprintf(fd, "  set avg: %lld, set max: %lld, late avg: %lld, late max: %lld\n",
+            (long long) (scheduler->sets ? scheduler->set_ns / scheduler->sets / 1000 : 0),
+            (long long) (scheduler->set_max_ns / 1000),
+            (long long) (fires ? scheduler->late_ns / fires / 1000 : 0),
+            (long long) (scheduler->late_max_ns / 1000));
+    dumpLog2Histogram(fd, "set", scheduler->set_hist, ALARM_HIST_BUCKETS, "us");
+    dumpLog2Histogram(fd, "late", scheduler->late_hist, ALARM_HIST_BUCKETS, "us");
+    pthread_mutex_unlock(&scheduler->lock);
+}
+
+/**
+ * Wake lock callouts
+ *
+ * The stack takes and drops its wake locks at a high rate, in particular
+ * while streaming audio. Acquires and releases are counted here per lock
+ * name, and only the first acquire and the last release of a name reach
+ * AdapterService. Those calls are made by the calling thread if it is
+ * attached to the VM, and otherwise by a dispatcher thread that stays
+ * attached while the stack is up, instead of attaching and detaching the
+ * caller each time. An acquire waits for the dispatcher so its result can
+ * be reported; a release does not. Until AdapterService holds a lock, every
+ * acquire of it waits for a call to complete, so none reports success while
+ * the first call is in flight and a failed call is retried by the next
+ * acquire. An acquire that fails does not count. Lock names become Java
+ * strings once.
+ */
+
+#define WAKE_LOCK_MAX 8
+#define WAKE_LOCK_NAME_LEN 64
+// Held times are bucketed by powers of two of milliseconds.
+#define WAKE_LOCK_HIST_BUCKETS 16
+
+typedef struct {
+    char name[WAKE_LOCK_NAME_LEN];
+    jstring jname;
+    int refs;
+    // Whether AdapterService holds the lock, as of the last call to it.
+    bool held;
+    // Set when the dispatcher has to bring AdapterService in line.
+    bool dirty;
+    // Acquires that asked for a call, and how many of them the last
+    // completed call covered.
+    uint32_t acquire_requests;
+    uint32_t acquire_served;
+    int64_t since_ns;
+    uint64_t acquires;
+    uint64_t releases;
+    uint64_t java_acquires;
+    uint64_t java_releases;
+    uint64_t failures;
+    uint32_t held_hist[WAKE_LOCK_HIST_BUCKETS];
+} wake_lock_t;
+
+static pthread_mutex_t sWakeLockLock = PTHREAD_MUTEX_INITIALIZER;
+// Serializes calls to AdapterService; held across them.
+static pthread_mutex_t sWakeLockCallLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sWakeLockCond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t sWakeLockDoneCond = PTHREAD_COND_INITIALIZER;
+static wake_lock_t sWakeLocks[WAKE_LOCK_MAX];
+static int sWakeLockCount;
+static pthread_t sWakeLockThread;
+static bool sWakeLockThreadRunning;
+static bool sWakeLockThreadStop;
+
+// Must be called with sWakeLockLock held.
+static wake_lock_t* wakeLockFor(const char* name) {
+    for (int i = 0; i < sWakeLockCount; i++) {
+        if (!strncmp(sWakeLocks[i].name, name, WAKE_LOCK_NAME_LEN - 1)) return &sWakeLocks[i];
+    }
+    if (sWakeLockCount == WAKE_LOCK_MAX) return NULL;
+
+    wake_lock_t* lock = &sWakeLocks[sWakeLockCount++];
+    memset(lock, 0, sizeof(wake_lock_t));
+    strlcpy(lock->name, name, sizeof(lock->name));
+    return lock;
+}
+
+// Brings AdapterService in line with the reference count of |lock|. Must be
+// called with sWakeLockCallLock held.
+static void wakeLockSync(JNIEnv* env, wake_lock_t* lock) {
+    pthread_mutex_lock(&sWakeLockLock);
+    bool want = lock->refs > 0;
+    bool held = lock->held;
+    uint32_t requests = lock->acquire_requests;
+    if (want == held) {
+        lock->acquire_served = requests;
+        pthread_cond_broadcast(&sWakeLockDoneCond);
+    }
+    pthread_mutex_unlock(&sWakeLockLock);
+    if (want == held) return;
+
+    if (lock->jname == NULL) {
+        jstring name = env->NewStringUTF(lock->name);
+        if (name != NULL) {
+            lock->jname = (jstring) env->NewGlobalRef(name);
+            env->DeleteLocalRef(name);
+        }
+    }
+
+    jboolean ok = JNI_FALSE;
+    if (lock->jname == NULL) {
+        ALOGE("%s unable to allocate string: %s", __func__, lock->name);
+        env->ExceptionClear();
+    } else if (sJniAdapterServiceObj) {
+        ok = env->CallBooleanMethod(sJniAdapterServiceObj,
+                                    want ? method_acquireWakeLock : method_releaseWakeLock,
+                                    lock->jname);
+        checkAndClearExceptionFromCallback(env, __func__);
     } else {
-        ALOGE("%s unable to allocate string: %s", __func__, lock_name);
-        ret = BT_STATUS_NOMEM;
+        ALOGE("JNI ERROR : JNI reference already cleaned : %s", __func__);
     }
 
-    if (status == JNI_EDETACHED) {
-        vm->DetachCurrentThread();
+    pthread_mutex_lock(&sWakeLockLock);
+    // A failed release leaves nothing held on the Java side either.
+    if (ok || !want) lock->held = want;
+    if (!ok) {
+        lock->failures++;
+    } else if (want) {
+        lock->java_acquires++;
+    } else {
+        lock->java_releases++;
     }
+    lock->acquire_served = requests;
+    pthread_cond_broadcast(&sWakeLockDoneCond);
+    pthread_mutex_unlock(&sWakeLockLock);
+}
 
-    return ret;
+static void* wakeLockThread(void* arg) {
+    JavaVM* vm = AndroidRuntime::getJavaVM();
+    JNIEnv* env = NULL;
+    JavaVMAttachArgs args = { JNI_VERSION_1_6, (char*) "BT Wake Lock", NULL };
+    if (vm->AttachCurrentThread(&env, &args) != 0) {
+        ALOGE("%s: unable to attach thread to VM", __func__);
+        pthread_mutex_lock(&sWakeLockLock);
+        sWakeLockThreadStop = true;
+        pthread_cond_broadcast(&sWakeLockDoneCond);
+        pthread_mutex_unlock(&sWakeLockLock);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&sWakeLockLock);
+    while (!sWakeLockThreadStop) {
+        wake_lock_t* lock = NULL;
+        for (int i = 0; i < sWakeLockCount && lock == NULL; i++) {
+            if (sWakeLocks[i].dirty) lock = &sWakeLocks[i];
+        }
+        if (lock == NULL) {
+            pthread_cond_wait(&sWakeLockCond, &sWakeLockLock);
+            continue;
+        }
+
+        lock->dirty = false;
+        pthread_mutex_unlock(&sWakeLockLock);
+        pthread_mutex_lock(&sWakeLockCallLock);
+        wakeLockSync(env, lock);
+        pthread_mutex_unlock(&sWakeLockCallLock);
+        pthread_mutex_lock(&sWakeLockLock);
+    }
+    pthread_mutex_unlock(&sWakeLockLock);
+
+    vm->DetachCurrentThread();
+    return NULL;
 }
 
-static int release_wake_lock_callout(const char *lock_name) {
+static void wakeLockStartThread() {
+    pthread_mutex_lock(&sWakeLockLock);
+    if (!sWakeLockThreadRunning) {
+        sWakeLockThreadStop = false;
+        sWakeLockThreadRunning =
+                pthread_create(&sWakeLockThread, NULL, wakeLockThread, NULL) == 0;
+        if (!sWakeLockThreadRunning) ALOGE("%s: unable to start thread", __func__);
+    }
+    pthread_mutex_unlock(&sWakeLockLock);
+}
+
+// Stops the dispatcher and forgets all locks; AdapterService releases its
+// wake lock itself on cleanup.
+static void wakeLockStopThread(JNIEnv* env) {
+    pthread_mutex_lock(&sWakeLockLock);
+    bool running = sWakeLockThreadRunning;
+    sWakeLockThreadStop = true;
+    pthread_cond_signal(&sWakeLockCond);
+    pthread_mutex_unlock(&sWakeLockLock);
+    if (running) pthread_join(sWakeLockThread, NULL);
+
+    pthread_mutex_lock(&sWakeLockCallLock);
+    pthread_mutex_lock(&sWakeLockLock);
+    sWakeLockThreadRunning = false;
+    pthread_cond_broadcast(&sWakeLockDoneCond);
+    for (int i = 0; i < sWakeLockCount; i++) {
+        if (sWakeLocks[i].jname) env->DeleteGlobalRef(sWakeLocks[i].jname);
+    }
+    memset(sWakeLocks, 0, sizeof(sWakeLocks));
+    sWakeLockCount = 0;
+    pthread_mutex_unlock(&sWakeLockLock);
+    pthread_mutex_unlock(&sWakeLockCallLock);
+}
+
+static int wake_lock_update(const char *lock_name, bool acquire) {
+    pthread_mutex_lock(&sWakeLockLock);
+    wake_lock_t* lock = wakeLockFor(lock_name);
+    if (lock == NULL) {
+        pthread_mutex_unlock(&sWakeLockLock);
+        ALOGE("%s: too many wake locks, dropping %s", __func__, lock_name);
+        return BT_STATUS_NOMEM;
+    }
+    if (acquire) {
+        lock->acquires++;
+        // With other references and no call pending, held is what
+        // AdapterService has; a release may still be in flight otherwise.
+        bool settled = lock->refs > 0 && lock->acquire_served == lock->acquire_requests;
+        if (lock->refs++ == 0) lock->since_ns = monotonic_ns();
+        if (settled && lock->held) {
+            pthread_mutex_unlock(&sWakeLockLock);
+            return BT_STATUS_SUCCESS;
+        }
+        lock->acquire_requests++;
+    } else {
+        if (lock->refs == 0) {
+            pthread_mutex_unlock(&sWakeLockLock);
+            ALOGE("%s: %s is not held", __func__, lock_name);
+            return BT_STATUS_WAKELOCK_ERROR;
+        }
+        lock->releases++;
+        if (--lock->refs > 0) {
+            pthread_mutex_unlock(&sWakeLockLock);
+            return BT_STATUS_SUCCESS;
+        }
+        uint64_t ms = (monotonic_ns() - lock->since_ns) / 1000000;
+        int bucket = ms == 0 ? 0 : 64 - __builtin_clzll(ms);
+        if (bucket >= WAKE_LOCK_HIST_BUCKETS) bucket = WAKE_LOCK_HIST_BUCKETS - 1;
+        lock->held_hist[bucket]++;
+    }
+    uint32_t request = lock->acquire_requests;
+    pthread_mutex_unlock(&sWakeLockLock);
+
     JNIEnv *env;
     JavaVM *vm = AndroidRuntime::getJavaVM();
     jint status = vm->GetEnv((void **)&env, JNI_VERSION_1_6);
@@ -606,42 +1764,71 @@ static int release_wake_lock_callout(const char *lock_name) {
         ALOGE("%s unable to get environment for JNI call", __func__);
         return BT_STATUS_JNI_ENVIRONMENT_ERROR;
     }
-    if (status == JNI_EDETACHED && vm->AttachCurrentThread(&env, &sAttachArgs) != 0) {
-        ALOGE("%s unable to attach thread to VM", __func__);
-        return BT_STATUS_JNI_THREAD_ATTACH_ERROR;
-    }
 
-    jint ret = BT_STATUS_SUCCESS;
-    jstring lock_name_jni = env->NewStringUTF(lock_name);
-    if (lock_name_jni) {
-        if (sJniAdapterServiceObj) {
-            bool released = env->CallBooleanMethod(sJniAdapterServiceObj,
-                                method_releaseWakeLock, lock_name_jni);
-            if (!released) ret = BT_STATUS_WAKELOCK_ERROR;
-            env->DeleteLocalRef(lock_name_jni);
-        } else {
-            ALOGE("JNI ERROR : JNI reference already cleaned : release_wake_lock_callout", __FUNCTION__);
+    bool dispatched = false;
+    if (status == JNI_EDETACHED) {
+        pthread_mutex_lock(&sWakeLockLock);
+        dispatched = sWakeLockThreadRunning && !sWakeLockThreadStop;
+        if (dispatched) {
+            lock->dirty = true;
+            pthread_cond_signal(&sWakeLockCond);
         }
-    } else {
-        ALOGE("%s unable to allocate string: %s", __func__, lock_name);
-        ret = BT_STATUS_NOMEM;
+        pthread_mutex_unlock(&sWakeLockLock);
     }
 
-    if (status == JNI_EDETACHED) {
-        vm->DetachCurrentThread();
-    }
+    if (!dispatched) {
+        // Called on an attached thread, or after cleanup.
+        if (status == JNI_EDETACHED && vm->AttachCurrentThread(&env, &sAttachArgs) != 0) {
+            ALOGE("%s unable to attach thread to VM", __func__);
+            return BT_STATUS_JNI_THREAD_ATTACH_ERROR;
+        }
+        pthread_mutex_lock(&sWakeLockCallLock);
+        wakeLockSync(env, lock);
+        pthread_mutex_unlock(&sWakeLockCallLock);
+        if (status == JNI_EDETACHED) vm->DetachCurrentThread();
+    }
+    if (!acquire) return BT_STATUS_SUCCESS;
+
+    pthread_mutex_lock(&sWakeLockLock);
+    // Wait for a call that started after this acquire asked for it.
+    while (sWakeLockThreadRunning && !sWakeLockThreadStop && lock->refs > 0 && !lock->held &&
+           (int32_t) (lock->acquire_served - request) < 0) {
+        pthread_cond_wait(&sWakeLockDoneCond, &sWakeLockLock);
+    }
+    bool held = lock->held || lock->refs == 0;
+    // The stack does not release a lock it failed to acquire.
+    if (!held) lock->refs--;
+    pthread_mutex_unlock(&sWakeLockLock);
+    return held ? BT_STATUS_SUCCESS : BT_STATUS_WAKELOCK_ERROR;
+}
 
-    return ret;
+static int acquire_wake_lock_callout(const char *lock_name) {
+    return wake_lock_update(lock_name, true);
+}
+
+static int release_wake_lock_callout(const char *lock_name) {
+    return wake_lock_update(lock_name, false);
+}
+
+static void dumpWakeLockStats(int fd) {
+    pthread_mutex_lock(&sWakeLockLock);
+    dprintf(fd, "\nWake locks (java = calls that reached AdapterService)\n");
+    for (int i = 0; i < sWakeLockCount; i++) {
+        const wake_lock_t& lock = sWakeLocks[i];
+        dprintf(fd, "  %s: refs %d, held %d, acquires %llu, releases %llu, "
+                "java acquires %llu, java releases %llu, failures %llu\n",
+                lock.name, lock.refs, lock.held, (unsigned long long) lock.acquires,
+                (unsigned long long) lock.releases, (unsigned long long) lock.java_acquires,
+                (unsigned long long) lock.java_releases, (unsigned long long) lock.failures);
+        dumpLog2Histogram(fd, "held", lock.held_hist, WAKE_LOCK_HIST_BUCKETS, "ms");
+    }
+    pthread_mutex_unlock(&sWakeLockLock);
 }
 
 // Called by Java code when alarm is fired. A wake lock is held by the caller
 // over the duration of this callback.
 static void alarmFiredNative(JNIEnv *env, jobject obj) {
-    if (sAlarmCallback) {
-        sAlarmCallback(sAlarmCallbackData);
-    } else {
-        ALOGE("%s() - Alarm fired with callback not set!", __func__);
-    }
+    alarmFire(&sAlarmScheduler, true);
 }
 
 static bt_os_callouts_t sBluetoothOsCallouts = {
@@ -652,10 +1839,6 @@ static bt_os_callouts_t sBluetoothOsCallouts = {
 };
 
 static void classInitNative(JNIEnv* env, jclass clazz) {
-    jclass jniUidTrafficClass = env->FindClass("android/bluetooth/UidTraffic");
-    android_bluetooth_UidTraffic.constructor = env->GetMethodID(jniUidTrafficClass,
-                                                                "<init>", "(IJJ)V");
-
     jclass jniCallbackClass =
         env->FindClass("com/android/bluetooth/btservice/JniCallbacks");
     sJniCallbacksField = env->GetFieldID(clazz, "mJniCallbacks",
@@ -673,6 +1856,11 @@ static void classInitNative(JNIEnv* env, jclass clazz) {
                                                             "devicePropertyChangedCallback",
                                                             "([B[I[[B)V");
     method_deviceFoundCallback = env->GetMethodID(jniCallbackClass, "deviceFoundCallback", "([B)V");
+    method_deviceFoundWithPropertiesCallback = env->GetMethodID(jniCallbackClass,
+                                                                "deviceFoundWithPropertiesCallback",
+                                                                "([B[I[[B)V");
+    method_devicesFoundCallback = env->GetMethodID(jniCallbackClass, "devicesFoundCallback",
+                                                   "([B[I[I[[B)V");
     method_pinRequestCallback = env->GetMethodID(jniCallbackClass, "pinRequestCallback",
                                                  "([B[BIZ)V");
     method_sspRequestCallback = env->GetMethodID(jniCallbackClass, "sspRequestCallback",
@@ -687,7 +1875,7 @@ static void classInitNative(JNIEnv* env, jclass clazz) {
     method_setWakeAlarm = env->GetMethodID(clazz, "setWakeAlarm", "(JZ)Z");
     method_acquireWakeLock = env->GetMethodID(clazz, "acquireWakeLock", "(Ljava/lang/String;)Z");
     method_releaseWakeLock = env->GetMethodID(clazz, "releaseWakeLock", "(Ljava/lang/String;)Z");
-    method_energyInfo = env->GetMethodID(clazz, "energyInfoCallback", "(IIJJJJ[Landroid/bluetooth/UidTraffic;)V");
+    method_energyInfo = env->GetMethodID(clazz, "energyInfoCallback", "(IIJJJJ)V");
 
     char value[PROPERTY_VALUE_MAX];
     property_get("bluetooth.mock_stack", value, "");
@@ -714,9 +1902,6 @@ static void classInitNative(JNIEnv* env, jclass clazz) {
 static bool initNative(JNIEnv* env, jobject obj) {
     ALOGV("%s",__func__);
 
-    android_bluetooth_UidTraffic.clazz = (jclass) env->NewGlobalRef(
-            env->FindClass("android/bluetooth/UidTraffic"));
-
     sJniAdapterServiceObj = env->NewGlobalRef(obj);
     if (sJniCallbacksField) {
         sJniCallbacksObj = env->NewGlobalRef(env->GetObjectField(obj, sJniCallbacksField));
@@ -734,11 +1919,17 @@ static bool initNative(JNIEnv* env, jobject obj) {
         sBluetoothInterface = NULL;
         return JNI_FALSE;
     }
+    wakeLockStartThread();
+    pthread_mutex_lock(&sAlarmScheduler.lock);
+    alarmSchedulerStart(&sAlarmScheduler);
+    pthread_mutex_unlock(&sAlarmScheduler.lock);
     ret = sBluetoothInterface->set_os_callouts(&sBluetoothOsCallouts);
     if (ret != BT_STATUS_SUCCESS) {
         ALOGE("Error while setting Bluetooth callouts: %d\n", ret);
         sBluetoothInterface->cleanup();
         sBluetoothInterface = NULL;
+        wakeLockStopThread(env);
+        alarmSchedulerStop(&sAlarmScheduler);
         return JNI_FALSE;
     }
 
@@ -759,6 +1950,16 @@ static bool cleanupNative(JNIEnv *env, jobject obj) {
     sBluetoothInterface->cleanup();
     ALOGI("%s: return from cleanup",__func__);
 
+    discoveryBatchStopThread();
+    wakeLockStopThread(env);
+    alarmSchedulerStop(&sAlarmScheduler);
+    remotePropForget(NULL);
+
+    pthread_mutex_lock(&sUidTrafficLock);
+    sUidTraffic.clear();
+    sUidTrafficCursor = 0;
+    pthread_mutex_unlock(&sUidTrafficLock);
+
     if (sJniCallbacksObj) {
         env->DeleteGlobalRef(sJniCallbacksObj);
         sJniCallbacksObj = NULL;
@@ -767,10 +1968,6 @@ static bool cleanupNative(JNIEnv *env, jobject obj) {
         env->DeleteGlobalRef(sJniAdapterServiceObj);
         sJniAdapterServiceObj = NULL;
     }
-    if (android_bluetooth_UidTraffic.clazz) {
-        env->DeleteGlobalRef(android_bluetooth_UidTraffic.clazz);
-        android_bluetooth_UidTraffic.clazz = NULL;
-    }
 
     return JNI_TRUE;
 }
@@ -796,6 +1993,18 @@ static jboolean disableNative(JNIEnv* env, jobject obj) {
     return (ret == BT_STATUS_FAIL) ? JNI_FALSE : JNI_TRUE;
 }
 
+// Sets the longest time, in ms, a found device waits to be passed up in a
+// batch; 0 passes every device up as it is found.
+static jboolean setDiscoveryBatchingNative(JNIEnv* env, jobject obj, jint intervalMs) {
+    ALOGV("%s: %d ms", __func__, intervalMs);
+
+    if (intervalMs <= 0) {
+        discoveryBatchStop(env);
+        return JNI_TRUE;
+    }
+    return discoveryBatchStart(intervalMs) ? JNI_TRUE : JNI_FALSE;
+}
+
 static jboolean startDiscoveryNative(JNIEnv* env, jobject obj) {
     ALOGV("%s",__func__);
 
@@ -1279,6 +2488,40 @@ static int readEnergyInfo()
     return (ret == BT_STATUS_SUCCESS) ? JNI_TRUE : JNI_FALSE;
 }
 
+// Returns {cursor, then uid, rx bytes, tx bytes for every UID with traffic
+// since the read that returned |cursor|}.
+static jlongArray getUidTrafficNative(JNIEnv *env, jobject obj, jlong cursor) {
+    pthread_mutex_lock(&sUidTrafficLock);
+    bool stale = cursor != sUidTrafficCursor;
+    std::vector<jlong> packed;
+    packed.push_back(++sUidTrafficCursor);
+    for (size_t i = 0; i < sUidTraffic.size(); i++) {
+        uid_traffic_t& entry = sUidTraffic[i];
+        int64_t rx = entry.rx_bytes - (stale ? 0 : entry.rx_read);
+        int64_t tx = entry.tx_bytes - (stale ? 0 : entry.tx_read);
+        entry.rx_read = entry.rx_bytes;
+        entry.tx_read = entry.tx_bytes;
+        if (rx == 0 && tx == 0) continue;
+        packed.push_back(entry.uid);
+        packed.push_back(rx);
+        packed.push_back(tx);
+    }
+    pthread_mutex_unlock(&sUidTrafficLock);
+
+    jlongArray result = env->NewLongArray(packed.size());
+    if (result) env->SetLongArrayRegion(result, 0, packed.size(), &packed[0]);
+    return result;
+}
+
+static void dumpUidTrafficStats(int fd) {
+    pthread_mutex_lock(&sUidTrafficLock);
+    dprintf(fd, "\nUID traffic\n");
+    dprintf(fd, "  uids: %zu, reports: %llu, uid updates: %llu, cursor: %lld\n",
+            sUidTraffic.size(), (unsigned long long) sUidTrafficReports,
+            (unsigned long long) sUidTrafficUpdates, (long long) sUidTrafficCursor);
+    pthread_mutex_unlock(&sUidTrafficLock);
+}
+
 static void dumpNative(JNIEnv *env, jobject obj, jobject fdObj,
                        jobjectArray argArray)
 {
@@ -1301,6 +2544,12 @@ static void dumpNative(JNIEnv *env, jobject obj, jobject fdObj,
     }
 
     sBluetoothInterface->dump(fd, args);
+    dumpCallbackStats(fd);
+    dumpRemotePropStats(fd);
+    dumpDiscoveryBatchStats(fd);
+    dumpWakeLockStats(fd);
+    dumpAlarmStats(fd);
+    dumpUidTrafficStats(fd);
 
     for (int i = 0; i < numArgs; i++) {
       env->ReleaseStringUTFChars(argObjs[i], args[i]);
@@ -1310,6 +2559,18 @@ static void dumpNative(JNIEnv *env, jobject obj, jobject fdObj,
     delete[] argObjs;
 }
 
+// Makes the next event of |address|, or of every device if it is null, pass
+// up all its properties again.
+static void forgetRemoteDevicePropertiesNative(JNIEnv *env, jobject obj, jbyteArray address) {
+    if (address == NULL) {
+        remotePropForget(NULL);
+    } else if (env->GetArrayLength(address) == sizeof(bt_bdaddr_t)) {
+        bt_bdaddr_t bda;
+        env->GetByteArrayRegion(address, 0, sizeof(bt_bdaddr_t), (jbyte*) &bda);
+        remotePropForget(&bda);
+    }
+}
+
 static jboolean factoryResetNative(JNIEnv *env, jobject obj) {
     ALOGV("%s", __func__);
     if (!sBluetoothInterface) return JNI_FALSE;
@@ -1338,6 +2599,91 @@ static void interopDatabaseAddNative(JNIEnv *env, jobject obj, int feature,
     env->ReleaseByteArrayElements(address, addr, 0);
 }
 
+#ifdef BT_JNI_TEST_HOOKS
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int fired;
+    std::atomic<uint64_t> java_calls;
+    std::atomic<uint64_t> wake_holds;
+    std::atomic<int> wake_held;
+} alarm_benchmark_t;
+
+static void alarmBenchmarkFired(void* data) {
+    alarm_benchmark_t* bench = (alarm_benchmark_t*) data;
+    pthread_mutex_lock(&bench->lock);
+    bench->fired++;
+    pthread_cond_signal(&bench->cond);
+    pthread_mutex_unlock(&bench->lock);
+}
+
+static bool alarmBenchmarkSetJavaAlarm(alarm_scheduler_t* scheduler, uint64_t delay_millis) {
+    ((alarm_benchmark_t*) scheduler->context)->java_calls++;
+    return true;
+}
+
+static void alarmBenchmarkHoldWakeLock(alarm_scheduler_t* scheduler, bool hold) {
+    alarm_benchmark_t* bench = (alarm_benchmark_t*) scheduler->context;
+    if (hold) bench->wake_holds++;
+    bench->wake_held += hold ? 1 : -1;
+}
+
+// Sets |alarms| alarms |period_millis| apart on a scheduler of its own, the
+// way the A2DP media timer does while streaming, every |wake_every|th one a
+// waking alarm, and waits for each to fire. Returns alarms fired, calls to
+// AdapterService, calls a Java only scheduler would have made, the average
+// and maximum set time and lateness in ns, fires run under the wake lock and
+// wake locks left held.
+static jlongArray benchmarkAlarmsNative(JNIEnv* env, jclass clazz, jint alarms,
+                                        jint period_millis, jint wake_every) {
+    alarm_benchmark_t bench;
+    pthread_mutex_init(&bench.lock, NULL);
+    pthread_cond_init(&bench.cond, NULL);
+    bench.fired = 0;
+    bench.java_calls = 0;
+    bench.wake_holds = 0;
+    bench.wake_held = 0;
+
+    alarm_scheduler_t scheduler;
+    memset(&scheduler, 0, sizeof(scheduler));
+    pthread_mutex_init(&scheduler.lock, NULL);
+    scheduler.timer_fd = -1;
+    scheduler.event_fd = -1;
+    scheduler.set_java_alarm = alarmBenchmarkSetJavaAlarm;
+    scheduler.hold_wake_lock = alarmBenchmarkHoldWakeLock;
+    scheduler.context = &bench;
+
+    jlongArray result = NULL;
+    if (alarmSchedulerStart(&scheduler)) {
+        for (int i = 0; i < alarms; i++) {
+            bool should_wake = wake_every > 0 && i % wake_every == 0;
+            if (!alarmSchedulerSet(&scheduler, period_millis, should_wake, alarmBenchmarkFired,
+                                   &bench)) {
+                break;
+            }
+            pthread_mutex_lock(&bench.lock);
+            while (bench.fired <= i) pthread_cond_wait(&bench.cond, &bench.lock);
+            pthread_mutex_unlock(&bench.lock);
+        }
+        alarmSchedulerStop(&scheduler);
+
+        jlong stats[] = {
+            bench.fired, (jlong) bench.java_calls.load(), alarms,
+            scheduler.sets ? scheduler.set_ns / (jlong) scheduler.sets : 0, scheduler.set_max_ns,
+            scheduler.fires ? scheduler.late_ns / (jlong) scheduler.fires : 0,
+            scheduler.late_max_ns, (jlong) bench.wake_holds.load(), bench.wake_held.load(),
+        };
+        result = env->NewLongArray(NELEM(stats));
+        if (result) env->SetLongArrayRegion(result, 0, NELEM(stats), stats);
+    }
+
+    pthread_mutex_destroy(&scheduler.lock);
+    pthread_cond_destroy(&bench.cond);
+    pthread_mutex_destroy(&bench.lock);
+    return result;
+}
+#endif
+
 static JNINativeMethod sMethods[] = {
     /* name, signature, funcPtr */
     {"classInitNative", "()V", (void *) classInitNative},
@@ -1366,8 +2712,14 @@ static JNINativeMethod sMethods[] = {
     {"configHciSnoopLogNative", "(Z)Z", (void*) configHciSnoopLogNative},
     {"alarmFiredNative", "()V", (void *) alarmFiredNative},
     {"readEnergyInfo", "()I", (void*) readEnergyInfo},
+    {"getUidTrafficNative", "(J)[J", (void*) getUidTrafficNative},
     {"dumpNative", "(Ljava/io/FileDescriptor;[Ljava/lang/String;)V", (void*) dumpNative},
     {"factoryResetNative", "()Z", (void*)factoryResetNative},
+    {"forgetRemoteDevicePropertiesNative", "([B)V", (void*) forgetRemoteDevicePropertiesNative},
+    {"setDiscoveryBatchingNative", "(I)Z", (void*) setDiscoveryBatchingNative},
+#ifdef BT_JNI_TEST_HOOKS
+    {"benchmarkAlarmsNative", "(III)[J", (void*) benchmarkAlarmsNative},
+#endif
     {"interopDatabaseClearNative", "()V", (void*) interopDatabaseClearNative},
     {"interopDatabaseAddNative", "(I[BI)V", (void*) interopDatabaseAddNative},
     {"getSocketOptNative", "(III[B)I", (void*) getSocketOptNative},
@@ -1375,8 +2727,113 @@ static JNINativeMethod sMethods[] = {
 
 };
 
+#ifdef BT_JNI_TEST_HOOKS
+// Collects devices handed in from Java into one batch, as the found
+// callback does during discovery; used to test the batching.
+static jobject discoveryBatchCoalesceNative(JNIEnv* env, jclass clazz, jbyteArray addresses,
+                                            jintArray offsets, jintArray types,
+                                            jobjectArray values) {
+    jsize count = env->GetArrayLength(addresses) / sizeof(bt_bdaddr_t);
+    if (env->GetArrayLength(offsets) != count + 1) return NULL;
+    std::vector<jint> c_offsets(count + 1);
+    env->GetIntArrayRegion(offsets, 0, count + 1, &c_offsets[0]);
+    jsize num_types = env->GetArrayLength(types);
+    std::vector<jint> c_types(num_types + 1);
+    if (num_types > 0) env->GetIntArrayRegion(types, 0, num_types, &c_types[0]);
+
+    discovery_batch_t batch;
+    batch.num_props = 0;
+    for (jsize i = 0; i < count; i++) {
+        bt_bdaddr_t address;
+        env->GetByteArrayRegion(addresses, i * sizeof(bt_bdaddr_t), sizeof(bt_bdaddr_t),
+                                (jbyte*) address.address);
+        int first = c_offsets[i];
+        int num = c_offsets[i + 1] - first;
+        if (first < 0 || num < 0 || first + num > num_types) return NULL;
+
+        std::vector<std::vector<jbyte> > vals(num);
+        std::vector<bt_property_t> props(num + 1);
+        for (int j = 0; j < num; j++) {
+            jbyteArray val = (jbyteArray) env->GetObjectArrayElement(values, first + j);
+            jsize len = val ? env->GetArrayLength(val) : 0;
+            vals[j].resize(len + 1);
+            if (len > 0) env->GetByteArrayRegion(val, 0, len, &vals[j][0]);
+            env->DeleteLocalRef(val);
+            props[j].type = (bt_property_type_t) c_types[first + j];
+            props[j].len = len;
+            props[j].val = &vals[j][0];
+        }
+        discoveryBatchAdd(&batch, &address, num, &props[0]);
+    }
+
+    jbyteArray j_addresses;
+    jintArray j_offsets;
+    jintArray j_types;
+    jobjectArray j_values;
+    if (!discoveryBatchToJava(env, batch, &j_addresses, &j_offsets, &j_types, &j_values)) {
+        return NULL;
+    }
+    jmethodID init = env->GetMethodID(clazz, "<init>", "([B[I[I[[B)V");
+    return env->NewObject(clazz, init, j_addresses, j_offsets, j_types, j_values);
+}
+
+// Turns batching on with |sink| getting the batches through its
+// devicesFoundCallback(), in place of RemoteDevices.
+static jboolean discoveryBatchStartTestNative(JNIEnv* env, jclass clazz, jobject sink,
+                                              jint interval_ms) {
+    jclass sinkClass = env->GetObjectClass(sink);
+    jmethodID method = env->GetMethodID(sinkClass, "devicesFoundCallback", "([B[I[I[[B)V");
+    if (method == NULL) return JNI_FALSE;
+
+    pthread_mutex_lock(&sDiscoveryDeliverLock);
+    if (sDiscoveryTestSink != NULL) env->DeleteGlobalRef(sDiscoveryTestSink);
+    sDiscoveryTestSink = env->NewGlobalRef(sink);
+    sDiscoveryTestSinkMethod = method;
+    pthread_mutex_unlock(&sDiscoveryDeliverLock);
+    remotePropForget(NULL);
+    return discoveryBatchStart(interval_ms) ? JNI_TRUE : JNI_FALSE;
+}
+
+// Reports |address| found with |rssi| as the found callback does. Returns
+// false if batching is off.
+static jboolean discoveryBatchFoundTestNative(JNIEnv* env, jclass clazz, jbyteArray address,
+                                              jint rssi) {
+    if (env->GetArrayLength(address) != sizeof(bt_bdaddr_t)) return JNI_FALSE;
+    bt_bdaddr_t bda;
+    env->GetByteArrayRegion(address, 0, sizeof(bt_bdaddr_t), (jbyte*) &bda);
+    int8_t c_rssi = rssi;
+    bt_property_t props[2] = {
+        { BT_PROPERTY_BDADDR, sizeof(bda), &bda },
+        { BT_PROPERTY_REMOTE_RSSI, sizeof(c_rssi), &c_rssi },
+    };
+    return discoveryBatchFound(&bda, NELEM(props), props) ? JNI_TRUE : JNI_FALSE;
+}
+
+// Turns batching off as discovery stopping does, then drops the sink.
+static void discoveryBatchStopTestNative(JNIEnv* env, jclass clazz) {
+    discoveryBatchStop(env);
+    pthread_mutex_lock(&sDiscoveryDeliverLock);
+    if (sDiscoveryTestSink != NULL) env->DeleteGlobalRef(sDiscoveryTestSink);
+    sDiscoveryTestSink = NULL;
+    pthread_mutex_unlock(&sDiscoveryDeliverLock);
+}
+
+static JNINativeMethod sDiscoveryBatchMethods[] = {
+    {"coalesceNative", "([B[I[I[[B)Lcom/android/bluetooth/btservice/DiscoveryBatch;",
+        (void*) discoveryBatchCoalesceNative},
+    {"startTestNative", "(Ljava/lang/Object;I)Z", (void*) discoveryBatchStartTestNative},
+    {"foundTestNative", "([BI)Z", (void*) discoveryBatchFoundTestNative},
+    {"stopTestNative", "()V", (void*) discoveryBatchStopTestNative},
+};
+#endif
+
 int register_com_android_bluetooth_btservice_AdapterService(JNIEnv* env)
 {
+#ifdef BT_JNI_TEST_HOOKS
+    int status = jniRegisterNativeMethods(env, "com/android/bluetooth/btservice/DiscoveryBatch",
+                                          sDiscoveryBatchMethods, NELEM(sDiscoveryBatchMethods));
+    if (status < 0) return status;
+#endif
     return jniRegisterNativeMethods(env, "com/android/bluetooth/btservice/AdapterService",
                                     sMethods, NELEM(sMethods));
 }
@@ -19,18 +19,20 @@
 
 #define LOG_NDEBUG 0
 
-#define CHECK_CALLBACK_ENV                                                      \
-   if (!checkCallbackThread()) {                                                \
-       error("Callback: '%s' is not called on the correct thread", __FUNCTION__);\
-       return;                                                                  \
-   }
-
 #include "com_android_bluetooth.h"
 #include "hardware/bt_gatt.h"
 #include "utils/Log.h"
 #include "android_runtime/AndroidRuntime.h"
 
 #include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <math.h>
+#include <atomic>
 
 #include <cutils/log.h>
 #define info(fmt, ...)  ALOGI ("%s(L%d): " fmt,__func__, __LINE__,  ## __VA_ARGS__)
@@ -140,6 +142,7 @@ namespace android {
 
 static jmethodID method_onClientRegistered;
 static jmethodID method_onScanResult;
+static jmethodID method_onBatchedScanResults;
 static jmethodID method_onConnected;
 static jmethodID method_onDisconnected;
 static jmethodID method_onReadCharacteristic;
@@ -149,6 +152,7 @@ static jmethodID method_onSearchCompleted;
 static jmethodID method_onReadDescriptor;
 static jmethodID method_onWriteDescriptor;
 static jmethodID method_onNotify;
+static jmethodID method_onNotifyPooled;
 static jmethodID method_onRegisterForNotifications;
 static jmethodID method_onReadRemoteRssi;
 static jmethodID method_onAdvertiseCallback;
@@ -161,15 +165,17 @@ static jmethodID method_onMultiAdvUpdate;
 static jmethodID method_onMultiAdvSetAdvData;
 static jmethodID method_onMultiAdvDisable;
 static jmethodID method_onClientCongestion;
+static jmethodID method_onScanFilterProgrammed;
+static jmethodID method_onProximityChanged;
+static jmethodID method_onBulkWriteCompleted;
+static jmethodID method_onReadBatchCompleted;
 static jmethodID method_onBatchScanStorageConfigured;
 static jmethodID method_onBatchScanStartStopped;
 static jmethodID method_onBatchScanReports;
 static jmethodID method_onBatchScanThresholdCrossed;
 
-static jmethodID method_CreateonTrackAdvFoundLostObject;
-static jmethodID method_onTrackAdvFoundLost;
+static jmethodID method_onTrackAdvFoundLostEvent;
 static jmethodID method_onScanParamSetupCompleted;
-static jmethodID method_getSampleGattDbElement;
 static jmethodID method_onGetGattDb;
 
 /**
@@ -188,130 +194,3224 @@ static jmethodID method_onResponseSendCompleted;
 static jmethodID method_onAttributeRead;
 static jmethodID method_onAttributeWrite;
 static jmethodID method_onExecuteWrite;
+static jmethodID method_onAttributeWriteAssembled;
 static jmethodID method_onNotificationSent;
 static jmethodID method_onServerCongestion;
 static jmethodID method_onServerMtuChanged;
 
-/**
- * Static variables
- */
+/**
+ * Static variables
+ */
+
+static const btgatt_interface_t *sGattIf = NULL;
+static jobject mCallbacksObj = NULL;
+static int64_t elapsed_realtime_nanos()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_BOOTTIME, &ts);
+    return (int64_t) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int64_t monotonic_nanos()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * Remote address cache
+ *
+ * Interns the "XX:XX:XX:XX:XX:XX" Java string for each remote address as a
+ * global reference so callbacks for a device we have seen recently do not
+ * format and allocate a new string. Entries live in an open-addressing table
+ * with linear probing; when full, the least recently used entry is evicted.
+ * Strings returned by addrCacheGet() are global references owned by the
+ * cache and must not be deleted by the caller. The cache is only used from
+ * the callback thread, and cleared in cleanupNative() once the stack stopped
+ * calling back; sAddrCacheLock is there for the stats, which are read from
+ * other threads.
+ */
+
+#define ADDR_CACHE_MAX_ENTRIES 256
+#define ADDR_CACHE_SLOTS (2 * ADDR_CACHE_MAX_ENTRIES)
+
+typedef struct {
+    uint64_t key;       // 48 bit address, 0 marks an empty slot
+    jstring address;
+    uint32_t last_used;
+} addr_cache_slot_t;
+
+static pthread_mutex_t sAddrCacheLock = PTHREAD_MUTEX_INITIALIZER;
+static addr_cache_slot_t sAddrCache[ADDR_CACHE_SLOTS];
+static int sAddrCacheCount = 0;
+static uint32_t sAddrCacheTick = 0;
+static uint64_t sAddrCacheHits = 0;
+static uint64_t sAddrCacheMisses = 0;
+static uint64_t sAddrCacheEvictions = 0;
+
+static uint64_t bdaddr_to_key(const bt_bdaddr_t* bda)
+{
+    uint64_t key = 0;
+    for (int i = 0; i < BD_ADDR_LEN; i++)
+        key = (key << 8) | bda->address[i];
+    // The all-zero address is a valid key, keep 0 free for empty slots.
+    return key | (1ULL << 48);
+}
+
+static int addr_cache_slot(uint64_t key)
+{
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    return (int) (key & (ADDR_CACHE_SLOTS - 1));
+}
+
+// Removes slot |i| and shifts following entries of the probe run back so
+// lookups never stop at the hole.
+static void addrCacheRemoveSlot(JNIEnv* env, int i)
+{
+    env->DeleteGlobalRef(sAddrCache[i].address);
+    int j = i;
+    for (;;) {
+        j = (j + 1) & (ADDR_CACHE_SLOTS - 1);
+        if (sAddrCache[j].key == 0) break;
+        int k = addr_cache_slot(sAddrCache[j].key);
+        bool in_place = (i <= j) ? (i < k && k <= j) : (i < k || k <= j);
+        if (in_place) continue;
+        sAddrCache[i] = sAddrCache[j];
+        i = j;
+    }
+    sAddrCache[i].key = 0;
+    sAddrCache[i].address = NULL;
+    sAddrCacheCount--;
+}
+
+static void addrCacheEvictOldest(JNIEnv* env)
+{
+    int oldest = -1;
+    for (int i = 0; i < ADDR_CACHE_SLOTS; i++) {
+        if (sAddrCache[i].key == 0) continue;
+        if (oldest < 0 ||
+                sAddrCacheTick - sAddrCache[i].last_used >
+                sAddrCacheTick - sAddrCache[oldest].last_used) {
+            oldest = i;
+        }
+    }
+    if (oldest >= 0) {
+        addrCacheRemoveSlot(env, oldest);
+        sAddrCacheEvictions++;
+    }
+}
+
+// Must be called with sAddrCacheLock held.
+static jstring addrCacheLookup(JNIEnv* env, const bt_bdaddr_t* bda)
+{
+    uint64_t key = bdaddr_to_key(bda);
+    int i = addr_cache_slot(key);
+    sAddrCacheTick++;
+
+    while (sAddrCache[i].key != 0) {
+        if (sAddrCache[i].key == key) {
+            sAddrCache[i].last_used = sAddrCacheTick;
+            sAddrCacheHits++;
+            return sAddrCache[i].address;
+        }
+        i = (i + 1) & (ADDR_CACHE_SLOTS - 1);
+    }
+
+    sAddrCacheMisses++;
+
+    char c_address[32];
+    snprintf(c_address, sizeof(c_address), "%02X:%02X:%02X:%02X:%02X:%02X",
+        bda->address[0], bda->address[1], bda->address[2],
+        bda->address[3], bda->address[4], bda->address[5]);
+
+    jstring local = env->NewStringUTF(c_address);
+    if (local == NULL) return NULL;
+    jstring address = (jstring) env->NewGlobalRef(local);
+    env->DeleteLocalRef(local);
+    if (address == NULL) return NULL;
+
+    if (sAddrCacheCount >= ADDR_CACHE_MAX_ENTRIES) {
+        addrCacheEvictOldest(env);
+        // Eviction may have shifted entries, find the insertion point again.
+        i = addr_cache_slot(key);
+        while (sAddrCache[i].key != 0)
+            i = (i + 1) & (ADDR_CACHE_SLOTS - 1);
+    }
+
+    sAddrCache[i].key = key;
+    sAddrCache[i].address = address;
+    sAddrCache[i].last_used = sAddrCacheTick;
+    sAddrCacheCount++;
+    return address;
+}
+
+static jstring addrCacheGet(JNIEnv* env, const bt_bdaddr_t* bda)
+{
+    pthread_mutex_lock(&sAddrCacheLock);
+    jstring address = addrCacheLookup(env, bda);
+    pthread_mutex_unlock(&sAddrCacheLock);
+    return address;
+}
+
+static void addrCacheClear(JNIEnv* env)
+{
+    pthread_mutex_lock(&sAddrCacheLock);
+    for (int i = 0; i < ADDR_CACHE_SLOTS; i++) {
+        if (sAddrCache[i].key == 0) continue;
+        env->DeleteGlobalRef(sAddrCache[i].address);
+        sAddrCache[i].key = 0;
+        sAddrCache[i].address = NULL;
+    }
+    sAddrCacheCount = 0;
+    pthread_mutex_unlock(&sAddrCacheLock);
+}
+
+/**
+ * Notification buffer pools
+ *
+ * GattService can register a direct ByteBuffer per client connection. While
+ * registered, btgattc_notify_cb() copies the value into the next slot of that
+ * buffer and reports only (conn_id, handle, slot, len), avoiding the address
+ * string and byte[] allocations of the regular path. Values that do not fit a
+ * slot fall back to onNotify().
+ */
+
+#define NOTIFY_POOL_MAX_CONN 16
+
+typedef struct {
+    bool in_use;
+    int conn_id;
+    jobject buffer;
+    uint8_t* base;
+    int slot_size;
+    int num_slots;
+    int next_slot;
+} notify_pool_t;
+
+static pthread_mutex_t sNotifyPoolLock = PTHREAD_MUTEX_INITIALIZER;
+static notify_pool_t sNotifyPools[NOTIFY_POOL_MAX_CONN];
+
+// Must be called with sNotifyPoolLock held.
+static notify_pool_t* notifyPoolFind(int conn_id)
+{
+    for (int i = 0; i < NOTIFY_POOL_MAX_CONN; i++) {
+        if (sNotifyPools[i].in_use && sNotifyPools[i].conn_id == conn_id)
+            return &sNotifyPools[i];
+    }
+    return NULL;
+}
+
+// Must be called with sNotifyPoolLock held.
+static void notifyPoolRelease(JNIEnv* env, notify_pool_t* pool)
+{
+    env->DeleteGlobalRef(pool->buffer);
+    memset(pool, 0, sizeof(notify_pool_t));
+}
+
+/**
+ * GATT database cache
+ *
+ * Keeps the last attribute database discovered for each remote device so a
+ * reconnecting client gets its services without waiting for discovery. The
+ * cached copy is only a provisional answer: GattService still asks the stack
+ * to discover services, and the stack validates its own view through Service
+ * Changed and the Database Hash. When that result arrives it replaces the
+ * entry and reaches Java only if it differs from the copy already served.
+ * An entry is also dropped when the remote reports a service change
+ * (services added/removed callbacks) or the app refreshes the device.
+ *
+ * Entries are persisted to the file passed to gattClientInitDbCacheNative()
+ * so they survive a Bluetooth restart. The file is written by a dedicated
+ * thread so the callback thread never blocks on storage. Each entry carries
+ * a hash of its contents which is checked on load and used to skip
+ * rewriting the file when a rediscovery found the same database.
+ *
+ * File layout (little endian):
+ *   u32 magic, u32 version, u32 entry count
+ *   per entry: 6 byte address, u32 hash, u32 element count, elements
+ *   per element: u16 id, u8 type, u16 attribute/start/end handle,
+ *                u8 properties, 16 byte uuid
+ */
+
+#define GATT_DB_CACHE_MAGIC 0x44475442  // "BTGD"
+#define GATT_DB_CACHE_VERSION 1
+#define GATT_DB_CACHE_MAX_DEVICES 32
+#define GATT_DB_CACHE_MAX_ELEMENTS 512
+#define GATT_DB_ELEMENT_RECORD_LEN 26
+#define GATT_CONN_MAX 16
+
+typedef struct {
+    bool in_use;
+    bt_bdaddr_t bda;
+    uint32_t hash;
+    int64_t last_used;
+    int count;
+    btgatt_db_element_t* db;
+} gatt_db_cache_entry_t;
+
+typedef struct {
+    bool in_use;
+    int conn_id;
+    bt_bdaddr_t bda;
+    // Set while a database served from the cache awaits the stack's result.
+    bool served_from_cache;
+    uint32_t served_hash;
+} gatt_conn_addr_t;
+
+static pthread_mutex_t sGattDbCacheLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sGattDbCacheCond = PTHREAD_COND_INITIALIZER;
+static pthread_t sGattDbCacheThread;
+static bool sGattDbCacheThreadRunning;
+static bool sGattDbCacheStop;
+static bool sGattDbCacheDirty;
+static gatt_db_cache_entry_t sGattDbCache[GATT_DB_CACHE_MAX_DEVICES];
+static gatt_conn_addr_t sGattConnAddrs[GATT_CONN_MAX];
+static char* sGattDbCachePath = NULL;
+
+// Must be called with sGattDbCacheLock held.
+static gatt_conn_addr_t* gattConnFind(int conn_id)
+{
+    for (int i = 0; i < GATT_CONN_MAX; i++) {
+        if (sGattConnAddrs[i].in_use && sGattConnAddrs[i].conn_id == conn_id)
+            return &sGattConnAddrs[i];
+    }
+    return NULL;
+}
+
+static void gattConnAdd(int conn_id, const bt_bdaddr_t* bda)
+{
+    pthread_mutex_lock(&sGattDbCacheLock);
+    gatt_conn_addr_t* conn = gattConnFind(conn_id);
+    for (int i = 0; conn == NULL && i < GATT_CONN_MAX; i++) {
+        if (!sGattConnAddrs[i].in_use) conn = &sGattConnAddrs[i];
+    }
+    if (conn != NULL) {
+        memset(conn, 0, sizeof(gatt_conn_addr_t));
+        conn->in_use = true;
+        conn->conn_id = conn_id;
+        conn->bda = *bda;
+    }
+    pthread_mutex_unlock(&sGattDbCacheLock);
+}
+
+static void gattConnRemove(int conn_id)
+{
+    pthread_mutex_lock(&sGattDbCacheLock);
+    gatt_conn_addr_t* conn = gattConnFind(conn_id);
+    if (conn != NULL) conn->in_use = false;
+    pthread_mutex_unlock(&sGattDbCacheLock);
+}
+
+static uint32_t gatt_db_hash(const btgatt_db_element_t* db, int count)
+{
+    // FNV-1a over the fields that make up the database.
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < count; i++) {
+        uint32_t fields[] = { db[i].id, (uint32_t) db[i].type, db[i].attribute_handle,
+                              db[i].start_handle, db[i].end_handle, db[i].properties };
+        for (size_t f = 0; f < NELEM(fields); f++) {
+            for (int b = 0; b < 4; b++) {
+                hash ^= (fields[f] >> (8 * b)) & 0xFF;
+                hash *= 16777619u;
+            }
+        }
+        for (int b = 0; b < 16; b++) {
+            hash ^= db[i].uuid.uu[b];
+            hash *= 16777619u;
+        }
+    }
+    return hash;
+}
+
+// Must be called with sGattDbCacheLock held.
+static gatt_db_cache_entry_t* gattDbCacheFind(const bt_bdaddr_t* bda)
+{
+    for (int i = 0; i < GATT_DB_CACHE_MAX_DEVICES; i++) {
+        if (sGattDbCache[i].in_use &&
+                memcmp(&sGattDbCache[i].bda, bda, sizeof(bt_bdaddr_t)) == 0)
+            return &sGattDbCache[i];
+    }
+    return NULL;
+}
+
+// Must be called with sGattDbCacheLock held.
+static void gattDbCacheDrop(gatt_db_cache_entry_t* entry)
+{
+    free(entry->db);
+    memset(entry, 0, sizeof(gatt_db_cache_entry_t));
+}
+
+// Must be called with sGattDbCacheLock held. Takes ownership of |db|.
+static void gattDbCachePut(const bt_bdaddr_t* bda, btgatt_db_element_t* db, int count,
+                           uint32_t hash)
+{
+    gatt_db_cache_entry_t* entry = gattDbCacheFind(bda);
+    if (entry == NULL) {
+        gatt_db_cache_entry_t* oldest = NULL;
+        for (int i = 0; i < GATT_DB_CACHE_MAX_DEVICES; i++) {
+            if (!sGattDbCache[i].in_use) {
+                entry = &sGattDbCache[i];
+                break;
+            }
+            if (oldest == NULL || sGattDbCache[i].last_used < oldest->last_used)
+                oldest = &sGattDbCache[i];
+        }
+        if (entry == NULL) entry = oldest;
+    }
+    gattDbCacheDrop(entry);
+
+    entry->in_use = true;
+    entry->bda = *bda;
+    entry->hash = hash;
+    entry->last_used = elapsed_realtime_nanos();
+    entry->count = count;
+    entry->db = db;
+}
+
+static void put_u16(uint8_t** p, uint16_t v)
+{
+    *(*p)++ = v & 0xFF;
+    *(*p)++ = v >> 8;
+}
+
+static void put_u32(uint8_t** p, uint32_t v)
+{
+    put_u16(p, v & 0xFFFF);
+    put_u16(p, v >> 16);
+}
+
+static uint16_t get_u16(const uint8_t** p)
+{
+    uint16_t v = (*p)[0] | ((*p)[1] << 8);
+    *p += 2;
+    return v;
+}
+
+static uint32_t get_u32(const uint8_t** p)
+{
+    uint32_t v = get_u16(p);
+    return v | ((uint32_t) get_u16(p) << 16);
+}
+
+// Must be called with sGattDbCacheLock held. Returns the file image of the
+// cache, or NULL if it cannot be allocated.
+static uint8_t* gattDbCacheSerialize(size_t* out_size)
+{
+    size_t size = 12;
+    int entries = 0;
+    for (int i = 0; i < GATT_DB_CACHE_MAX_DEVICES; i++) {
+        if (!sGattDbCache[i].in_use) continue;
+        size += BD_ADDR_LEN + 8 + sGattDbCache[i].count * GATT_DB_ELEMENT_RECORD_LEN;
+        entries++;
+    }
+
+    uint8_t* buf = (uint8_t*) malloc(size);
+    if (buf == NULL) return NULL;
+
+    uint8_t* p = buf;
+    put_u32(&p, GATT_DB_CACHE_MAGIC);
+    put_u32(&p, GATT_DB_CACHE_VERSION);
+    put_u32(&p, entries);
+    for (int i = 0; i < GATT_DB_CACHE_MAX_DEVICES; i++) {
+        const gatt_db_cache_entry_t& entry = sGattDbCache[i];
+        if (!entry.in_use) continue;
+        memcpy(p, entry.bda.address, BD_ADDR_LEN);
+        p += BD_ADDR_LEN;
+        put_u32(&p, entry.hash);
+        put_u32(&p, entry.count);
+        for (int j = 0; j < entry.count; j++) {
+            const btgatt_db_element_t& el = entry.db[j];
+            put_u16(&p, el.id);
+            *p++ = (uint8_t) el.type;
+            put_u16(&p, el.attribute_handle);
+            put_u16(&p, el.start_handle);
+            put_u16(&p, el.end_handle);
+            *p++ = el.properties;
+            memcpy(p, el.uuid.uu, 16);
+            p += 16;
+        }
+    }
+
+    *out_size = size;
+    return buf;
+}
+
+static void gattDbCacheWrite(const char* path, const uint8_t* buf, size_t size)
+{
+    // Write to a temporary file first so a crash never leaves a torn cache.
+    char tmp_path[PATH_MAX];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    FILE* file = fopen(tmp_path, "wb");
+    if (file != NULL) {
+        bool ok = fwrite(buf, 1, size, file) == size;
+        ok = (fclose(file) == 0) && ok;
+        if (!ok || rename(tmp_path, path) != 0) {
+            error("Unable to write GATT database cache %s", path);
+            unlink(tmp_path);
+        }
+    }
+}
+
+static void* gattDbCacheRun(void* arg)
+{
+    pthread_mutex_lock(&sGattDbCacheLock);
+    while (true) {
+        while (!sGattDbCacheDirty && !sGattDbCacheStop) {
+            pthread_cond_wait(&sGattDbCacheCond, &sGattDbCacheLock);
+        }
+        // Pending changes are still written out when stopping.
+        if (!sGattDbCacheDirty) break;
+
+        sGattDbCacheDirty = false;
+        size_t size = 0;
+        uint8_t* buf = gattDbCacheSerialize(&size);
+        char* path = sGattDbCachePath ? strdup(sGattDbCachePath) : NULL;
+        pthread_mutex_unlock(&sGattDbCacheLock);
+
+        if (buf != NULL && path != NULL) gattDbCacheWrite(path, buf, size);
+        free(buf);
+        free(path);
+
+        pthread_mutex_lock(&sGattDbCacheLock);
+    }
+    pthread_mutex_unlock(&sGattDbCacheLock);
+    return NULL;
+}
+
+// Must be called with sGattDbCacheLock held.
+static void gattDbCacheStartThread()
+{
+    if (sGattDbCacheThreadRunning) return;
+
+    sGattDbCacheStop = false;
+    if (pthread_create(&sGattDbCacheThread, NULL, gattDbCacheRun, NULL) != 0) {
+        error("Unable to start the GATT database cache writer thread");
+        return;
+    }
+    sGattDbCacheThreadRunning = true;
+}
+
+static void gattDbCacheStopThread()
+{
+    pthread_mutex_lock(&sGattDbCacheLock);
+    bool running = sGattDbCacheThreadRunning;
+    sGattDbCacheStop = true;
+    if (running) pthread_cond_signal(&sGattDbCacheCond);
+    pthread_mutex_unlock(&sGattDbCacheLock);
+    if (!running) return;
+
+    pthread_join(sGattDbCacheThread, NULL);
+    pthread_mutex_lock(&sGattDbCacheLock);
+    sGattDbCacheThreadRunning = false;
+    pthread_mutex_unlock(&sGattDbCacheLock);
+}
+
+// Must be called with sGattDbCacheLock held. Hands the file write to the
+// writer thread; changes made before it gets to run are written together.
+static void gattDbCacheSave()
+{
+    if (sGattDbCachePath == NULL || !sGattDbCacheThreadRunning) return;
+    sGattDbCacheDirty = true;
+    pthread_cond_signal(&sGattDbCacheCond);
+}
+
+// Must be called with sGattDbCacheLock held.
+static void gattDbCacheLoad()
+{
+    FILE* file = fopen(sGattDbCachePath, "rb");
+    if (file == NULL) return;
+
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    uint8_t* buf = (size >= 12) ? (uint8_t*) malloc(size) : NULL;
+    bool ok = buf != NULL && fread(buf, 1, size, file) == (size_t) size;
+    fclose(file);
+    if (!ok) {
+        free(buf);
+        return;
+    }
+
+    const uint8_t* p = buf;
+    const uint8_t* end = buf + size;
+    uint32_t magic = get_u32(&p);
+    uint32_t version = get_u32(&p);
+    uint32_t entries = get_u32(&p);
+    if (magic != GATT_DB_CACHE_MAGIC || version != GATT_DB_CACHE_VERSION) {
+        warn("Ignoring GATT database cache with unknown format");
+        free(buf);
+        return;
+    }
+
+    for (uint32_t i = 0; i < entries && i < GATT_DB_CACHE_MAX_DEVICES; i++) {
+        if (end - p < BD_ADDR_LEN + 8) break;
+        bt_bdaddr_t bda;
+        memcpy(bda.address, p, BD_ADDR_LEN);
+        p += BD_ADDR_LEN;
+        uint32_t hash = get_u32(&p);
+        uint32_t count = get_u32(&p);
+        if (count > GATT_DB_CACHE_MAX_ELEMENTS ||
+                (size_t) (end - p) < count * GATT_DB_ELEMENT_RECORD_LEN) break;
+
+        btgatt_db_element_t* db =
+                (btgatt_db_element_t*) calloc(count, sizeof(btgatt_db_element_t));
+        if (db == NULL) break;
+        for (uint32_t j = 0; j < count; j++) {
+            db[j].id = get_u16(&p);
+            db[j].type = (bt_gatt_db_attribute_type_t) *p++;
+            db[j].attribute_handle = get_u16(&p);
+            db[j].start_handle = get_u16(&p);
+            db[j].end_handle = get_u16(&p);
+            db[j].properties = *p++;
+            memcpy(db[j].uuid.uu, p, 16);
+            p += 16;
+        }
+
+        if (gatt_db_hash(db, count) != hash) {
+            warn("Dropping corrupt GATT database cache entry");
+            free(db);
+            continue;
+        }
+        gattDbCachePut(&bda, db, count, hash);
+    }
+    free(buf);
+}
+
+// Records the database the stack just discovered on |conn_id|. Returns false
+// if Java already holds the same database because it was served from the
+// cache, in which case it must not be delivered again.
+static bool gattDbCacheStore(int conn_id, const btgatt_db_element_t* db, int count)
+{
+    pthread_mutex_lock(&sGattDbCacheLock);
+    gatt_conn_addr_t* conn = gattConnFind(conn_id);
+    if (conn == NULL || sGattDbCachePath == NULL) {
+        pthread_mutex_unlock(&sGattDbCacheLock);
+        return true;
+    }
+
+    uint32_t hash = gatt_db_hash(db, count);
+    bool deliver = !conn->served_from_cache || conn->served_hash != hash;
+    conn->served_from_cache = false;
+    if (count <= 0 || count > GATT_DB_CACHE_MAX_ELEMENTS) {
+        pthread_mutex_unlock(&sGattDbCacheLock);
+        return deliver;
+    }
+
+    gatt_db_cache_entry_t* entry = gattDbCacheFind(&conn->bda);
+    if (entry != NULL && entry->hash == hash && entry->count == count) {
+        entry->last_used = elapsed_realtime_nanos();
+        pthread_mutex_unlock(&sGattDbCacheLock);
+        return deliver;
+    }
+
+    btgatt_db_element_t* copy =
+            (btgatt_db_element_t*) malloc(count * sizeof(btgatt_db_element_t));
+    if (copy != NULL) {
+        memcpy(copy, db, count * sizeof(btgatt_db_element_t));
+        gattDbCachePut(&conn->bda, copy, count, hash);
+        gattDbCacheSave();
+    }
+    pthread_mutex_unlock(&sGattDbCacheLock);
+    return deliver;
+}
+
+static void gattDbCacheInvalidate(const bt_bdaddr_t* bda)
+{
+    pthread_mutex_lock(&sGattDbCacheLock);
+    gatt_db_cache_entry_t* entry = gattDbCacheFind(bda);
+    if (entry != NULL) {
+        gattDbCacheDrop(entry);
+        gattDbCacheSave();
+    }
+    pthread_mutex_unlock(&sGattDbCacheLock);
+}
+
+static void gattDbCacheInvalidateConn(int conn_id)
+{
+    bt_bdaddr_t bda;
+    pthread_mutex_lock(&sGattDbCacheLock);
+    gatt_conn_addr_t* conn = gattConnFind(conn_id);
+    bool found = conn != NULL;
+    if (found) bda = conn->bda;
+    pthread_mutex_unlock(&sGattDbCacheLock);
+
+    if (found) gattDbCacheInvalidate(&bda);
+}
+
+/**
+ * Scan result batching
+ *
+ * When enabled from ScanManager, scan results are coalesced here and handed
+ * to GattService.onBatchedScanResults() in a single upcall once either
+ * |max_results| records are pending or the oldest record is |timeout_ms| old.
+ * Each record is packed as the 6 byte address followed by the significant
+ * part of the advertising data; |offsets| holds count + 1 entries so Java can
+ * recover the record boundaries.
+ */
+
+#define SCAN_ADV_DATA_LEN 62
+#define SCAN_BATCH_MAX_RESULTS 64
+
+typedef struct {
+    uint8_t data[SCAN_BATCH_MAX_RESULTS * (BD_ADDR_LEN + SCAN_ADV_DATA_LEN)];
+    jint offsets[SCAN_BATCH_MAX_RESULTS + 1];
+    jint rssi[SCAN_BATCH_MAX_RESULTS];
+    jlong timestamp[SCAN_BATCH_MAX_RESULTS];
+    jint client_mask[SCAN_BATCH_MAX_RESULTS];
+    int count;
+    int max_results;
+    int64_t timeout_ns;
+} scan_batch_t;
+
+static pthread_mutex_t sScanBatchLock = PTHREAD_MUTEX_INITIALIZER;
+static scan_batch_t sScanBatch;
+
+// Returns the number of bytes covered by well-formed AD structures.
+static int adv_data_len(const uint8_t* adv_data, int max_len)
+{
+    int pos = 0;
+    while (pos < max_len) {
+        int len = adv_data[pos];
+        if (len == 0 || pos + 1 + len > max_len) break;
+        pos += 1 + len;
+    }
+    return pos;
+}
+
+/**
+ * Scan result pre-filtering
+ *
+ * ScanManager gives every regular scan client a slot and programs it with a
+ * compiled form of the client's ScanFilters. Each result is evaluated here
+ * against the raw advertising data and only forwarded if some slot may want
+ * it; the bitmask of those slots travels with the result so GattService only
+ * runs the exact Java matching for those clients. Matching is conservative:
+ * filter fields that are not compiled (device name, solicitation UUIDs) are
+ * left to Java, so a set bit means "may match" and a clear bit is final.
+ *
+ * A program is a list of filters, any of which may match. Each filter is a
+ * flags byte followed by the fields it names, in flag order:
+ *   ADDRESS       6 byte address, most significant byte first
+ *   SERVICE_UUID  16 byte UUID and 16 byte mask, little endian
+ *   MANUFACTURER  u16 company id, u8 length n, n bytes data, n bytes mask
+ *   SERVICE_DATA  16 byte UUID, u8 length n, n bytes data, n bytes mask
+ * An empty program matches every result.
+ */
+
+#define SCAN_PREFILTER_SLOTS 32
+#define SCAN_PREFILTER_MAX_PROGRAM 1024
+#define SCAN_PREFILTER_ADDRESS 0x01
+#define SCAN_PREFILTER_SERVICE_UUID 0x02
+#define SCAN_PREFILTER_MANUFACTURER 0x04
+#define SCAN_PREFILTER_SERVICE_DATA 0x08
+
+#define AD_TYPE_UUID16_PARTIAL 0x02
+#define AD_TYPE_UUID16_COMPLETE 0x03
+#define AD_TYPE_UUID32_PARTIAL 0x04
+#define AD_TYPE_UUID32_COMPLETE 0x05
+#define AD_TYPE_UUID128_PARTIAL 0x06
+#define AD_TYPE_UUID128_COMPLETE 0x07
+#define AD_TYPE_SERVICE_DATA_UUID16 0x16
+#define AD_TYPE_SERVICE_DATA_UUID32 0x20
+#define AD_TYPE_SERVICE_DATA_UUID128 0x21
+#define AD_TYPE_MANUFACTURER_DATA 0xFF
+
+typedef struct {
+    bool in_use;
+    int len;
+    uint8_t program[SCAN_PREFILTER_MAX_PROGRAM];
+} scan_prefilter_slot_t;
+
+static pthread_mutex_t sScanPrefilterLock = PTHREAD_MUTEX_INITIALIZER;
+static scan_prefilter_slot_t sScanPrefilter[SCAN_PREFILTER_SLOTS];
+static uint32_t sScanPrefilterSlotsInUse;
+
+// Bluetooth base UUID 00000000-0000-1000-8000-00805F9B34FB, little endian.
+static const uint8_t BASE_UUID_LE[16] = {
+    0xFB, 0x34, 0x9B, 0x5F, 0x80, 0x00, 0x00, 0x80,
+    0x00, 0x10, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
+};
+
+// Expands a 2, 4 or 16 byte UUID from advertising data to 128 bits.
+static void ad_uuid_to_128(const uint8_t* uuid, int uuid_len, uint8_t* out)
+{
+    if (uuid_len == 16) {
+        memcpy(out, uuid, 16);
+        return;
+    }
+    memcpy(out, BASE_UUID_LE, 16);
+    memcpy(out + 12, uuid, uuid_len);
+}
+
+static bool masked_equal(const uint8_t* a, const uint8_t* b, const uint8_t* mask, int len)
+{
+    for (int i = 0; i < len; i++) {
+        if ((a[i] & mask[i]) != (b[i] & mask[i])) return false;
+    }
+    return true;
+}
+
+static int ad_uuid_len(uint8_t type)
+{
+    switch (type) {
+        case AD_TYPE_UUID16_PARTIAL:
+        case AD_TYPE_UUID16_COMPLETE:
+        case AD_TYPE_SERVICE_DATA_UUID16:
+            return 2;
+        case AD_TYPE_UUID32_PARTIAL:
+        case AD_TYPE_UUID32_COMPLETE:
+        case AD_TYPE_SERVICE_DATA_UUID32:
+            return 4;
+        case AD_TYPE_UUID128_PARTIAL:
+        case AD_TYPE_UUID128_COMPLETE:
+        case AD_TYPE_SERVICE_DATA_UUID128:
+            return 16;
+        default:
+            return 0;
+    }
+}
+
+static bool ad_has_service_uuid(const uint8_t* adv, int adv_len, const uint8_t* uuid,
+                                const uint8_t* mask)
+{
+    uint8_t full[16];
+    for (int pos = 0; pos < adv_len; pos += 1 + adv[pos]) {
+        uint8_t type = adv[pos + 1];
+        if (type < AD_TYPE_UUID16_PARTIAL || type > AD_TYPE_UUID128_COMPLETE) continue;
+        int uuid_len = ad_uuid_len(type);
+        for (int i = pos + 2; i + uuid_len <= pos + 1 + adv[pos]; i += uuid_len) {
+            ad_uuid_to_128(adv + i, uuid_len, full);
+            if (masked_equal(full, uuid, mask, 16)) return true;
+        }
+    }
+    return false;
+}
+
+// Data is matched as a prefix, as ScanFilter does.
+static bool ad_has_manufacturer_data(const uint8_t* adv, int adv_len, uint16_t id,
+                                     const uint8_t* data, const uint8_t* mask, int len)
+{
+    for (int pos = 0; pos < adv_len; pos += 1 + adv[pos]) {
+        int field_len = adv[pos] - 1;
+        const uint8_t* field = adv + pos + 2;
+        if (adv[pos + 1] != AD_TYPE_MANUFACTURER_DATA || field_len < 2) continue;
+        if ((field[0] | (field[1] << 8)) != id || field_len - 2 < len) continue;
+        if (masked_equal(field + 2, data, mask, len)) return true;
+    }
+    return false;
+}
+
+static bool ad_has_service_data(const uint8_t* adv, int adv_len, const uint8_t* uuid,
+                                const uint8_t* data, const uint8_t* mask, int len)
+{
+    uint8_t full[16];
+    for (int pos = 0; pos < adv_len; pos += 1 + adv[pos]) {
+        uint8_t type = adv[pos + 1];
+        if (type != AD_TYPE_SERVICE_DATA_UUID16 && type != AD_TYPE_SERVICE_DATA_UUID32 &&
+                type != AD_TYPE_SERVICE_DATA_UUID128) continue;
+        int uuid_len = ad_uuid_len(type);
+        int field_len = adv[pos] - 1;
+        const uint8_t* field = adv + pos + 2;
+        if (field_len < uuid_len || field_len - uuid_len < len) continue;
+        ad_uuid_to_128(field, uuid_len, full);
+        if (memcmp(full, uuid, 16) != 0) continue;
+        if (masked_equal(field + uuid_len, data, mask, len)) return true;
+    }
+    return false;
+}
+
+// Returns true if any filter of |program| may match. A malformed program
+// matches everything so Java still sees the result.
+static bool scan_prefilter_eval(const uint8_t* program, int len, const bt_bdaddr_t* bda,
+                                const uint8_t* adv, int adv_len)
+{
+    const uint8_t* p = program;
+    const uint8_t* end = program + len;
+    if (p == end) return true;
+
+    while (p < end) {
+        uint8_t flags = *p++;
+        bool match = true;
+
+        if (flags & SCAN_PREFILTER_ADDRESS) {
+            if (end - p < BD_ADDR_LEN) return true;
+            match = memcmp(p, bda->address, BD_ADDR_LEN) == 0;
+            p += BD_ADDR_LEN;
+        }
+        if (flags & SCAN_PREFILTER_SERVICE_UUID) {
+            if (end - p < 32) return true;
+            match = match && ad_has_service_uuid(adv, adv_len, p, p + 16);
+            p += 32;
+        }
+        if (flags & SCAN_PREFILTER_MANUFACTURER) {
+            if (end - p < 3 || end - p < 3 + 2 * p[2]) return true;
+            int n = p[2];
+            match = match && ad_has_manufacturer_data(adv, adv_len, p[0] | (p[1] << 8),
+                                                      p + 3, p + 3 + n, n);
+            p += 3 + 2 * n;
+        }
+        if (flags & SCAN_PREFILTER_SERVICE_DATA) {
+            if (end - p < 17 || end - p < 17 + 2 * p[16]) return true;
+            int n = p[16];
+            match = match && ad_has_service_data(adv, adv_len, p, p + 17, p + 17 + n, n);
+            p += 17 + 2 * n;
+        }
+        if (match) return true;
+    }
+    return false;
+}
+
+// Returns the slots that may want the result, or all bits set if no slot
+// is programmed.
+static uint32_t scanPrefilterMatch(const bt_bdaddr_t* bda, const uint8_t* adv_data)
+{
+    uint32_t mask = 0;
+    int adv_len = adv_data_len(adv_data, SCAN_ADV_DATA_LEN);
+
+    pthread_mutex_lock(&sScanPrefilterLock);
+    if (sScanPrefilterSlotsInUse == 0) {
+        pthread_mutex_unlock(&sScanPrefilterLock);
+        return 0xFFFFFFFF;
+    }
+    for (int i = 0; i < SCAN_PREFILTER_SLOTS; i++) {
+        const scan_prefilter_slot_t& slot = sScanPrefilter[i];
+        if (slot.in_use && scan_prefilter_eval(slot.program, slot.len, bda, adv_data, adv_len))
+            mask |= 1u << i;
+    }
+    pthread_mutex_unlock(&sScanPrefilterLock);
+    return mask;
+}
+
+/**
+ * Scan result duplicate suppression
+ *
+ * With controller duplicate filtering off, the same advertiser reports the
+ * same payload many times a second. When a window is configured, a result is
+ * only forwarded if its payload differs from the last forwarded one of that
+ * address, its RSSI moved by more than |rssi_delta| dB, or |window_ns| passed
+ * since the last forwarded result. The table is direct mapped; an address
+ * that collides simply evicts the previous one, which only costs a
+ * duplicate being forwarded.
+ */
+
+#define SCAN_DEDUPE_SLOTS 512
+
+typedef struct {
+    uint64_t key;
+    uint32_t payload_hash;
+    int rssi;
+    int64_t forwarded_ns;
+} scan_dedupe_entry_t;
+
+static pthread_mutex_t sScanDedupeLock = PTHREAD_MUTEX_INITIALIZER;
+static scan_dedupe_entry_t sScanDedupe[SCAN_DEDUPE_SLOTS];
+static int64_t sScanDedupeWindowNs;
+static int sScanDedupeRssiDelta;
+static uint64_t sScanDedupeForwarded;
+static uint64_t sScanDedupeSuppressed;
+
+static uint32_t adv_data_hash(const uint8_t* adv_data, int len)
+{
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < len; i++) {
+        hash ^= adv_data[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Returns true if the result should be forwarded.
+static bool scanDedupeCheck(const bt_bdaddr_t* bda, int rssi, const uint8_t* adv_data)
+{
+    pthread_mutex_lock(&sScanDedupeLock);
+    if (sScanDedupeWindowNs <= 0) {
+        pthread_mutex_unlock(&sScanDedupeLock);
+        return true;
+    }
+
+    uint64_t key = bdaddr_to_key(bda);
+    uint32_t hash = adv_data_hash(adv_data, adv_data_len(adv_data, SCAN_ADV_DATA_LEN));
+    int64_t now = elapsed_realtime_nanos();
+    scan_dedupe_entry_t& entry = sScanDedupe[addr_cache_slot(key) & (SCAN_DEDUPE_SLOTS - 1)];
+
+    bool forward = entry.key != key || entry.payload_hash != hash ||
+            abs(rssi - entry.rssi) > sScanDedupeRssiDelta ||
+            now - entry.forwarded_ns >= sScanDedupeWindowNs;
+    if (forward) {
+        entry.key = key;
+        entry.payload_hash = hash;
+        entry.rssi = rssi;
+        entry.forwarded_ns = now;
+        sScanDedupeForwarded++;
+    } else {
+        sScanDedupeSuppressed++;
+    }
+    pthread_mutex_unlock(&sScanDedupeLock);
+    return forward;
+}
+
+static bool scanBatchEnabled()
+{
+    return sScanBatch.max_results > 1;
+}
+
+// Queues a result. Returns true if the batch should be flushed now.
+static bool scanBatchAdd(bt_bdaddr_t* bda, int rssi, uint8_t* adv_data, uint32_t client_mask)
+{
+    pthread_mutex_lock(&sScanBatchLock);
+
+    int i = sScanBatch.count;
+    int pos = sScanBatch.offsets[i];
+    int len = adv_data_len(adv_data, SCAN_ADV_DATA_LEN);
+
+    memcpy(&sScanBatch.data[pos], bda->address, BD_ADDR_LEN);
+    memcpy(&sScanBatch.data[pos + BD_ADDR_LEN], adv_data, len);
+    sScanBatch.rssi[i] = rssi;
+    sScanBatch.timestamp[i] = elapsed_realtime_nanos();
+    sScanBatch.client_mask[i] = client_mask;
+    sScanBatch.offsets[i + 1] = pos + BD_ADDR_LEN + len;
+    sScanBatch.count = i + 1;
+
+    bool flush = sScanBatch.count >= sScanBatch.max_results ||
+            sScanBatch.timestamp[i] - sScanBatch.timestamp[0] >= sScanBatch.timeout_ns;
+
+    pthread_mutex_unlock(&sScanBatchLock);
+    return flush;
+}
+
+// Delivers all pending results. May be called from the callback thread or
+// from a Java thread through gattClientFlushScanBatchNative(). The pending
+// records are copied out under the lock and the Java arrays are built after
+// it is dropped, so the callback thread never waits on JNI allocations.
+static void scanBatchFlush(JNIEnv* env)
+{
+    jbyteArray packed = NULL;
+    jintArray offsets = NULL;
+    jintArray rssi = NULL;
+    jlongArray timestamps = NULL;
+    jintArray client_masks = NULL;
+    scan_batch_t batch;
+
+    pthread_mutex_lock(&sScanBatchLock);
+    int count = sScanBatch.count;
+    if (count == 0) {
+        pthread_mutex_unlock(&sScanBatchLock);
+        return;
+    }
+
+    int len = sScanBatch.offsets[count];
+    memcpy(batch.data, sScanBatch.data, len);
+    memcpy(batch.offsets, sScanBatch.offsets, (count + 1) * sizeof(jint));
+    memcpy(batch.rssi, sScanBatch.rssi, count * sizeof(jint));
+    memcpy(batch.timestamp, sScanBatch.timestamp, count * sizeof(jlong));
+    memcpy(batch.client_mask, sScanBatch.client_mask, count * sizeof(jint));
+    sScanBatch.count = 0;
+    pthread_mutex_unlock(&sScanBatchLock);
+
+    packed = env->NewByteArray(len);
+    offsets = env->NewIntArray(count + 1);
+    rssi = env->NewIntArray(count);
+    timestamps = env->NewLongArray(count);
+    client_masks = env->NewIntArray(count);
+    if (packed && offsets && rssi && timestamps && client_masks) {
+        env->SetByteArrayRegion(packed, 0, len, (jbyte *) batch.data);
+        env->SetIntArrayRegion(offsets, 0, count + 1, batch.offsets);
+        env->SetIntArrayRegion(rssi, 0, count, batch.rssi);
+        env->SetLongArrayRegion(timestamps, 0, count, batch.timestamp);
+        env->SetIntArrayRegion(client_masks, 0, count, batch.client_mask);
+    } else {
+        error("Unable to allocate arrays for %d batched scan results", count);
+        count = 0;
+    }
+
+    if (count > 0 && mCallbacksObj != NULL) {
+        CALLBACK_UPCALL();
+        env->CallVoidMethod(mCallbacksObj, method_onBatchedScanResults, count, packed, offsets,
+                            rssi, timestamps, client_masks);
+    }
+
+    if (packed) env->DeleteLocalRef(packed);
+    if (offsets) env->DeleteLocalRef(offsets);
+    if (rssi) env->DeleteLocalRef(rssi);
+    if (timestamps) env->DeleteLocalRef(timestamps);
+    if (client_masks) env->DeleteLocalRef(client_masks);
+    checkAndClearExceptionFromCallback(env, __FUNCTION__);
+}
+
+/**
+ * RSSI proximity tracking
+ *
+ * Apps that only want to know whether a device is near used to take every
+ * scan result and RSSI reading up to Java. A proximity watch instead keeps
+ * the last PROXIMITY_WINDOW samples of one address in a ring buffer, fed from
+ * scan results, tracked advertising events and remote RSSI reads, and smooths
+ * them with an exponential moving average, a running median or a scalar
+ * Kalman filter. The smoothed RSSI is turned into a distance with the
+ * log-distance path loss model
+ *
+ *     d = 10 ^ ((ref_rssi - rssi) / (10 * n))
+ *
+ * where ref_rssi is the RSSI expected at one meter. It is derived from the TX
+ * power the device advertises when there is one, and falls back to the
+ * watch's configured value otherwise. Only zone changes go up, through
+ * onProximityChanged: entering once the distance drops to |near_cm|, leaving
+ * once it reaches |far_cm| or no sample arrived for PROXIMITY_LOST_NS. The gap
+ * between the two thresholds keeps a device sitting on the edge from
+ * flapping. Silence is noticed by gattClientCheckProximityNative(), which
+ * GattService calls periodically while watches exist.
+ *
+ * Each watch keeps the last advertising data seen from its device, and zone
+ * changes carry it so the app receives a scan record with onFoundOrLost()
+ * just as it does for hardware tracking filters.
+ */
+
+#define PROXIMITY_MAX_WATCHES 32
+#define PROXIMITY_WINDOW 16
+#define PROXIMITY_MIN_SAMPLES 3
+#define PROXIMITY_MAX_DISTANCE_CM 100000
+#define PROXIMITY_LOST_NS (10 * 1000000000LL)
+// Advertised TX power is the level at 0 m; the usual loss over the first
+// meter is 41 dB.
+#define PROXIMITY_ONE_METER_LOSS 41
+#define PROXIMITY_TX_POWER_UNKNOWN 127
+// Process and measurement noise of the Kalman filter, in dB^2.
+#define PROXIMITY_KALMAN_Q 0.125f
+#define PROXIMITY_KALMAN_R 4.0f
+#define PROXIMITY_EMA_ALPHA 0.25f
+#define PROXIMITY_ADV_LEN 62
+#define AD_TYPE_TX_POWER 0x0A
+
+enum {
+    PROXIMITY_FILTER_EMA = 0,
+    PROXIMITY_FILTER_MEDIAN = 1,
+    PROXIMITY_FILTER_KALMAN = 2,
+};
+
+typedef struct {
+    bool in_use;
+    int client_if;
+    uint64_t key;
+    bt_bdaddr_t bda;
+    int filter;
+    int near_cm;
+    int far_cm;
+    int ref_rssi;
+    int path_loss_x10;
+
+    int8_t samples[PROXIMITY_WINDOW];
+    int head;
+    int count;
+    float estimate;
+    float variance;
+    int tx_power;
+    int64_t last_sample_ns;
+    bool inside;
+    uint8_t adv[PROXIMITY_ADV_LEN];
+    int adv_len;
+} proximity_watch_t;
+
+typedef struct {
+    int client_if;
+    bt_bdaddr_t bda;
+    bool inside;
+    int rssi;
+    int distance_cm;
+    uint8_t adv[PROXIMITY_ADV_LEN];
+    int adv_len;
+} proximity_event_t;
+
+static pthread_mutex_t sProximityLock = PTHREAD_MUTEX_INITIALIZER;
+static proximity_watch_t sProximityWatches[PROXIMITY_MAX_WATCHES];
+// Only changed with sProximityLock held; read without it to skip the lock
+// while no watch exists.
+static std::atomic<int> sProximityWatchCount;
+static uint64_t sProximitySamples;
+static uint64_t sProximityEvents;
+
+// Returns the advertised TX power, or PROXIMITY_TX_POWER_UNKNOWN.
+static int ad_tx_power(const uint8_t* adv, int adv_len)
+{
+    int pos = 0;
+    while (pos < adv_len) {
+        int len = adv[pos];
+        if (len == 0 || pos + 1 + len > adv_len) break;
+        if (len == 2 && adv[pos + 1] == AD_TYPE_TX_POWER) return (int8_t) adv[pos + 2];
+        pos += 1 + len;
+    }
+    return PROXIMITY_TX_POWER_UNKNOWN;
+}
+
+static float proximityMedian(const proximity_watch_t* watch)
+{
+    int8_t sorted[PROXIMITY_WINDOW];
+    int n = watch->count;
+    for (int i = 0; i < n; i++) {
+        int8_t v = watch->samples[i];
+        int j = i;
+        for (; j > 0 && sorted[j - 1] > v; j--) sorted[j] = sorted[j - 1];
+        sorted[j] = v;
+    }
+    return n % 2 ? sorted[n / 2] : (sorted[n / 2 - 1] + sorted[n / 2]) / 2.0f;
+}
+
+// Must be called with sProximityLock held. Adds |rssi| to the window and
+// updates the smoothed estimate.
+static void proximityAddSample(proximity_watch_t* watch, int rssi, int64_t now)
+{
+    watch->samples[watch->head] = (int8_t) rssi;
+    watch->head = (watch->head + 1) % PROXIMITY_WINDOW;
+    if (watch->count < PROXIMITY_WINDOW) watch->count++;
+    watch->last_sample_ns = now;
+
+    if (watch->count == 1) {
+        watch->estimate = rssi;
+        watch->variance = PROXIMITY_KALMAN_R;
+        return;
+    }
+    switch (watch->filter) {
+        case PROXIMITY_FILTER_MEDIAN:
+            watch->estimate = proximityMedian(watch);
+            break;
+        case PROXIMITY_FILTER_KALMAN:
+        {
+            float p = watch->variance + PROXIMITY_KALMAN_Q;
+            float gain = p / (p + PROXIMITY_KALMAN_R);
+            watch->estimate += gain * (rssi - watch->estimate);
+            watch->variance = (1 - gain) * p;
+            break;
+        }
+        default:
+            watch->estimate += PROXIMITY_EMA_ALPHA * (rssi - watch->estimate);
+            break;
+    }
+}
+
+static int proximityDistanceCm(const proximity_watch_t* watch)
+{
+    int ref_rssi = watch->tx_power != PROXIMITY_TX_POWER_UNKNOWN ?
+            watch->tx_power - PROXIMITY_ONE_METER_LOSS : watch->ref_rssi;
+    float meters = powf(10.0f, (ref_rssi - watch->estimate) / watch->path_loss_x10);
+    float cm = meters * 100;
+    return cm > PROXIMITY_MAX_DISTANCE_CM ? PROXIMITY_MAX_DISTANCE_CM : (int) cm;
+}
+
+// Must be called with sProximityLock held.
+static void proximityEmit(proximity_watch_t* watch, bool inside, int distance_cm,
+                          proximity_event_t* events, int* num_events)
+{
+    watch->inside = inside;
+    proximity_event_t& event = events[(*num_events)++];
+    event.client_if = watch->client_if;
+    event.bda = watch->bda;
+    event.inside = inside;
+    event.rssi = (int) watch->estimate;
+    event.distance_cm = distance_cm;
+    event.adv_len = watch->adv_len;
+    memcpy(event.adv, watch->adv, watch->adv_len);
+    sProximityEvents++;
+}
+
+// Feeds one RSSI sample of |bda|. |tx_power| is the advertised TX power or
+// PROXIMITY_TX_POWER_UNKNOWN, |adv| the advertising data the sample came with
+// if any. Zone changes are written to |events|, which must hold
+// PROXIMITY_MAX_WATCHES entries. Returns the number of events.
+static int proximityUpdate(const bt_bdaddr_t* bda, int rssi, int tx_power,
+                           const uint8_t* adv, int adv_len, proximity_event_t* events)
+{
+    int num_events = 0;
+    // A watch added concurrently only misses this sample.
+    if (sProximityWatchCount == 0) return 0;
+
+    uint64_t key = bdaddr_to_key(bda);
+    int64_t now = elapsed_realtime_nanos();
+    if (adv_len > PROXIMITY_ADV_LEN) adv_len = PROXIMITY_ADV_LEN;
+    pthread_mutex_lock(&sProximityLock);
+    for (int i = 0; i < PROXIMITY_MAX_WATCHES; i++) {
+        proximity_watch_t* watch = &sProximityWatches[i];
+        if (!watch->in_use || watch->key != key) continue;
+
+        if (tx_power != PROXIMITY_TX_POWER_UNKNOWN) watch->tx_power = tx_power;
+        if (adv_len > 0) {
+            memcpy(watch->adv, adv, adv_len);
+            watch->adv_len = adv_len;
+        }
+        proximityAddSample(watch, rssi, now);
+        sProximitySamples++;
+        if (watch->count < PROXIMITY_MIN_SAMPLES) continue;
+
+        int distance_cm = proximityDistanceCm(watch);
+        if (!watch->inside && distance_cm <= watch->near_cm) {
+            proximityEmit(watch, true, distance_cm, events, &num_events);
+        } else if (watch->inside && distance_cm >= watch->far_cm) {
+            proximityEmit(watch, false, distance_cm, events, &num_events);
+        }
+    }
+    pthread_mutex_unlock(&sProximityLock);
+    return num_events;
+}
+
+// Marks devices that have gone quiet for PROXIMITY_LOST_NS as having left.
+// Returns the number of events written to |events|, which must hold
+// PROXIMITY_MAX_WATCHES entries, and sets |watches| to the watches left.
+static int proximityCheckLost(proximity_event_t* events, int* watches)
+{
+    int num_events = 0;
+    int64_t now = elapsed_realtime_nanos();
+    pthread_mutex_lock(&sProximityLock);
+    for (int i = 0; i < PROXIMITY_MAX_WATCHES; i++) {
+        proximity_watch_t* watch = &sProximityWatches[i];
+        if (watch->in_use && watch->inside && now - watch->last_sample_ns > PROXIMITY_LOST_NS) {
+            watch->count = 0;
+            proximityEmit(watch, false, PROXIMITY_MAX_DISTANCE_CM, events, &num_events);
+        }
+    }
+    *watches = sProximityWatchCount;
+    pthread_mutex_unlock(&sProximityLock);
+    return num_events;
+}
+
+// Sends zone changes up. Runs on the callback thread or, for devices that went
+// quiet, on the thread of gattClientCheckProximityNative(); addresses are
+// therefore not taken from the callback thread's address cache.
+static void proximityDeliver(JNIEnv* env, const proximity_event_t* events, int num_events)
+{
+    for (int i = 0; i < num_events; i++) {
+        const bt_bdaddr_t* bda = &events[i].bda;
+        char c_address[32];
+        snprintf(c_address, sizeof(c_address), "%02X:%02X:%02X:%02X:%02X:%02X",
+                bda->address[0], bda->address[1], bda->address[2],
+                bda->address[3], bda->address[4], bda->address[5]);
+        jstring address = env->NewStringUTF(c_address);
+        jbyteArray adv = env->NewByteArray(events[i].adv_len);
+        if (address != NULL && adv != NULL) {
+            env->SetByteArrayRegion(adv, 0, events[i].adv_len, (const jbyte*) events[i].adv);
+            env->CallVoidMethod(mCallbacksObj, method_onProximityChanged, events[i].client_if,
+                                address, (jboolean) events[i].inside, events[i].rssi,
+                                events[i].distance_cm, adv);
+        }
+        checkAndClearExceptionFromCallback(env, __FUNCTION__);
+        if (address != NULL) env->DeleteLocalRef(address);
+        if (adv != NULL) env->DeleteLocalRef(adv);
+    }
+}
+
+// Feeds a sample from a callback and sends up the resulting zone changes.
+static void proximitySample(JNIEnv* env, const bt_bdaddr_t* bda, int rssi, int tx_power,
+                            const uint8_t* adv, int adv_len)
+{
+    proximity_event_t events[PROXIMITY_MAX_WATCHES];
+    int num_events = proximityUpdate(bda, rssi, tx_power, adv, adv_len, events);
+    if (num_events > 0) {
+        CALLBACK_UPCALL();
+        proximityDeliver(env, events, num_events);
+    }
+}
+
+// Must be called with sProximityLock held.
+static void proximityRemove(proximity_watch_t* watch)
+{
+    memset(watch, 0, sizeof(proximity_watch_t));
+    sProximityWatchCount--;
+}
+
+/**
+ * Advertiser presence tracking
+ *
+ * Keeps the found/lost state of every advertiser reported by the on-found /
+ * on-lost tracking filters, per client, with first and last seen times and
+ * RSSI statistics. btgattc_track_adv_event_cb() only goes up to Java when an
+ * advertiser actually changes state; a repeated found or a lost for an
+ * advertiser that is not present is absorbed here.
+ *
+ * Present advertisers are also kept as packed rows of PRESENCE_FIELDS longs,
+ * updated in place on every event, so a snapshot is a single array copy and
+ * the presence version, bumped on each transition, tells a poller whether it
+ * needs one at all. A row holds the address (48 bits, first byte most
+ * significant), client, first and last seen elapsed realtime in
+ * nanoseconds, last, minimum, maximum and mean RSSI, and TX power.
+ *
+ * The table is open addressed without deletion; once it is full, the least
+ * recently seen absent advertiser is overwritten in place.
+ */
+
+#define PRESENCE_SLOTS 256
+#define PRESENCE_FIELDS 9
+#define ADV_STATE_FOUND 0
+
+typedef struct {
+    bool in_use;
+    int client_if;
+    uint64_t key;
+    int row;
+    int64_t first_seen_ns;
+    int64_t last_seen_ns;
+    int rssi;
+    int rssi_min;
+    int rssi_max;
+    int64_t rssi_sum;
+    int samples;
+    int tx_power;
+} presence_entry_t;
+
+static pthread_mutex_t sPresenceLock = PTHREAD_MUTEX_INITIALIZER;
+static presence_entry_t sPresence[PRESENCE_SLOTS];
+static int sPresenceUsed;
+static jlong sPresenceRows[PRESENCE_SLOTS][PRESENCE_FIELDS];
+static int sPresenceRowSlot[PRESENCE_SLOTS];
+static int sPresenceCount;
+static uint64_t sPresenceVersion;
+static uint64_t sPresenceTransitions;
+static uint64_t sPresenceAbsorbed;
+
+// Must be called with sPresenceLock held. Returns the entry of |key| for
+// |client_if|, taking a free or reusable slot for it if needed, or NULL if
+// every slot holds a present advertiser.
+static presence_entry_t* presenceEntry(int client_if, uint64_t key)
+{
+    int home = addr_cache_slot(key ^ ((uint64_t) client_if << 49)) % PRESENCE_SLOTS;
+    presence_entry_t* oldest = NULL;
+    for (int i = 0; i < PRESENCE_SLOTS; i++) {
+        presence_entry_t* entry = &sPresence[(home + i) % PRESENCE_SLOTS];
+        if (!entry->in_use) {
+            memset(entry, 0, sizeof(presence_entry_t));
+            entry->in_use = true;
+            entry->client_if = client_if;
+            entry->key = key;
+            entry->row = -1;
+            sPresenceUsed++;
+            return entry;
+        }
+        if (entry->key == key && entry->client_if == client_if) return entry;
+        if (entry->row < 0 && (oldest == NULL || entry->last_seen_ns < oldest->last_seen_ns))
+            oldest = entry;
+    }
+    // Full: lookups probe every slot now, so reusing one in place is safe.
+    if (oldest != NULL) {
+        memset(oldest, 0, sizeof(presence_entry_t));
+        oldest->in_use = true;
+        oldest->client_if = client_if;
+        oldest->key = key;
+        oldest->row = -1;
+    }
+    return oldest;
+}
+
+// Must be called with sPresenceLock held.
+static void presenceWriteRow(const presence_entry_t* entry)
+{
+    jlong* row = sPresenceRows[entry->row];
+    row[0] = entry->key & ((1ULL << 48) - 1);
+    row[1] = entry->client_if;
+    row[2] = entry->first_seen_ns;
+    row[3] = entry->last_seen_ns;
+    row[4] = entry->rssi;
+    row[5] = entry->rssi_min;
+    row[6] = entry->rssi_max;
+    row[7] = entry->samples > 0 ? entry->rssi_sum / entry->samples : entry->rssi;
+    row[8] = entry->tx_power;
+}
+
+// Must be called with sPresenceLock held.
+static void presenceRemoveRow(presence_entry_t* entry)
+{
+    int last = --sPresenceCount;
+    if (entry->row != last) {
+        memcpy(sPresenceRows[entry->row], sPresenceRows[last], sizeof(sPresenceRows[0]));
+        int slot = sPresenceRowSlot[last];
+        sPresenceRowSlot[entry->row] = slot;
+        sPresence[slot].row = entry->row;
+    }
+    entry->row = -1;
+}
+
+// Records a tracking event. Returns true if the advertiser changed state.
+static bool presenceUpdate(const btgatt_track_adv_info_t* info)
+{
+    bool found = info->advertiser_state == ADV_STATE_FOUND;
+    int64_t now = elapsed_realtime_nanos();
+
+    pthread_mutex_lock(&sPresenceLock);
+    presence_entry_t* entry = presenceEntry(info->client_if, bdaddr_to_key(&info->bd_addr));
+    if (entry == NULL) {
+        // No room to remember it; let Java see the event as before.
+        pthread_mutex_unlock(&sPresenceLock);
+        return true;
+    }
+
+    bool present = entry->row >= 0;
+    if (found) {
+        if (!present) entry->first_seen_ns = now;
+        entry->last_seen_ns = now;
+        entry->rssi = info->rssi_value;
+        if (entry->samples == 0 || entry->rssi < entry->rssi_min) entry->rssi_min = entry->rssi;
+        if (entry->samples == 0 || entry->rssi > entry->rssi_max) entry->rssi_max = entry->rssi;
+        entry->rssi_sum += entry->rssi;
+        entry->samples++;
+        entry->tx_power = info->tx_power;
+        if (!present) {
+            entry->row = sPresenceCount++;
+            sPresenceRowSlot[entry->row] = entry - sPresence;
+        }
+        presenceWriteRow(entry);
+    } else if (present) {
+        presenceRemoveRow(entry);
+    }
+
+    bool changed = found != present;
+    if (changed) {
+        sPresenceVersion++;
+        sPresenceTransitions++;
+    } else {
+        sPresenceAbsorbed++;
+    }
+    pthread_mutex_unlock(&sPresenceLock);
+    return changed;
+}
+
+/**
+ * Batch scan report parsing
+ *
+ * Reports are decoded here into per-field columns of a BatchScanReport so
+ * Java no longer walks the raw blob allocating an array per field.
+ *
+ * Truncated records are 11 bytes: address (6, little endian), address type,
+ * tx power, rssi, timestamp (2). Full records have the same 11 byte header
+ * followed by the advertising data and the scan response, each prefixed by
+ * its length.
+ */
+
+#define BATCH_SCAN_FORMAT_TRUNCATED 1
+#define BATCH_SCAN_FORMAT_FULL 2
+#define BATCH_SCAN_HEADER_LEN 11
+#define BATCH_SCAN_RSSI_OFFSET 8
+#define BATCH_SCAN_TIMESTAMP_OFFSET 9
+// The controller reports the age of a record in units of 50 ms.
+#define BATCH_SCAN_TIMESTAMP_UNIT_NS (50LL * 1000 * 1000)
+
+static jclass class_BatchScanReport;
+static jmethodID method_BatchScanReport_init;
+
+// Counts the well-formed full records in |data| and the size of their scan
+// records. Parsing stops at the first truncated record.
+static int batch_scan_count_full(const uint8_t* data, int len, int max_records,
+                                 int* records_len)
+{
+    int count = 0;
+    int pos = 0;
+    *records_len = 0;
+    while (count < max_records && pos + BATCH_SCAN_HEADER_LEN < len) {
+        int adv_len = data[pos + BATCH_SCAN_HEADER_LEN];
+        int rsp_pos = pos + BATCH_SCAN_HEADER_LEN + 1 + adv_len;
+        if (rsp_pos >= len) break;
+        int rsp_len = data[rsp_pos];
+        if (rsp_pos + 1 + rsp_len > len) break;
+        *records_len += adv_len + rsp_len;
+        pos = rsp_pos + 1 + rsp_len;
+        count++;
+    }
+    return count;
+}
+
+static jobject parseBatchScanReport(JNIEnv* env, jclass clazz, jmethodID init, int format,
+                                    int num_records, const uint8_t* data, int len)
+{
+    if (num_records < 0 || len < 0 || (len > 0 && data == NULL)) return NULL;
+
+    bool full = format == BATCH_SCAN_FORMAT_FULL;
+    int records_len = 0;
+    int count = num_records;
+    if (full) {
+        count = batch_scan_count_full(data, len, num_records, &records_len);
+    } else if (count > len / BATCH_SCAN_HEADER_LEN) {
+        count = len / BATCH_SCAN_HEADER_LEN;
+    }
+    if (count < num_records) {
+        warn("%s: report holds %d of %d records", __FUNCTION__, count, num_records);
+    }
+
+    jbyteArray addresses = env->NewByteArray(count * BD_ADDR_LEN);
+    jintArray rssi = env->NewIntArray(count);
+    jlongArray timestamps = env->NewLongArray(count);
+    jbyteArray records = full ? env->NewByteArray(records_len) : NULL;
+    jintArray offsets = full ? env->NewIntArray(count + 1) : NULL;
+    jobject report = NULL;
+
+    if (addresses && rssi && timestamps && (!full || (records && offsets))) {
+        int64_t now = elapsed_realtime_nanos();
+        uint8_t* c_addresses = (uint8_t*) env->GetPrimitiveArrayCritical(addresses, NULL);
+        jint* c_rssi = (jint*) env->GetPrimitiveArrayCritical(rssi, NULL);
+        jlong* c_timestamps = (jlong*) env->GetPrimitiveArrayCritical(timestamps, NULL);
+        uint8_t* c_records = full ?
+                (uint8_t*) env->GetPrimitiveArrayCritical(records, NULL) : NULL;
+        jint* c_offsets = full ? (jint*) env->GetPrimitiveArrayCritical(offsets, NULL) : NULL;
+
+        if (c_addresses && c_rssi && c_timestamps && (!full || (c_records && c_offsets))) {
+            int pos = 0;
+            int out = 0;
+            if (full) c_offsets[0] = 0;
+            for (int i = 0; i < count; i++) {
+                const uint8_t* rec = data + pos;
+                // Addresses are reported least significant byte first.
+                uint8_t* addr = c_addresses + i * BD_ADDR_LEN;
+                for (int b = 0; b < BD_ADDR_LEN; b++) addr[b] = rec[BD_ADDR_LEN - 1 - b];
+                c_rssi[i] = (int8_t) rec[BATCH_SCAN_RSSI_OFFSET];
+                int units = rec[BATCH_SCAN_TIMESTAMP_OFFSET] |
+                        (rec[BATCH_SCAN_TIMESTAMP_OFFSET + 1] << 8);
+                c_timestamps[i] = now - units * BATCH_SCAN_TIMESTAMP_UNIT_NS;
+
+                if (!full) {
+                    pos += BATCH_SCAN_HEADER_LEN;
+                    continue;
+                }
+                // Combine advertise packet and scan response packet.
+                int adv_len = rec[BATCH_SCAN_HEADER_LEN];
+                memcpy(c_records + out, rec + BATCH_SCAN_HEADER_LEN + 1, adv_len);
+                out += adv_len;
+                const uint8_t* rsp = rec + BATCH_SCAN_HEADER_LEN + 1 + adv_len;
+                memcpy(c_records + out, rsp + 1, rsp[0]);
+                out += rsp[0];
+                c_offsets[i + 1] = out;
+                pos += BATCH_SCAN_HEADER_LEN + 2 + adv_len + rsp[0];
+            }
+        }
+
+        if (c_offsets) env->ReleasePrimitiveArrayCritical(offsets, c_offsets, 0);
+        if (c_records) env->ReleasePrimitiveArrayCritical(records, c_records, 0);
+        if (c_timestamps) env->ReleasePrimitiveArrayCritical(timestamps, c_timestamps, 0);
+        if (c_rssi) env->ReleasePrimitiveArrayCritical(rssi, c_rssi, 0);
+        if (c_addresses) env->ReleasePrimitiveArrayCritical(addresses, c_addresses, 0);
+
+        report = env->NewObject(clazz, init, format, count, addresses, rssi, timestamps,
+                                records, offsets);
+    } else {
+        error("Unable to allocate arrays for %d batch scan records", count);
+    }
+
+    if (addresses) env->DeleteLocalRef(addresses);
+    if (rssi) env->DeleteLocalRef(rssi);
+    if (timestamps) env->DeleteLocalRef(timestamps);
+    if (records) env->DeleteLocalRef(records);
+    if (offsets) env->DeleteLocalRef(offsets);
+    return report;
+}
+
+/**
+ * GATT server attribute table
+ *
+ * Values GattService registers for constant attributes (device information
+ * strings and the like), indexed by attribute handle. btgatts_request_read_cb()
+ * answers reads of these handles, including long reads, straight from the
+ * table; only attributes without an entry are sent up to the app. Each change
+ * bumps a global version counter that is stored with the entry, so the dump
+ * can tell stale values from fresh ones.
+ *
+ * A value passed to gattServerAddCharacteristicNative() is held per server
+ * until the stack reports the new characteristic handle.
+ */
+
+#define GATT_ATTR_MAX_SERVERS 16
+#define GATT_STATUS_INVALID_OFFSET 0x07
+#define GATT_STATUS_BUSY 0x84
+#define GATT_STATUS_ERROR 0x85
+#define GATT_STATUS_CONGESTED 0x8f
+
+typedef struct {
+    int server_if;
+    int srvc_handle;
+    uint32_t version;
+    uint16_t len;
+    uint8_t* value;
+} gatt_attr_entry_t;
+
+typedef struct {
+    int server_if;
+    uint16_t len;
+    uint8_t* value;
+} gatt_attr_pending_t;
+
+static pthread_mutex_t sGattAttrLock = PTHREAD_MUTEX_INITIALIZER;
+static gatt_attr_entry_t* sGattAttrs;
+static int sGattAttrCapacity;
+static int sGattAttrCount;
+static uint32_t sGattAttrVersion;
+static uint64_t sGattAttrReads;
+static gatt_attr_pending_t sGattAttrPending[GATT_ATTR_MAX_SERVERS];
+
+// Must be called with sGattAttrLock held.
+static void gattAttrFree(gatt_attr_entry_t* entry)
+{
+    if (entry->value != NULL) sGattAttrCount--;
+    free(entry->value);
+    memset(entry, 0, sizeof(gatt_attr_entry_t));
+}
+
+// Must be called with sGattAttrLock held. Takes ownership of |value|.
+static void gattAttrSet(int server_if, int srvc_handle, int handle, uint8_t* value,
+                        uint16_t len)
+{
+    if (handle <= 0 || handle > 0xFFFF) {
+        free(value);
+        return;
+    }
+
+    if (handle >= sGattAttrCapacity) {
+        int capacity = sGattAttrCapacity ? sGattAttrCapacity : 64;
+        while (capacity <= handle) capacity *= 2;
+        gatt_attr_entry_t* attrs = (gatt_attr_entry_t*) realloc(sGattAttrs,
+                capacity * sizeof(gatt_attr_entry_t));
+        if (attrs == NULL) {
+            error("Unable to grow attribute table to %d handles", capacity);
+            free(value);
+            return;
+        }
+        memset(attrs + sGattAttrCapacity, 0,
+               (capacity - sGattAttrCapacity) * sizeof(gatt_attr_entry_t));
+        sGattAttrs = attrs;
+        sGattAttrCapacity = capacity;
+    }
+
+    gatt_attr_entry_t* entry = &sGattAttrs[handle];
+    gattAttrFree(entry);
+    if (value == NULL) return;
+
+    entry->server_if = server_if;
+    entry->srvc_handle = srvc_handle;
+    entry->version = ++sGattAttrVersion;
+    entry->len = len;
+    entry->value = value;
+    sGattAttrCount++;
+}
+
+// Must be called with sGattAttrLock held. |srvc_handle| 0 matches any service.
+static void gattAttrClear(int server_if, int srvc_handle)
+{
+    for (int i = 0; i < sGattAttrCapacity; i++) {
+        gatt_attr_entry_t* entry = &sGattAttrs[i];
+        if (entry->value == NULL) continue;
+        if (server_if != 0 && entry->server_if != server_if) continue;
+        if (srvc_handle != 0 && entry->srvc_handle != srvc_handle) continue;
+        gattAttrFree(entry);
+    }
+    sGattAttrVersion++;
+}
+
+// Must be called with sGattAttrLock held.
+static gatt_attr_pending_t* gattAttrPending(int server_if, bool create)
+{
+    gatt_attr_pending_t* empty = NULL;
+    for (int i = 0; i < GATT_ATTR_MAX_SERVERS; i++) {
+        gatt_attr_pending_t* pending = &sGattAttrPending[i];
+        if (pending->server_if == server_if) return pending;
+        if (pending->server_if == 0 && empty == NULL) empty = pending;
+    }
+    if (create && empty != NULL) empty->server_if = server_if;
+    return create ? empty : NULL;
+}
+
+// Copies |val| into a heap buffer. Returns NULL for a null array; an empty
+// value is kept as a zero length allocation.
+static uint8_t* gattAttrCopy(JNIEnv* env, jbyteArray val, uint16_t* len)
+{
+    *len = 0;
+    if (val == NULL) return NULL;
+
+    jsize size = env->GetArrayLength(val);
+    if (size > BTGATT_MAX_ATTR_LEN) size = BTGATT_MAX_ATTR_LEN;
+    uint8_t* value = (uint8_t*) malloc(size > 0 ? size : 1);
+    if (value == NULL) return NULL;
+    env->GetByteArrayRegion(val, 0, size, (jbyte*) value);
+    *len = (uint16_t) size;
+    return value;
+}
+
+// Answers a read from the attribute table. Returns false if |handle| has no
+// registered value and the request has to go to the app.
+static bool gattAttrRespond(int conn_id, int trans_id, int handle, int offset)
+{
+    btgatt_response_t response;
+    int status = 0;
+
+    pthread_mutex_lock(&sGattAttrLock);
+    if (handle <= 0 || handle >= sGattAttrCapacity || sGattAttrs[handle].value == NULL) {
+        pthread_mutex_unlock(&sGattAttrLock);
+        return false;
+    }
+
+    const gatt_attr_entry_t& entry = sGattAttrs[handle];
+    memset(&response, 0, sizeof(response));
+    response.attr_value.handle = handle;
+    response.attr_value.offset = offset;
+    if (offset > entry.len) {
+        status = GATT_STATUS_INVALID_OFFSET;
+    } else {
+        response.attr_value.len = entry.len - offset;
+        memcpy(response.attr_value.value, entry.value + offset, response.attr_value.len);
+    }
+    sGattAttrReads++;
+    pthread_mutex_unlock(&sGattAttrLock);
+
+    sGattIf->server->send_response(conn_id, trans_id, status, &response);
+    return true;
+}
+
+/**
+ * Server notification fan-out
+ *
+ * gattServerSendNotificationMultiNative() sends one value to many
+ * connections with a single JNI call. Connections reported congested by
+ * btgatts_congestion_cb() get the value queued instead, and their queue is
+ * flushed once the congestion clears, so one slow link does not hold back the
+ * others. When a queue is full the oldest value is dropped; a notification
+ * is only worth delivering if it is recent.
+ *
+ * The single notification and indication paths go through the same queue,
+ * and a connection keeps queueing until the flush has drained it, so values
+ * sent while the queue is flushed cannot overtake the queued ones.
+ */
+
+#define SERVER_NOTIFY_MAX_CONN 64
+#define SERVER_NOTIFY_QUEUE_DEPTH 8
+
+typedef struct {
+    int server_if;
+    int attr_handle;
+    bool confirm;
+    uint16_t len;
+    uint8_t* value;
+} server_notify_t;
+
+typedef struct {
+    int conn_id;
+    bool congested;
+    bool draining;
+    int head;
+    int count;
+    server_notify_t queue[SERVER_NOTIFY_QUEUE_DEPTH];
+} server_notify_conn_t;
+
+static pthread_mutex_t sServerNotifyLock = PTHREAD_MUTEX_INITIALIZER;
+static server_notify_conn_t sServerNotifyConns[SERVER_NOTIFY_MAX_CONN];
+static uint64_t sServerNotifySent;
+static uint64_t sServerNotifyQueued;
+static uint64_t sServerNotifyDropped;
+
+// Must be called with sServerNotifyLock held.
+static server_notify_conn_t* serverNotifyConn(int conn_id, bool create)
+{
+    server_notify_conn_t* empty = NULL;
+    for (int i = 0; i < SERVER_NOTIFY_MAX_CONN; i++) {
+        server_notify_conn_t* conn = &sServerNotifyConns[i];
+        if (conn->conn_id == conn_id) return conn;
+        if (conn->conn_id == 0 && empty == NULL) empty = conn;
+    }
+    if (!create || empty == NULL) return NULL;
+    empty->conn_id = conn_id;
+    return empty;
+}
+
+// Must be called with sServerNotifyLock held.
+static void serverNotifyReset(server_notify_conn_t* conn)
+{
+    for (int i = 0; i < conn->count; i++) {
+        free(conn->queue[(conn->head + i) % SERVER_NOTIFY_QUEUE_DEPTH].value);
+    }
+    memset(conn, 0, sizeof(server_notify_conn_t));
+}
+
+// Must be called with sServerNotifyLock held. Returns false if the value was
+// dropped because it could not be copied.
+static bool serverNotifyEnqueue(server_notify_conn_t* conn, int server_if, int attr_handle,
+                                bool confirm, const uint8_t* value, uint16_t len)
+{
+    uint8_t* copy = (uint8_t*) malloc(len > 0 ? len : 1);
+    if (copy == NULL) return false;
+    memcpy(copy, value, len);
+
+    if (conn->count == SERVER_NOTIFY_QUEUE_DEPTH) {
+        free(conn->queue[conn->head].value);
+        conn->head = (conn->head + 1) % SERVER_NOTIFY_QUEUE_DEPTH;
+        conn->count--;
+        sServerNotifyDropped++;
+    }
+
+    server_notify_t& slot =
+            conn->queue[(conn->head + conn->count) % SERVER_NOTIFY_QUEUE_DEPTH];
+    slot.server_if = server_if;
+    slot.attr_handle = attr_handle;
+    slot.confirm = confirm;
+    slot.len = len;
+    slot.value = copy;
+    conn->count++;
+    sServerNotifyQueued++;
+    return true;
+}
+
+// Sends |value| to |conn_id|, or queues it behind earlier values while the
+// connection is congested or its queue is being flushed. Returns true if the
+// value was sent right away.
+static bool serverNotifySend(int server_if, int attr_handle, int conn_id, bool confirm,
+                             const uint8_t* value, uint16_t len)
+{
+    pthread_mutex_lock(&sServerNotifyLock);
+    server_notify_conn_t* conn = serverNotifyConn(conn_id, false);
+    bool queued = conn != NULL && (conn->congested || conn->draining) &&
+            serverNotifyEnqueue(conn, server_if, attr_handle, confirm, value, len);
+    pthread_mutex_unlock(&sServerNotifyLock);
+    if (queued) return false;
+
+    sGattIf->server->send_indication(server_if, attr_handle, conn_id, len,
+                                     confirm ? 1 : 0, (char*) value);
+    return true;
+}
+
+static void serverNotifyCongestion(int conn_id, bool congested)
+{
+    pthread_mutex_lock(&sServerNotifyLock);
+    server_notify_conn_t* conn = serverNotifyConn(conn_id, congested);
+    if (conn != NULL) {
+        conn->congested = congested;
+        if (!congested) conn->draining = true;
+    }
+
+    // Send the queue one value at a time. The slot stays taken until the
+    // queue is empty so senders keep queueing behind it in the meantime.
+    int sent = 0;
+    while (!congested && conn != NULL) {
+        if (conn->count == 0) {
+            conn->conn_id = 0;
+            conn->draining = false;
+            conn->head = 0;
+            break;
+        }
+
+        server_notify_t pending = conn->queue[conn->head];
+        conn->head = (conn->head + 1) % SERVER_NOTIFY_QUEUE_DEPTH;
+        conn->count--;
+        pthread_mutex_unlock(&sServerNotifyLock);
+
+        if (sGattIf) {
+            sGattIf->server->send_indication(pending.server_if, pending.attr_handle,
+                                             conn_id, pending.len, pending.confirm,
+                                             (char*) pending.value);
+        }
+        free(pending.value);
+        sent++;
+
+        // The connection may have gone away while the lock was dropped.
+        pthread_mutex_lock(&sServerNotifyLock);
+        conn = serverNotifyConn(conn_id, false);
+    }
+    sServerNotifySent += sent;
+    pthread_mutex_unlock(&sServerNotifyLock);
+}
+
+static void serverNotifyDisconnected(int conn_id)
+{
+    pthread_mutex_lock(&sServerNotifyLock);
+    server_notify_conn_t* conn = serverNotifyConn(conn_id, false);
+    if (conn != NULL) serverNotifyReset(conn);
+    pthread_mutex_unlock(&sServerNotifyLock);
+}
+
+/**
+ * Scan filter programming
+ *
+ * gattClientScanFilterProgramNative() takes every hardware filter a client
+ * wants in one call and only sends the controller what differs from what is
+ * already installed. The feature entries installed at each filter index are
+ * mirrored here; deleting the filter parameters of an index when a scan stops
+ * leaves its entries in the controller, so a scan restarted with the same or
+ * similar filters picks the free indices whose entries match best and only
+ * adds or deletes the difference before setting the parameters again.
+ *
+ * The operations run one at a time, each issued from the completion callback
+ * of the previous one, and ScanManager is told once through
+ * onScanFilterProgrammed. An index touched through the single entry natives,
+ * or by a failed program, is no longer trusted; entries for it are added
+ * again the next time it is used.
+ *
+ * Entries arrive encoded by ScanManager.writeFilterEntry(); two are the same
+ * filter if type and encoding match.
+ */
+
+#define SCAN_FILTER_MAX_INDEX 32
+#define SCAN_FILTER_MAX_ENTRIES 8
+#define SCAN_FILTER_ENTRY_MAX_LEN 64
+#define SCAN_FILTER_PARAM_FIELDS 10
+
+#define SCAN_FILTER_TYPE_ADDRESS 0
+#define SCAN_FILTER_TYPE_SERVICE_UUID 2
+#define SCAN_FILTER_TYPE_SOLICIT_UUID 3
+#define SCAN_FILTER_TYPE_LOCAL_NAME 4
+#define SCAN_FILTER_TYPE_MANUFACTURER_DATA 5
+#define SCAN_FILTER_TYPE_SERVICE_DATA 6
+
+enum {
+    SCAN_FILTER_OP_ADD = 0,
+    SCAN_FILTER_OP_DELETE = 1,
+    SCAN_FILTER_OP_PARAMS = 2,
+};
+
+typedef struct {
+    uint8_t type;
+    uint8_t len;
+    uint8_t data[SCAN_FILTER_ENTRY_MAX_LEN];
+} scan_filter_entry_t;
+
+typedef struct {
+    bool known;
+    int count;
+    scan_filter_entry_t entries[SCAN_FILTER_MAX_ENTRIES];
+} scan_filter_slot_t;
+
+typedef struct {
+    int kind;
+    int filt_index;
+    scan_filter_entry_t entry;
+    btgatt_filt_param_setup_t params;
+} scan_filter_op_t;
+
+typedef struct {
+    int client_if;
+    int count;
+    int next;
+    int status;
+    scan_filter_op_t* ops;
+} scan_filter_program_t;
+
+// FilterParams getters, looked up once in classInitNative().
+static jmethodID method_FilterParams_getClientIf;
+static jmethodID method_FilterParams_getFiltIndex;
+static jmethodID method_FilterParams_getFeatSeln;
+static jmethodID method_FilterParams_getListLogicType;
+static jmethodID method_FilterParams_getFiltLogicType;
+static jmethodID method_FilterParams_getDelyMode;
+static jmethodID method_FilterParams_getFoundTimeout;
+static jmethodID method_FilterParams_getLostTimeout;
+static jmethodID method_FilterParams_getFoundTimeOutCnt;
+static jmethodID method_FilterParams_getNumOfTrackEntries;
+static jmethodID method_FilterParams_getRSSIHighValue;
+static jmethodID method_FilterParams_getRSSILowValue;
+
+static pthread_mutex_t sScanFilterLock = PTHREAD_MUTEX_INITIALIZER;
+static scan_filter_slot_t sScanFilterSlots[SCAN_FILTER_MAX_INDEX];
+static scan_filter_program_t sScanFilterProgram;
+static uint64_t sScanFilterPrograms;
+static uint64_t sScanFilterOps;
+static uint64_t sScanFilterOpsSaved;
+
+static void scanFilterForget(int filt_index)
+{
+    if (filt_index < 0 || filt_index >= SCAN_FILTER_MAX_INDEX) return;
+    pthread_mutex_lock(&sScanFilterLock);
+    sScanFilterSlots[filt_index].known = false;
+    sScanFilterSlots[filt_index].count = 0;
+    pthread_mutex_unlock(&sScanFilterLock);
+}
+
+static bool scanFilterEntryEquals(const scan_filter_entry_t* a, const scan_filter_entry_t* b)
+{
+    return a->type == b->type && a->len == b->len && memcmp(a->data, b->data, a->len) == 0;
+}
+
+static bool scanFilterContains(const scan_filter_entry_t* entries, int count,
+                               const scan_filter_entry_t* entry)
+{
+    for (int i = 0; i < count; i++) {
+        if (scanFilterEntryEquals(&entries[i], entry)) return true;
+    }
+    return false;
+}
+
+// Must be called with sScanFilterLock held. Returns the number of entry
+// operations needed to turn |filt_index| into |entries|.
+static int scanFilterCost(int filt_index, const scan_filter_entry_t* entries, int count)
+{
+    if (filt_index < 0 || filt_index >= SCAN_FILTER_MAX_INDEX ||
+            !sScanFilterSlots[filt_index].known)
+        return count;
+
+    const scan_filter_slot_t& slot = sScanFilterSlots[filt_index];
+    int cost = 0;
+    for (int i = 0; i < slot.count; i++) {
+        if (!scanFilterContains(entries, count, &slot.entries[i])) cost++;
+    }
+    for (int i = 0; i < count; i++) {
+        if (!scanFilterContains(slot.entries, slot.count, &entries[i])) cost++;
+    }
+    return cost;
+}
+
+static uint64_t scanFilterGetLe(const uint8_t* p, int len)
+{
+    uint64_t v = 0;
+    for (int i = len - 1; i >= 0; i--) v = (v << 8) | p[i];
+    return v;
+}
+
+// Sends one entry operation to the stack.
+static bt_status_t scanFilterAddRemove(int client_if, int action, int filt_index,
+                                       const scan_filter_entry_t* entry)
+{
+    const uint8_t* p = entry->data;
+    switch (entry->type) {
+        case SCAN_FILTER_TYPE_ADDRESS:
+        {
+            bt_bdaddr_t bda;
+            memcpy(bda.address, p, BD_ADDR_LEN);
+            return sGattIf->client->scan_filter_add_remove(client_if, action, entry->type,
+                    filt_index, 0, 0, NULL, NULL, &bda, p[BD_ADDR_LEN], 0, NULL, 0, NULL);
+        }
+
+        case SCAN_FILTER_TYPE_SERVICE_UUID:
+        case SCAN_FILTER_TYPE_SOLICIT_UUID:
+        {
+            bt_uuid_t uuid, uuid_mask;
+            uint64_t mask_lsb = scanFilterGetLe(p + 16, 8);
+            uint64_t mask_msb = scanFilterGetLe(p + 24, 8);
+            set_uuid(uuid.uu, scanFilterGetLe(p + 8, 8), scanFilterGetLe(p, 8));
+            set_uuid(uuid_mask.uu, mask_msb, mask_lsb);
+            return sGattIf->client->scan_filter_add_remove(client_if, action, entry->type,
+                    filt_index, 0, 0, &uuid, mask_lsb != 0 && mask_msb != 0 ? &uuid_mask : NULL,
+                    NULL, 0, 0, NULL, 0, NULL);
+        }
+
+        case SCAN_FILTER_TYPE_LOCAL_NAME:
+            return sGattIf->client->scan_filter_add_remove(client_if, action, entry->type,
+                    filt_index, 0, 0, NULL, NULL, NULL, 0, entry->len, (char*) p, 0, NULL);
+
+        case SCAN_FILTER_TYPE_MANUFACTURER_DATA:
+        case SCAN_FILTER_TYPE_SERVICE_DATA:
+        {
+            int company = 0;
+            int company_mask = 0;
+            int len = entry->len;
+            if (entry->type == SCAN_FILTER_TYPE_MANUFACTURER_DATA) {
+                company = (int) scanFilterGetLe(p, 2);
+                company_mask = (int) scanFilterGetLe(p + 2, 2);
+                p += 4;
+                len -= 4;
+            }
+            // Data and mask have the same length.
+            len /= 2;
+            return sGattIf->client->scan_filter_add_remove(client_if, action, entry->type,
+                    filt_index, company, company_mask, NULL, NULL, NULL, 0, len, (char*) p,
+                    len, (char*) p + len);
+        }
+    }
+    return BT_STATUS_PARM_INVALID;
+}
+
+static bt_status_t scanFilterIssue(int client_if, const scan_filter_op_t* op)
+{
+    if (!sGattIf) return BT_STATUS_NOT_READY;
+    if (op->kind == SCAN_FILTER_OP_PARAMS)
+        return sGattIf->client->scan_filter_param_setup(op->params);
+    return scanFilterAddRemove(client_if, op->kind, op->filt_index, &op->entry);
+}
+
+// Runs the program from its current operation until one is accepted by the
+// stack. Returns true if the program is over, with its status in |status|.
+static bool scanFilterProgramRun(int* status)
+{
+    for (;;) {
+        pthread_mutex_lock(&sScanFilterLock);
+        scan_filter_program_t& program = sScanFilterProgram;
+        if (program.status != 0 || program.next >= program.count) {
+            if (program.status != 0) {
+                for (int i = 0; i < program.count; i++) {
+                    int filt_index = program.ops[i].filt_index;
+                    if (filt_index >= 0 && filt_index < SCAN_FILTER_MAX_INDEX) {
+                        sScanFilterSlots[filt_index].known = false;
+                        sScanFilterSlots[filt_index].count = 0;
+                    }
+                }
+            }
+            *status = program.status;
+            free(program.ops);
+            memset(&program, 0, sizeof(scan_filter_program_t));
+            pthread_mutex_unlock(&sScanFilterLock);
+            return true;
+        }
+        scan_filter_op_t op = program.ops[program.next];
+        int client_if = program.client_if;
+        pthread_mutex_unlock(&sScanFilterLock);
+
+        if (scanFilterIssue(client_if, &op) == BT_STATUS_SUCCESS) return false;
+
+        pthread_mutex_lock(&sScanFilterLock);
+        sScanFilterProgram.status = GATT_STATUS_ERROR;
+        pthread_mutex_unlock(&sScanFilterLock);
+    }
+}
+
+// Called for every scan filter completion. Returns false if no program of
+// |client_if| is running; otherwise moves on to the next operation and returns
+// true, setting |done| once the program is over.
+static bool scanFilterProgramStep(int client_if, int status, bool* done, int* result)
+{
+    *done = false;
+
+    pthread_mutex_lock(&sScanFilterLock);
+    if (sScanFilterProgram.ops == NULL || sScanFilterProgram.client_if != client_if) {
+        pthread_mutex_unlock(&sScanFilterLock);
+        return false;
+    }
+    if (status != 0) sScanFilterProgram.status = status;
+    sScanFilterProgram.next++;
+    pthread_mutex_unlock(&sScanFilterLock);
+
+    *done = scanFilterProgramRun(result);
+    return true;
+}
+
+/**
+ * Prepared write assembly
+ *
+ * For servers that opt in through gattServerSetWriteAssemblyNative(), the
+ * fragments of a long write are acknowledged here and assembled per
+ * (conn_id, handle) instead of being sent to GattService one by one. When the
+ * execute write arrives each assembled value goes up once, through
+ * onAttributeWriteAssembled, ahead of the usual onExecuteWrite; a cancelled
+ * execute just drops them.
+ *
+ * Values are assembled in blocks of BTGATT_MAX_ATTR_LEN bytes taken from a
+ * fixed pool. A fragment that needs a block when the pool is empty gets
+ * Prepare Queue Full, which is what ATT expects from a server with a bounded
+ * queue.
+ */
+
+#define PREP_WRITE_MAX_CONN 64
+#define PREP_WRITE_POOL_BLOCKS 8
+#define GATT_STATUS_PREPARE_Q_FULL 0x09
+
+typedef struct {
+    int conn_id;
+    int server_if;
+} prep_write_conn_t;
+
+typedef struct {
+    int conn_id;
+    int handle;
+    uint16_t len;
+    uint8_t* block;
+} prep_write_t;
+
+static pthread_mutex_t sPrepWriteLock = PTHREAD_MUTEX_INITIALIZER;
+static int sPrepWriteServers[GATT_ATTR_MAX_SERVERS];
+static prep_write_conn_t sPrepWriteConns[PREP_WRITE_MAX_CONN];
+static prep_write_t sPrepWrites[PREP_WRITE_POOL_BLOCKS];
+static uint8_t sPrepWritePool[PREP_WRITE_POOL_BLOCKS][BTGATT_MAX_ATTR_LEN];
+static uint8_t* sPrepWriteFree[PREP_WRITE_POOL_BLOCKS];
+static int sPrepWriteFreeCount = -1;
+static uint64_t sPrepWriteFragments;
+static uint64_t sPrepWriteAssembled;
+static uint64_t sPrepWriteRejected;
+
+// Must be called with sPrepWriteLock held.
+static uint8_t* prepWriteAlloc()
+{
+    if (sPrepWriteFreeCount < 0) {
+        for (int i = 0; i < PREP_WRITE_POOL_BLOCKS; i++) sPrepWriteFree[i] = sPrepWritePool[i];
+        sPrepWriteFreeCount = PREP_WRITE_POOL_BLOCKS;
+    }
+    if (sPrepWriteFreeCount == 0) return NULL;
+    uint8_t* block = sPrepWriteFree[--sPrepWriteFreeCount];
+    memset(block, 0, BTGATT_MAX_ATTR_LEN);
+    return block;
+}
+
+// Must be called with sPrepWriteLock held.
+static void prepWriteRelease(prep_write_t* write)
+{
+    if (write->block != NULL) sPrepWriteFree[sPrepWriteFreeCount++] = write->block;
+    memset(write, 0, sizeof(prep_write_t));
+}
+
+// Must be called with sPrepWriteLock held.
+static bool prepWriteEnabled(int conn_id)
+{
+    int server_if = 0;
+    for (int i = 0; i < PREP_WRITE_MAX_CONN; i++) {
+        if (sPrepWriteConns[i].conn_id == conn_id) {
+            server_if = sPrepWriteConns[i].server_if;
+            break;
+        }
+    }
+    if (server_if == 0) return false;
+    for (int i = 0; i < GATT_ATTR_MAX_SERVERS; i++) {
+        if (sPrepWriteServers[i] == server_if) return true;
+    }
+    return false;
+}
+
+// Must be called with sPrepWriteLock held.
+static void prepWriteDiscard(int conn_id)
+{
+    for (int i = 0; i < PREP_WRITE_POOL_BLOCKS; i++) {
+        if (sPrepWrites[i].conn_id == conn_id) prepWriteRelease(&sPrepWrites[i]);
+    }
+}
+
+static void prepWriteConnection(int conn_id, int server_if, bool connected)
+{
+    pthread_mutex_lock(&sPrepWriteLock);
+    prepWriteDiscard(conn_id);
+    prep_write_conn_t* empty = NULL;
+    for (int i = 0; i < PREP_WRITE_MAX_CONN; i++) {
+        prep_write_conn_t* conn = &sPrepWriteConns[i];
+        if (conn->conn_id == conn_id) memset(conn, 0, sizeof(prep_write_conn_t));
+        if (conn->conn_id == 0 && empty == NULL) empty = conn;
+    }
+    if (connected && empty != NULL) {
+        empty->conn_id = conn_id;
+        empty->server_if = server_if;
+    }
+    pthread_mutex_unlock(&sPrepWriteLock);
+}
+
+// Takes a prepared write fragment if its connection belongs to a server that
+// assembles writes, and acknowledges it. Returns false if GattService has to
+// handle the fragment.
+static bool prepWriteFragment(int conn_id, int trans_id, int handle, int offset,
+                              int length, const uint8_t* value)
+{
+    int status = 0;
+
+    pthread_mutex_lock(&sPrepWriteLock);
+    if (!prepWriteEnabled(conn_id)) {
+        pthread_mutex_unlock(&sPrepWriteLock);
+        return false;
+    }
+
+    prep_write_t* write = NULL;
+    prep_write_t* empty = NULL;
+    for (int i = 0; i < PREP_WRITE_POOL_BLOCKS; i++) {
+        prep_write_t* w = &sPrepWrites[i];
+        if (w->conn_id == conn_id && w->handle == handle) write = w;
+        if (w->conn_id == 0 && empty == NULL) empty = w;
+    }
+    if (offset < 0 || length < 0 || offset + length > BTGATT_MAX_ATTR_LEN) {
+        status = GATT_STATUS_INVALID_OFFSET;
+    } else if (write == NULL) {
+        uint8_t* block = empty != NULL ? prepWriteAlloc() : NULL;
+        if (block == NULL) {
+            status = GATT_STATUS_PREPARE_Q_FULL;
+        } else {
+            write = empty;
+            write->conn_id = conn_id;
+            write->handle = handle;
+            write->block = block;
+        }
+    }
+    if (status == 0) {
+        memcpy(write->block + offset, value, length);
+        if (offset + length > write->len) write->len = offset + length;
+        sPrepWriteFragments++;
+    } else {
+        sPrepWriteRejected++;
+    }
+    pthread_mutex_unlock(&sPrepWriteLock);
+
+    // The Prepare Write Response echoes the fragment back.
+    btgatt_response_t response;
+    memset(&response, 0, sizeof(response));
+    response.attr_value.handle = handle;
+    response.attr_value.offset = offset;
+    if (status == 0) {
+        response.attr_value.len = length;
+        memcpy(response.attr_value.value, value, length);
+    }
+    if (sGattIf) sGattIf->server->send_response(conn_id, trans_id, status, &response);
+    return true;
+}
+
+/**
+ * Client write pipeline
+ *
+ * gattClientWriteCharacteristicBulkNative() hands a whole buffer to native
+ * code, which splits it into write-without-response segments of MTU - 3 bytes
+ * and pumps them to the stack without a trip to Java per packet. At most
+ * CLIENT_WRITE_CREDITS segments are outstanding; each write callback returns a
+ * credit and btgattc_congestion_cb() holds the pump until the link drains.
+ * The MTU is taken from btgattc_configure_mtu_cb().
+ *
+ * GattService hears back once, through onBulkWriteCompleted, when the last
+ * segment has been acknowledged, the remote returned an error or the link
+ * went away.
+ *
+ * Segments are issued from both the binder thread that starts a bulk write
+ * and the callback thread as credits return. sClientWriteIssueLock makes
+ * taking the next segment and handing it to the stack one step, so segments
+ * reach the stack in order whichever thread sends them. Write callbacks only
+ * carry the handle, so every write issued to the handle of an active bulk
+ * write, including ordinary writes from GattService, is recorded in issue
+ * order and each callback is matched against the oldest record. An ordinary
+ * write that finds no record left is not issued and fails with
+ * GATT_STATUS_BUSY.
+ *
+ * The time from the first segment to the completion of each bulk write is
+ * added up with the bytes acknowledged, giving the throughput in the dump.
+ */
+
+#define CLIENT_WRITE_MAX_CONN 16
+#define CLIENT_WRITE_CREDITS 4
+#define CLIENT_WRITE_DEFAULT_MTU 23
+#define CLIENT_WRITE_TYPE_NO_RSP 1
+#define CLIENT_WRITE_MAX_ISSUED 32
+
+typedef struct {
+    int conn_id;
+    int mtu;
+    bool congested;
+    // Active bulk write, if |value| is not NULL.
+    int handle;
+    int auth_req;
+    int status;
+    int in_flight;
+    uint8_t* value;
+    size_t len;
+    size_t seg_len;
+    size_t offset;
+    size_t acked;
+    int64_t start_ns;
+    // Writes to |handle| awaiting their callback, oldest in bit 0; a set bit
+    // is a bulk write segment, a clear bit an ordinary write.
+    uint32_t issued;
+    int issued_count;
+} client_write_conn_t;
+
+typedef struct {
+    bool done;
+    int handle;
+    int status;
+    size_t bytes;
+} client_write_result_t;
+
+// Lock order: sClientWriteIssueLock, then sClientWriteLock.
+static pthread_mutex_t sClientWriteIssueLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t sClientWriteLock = PTHREAD_MUTEX_INITIALIZER;
+static client_write_conn_t sClientWriteConns[CLIENT_WRITE_MAX_CONN];
+static uint64_t sClientWriteCompleted;
+static uint64_t sClientWriteFailed;
+static uint64_t sClientWriteSegments;
+static uint64_t sClientWriteBytes;
+static uint64_t sClientWritePauses;
+static uint64_t sClientWriteBusyNs;
+
+// Must be called with sClientWriteLock held.
+static client_write_conn_t* clientWriteConn(int conn_id, bool create)
+{
+    client_write_conn_t* empty = NULL;
+    for (int i = 0; i < CLIENT_WRITE_MAX_CONN; i++) {
+        client_write_conn_t* conn = &sClientWriteConns[i];
+        if (conn->conn_id == conn_id) return conn;
+        if (conn->conn_id == 0 && empty == NULL) empty = conn;
+    }
+    if (!create || empty == NULL) return NULL;
+    empty->conn_id = conn_id;
+    empty->mtu = CLIENT_WRITE_DEFAULT_MTU;
+    return empty;
+}
+
+// Must be called with sClientWriteLock held. Ends the active bulk write and
+// fills in |result| for the completion callback.
+static void clientWriteFinish(client_write_conn_t* conn, client_write_result_t* result)
+{
+    result->done = true;
+    result->handle = conn->handle;
+    result->status = conn->status;
+    result->bytes = conn->acked;
+
+    if (conn->status == 0) sClientWriteCompleted++;
+    else sClientWriteFailed++;
+    sClientWriteBytes += conn->acked;
+    sClientWriteBusyNs += monotonic_nanos() - conn->start_ns;
+
+    free(conn->value);
+    conn->value = NULL;
+    conn->in_flight = 0;
+}
+
+// Must be called with sClientWriteLock held. Records a write about to be
+// issued to the handle of the active bulk write. Room for the segment
+// credits is always kept, so this only fails for an ordinary write, which
+// must then not be issued.
+static bool clientWriteIssued(client_write_conn_t* conn, bool segment)
+{
+    if (!segment && conn->issued_count >= CLIENT_WRITE_MAX_ISSUED - CLIENT_WRITE_CREDITS) {
+        warn("Too many writes outstanding on conn_id %d", conn->conn_id);
+        return false;
+    }
+    if (segment) conn->issued |= 1u << conn->issued_count;
+    else conn->issued &= ~(1u << conn->issued_count);
+    conn->issued_count++;
+    return true;
+}
+
+// Sends segments of the active bulk write until credits run out, the link is
+// congested or the buffer is exhausted.
+static void clientWritePump(int conn_id)
+{
+    uint8_t seg[BTGATT_MAX_ATTR_LEN];
+
+    while (sGattIf) {
+        pthread_mutex_lock(&sClientWriteIssueLock);
+        pthread_mutex_lock(&sClientWriteLock);
+        client_write_conn_t* conn = clientWriteConn(conn_id, false);
+        if (conn == NULL || conn->value == NULL || conn->congested || conn->status != 0 ||
+                conn->in_flight >= CLIENT_WRITE_CREDITS || conn->offset >= conn->len) {
+            pthread_mutex_unlock(&sClientWriteLock);
+            pthread_mutex_unlock(&sClientWriteIssueLock);
+            return;
+        }
+        int handle = conn->handle;
+        int auth_req = conn->auth_req;
+        size_t len = conn->len - conn->offset;
+        if (len > conn->seg_len) len = conn->seg_len;
+        memcpy(seg, conn->value + conn->offset, len);
+        conn->offset += len;
+        conn->in_flight++;
+        clientWriteIssued(conn, true);
+        sClientWriteSegments++;
+        pthread_mutex_unlock(&sClientWriteLock);
+
+        sGattIf->client->write_characteristic(conn_id, handle, CLIENT_WRITE_TYPE_NO_RSP,
+                                              len, auth_req, (char*) seg);
+        pthread_mutex_unlock(&sClientWriteIssueLock);
+    }
+}
+
+// Called for every write callback. Returns true if the write was a segment of
+// a bulk write, in which case it must not be reported to GattService on its
+// own; |result| says whether the bulk write has now finished.
+static bool clientWriteAcked(int conn_id, int handle, int status,
+                             client_write_result_t* result)
+{
+    bool consumed = false;
+    memset(result, 0, sizeof(client_write_result_t));
+
+    pthread_mutex_lock(&sClientWriteLock);
+    client_write_conn_t* conn = clientWriteConn(conn_id, false);
+    if (conn != NULL && conn->handle == handle && conn->issued_count > 0) {
+        consumed = conn->issued & 1;
+        conn->issued >>= 1;
+        conn->issued_count--;
+    }
+    if (consumed && conn->value != NULL && conn->in_flight > 0) {
+        conn->in_flight--;
+        // A congested status still means the segment was queued for sending.
+        if (status == 0 || status == GATT_STATUS_CONGESTED) {
+            conn->acked += conn->seg_len;
+            if (conn->acked > conn->offset) conn->acked = conn->offset;
+        } else if (conn->status == 0) {
+            conn->status = status;
+        }
+        if (conn->in_flight == 0 && (conn->status != 0 || conn->acked == conn->len))
+            clientWriteFinish(conn, result);
+    }
+    pthread_mutex_unlock(&sClientWriteLock);
+
+    if (consumed && !result->done) clientWritePump(conn_id);
+    return consumed;
+}
+
+// Issues an ordinary write on behalf of GattService. A write to the handle of
+// an active bulk write is recorded so its callback is not taken for a
+// segment acknowledgement. Returns false, without issuing the write, if there
+// is no room left to record it.
+static bool clientWriteSingle(int conn_id, int handle, int write_type, int auth_req,
+                              const uint8_t* value, uint16_t len)
+{
+    pthread_mutex_lock(&sClientWriteIssueLock);
+    pthread_mutex_lock(&sClientWriteLock);
+    bool issue = true;
+    client_write_conn_t* conn = clientWriteConn(conn_id, false);
+    if (conn != NULL && conn->handle == handle &&
+            (conn->value != NULL || conn->issued_count > 0))
+        issue = clientWriteIssued(conn, false);
+    pthread_mutex_unlock(&sClientWriteLock);
+
+    if (issue) {
+        sGattIf->client->write_characteristic(conn_id, handle, write_type, len, auth_req,
+                                              (char*) value);
+    }
+    pthread_mutex_unlock(&sClientWriteIssueLock);
+    return issue;
+}
+
+static void clientWriteCongestion(int conn_id, bool congested)
+{
+    pthread_mutex_lock(&sClientWriteLock);
+    client_write_conn_t* conn = clientWriteConn(conn_id, true);
+    if (conn != NULL) {
+        if (congested && !conn->congested && conn->value != NULL) sClientWritePauses++;
+        conn->congested = congested;
+    }
+    pthread_mutex_unlock(&sClientWriteLock);
+
+    if (!congested) clientWritePump(conn_id);
+}
+
+static void clientWriteMtuChanged(int conn_id, int mtu)
+{
+    pthread_mutex_lock(&sClientWriteLock);
+    client_write_conn_t* conn = clientWriteConn(conn_id, true);
+    if (conn != NULL) conn->mtu = mtu;
+    pthread_mutex_unlock(&sClientWriteLock);
+}
+
+// Forgets the connection. A bulk write still in progress fails.
+static void clientWriteDisconnected(int conn_id, client_write_result_t* result)
+{
+    memset(result, 0, sizeof(client_write_result_t));
+
+    pthread_mutex_lock(&sClientWriteLock);
+    client_write_conn_t* conn = clientWriteConn(conn_id, false);
+    if (conn != NULL) {
+        if (conn->value != NULL) {
+            if (conn->status == 0) conn->status = GATT_STATUS_ERROR;
+            clientWriteFinish(conn, result);
+        }
+        memset(conn, 0, sizeof(client_write_conn_t));
+    }
+    pthread_mutex_unlock(&sClientWriteLock);
+}
+
+/**
+ * Client read batches
+ *
+ * gattClientReadCharacteristicBatchNative() takes a list of handles and
+ * reads them one after the other, issuing each read from the callback of the
+ * previous one rather than waiting for Java to ask for it. ATT allows one
+ * outstanding request per bearer and the HAL has no Read Multiple, so this is
+ * as tight as the pipeline gets. The values are packed into one buffer and
+ * handed to GattService with a single onReadBatchCompleted upcall, together
+ * with a status per handle and count + 1 offsets into the buffer.
+ *
+ * A failed read does not end the batch; its status is recorded and the next
+ * handle is read.
+ */
+
+#define CLIENT_READ_MAX_CONN 16
+#define CLIENT_READ_INITIAL_CAPACITY 256
+
+typedef struct {
+    int conn_id;
+    int auth_req;
+    int count;
+    int next;
+    int* handles;
+    int* statuses;
+    int* offsets;
+    uint8_t* values;
+    size_t capacity;
+} client_read_batch_t;
+
+static pthread_mutex_t sClientReadLock = PTHREAD_MUTEX_INITIALIZER;
+static client_read_batch_t sClientReadBatches[CLIENT_READ_MAX_CONN];
+static uint64_t sClientReadBatchCount;
+static uint64_t sClientReadCount;
+static uint64_t sClientReadFailed;
+
+static void clientReadBatchFree(client_read_batch_t* batch)
+{
+    free(batch->handles);
+    free(batch->statuses);
+    free(batch->offsets);
+    free(batch->values);
+    memset(batch, 0, sizeof(client_read_batch_t));
+}
+
+// Must be called with sClientReadLock held.
+static client_read_batch_t* clientReadBatchFind(int conn_id)
+{
+    for (int i = 0; i < CLIENT_READ_MAX_CONN; i++) {
+        if (sClientReadBatches[i].conn_id == conn_id) return &sClientReadBatches[i];
+    }
+    return NULL;
+}
+
+// Must be called with sClientReadLock held. Stores the result of the read in
+// flight; a value that cannot be stored turns into a failed read.
+static void clientReadBatchAppend(client_read_batch_t* batch, int status,
+                                  const uint8_t* value, uint16_t len)
+{
+    int start = batch->offsets[batch->next];
+    if (status == 0 && start + len > (int) batch->capacity) {
+        size_t capacity = batch->capacity * 2;
+        while (start + len > (int) capacity) capacity *= 2;
+        uint8_t* values = (uint8_t*) realloc(batch->values, capacity);
+        if (values == NULL) {
+            status = GATT_STATUS_ERROR;
+        } else {
+            batch->values = values;
+            batch->capacity = capacity;
+        }
+    }
+    if (status != 0) len = 0;
+
+    if (len > 0) memcpy(batch->values + start, value, len);
+    batch->statuses[batch->next] = status;
+    batch->offsets[batch->next + 1] = start + len;
+    batch->next++;
+
+    sClientReadCount++;
+    if (status != 0) sClientReadFailed++;
+}
+
+// Called for every characteristic read. Returns false if the read was not
+// part of a batch. Otherwise sets |next_handle| to the handle to read next, or
+// to 0 and moves the finished batch to |done|.
+static bool clientReadBatchRecord(int conn_id, int handle, int status, const uint8_t* value,
+                                  uint16_t len, int* next_handle, int* auth_req,
+                                  client_read_batch_t* done)
+{
+    memset(done, 0, sizeof(client_read_batch_t));
+    *next_handle = 0;
+
+    pthread_mutex_lock(&sClientReadLock);
+    client_read_batch_t* batch = clientReadBatchFind(conn_id);
+    if (batch == NULL || batch->handles[batch->next] != handle) {
+        pthread_mutex_unlock(&sClientReadLock);
+        return false;
+    }
+
+    clientReadBatchAppend(batch, status, value, len);
+    if (batch->next < batch->count) {
+        *next_handle = batch->handles[batch->next];
+        *auth_req = batch->auth_req;
+    } else {
+        *done = *batch;
+        memset(batch, 0, sizeof(client_read_batch_t));
+    }
+    pthread_mutex_unlock(&sClientReadLock);
+    return true;
+}
+
+// Reads |handle| and, if the stack refuses, records the failure and moves on
+// to the following handles. Returns true if that finished the batch.
+static bool clientReadBatchIssue(int conn_id, int handle, int auth_req,
+                                 client_read_batch_t* done)
+{
+    while (handle != 0) {
+        if (sGattIf &&
+                sGattIf->client->read_characteristic(conn_id, handle, auth_req) == BT_STATUS_SUCCESS)
+            return false;
+        clientReadBatchRecord(conn_id, handle, GATT_STATUS_ERROR, NULL, 0, &handle, &auth_req,
+                              done);
+    }
+    return done->conn_id != 0;
+}
+
+// Fails the reads left in the batch of a closed connection. Returns true if
+// there was one, now moved to |done|.
+static bool clientReadBatchDisconnected(int conn_id, client_read_batch_t* done)
+{
+    memset(done, 0, sizeof(client_read_batch_t));
+
+    pthread_mutex_lock(&sClientReadLock);
+    client_read_batch_t* batch = clientReadBatchFind(conn_id);
+    if (batch != NULL) {
+        while (batch->next < batch->count) {
+            clientReadBatchAppend(batch, GATT_STATUS_ERROR, NULL, 0);
+        }
+        *done = *batch;
+        memset(batch, 0, sizeof(client_read_batch_t));
+    }
+    pthread_mutex_unlock(&sClientReadLock);
+    return done->conn_id != 0;
+}
+
+// Hands a finished batch to GattService and frees it.
+static void clientReadBatchDeliver(JNIEnv* env, client_read_batch_t* batch)
+{
+    jintArray handles = env->NewIntArray(batch->count);
+    jintArray statuses = env->NewIntArray(batch->count);
+    jintArray offsets = env->NewIntArray(batch->count + 1);
+    jbyteArray values = env->NewByteArray(batch->offsets[batch->count]);
+
+    if (handles != NULL && statuses != NULL && offsets != NULL && values != NULL) {
+        env->SetIntArrayRegion(handles, 0, batch->count, batch->handles);
+        env->SetIntArrayRegion(statuses, 0, batch->count, batch->statuses);
+        env->SetIntArrayRegion(offsets, 0, batch->count + 1, batch->offsets);
+        env->SetByteArrayRegion(values, 0, batch->offsets[batch->count],
+                                (jbyte*) batch->values);
+        env->CallVoidMethod(mCallbacksObj, method_onReadBatchCompleted, batch->conn_id,
+                            handles, statuses, offsets, values);
+    } else {
+        error("Unable to deliver read batch of %d handles", batch->count);
+    }
+    clientReadBatchFree(batch);
+}
+
+/**
+ * Advertising payload cache
+ *
+ * AdvertiseManager registers the fields of an advertising data or scan
+ * response set once and gets back a handle; the fields are kept here,
+ * already checked against the 31 byte AD limit, and applying a handle to an
+ * instance needs no array marshalling. Identical registrations share a
+ * handle through a reference count.
+ *
+ * The HAL still takes the fields rather than a raw AD image, so the size
+ * check mirrors how the stack lays them out: flags for advertising data,
+ * 16 and 32 bit UUIDs on the base UUID shortened, and the device name left
+ * out as the stack shortens it to whatever room is left.
+ *
+ * A rotation cycles one multi-advertising instance through a list of
+ * handles at a fixed interval, driven by a native thread so rotating beacon
+ * frames need neither Java timers nor JNI calls. Completions of the data
+ * writes it issues are consumed here and never reach AdvertiseManager,
+ * whose latch only expects its own operations. Writes still in flight when
+ * a rotation goes away leave a tombstone behind so their completions are
+ * consumed too, and a write with no completion after
+ * ADV_ROTATION_WRITE_TIMEOUT_NS is written off so the rotation carries on.
+ */
+
+#define ADV_PAYLOAD_MAX 32
+#define ADV_MAX_DATA_LEN 31
+#define ADV_UUID_MAX_LEN 64
+#define ADV_ROTATION_MAX 16
+#define ADV_ROTATION_MAX_PAYLOADS 8
+#define ADV_ROTATION_MIN_INTERVAL_MS 100
+#define ADV_ROTATION_WRITE_TIMEOUT_NS 2000000000LL
+#define ADV_ROTATION_TOMBSTONE_NS 10000000000LL
+
+typedef struct {
+    int refs;
+    bool set_scan_rsp;
+    bool incl_name;
+    bool incl_txpower;
+    int appearance;
+    uint16_t manu_len;
+    uint8_t manu[ADV_MAX_DATA_LEN];
+    uint16_t serv_data_len;
+    uint8_t serv_data[ADV_MAX_DATA_LEN];
+    uint16_t serv_uuid_len;
+    uint8_t serv_uuid[ADV_UUID_MAX_LEN];
+} adv_payload_t;
+
+typedef struct {
+    int client_if;
+    int count;
+    int next;
+    int handles[ADV_ROTATION_MAX_PAYLOADS];
+    int64_t interval_ns;
+    int64_t due_ns;
+    int pending;
+    int64_t issued_ns;
+} adv_rotation_t;
+
+// Writes of a rotation that is gone whose completions are still expected.
+typedef struct {
+    int client_if;
+    int pending;
+    int64_t expire_ns;
+} adv_rotation_tombstone_t;
+
+static pthread_mutex_t sAdvPayloadLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sAdvRotationCond;
+static pthread_t sAdvRotationThread;
+static bool sAdvRotationThreadRunning;
+static bool sAdvRotationStop;
+static adv_payload_t sAdvPayloads[ADV_PAYLOAD_MAX];
+static adv_rotation_t sAdvRotations[ADV_ROTATION_MAX];
+static adv_rotation_tombstone_t sAdvRotationTombstones[ADV_ROTATION_MAX];
+static uint64_t sAdvRotationWrites;
+static uint64_t sAdvRotationFailed;
+static uint64_t sAdvRotationTimeouts;
+
+// Bytes the stack needs for |payload|, device name excluded.
+static int advPayloadEncodedLen(const adv_payload_t* payload)
+{
+    static const uint8_t base_uuid[12] = {
+        0xFB, 0x34, 0x9B, 0x5F, 0x80, 0x00, 0x00, 0x80, 0x00, 0x10, 0x00, 0x00
+    };
+    int len = payload->set_scan_rsp ? 0 : 3;
+    if (payload->incl_txpower) len += 3;
+    if (payload->appearance != 0) len += 4;
+    if (payload->manu_len > 0) len += 2 + payload->manu_len;
+    if (payload->serv_data_len > 0) len += 2 + payload->serv_data_len;
+
+    int uuid_bytes[3] = { 0, 0, 0 };
+    for (int i = 0; i + 16 <= payload->serv_uuid_len; i += 16) {
+        const uint8_t* uuid = payload->serv_uuid + i;
+        if (memcmp(uuid, base_uuid, sizeof(base_uuid)) != 0) {
+            uuid_bytes[2] += 16;
+        } else if (uuid[14] == 0 && uuid[15] == 0) {
+            uuid_bytes[0] += 2;
+        } else {
+            uuid_bytes[1] += 4;
+        }
+    }
+    for (int i = 0; i < 3; i++) {
+        if (uuid_bytes[i] > 0) len += 2 + uuid_bytes[i];
+    }
+    return len;
+}
+
+static bool advPayloadEquals(const adv_payload_t* a, const adv_payload_t* b)
+{
+    return a->set_scan_rsp == b->set_scan_rsp && a->incl_name == b->incl_name &&
+            a->incl_txpower == b->incl_txpower && a->appearance == b->appearance &&
+            a->manu_len == b->manu_len && memcmp(a->manu, b->manu, a->manu_len) == 0 &&
+            a->serv_data_len == b->serv_data_len &&
+            memcmp(a->serv_data, b->serv_data, a->serv_data_len) == 0 &&
+            a->serv_uuid_len == b->serv_uuid_len &&
+            memcmp(a->serv_uuid, b->serv_uuid, a->serv_uuid_len) == 0;
+}
+
+static bt_status_t advPayloadApply(int client_if, const adv_payload_t* payload)
+{
+    if (!sGattIf) return BT_STATUS_NOT_READY;
+    return sGattIf->client->multi_adv_set_inst_data(client_if, payload->set_scan_rsp,
+            payload->incl_name, payload->incl_txpower, payload->appearance,
+            payload->manu_len, (char*) payload->manu, payload->serv_data_len,
+            (char*) payload->serv_data, payload->serv_uuid_len, (char*) payload->serv_uuid);
+}
+
+// Must be called with sAdvPayloadLock held.
+static adv_rotation_t* advRotationFind(int client_if)
+{
+    for (int i = 0; i < ADV_ROTATION_MAX; i++) {
+        if (sAdvRotations[i].count > 0 && sAdvRotations[i].client_if == client_if)
+            return &sAdvRotations[i];
+    }
+    return NULL;
+}
+
+// Returns the live tombstone of |client_if|, or NULL. Must be called with
+// sAdvPayloadLock held.
+static adv_rotation_tombstone_t* advRotationTombstoneFind(int client_if, int64_t now)
+{
+    for (int i = 0; i < ADV_ROTATION_MAX; i++) {
+        adv_rotation_tombstone_t* tombstone = &sAdvRotationTombstones[i];
+        if (tombstone->pending > 0 && tombstone->expire_ns > now &&
+                tombstone->client_if == client_if)
+            return tombstone;
+    }
+    return NULL;
+}
+
+// Expects |pending| more completions for |client_if| that no rotation will
+// claim. Must be called with sAdvPayloadLock held.
+static void advRotationBury(int client_if, int pending)
+{
+    int64_t now = monotonic_nanos();
+    adv_rotation_tombstone_t* tombstone = advRotationTombstoneFind(client_if, now);
+    if (tombstone == NULL) {
+        // Reuse a dead slot, or else the one closest to expiring.
+        tombstone = &sAdvRotationTombstones[0];
+        for (int i = 0; i < ADV_ROTATION_MAX; i++) {
+            adv_rotation_tombstone_t* t = &sAdvRotationTombstones[i];
+            if (t->pending == 0 || t->expire_ns <= now) {
+                tombstone = t;
+                break;
+            }
+            if (t->expire_ns < tombstone->expire_ns) tombstone = t;
+        }
+        tombstone->client_if = client_if;
+        tombstone->pending = 0;
+    }
+    tombstone->pending += pending;
+    tombstone->expire_ns = now + ADV_ROTATION_TOMBSTONE_NS;
+}
+
+// Must be called with sAdvPayloadLock held.
+static void advRotationRemove(adv_rotation_t* rotation)
+{
+    if (rotation->pending > 0) advRotationBury(rotation->client_if, rotation->pending);
+    for (int i = 0; i < rotation->count; i++) sAdvPayloads[rotation->handles[i]].refs--;
+    memset(rotation, 0, sizeof(adv_rotation_t));
+}
+
+static void* advRotationRun(void* arg)
+{
+    pthread_mutex_lock(&sAdvPayloadLock);
+    while (!sAdvRotationStop) {
+        int64_t now = monotonic_nanos();
+        int64_t wake_ns = LLONG_MAX;
+        adv_rotation_t* due = NULL;
+        for (int i = 0; i < ADV_ROTATION_MAX; i++) {
+            adv_rotation_t* rotation = &sAdvRotations[i];
+            if (rotation->count == 0) continue;
+            if (rotation->due_ns <= now) {
+                due = rotation;
+                break;
+            }
+            if (rotation->due_ns < wake_ns) wake_ns = rotation->due_ns;
+        }
+
+        if (due == NULL) {
+            if (wake_ns == LLONG_MAX) {
+                pthread_cond_wait(&sAdvRotationCond, &sAdvPayloadLock);
+            } else {
+                struct timespec ts;
+                ts.tv_sec = wake_ns / 1000000000LL;
+                ts.tv_nsec = wake_ns % 1000000000LL;
+                pthread_cond_timedwait(&sAdvRotationCond, &sAdvPayloadLock, &ts);
+            }
+            continue;
+        }
 
-static const btgatt_interface_t *sGattIf = NULL;
-static jobject mCallbacksObj = NULL;
-static JNIEnv *sCallbackEnv = NULL;
+        // A write still in flight means the stack is behind; skip a turn,
+        // unless its completion is overdue and presumably lost.
+        due->due_ns = now + due->interval_ns;
+        if (due->pending > 0) {
+            if (now - due->issued_ns < ADV_ROTATION_WRITE_TIMEOUT_NS) continue;
+            warn("Rotation of client %d: no data write completion, moving on", due->client_if);
+            sAdvRotationTimeouts++;
+            advRotationBury(due->client_if, due->pending);
+            due->pending = 0;
+        }
 
-static bool checkCallbackThread() {
-    sCallbackEnv = getCallbackEnv();
+        adv_payload_t payload = sAdvPayloads[due->handles[due->next]];
+        int client_if = due->client_if;
+        due->next = (due->next + 1) % due->count;
+        due->pending++;
+        due->issued_ns = now;
+        pthread_mutex_unlock(&sAdvPayloadLock);
+
+        bt_status_t status = advPayloadApply(client_if, &payload);
+
+        pthread_mutex_lock(&sAdvPayloadLock);
+        sAdvRotationWrites++;
+        if (status != BT_STATUS_SUCCESS) {
+            sAdvRotationFailed++;
+            adv_rotation_t* rotation = advRotationFind(client_if);
+            if (rotation != NULL && rotation->pending > 0) {
+                rotation->pending--;
+            } else {
+                // Stopped meanwhile; the write never went out.
+                adv_rotation_tombstone_t* tombstone =
+                        advRotationTombstoneFind(client_if, monotonic_nanos());
+                if (tombstone != NULL) tombstone->pending--;
+            }
+        }
+    }
+    pthread_mutex_unlock(&sAdvPayloadLock);
+    return NULL;
+}
 
-    JNIEnv* env = AndroidRuntime::getJNIEnv();
-    if (sCallbackEnv != env || sCallbackEnv == NULL) return false;
+// Must be called with sAdvPayloadLock held.
+static bool advRotationStartThread()
+{
+    if (sAdvRotationThreadRunning) return true;
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&sAdvRotationCond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    sAdvRotationStop = false;
+    if (pthread_create(&sAdvRotationThread, NULL, advRotationRun, NULL) != 0) {
+        error("Unable to start the advertising rotation thread");
+        pthread_cond_destroy(&sAdvRotationCond);
+        return false;
+    }
+    sAdvRotationThreadRunning = true;
     return true;
 }
 
+static void advRotationStopThread()
+{
+    pthread_mutex_lock(&sAdvPayloadLock);
+    bool running = sAdvRotationThreadRunning;
+    sAdvRotationStop = true;
+    if (running) pthread_cond_signal(&sAdvRotationCond);
+    pthread_mutex_unlock(&sAdvPayloadLock);
+    if (!running) return;
+
+    pthread_join(sAdvRotationThread, NULL);
+    pthread_mutex_lock(&sAdvPayloadLock);
+    pthread_cond_destroy(&sAdvRotationCond);
+    sAdvRotationThreadRunning = false;
+    pthread_mutex_unlock(&sAdvPayloadLock);
+}
+
+// Called for every advertising data completion. Returns true if the write
+// was issued by a rotation, running or gone.
+static bool advRotationCompleted(int client_if, int status)
+{
+    pthread_mutex_lock(&sAdvPayloadLock);
+    adv_rotation_t* rotation = advRotationFind(client_if);
+    bool consumed = rotation != NULL && rotation->pending > 0;
+    if (consumed) {
+        rotation->pending--;
+    } else {
+        adv_rotation_tombstone_t* tombstone =
+                advRotationTombstoneFind(client_if, monotonic_nanos());
+        if (tombstone != NULL) {
+            tombstone->pending--;
+            consumed = true;
+        }
+    }
+    if (consumed) {
+        if (status != 0) {
+            sAdvRotationFailed++;
+            warn("Rotation of client %d: data write failed, status %d", client_if, status);
+        }
+    }
+    pthread_mutex_unlock(&sAdvPayloadLock);
+    return consumed;
+}
+
 /**
  * BTA client callbacks
  */
 
 void btgattc_register_app_cb(int status, int clientIf, bt_uuid_t *app_uuid)
 {
-    CHECK_CALLBACK_ENV
+    CallbackEnv sCallbackEnv(__func__);
+    if (!sCallbackEnv.valid()) return;
+    CALLBACK_TIMER();
+    CALLBACK_UPCALL();
     sCallbackEnv->CallVoidMethod(mCallbacksObj, method_onClientRegistered, status,
         clientIf, UUID_PARAMS(app_uuid));
-    checkAndClearExceptionFromCallback(sCallbackEnv, __FUNCTION__);
 }
 
 void btgattc_scan_result_cb(bt_bdaddr_t* bda, int rssi, uint8_t* adv_data)
 {
-    CHECK_CALLBACK_ENV
+    CallbackEnv sCallbackEnv(__func__);
+    if (!sCallbackEnv.valid()) return;
+    CALLBACK_TIMER();
 
-    char c_address[32];
-    snprintf(c_address, sizeof(c_address),"%02X:%02X:%02X:%02X:%02X:%02X",
-        bda->address[0], bda->address[1], bda->address[2],
-        bda->address[3], bda->address[4], bda->address[5]);
+    if (sProximityWatchCount > 0) {
+        int len = adv_data_len(adv_data, PROXIMITY_ADV_LEN);
+        proximitySample(sCallbackEnv, bda, rssi, ad_tx_power(adv_data, len), adv_data, len);
+    }
+
+    uint32_t client_mask = scanPrefilterMatch(bda, adv_data);
+    if (client_mask == 0) return;
+    if (!scanDedupeCheck(bda, rssi, adv_data)) return;
 
-    jstring address = sCallbackEnv->NewStringUTF(c_address);
+    if (scanBatchEnabled()) {
+        if (scanBatchAdd(bda, rssi, adv_data, client_mask)) scanBatchFlush(sCallbackEnv);
+        return;
+    }
+
+    jstring address = addrCacheGet(sCallbackEnv, bda);
     jbyteArray jb = sCallbackEnv->NewByteArray(62);
     sCallbackEnv->SetByteArrayRegion(jb, 0, 62, (jbyte *) adv_data);
 
+    CALLBACK_UPCALL();
     sCallbackEnv->CallVoidMethod(mCallbacksObj, method_onScanResult,
-                                 address, rssi, jb);
-
-    sCallbackEnv->DeleteLocalRef(address);
-    sCallbackEnv->DeleteLocalRef(jb);
-    checkAndClearExceptionFromCallback(sCallbackEnv, __FUNCTION__);
+                                 address, rssi, jb, (jint) client_mask);
 }
 
 void btgattc_open_cb(int conn_id, int status, int clientIf, bt_bdaddr_t* bda)
 {
-    CHECK_CALLBACK_ENV
+    CallbackEnv sCallbackEnv(__func__);
+    if (!sCallbackEnv.valid()) return;
+    CALLBACK_TIMER();
 
-    char c_address[32];
-    snprintf(c_address, sizeof(c_address),"%02X:%02X:%02X:%02X:%02X:%02X",
-        bda->address[0], bda->address[1], bda->address[2],
-        bda->address[3], bda->address[4], bda->address[5]);
+    if (status == 0) gattConnAdd(conn_id, bda);
 
-    jstring address = sCallbackEnv->NewStringUTF(c_address);
+    jstring address = addrCacheGet(sCallbackEnv, bda);
+    CALLBACK_UPCALL();
     sCallbackEnv->CallVoidMethod(mCallbacksObj, method_onConnected,
         clientIf, conn_id, status, address);
-    sCallbackEnv->DeleteLocalRef(address);
-    checkAndClearExceptionFromCallback(sCallbackEnv, __FUNCTION__);
 }
 
 void btgattc_close_cb(int conn_id, int status, int clientIf, bt_bdaddr_t* bda)
 {
-    CHECK_CALLBACK_ENV
-    char c_address[32];
-    snprintf(c_address, sizeof(c_address),"%02X:%02X:%02X:%02X:%02X:%02X",
-        bda->address[0], bda->address[1], bda->address[2],
-        bda->address[3], bda->address[4], bda->address[5]);
-
-    jstring address = sCallbackEnv->NewStringUTF(c_address);
+    CallbackEnv sCallbackEnv(__func__);
+    if (!sCallbackEnv.valid()) return;
+    CALLBACK_TIMER();
+    gattConnRemove(conn_id);
+
+    client_write_result_t result;
+    clientWriteDisconnected(conn_id, &result);
+    client_read_batch_t batch;
+    bool batch_done = clientReadBatchDisconnected(conn_id, &batch);
+
+    jstring address = addrCacheGet(sCallbackEnv, bda);
+    CALLBACK_UPCALL();
+    if (batch_done) clientReadBatchDeliver(sCallbackEnv, &batch);
+    if (result.done) {
+        sCallbackEnv->CallVoidMethod(mCallbacksObj, method_onBulkWriteCompleted,
+                                     conn_id, result.status, result.handle, (jint) result.bytes);
+    }
     sCallbackEnv->CallVoidMethod(mCallbacksObj, method_onDisconnected,
         clientIf, conn_id, status, address);
-    sCallbackEnv->DeleteLocalRef(address);
-    checkAndClearExceptionFromCallback(sCallbackEnv, __FUNCTION__);
 }
 
 void btgattc_search_complete_cb(int conn_id, int status)
 {
-    CHECK_CALLBACK_ENV
+    CallbackEnv sCallbackEnv(__func__);
+    if (!sCallbackEnv.valid()) return;
+    CALLBACK_TIMER();
+    CALLBACK_UPCALL();
     sCallbackEnv->CallVoidMethod(mCallbacksObj, method_onSearchCompleted,
                                  conn_id, status);
-    checkAndClearExceptionFromCallback(sCallbackEnv, __FUNCTION__);
 }
 
 void btgattc_register_for_notification_cb(int conn_id, int registered, int status, uint16_t handle)
 {
-    CHECK_CALLBACK_ENV
+    CallbackEnv sCallbackEnv(__func__);
+    if (!sCallbackEnv.valid()) return;
+    CALLBACK_TIMER();
+    CALLBACK_UPCALL();
     sCallbackEnv->CallVoidMethod(mCallbacksObj, method_onRegisterForNotifications,
         conn_id, status, registered, handle);
-    checkAndClearExceptionFromCallback(sCallbackEnv, __FUNCTION__);
 }
 
 void btgattc_notify_cb(int conn_id, btgatt_notify_params_t *p_data)
 {
-    CHECK_CALLBACK_ENV
+    CallbackEnv sCallbackEnv(__func__);
+    if (!sCallbackEnv.valid()) return;
+    CALLBACK_TIMER();
+
+    // The pool is only released from cleanupNative() or from Java on
+    // disconnect, neither of which can race with a notification upcall for
+    // the same connection, so the slot stays valid outside the lock.
+    pthread_mutex_lock(&sNotifyPoolLock);
+    notify_pool_t* pool = notifyPoolFind(conn_id);
+    int slot = -1;
+    if (pool != NULL && p_data->len <= pool->slot_size) {
+        slot = pool->next_slot;
+        pool->next_slot = (slot + 1) % pool->num_slots;
+        memcpy(pool->base + slot * pool->slot_size, p_data->value, p_data->len);
+    }
+    pthread_mutex_unlock(&sNotifyPoolLock);
 
-    char c_address[32];
-    snprintf(c_address, sizeof(c_address), "%02X:%02X:%02X:%02X:%02X:%02X",
-        p_data->bda.address[0], p_data->bda.address[1], p_data->bda.address[2],
-        p_data->bda.address[3], p_data->bda.address[4], p_data->bda.address[5]);
+    if (slot >= 0) {
+        CALLBACK_UPCALL();
+        sCallbackEnv->CallVoidMethod(mCallbacksObj, method_onNotifyPooled, conn_id,
+                                     p_data->handle, p_data->is_notify, slot, p_data->len);
+        return;
+    }
 
-    jstring address = sCallbackEnv->NewStringUTF(c_address);
+    jstring address = addrCacheGet(sCallbackEnv, &p_data->bda);
     jbyteArray jb = sCallbackEnv->NewByteArray(p_data->len);
     sCallbackEnv->SetByteArrayRegion(jb, 0, p_data->len, (jbyte *) p_data->value);
 
+    CALLBACK_UPCALL();
     sCallbackEnv->CallVoidMethod(mCallbacksObj, method_onNotify,
                                  conn_id, address, p_data->handle, p_data->is_notify, jb);
-
-    sCallbackEnv->DeleteLocalRef(address);
-    sCallbackEnv->DeleteLocalRef(jb);
-    checkAndClearExceptionFromCallback(sCallbackEnv, __FUNCTION__);
 }
 
 void btgattc_read_characteristic_cb(int conn_id, int status, btgatt_read_params_t *p_data)
 {
-    CHECK_CALLBACK_ENV
+    CallbackEnv sCallbackEnv(__func__);
+    if (!sCallbackEnv.valid()) return;
+    CALLBACK_TIMER();
+
+    int next_handle;
+    int auth_req;
+    client_read_batch_t batch;
+    if (clientReadBatchRecord(conn_id, p_data->handle, status, p_data->value.value,
+                              p_data->value.len, &next_handle, &auth_req, &batch)) {
+        if (!clientReadBatchIssue(conn_id, next_handle, auth_req, &batch)) return;
+        CALLBACK_UPCALL();
+        clientReadBatchDeliver(sCallbackEnv, &batch);
+        return;
+    }
 
     jbyteArray jb;
     if (status == 0) { // Success
@@ -324,17 +3424,27 @@ void btgattc_read_characteristic_cb(int conn_id, int status, btgatt_read_params_
         sCallbackEnv->SetByteArrayRegion(jb, 0, 1, (jbyte *) &value);
     }
 
+    CALLBACK_UPCALL();
     sCallbackEnv->CallVoidMethod(mCallbacksObj, method_onReadCharacteristic,
         conn_id, status, p_data->handle, jb);
-    sCallbackEnv->DeleteLocalRef(jb);
-    checkAndClearExceptionFromCallback(sCallbackEnv, __FUNCTION__);
 }
 
 void btgattc_write_characteristic_cb(int conn_id, int status, uint16_t handle)
 {
     CallbackEnv sCallbackEnv(__func__);
     if (!sCallbackEnv.valid()) return;
+    CALLBACK_TIMER();
+
+    client_write_result_t result;
+    if (clientWriteAcked(conn_id, handle, status, &result)) {
+        if (!result.done) return;
+        CALLBACK_UPCALL();
+        sCallbackEnv->CallVoidMethod(mCallbacksObj, method_onBulkWriteCompleted,
+                                     conn_id, result.status, result.handle, (jint) result.bytes);
+        return;
+    }
 
+    CALLBACK_UPCALL();
     sCallbackEnv->CallVoidMethod(mCallbacksObj, method_onWriteCharacteristic,
                                  conn_id, status, handle);
 }
@@ -343,14 +3453,18 @@ void btgattc_execute_write_cb(int conn_id, int status)
 {
     CallbackEnv sCallbackEnv(__func__);
     if (!sCallbackEnv.valid()) return;
+    CALLBACK_TIMER();
 
+    CALLBACK_UPCALL();
     sCallbackEnv->CallVoidMethod(mCallbacksObj, method_onExecuteCompleted,
                                  conn_id, status);
 }
 
 void btgattc_read_descriptor_cb(int conn_id, int status, btgatt_read_params_t *p_data)
 {
-    CHECK_CALLBACK_ENV
+    CallbackEnv sCallbackEnv(__func__);
+    if (!sCallbackEnv.valid()) return;
+    CALLBACK_TIMER();
 
     jbyteArray jb;
     if ( p_data->value.len != 0 )
@@ -362,159 +3476,223 @@ void btgattc_read_descriptor_cb(int conn_id, int status, btgatt_read_params_t *p
         jb = sCallbackEnv->NewByteArray(1);
     }
 
+    CALLBACK_UPCALL();
     sCallbackEnv->CallVoidMethod(mCallbacksObj, method_onReadDescriptor,
         conn_id, status, p_data->handle, jb);
-
-    sCallbackEnv->DeleteLocalRef(jb);
-    checkAndClearExceptionFromCallback(sCallbackEnv, __FUNCTION__);
 }
 
 void btgattc_write_descriptor_cb(int conn_id, int status, uint16_t handle)
 {
     CallbackEnv sCallbackEnv(__func__);
     if (!sCallbackEnv.valid()) return;
+    CALLBACK_TIMER();
 
+    CALLBACK_UPCALL();
     sCallbackEnv->CallVoidMethod(mCallbacksObj, method_onWriteDescriptor,
                                  conn_id, status, handle);
 }
 
 void btgattc_remote_rssi_cb(int client_if,bt_bdaddr_t* bda, int rssi, int status)
 {
-    CHECK_CALLBACK_ENV
+    CallbackEnv sCallbackEnv(__func__);
+    if (!sCallbackEnv.valid()) return;
+    CALLBACK_TIMER();
 
-    char c_address[32];
-    snprintf(c_address, sizeof(c_address),"%02X:%02X:%02X:%02X:%02X:%02X",
-        bda->address[0], bda->address[1], bda->address[2],
-        bda->address[3], bda->address[4], bda->address[5]);
-    jstring address = sCallbackEnv->NewStringUTF(c_address);
+    if (status == 0) {
+        proximitySample(sCallbackEnv, bda, rssi, PROXIMITY_TX_POWER_UNKNOWN, NULL, 0);
+    }
+
+    jstring address = addrCacheGet(sCallbackEnv, bda);
+    CALLBACK_UPCALL();
     sCallbackEnv->CallVoidMethod(mCallbacksObj, method_onReadRemoteRssi,
        client_if, address, rssi, status);
-    sCallbackEnv->DeleteLocalRef(address);
-    checkAndClearExceptionFromCallback(sCallbackEnv, __FUNCTION__);
 }
 
 void btgattc_advertise_cb(int status, int client_if)
 {
-    CHECK_CALLBACK_ENV
+    CallbackEnv sCallbackEnv(__func__);
+    if (!sCallbackEnv.valid()) return;
+    CALLBACK_TIMER();
+    CALLBACK_UPCALL();
     sCallbackEnv->CallVoidMethod(mCallbacksObj, method_onAdvertiseCallback, status, client_if);
-    checkAndClearExceptionFromCallback(sCallbackEnv, __FUNCTION__);
 }
 
 void btgattc_configure_mtu_cb(int conn_id, int status, int mtu)
 {
-    CHECK_CALLBACK_ENV
+    CallbackEnv sCallbackEnv(__func__);
+    if (!sCallbackEnv.valid()) return;
+    CALLBACK_TIMER();
+
+    if (status == 0) clientWriteMtuChanged(conn_id, mtu);
+
+    CALLBACK_UPCALL();
     sCallbackEnv->CallVoidMethod(mCallbacksObj, method_onConfigureMTU,
                                  conn_id, status, mtu);
-    checkAndClearExceptionFromCallback(sCallbackEnv, __FUNCTION__);
 }
 
 void btgattc_scan_filter_cfg_cb(int action, int client_if, int status, int filt_type,
                                 int avbl_space)
 {
-    CHECK_CALLBACK_ENV
+    CallbackEnv sCallbackEnv(__func__);
+    if (!sCallbackEnv.valid()) return;
+    CALLBACK_TIMER();
+
+    bool done;
+    int result;
+    if (scanFilterProgramStep(client_if, status, &done, &result)) {
+        if (!done) return;
+        CALLBACK_UPCALL();
+        sCallbackEnv->CallVoidMethod(mCallbacksObj, method_onScanFilterProgrammed,
+                                     client_if, result);
+        return;
+    }
+
+    CALLBACK_UPCALL();
     sCallbackEnv->CallVoidMethod(mCallbacksObj, method_onScanFilterConfig,
                                  action, status, client_if, filt_type, avbl_space);
-    checkAndClearExceptionFromCallback(sCallbackEnv, __FUNCTION__);
 }
 
 void btgattc_scan_filter_param_cb(int action, int client_if, int status, int avbl_space)
 {
-    CHECK_CALLBACK_ENV
+    CallbackEnv sCallbackEnv(__func__);
+    if (!sCallbackEnv.valid()) return;
+    CALLBACK_TIMER();
+
+    bool done;
+    int result;
+    if (scanFilterProgramStep(client_if, status, &done, &result)) {
+        if (!done) return;
+        CALLBACK_UPCALL();
+        sCallbackEnv->CallVoidMethod(mCallbacksObj, method_onScanFilterProgrammed,
+                                     client_if, result);
+        return;
+    }
+
+    CALLBACK_UPCALL();
     sCallbackEnv->CallVoidMethod(mCallbacksObj, method_onScanFilterParamsConfigured,
             action, status, client_if, avbl_space);
-    checkAndClearExceptionFromCallback(sCallbackEnv, __FUNCTION__);
 }
 
 void btgattc_scan_filter_status_cb(int action, int client_if, int status)
 {
-    CHECK_CALLBACK_ENV
+    CallbackEnv sCallbackEnv(__func__);
+    if (!sCallbackEnv.valid()) return;
+    CALLBACK_TIMER();
+    CALLBACK_UPCALL();
     sCallbackEnv->CallVoidMethod(mCallbacksObj, method_onScanFilterEnableDisabled,
             action, status, client_if);
-    checkAndClearExceptionFromCallback(sCallbackEnv, __FUNCTION__);
 }
 
 void btgattc_multiadv_enable_cb(int client_if, int status)
 {
-    CHECK_CALLBACK_ENV
+    CallbackEnv sCallbackEnv(__func__);
+    if (!sCallbackEnv.valid()) return;
+    CALLBACK_TIMER();
+    CALLBACK_UPCALL();
     sCallbackEnv->CallVoidMethod(mCallbacksObj, method_onMultiAdvEnable, status,client_if);
-    checkAndClearExceptionFromCallback(sCallbackEnv, __FUNCTION__);
 }
 
 void btgattc_multiadv_update_cb(int client_if, int status)
 {
-    CHECK_CALLBACK_ENV
+    CallbackEnv sCallbackEnv(__func__);
+    if (!sCallbackEnv.valid()) return;
+    CALLBACK_TIMER();
+    CALLBACK_UPCALL();
     sCallbackEnv->CallVoidMethod(mCallbacksObj, method_onMultiAdvUpdate, status, client_if);
-    checkAndClearExceptionFromCallback(sCallbackEnv, __FUNCTION__);
 }
 
 void btgattc_multiadv_setadv_data_cb(int client_if, int status)
 {
-    CHECK_CALLBACK_ENV
+    CallbackEnv sCallbackEnv(__func__);
+    if (!sCallbackEnv.valid()) return;
+    CALLBACK_TIMER();
+
+    if (advRotationCompleted(client_if, status)) return;
+
+    CALLBACK_UPCALL();
     sCallbackEnv->CallVoidMethod(mCallbacksObj, method_onMultiAdvSetAdvData, status, client_if);
-    checkAndClearExceptionFromCallback(sCallbackEnv, __FUNCTION__);
 }
 
 void btgattc_multiadv_disable_cb(int client_if, int status)
 {
-    CHECK_CALLBACK_ENV
+    CallbackEnv sCallbackEnv(__func__);
+    if (!sCallbackEnv.valid()) return;
+    CALLBACK_TIMER();
+    CALLBACK_UPCALL();
     sCallbackEnv->CallVoidMethod(mCallbacksObj, method_onMultiAdvDisable, status, client_if);
-    checkAndClearExceptionFromCallback(sCallbackEnv, __FUNCTION__);
 }
 
 void btgattc_congestion_cb(int conn_id, bool congested)
 {
-    CHECK_CALLBACK_ENV
+    CallbackEnv sCallbackEnv(__func__);
+    if (!sCallbackEnv.valid()) return;
+    CALLBACK_TIMER();
+
+    clientWriteCongestion(conn_id, congested);
+
+    CALLBACK_UPCALL();
     sCallbackEnv->CallVoidMethod(mCallbacksObj, method_onClientCongestion, conn_id, congested);
-    checkAndClearExceptionFromCallback(sCallbackEnv, __FUNCTION__);
 }
 
 void btgattc_batchscan_cfg_storage_cb(int client_if, int status)
 {
-    CHECK_CALLBACK_ENV
+    CallbackEnv sCallbackEnv(__func__);
+    if (!sCallbackEnv.valid()) return;
+    CALLBACK_TIMER();
+    CALLBACK_UPCALL();
     sCallbackEnv->CallVoidMethod(mCallbacksObj, method_onBatchScanStorageConfigured, status, client_if);
-    checkAndClearExceptionFromCallback(sCallbackEnv, __FUNCTION__);
 }
 
 void btgattc_batchscan_startstop_cb(int startstop_action, int client_if, int status)
 {
-    CHECK_CALLBACK_ENV
+    CallbackEnv sCallbackEnv(__func__);
+    if (!sCallbackEnv.valid()) return;
+    CALLBACK_TIMER();
+    CALLBACK_UPCALL();
     sCallbackEnv->CallVoidMethod(mCallbacksObj, method_onBatchScanStartStopped, startstop_action,
                                  status, client_if);
-    checkAndClearExceptionFromCallback(sCallbackEnv, __FUNCTION__);
 }
 
 void btgattc_batchscan_reports_cb(int client_if, int status, int report_format,
                         int num_records, int data_len, uint8_t *p_rep_data)
 {
-    CHECK_CALLBACK_ENV
-    jbyteArray jb = sCallbackEnv->NewByteArray(data_len);
-    sCallbackEnv->SetByteArrayRegion(jb, 0, data_len, (jbyte *) p_rep_data);
+    CallbackEnv sCallbackEnv(__func__);
+    if (!sCallbackEnv.valid()) return;
+    CALLBACK_TIMER();
+    jobject report = parseBatchScanReport(sCallbackEnv, class_BatchScanReport,
+                                          method_BatchScanReport_init, report_format,
+                                          num_records, p_rep_data, data_len);
 
+    CALLBACK_UPCALL();
     sCallbackEnv->CallVoidMethod(mCallbacksObj, method_onBatchScanReports, status, client_if,
-                                report_format, num_records, jb);
-    sCallbackEnv->DeleteLocalRef(jb);
-    checkAndClearExceptionFromCallback(sCallbackEnv, __FUNCTION__);
+                                report);
 }
 
 void btgattc_batchscan_threshold_cb(int client_if)
 {
-    CHECK_CALLBACK_ENV
+    CallbackEnv sCallbackEnv(__func__);
+    if (!sCallbackEnv.valid()) return;
+    CALLBACK_TIMER();
+    CALLBACK_UPCALL();
     sCallbackEnv->CallVoidMethod(mCallbacksObj, method_onBatchScanThresholdCrossed, client_if);
-    checkAndClearExceptionFromCallback(sCallbackEnv, __FUNCTION__);
 }
 
 void btgattc_track_adv_event_cb(btgatt_track_adv_info_t *p_adv_track_info)
 {
     CallbackEnv sCallbackEnv(__func__);
     if (!sCallbackEnv.valid()) return;
+    CALLBACK_TIMER();
 
+    // Lost events carry no fresh sample; silence is handled by the watch.
+    if (p_adv_track_info->advertiser_state == 0) {
+        proximitySample(sCallbackEnv, &p_adv_track_info->bd_addr, p_adv_track_info->rssi_value,
+                        p_adv_track_info->tx_power, p_adv_track_info->p_adv_pkt_data,
+                        p_adv_track_info->adv_pkt_len);
+    }
 
-    snprintf(c_address, sizeof(c_address),"%02X:%02X:%02X:%02X:%02X:%02X",
-        p_adv_track_info->bd_addr.address[0], p_adv_track_info->bd_addr.address[1],
-        p_adv_track_info->bd_addr.address[2], p_adv_track_info->bd_addr.address[3],
-        p_adv_track_info->bd_addr.address[4], p_adv_track_info->bd_addr.address[5]);
+    if (!presenceUpdate(p_adv_track_info)) return;
 
-    jstring address = sCallbackEnv->NewStringUTF(c_address);
+    jstring address = addrCacheGet(sCallbackEnv, &p_adv_track_info->bd_addr);
 
     jbyteArray jb_adv_pkt = sCallbackEnv->NewByteArray(p_adv_track_info->adv_pkt_len);
     jbyteArray jb_scan_rsp = sCallbackEnv->NewByteArray(p_adv_track_info->scan_rsp_len);
@@ -525,89 +3703,98 @@ void btgattc_track_adv_event_cb(btgatt_track_adv_info_t *p_adv_track_info)
     sCallbackEnv->SetByteArrayRegion(jb_scan_rsp, 0, p_adv_track_info->scan_rsp_len,
                                      (jbyte *) p_adv_track_info->p_scan_rsp_data);
 
-    jobject trackadv_obj = sCallbackEnv->CallObjectMethod(mCallbacksObj, method_CreateonTrackAdvFoundLostObject,
+    CALLBACK_UPCALL();
+    sCallbackEnv->CallVoidMethod(mCallbacksObj, method_onTrackAdvFoundLostEvent,
                     p_adv_track_info->client_if, p_adv_track_info->adv_pkt_len, jb_adv_pkt,
                     p_adv_track_info->scan_rsp_len, jb_scan_rsp, p_adv_track_info->filt_index,
                     p_adv_track_info->advertiser_state, p_adv_track_info->advertiser_info_present,
                     address, p_adv_track_info->addr_type, p_adv_track_info->tx_power,
                     p_adv_track_info->rssi_value, p_adv_track_info->time_stamp);
-
-    if (NULL != trackadv_obj) {
-        sCallbackEnv->CallVoidMethod(mCallbacksObj, method_onTrackAdvFoundLost, trackadv_obj);
-        sCallbackEnv->DeleteLocalRef(trackadv_obj);
-    }
-    sCallbackEnv->DeleteLocalRef(address);
-    sCallbackEnv->DeleteLocalRef(jb_adv_pkt);
-    sCallbackEnv->DeleteLocalRef(jb_scan_rsp);
-
-    checkAndClearExceptionFromCallback(sCallbackEnv, __FUNCTION__);
 }
 
 void btgattc_scan_parameter_setup_completed_cb(int client_if, btgattc_error_t status)
 {
-    CHECK_CALLBACK_ENV
+    CallbackEnv sCallbackEnv(__func__);
+    if (!sCallbackEnv.valid()) return;
+    CALLBACK_TIMER();
+    CALLBACK_UPCALL();
     sCallbackEnv->CallVoidMethod(mCallbacksObj, method_onScanParamSetupCompleted, status, client_if);
-    checkAndClearExceptionFromCallback(sCallbackEnv, __func__);
 }
 
-void btgattc_get_gatt_db_cb(int conn_id, btgatt_db_element_t *db, int count)
+static void sendGattDb(JNIEnv* env, int conn_id, const btgatt_db_element_t *db, int count)
 {
-    CHECK_CALLBACK_ENV
-
-    // Because JNI uses a different class loader in the callback context, we cannot simply get the class.
-    // As a workaround, we have to make sure we obtain an object of the class first, as this will cause
-    // class loader to load it.
-    jobject objectForClass = sCallbackEnv->CallObjectMethod(mCallbacksObj, method_getSampleGattDbElement);
-    jclass gattDbElementClazz = sCallbackEnv->GetObjectClass(objectForClass);
-    sCallbackEnv->DeleteLocalRef(objectForClass);
-
-    jmethodID gattDbElementConstructor = sCallbackEnv->GetMethodID(gattDbElementClazz, "<init>", "()V");
-
-    jclass arrayListclazz = sCallbackEnv->FindClass("java/util/ArrayList");
-    jobject array = sCallbackEnv->NewObject(arrayListclazz, sCallbackEnv->GetMethodID(arrayListclazz, "<init>", "()V"));
-    jmethodID arrayAdd = sCallbackEnv->GetMethodID(arrayListclazz, "add", "(Ljava/lang/Object;)Z");
-    sCallbackEnv->DeleteLocalRef(arrayListclazz);
-
-    jclass uuidClazz = sCallbackEnv->FindClass("java/util/UUID");
-    jmethodID uuidConstructor = sCallbackEnv->GetMethodID(uuidClazz, "<init>", "(JJ)V");
-
-    for (int i = 0; i < count; i++) {
-        const btgatt_db_element_t &curr = db[i];
-
-        jobject element = sCallbackEnv->NewObject(gattDbElementClazz, gattDbElementConstructor);
-
-        jfieldID fid = sCallbackEnv->GetFieldID(gattDbElementClazz, "id", "I");
-        sCallbackEnv->SetIntField(element, fid, curr.id);
-
-        jobject uuid = sCallbackEnv->NewObject(uuidClazz, uuidConstructor, uuid_msb(&curr.uuid), uuid_lsb(&curr.uuid));
-        fid = sCallbackEnv->GetFieldID(gattDbElementClazz, "uuid", "java/util/UUID");
-        sCallbackEnv->SetObjectField(element, fid, uuid);
-        sCallbackEnv->DeleteLocalRef(uuid);
-
-        fid = sCallbackEnv->GetFieldID(gattDbElementClazz, "type", "I");
-        sCallbackEnv->SetIntField(element, fid, curr.type);
+    // The database is passed up as flat primitive arrays, one entry per
+    // element, so no Java object is constructed from native code. |handles|
+    // holds the attribute, start and end handle of each element.
+    jintArray ids = env->NewIntArray(count);
+    jintArray types = env->NewIntArray(count);
+    jintArray handles = env->NewIntArray(count * 3);
+    jintArray properties = env->NewIntArray(count);
+    jlongArray uuid_msbs = env->NewLongArray(count);
+    jlongArray uuid_lsbs = env->NewLongArray(count);
+
+    if (ids && types && handles && properties && uuid_msbs && uuid_lsbs) {
+        jint* c_ids = env->GetIntArrayElements(ids, NULL);
+        jint* c_types = env->GetIntArrayElements(types, NULL);
+        jint* c_handles = env->GetIntArrayElements(handles, NULL);
+        jint* c_properties = env->GetIntArrayElements(properties, NULL);
+        jlong* c_uuid_msb = env->GetLongArrayElements(uuid_msbs, NULL);
+        jlong* c_uuid_lsb = env->GetLongArrayElements(uuid_lsbs, NULL);
+
+        if (c_ids && c_types && c_handles && c_properties && c_uuid_msb && c_uuid_lsb) {
+            for (int i = 0; i < count; i++) {
+                const btgatt_db_element_t &curr = db[i];
+                c_ids[i] = curr.id;
+                c_types[i] = curr.type;
+                c_handles[3 * i] = curr.attribute_handle;
+                c_handles[3 * i + 1] = curr.start_handle;
+                c_handles[3 * i + 2] = curr.end_handle;
+                c_properties[i] = curr.properties;
+                c_uuid_msb[i] = uuid_msb(&curr.uuid);
+                c_uuid_lsb[i] = uuid_lsb(&curr.uuid);
+            }
+        }
 
-        fid = sCallbackEnv->GetFieldID(gattDbElementClazz, "attributeHandle", "I");
-        sCallbackEnv->SetIntField(element, fid, curr.attribute_handle);
+        if (c_ids) env->ReleaseIntArrayElements(ids, c_ids, 0);
+        if (c_types) env->ReleaseIntArrayElements(types, c_types, 0);
+        if (c_handles) env->ReleaseIntArrayElements(handles, c_handles, 0);
+        if (c_properties) env->ReleaseIntArrayElements(properties, c_properties, 0);
+        if (c_uuid_msb) env->ReleaseLongArrayElements(uuid_msbs, c_uuid_msb, 0);
+        if (c_uuid_lsb) env->ReleaseLongArrayElements(uuid_lsbs, c_uuid_lsb, 0);
 
-        fid = sCallbackEnv->GetFieldID(gattDbElementClazz, "startHandle", "I");
-        sCallbackEnv->SetIntField(element, fid, curr.start_handle);
+        CALLBACK_UPCALL();
+        env->CallVoidMethod(mCallbacksObj, method_onGetGattDb, conn_id, ids, types,
+                                     handles, properties, uuid_msbs, uuid_lsbs);
+    } else {
+        error("Unable to allocate arrays for %d GATT db elements", count);
+    }
 
-        fid = sCallbackEnv->GetFieldID(gattDbElementClazz, "endHandle", "I");
-        sCallbackEnv->SetIntField(element, fid, curr.end_handle);
+    if (ids) env->DeleteLocalRef(ids);
+    if (types) env->DeleteLocalRef(types);
+    if (handles) env->DeleteLocalRef(handles);
+    if (properties) env->DeleteLocalRef(properties);
+    if (uuid_msbs) env->DeleteLocalRef(uuid_msbs);
+    if (uuid_lsbs) env->DeleteLocalRef(uuid_lsbs);
+    checkAndClearExceptionFromCallback(env, __FUNCTION__);
+}
 
-        fid = sCallbackEnv->GetFieldID(gattDbElementClazz, "properties", "I");
-        sCallbackEnv->SetIntField(element, fid, curr.properties);
+void btgattc_get_gatt_db_cb(int conn_id, btgatt_db_element_t *db, int count)
+{
+    CallbackEnv sCallbackEnv(__func__);
+    if (!sCallbackEnv.valid()) return;
+    CALLBACK_TIMER();
 
-        sCallbackEnv->CallBooleanMethod(array, arrayAdd, element);
-        sCallbackEnv->DeleteLocalRef(element);
-    }
+    if (gattDbCacheStore(conn_id, db, count)) sendGattDb(sCallbackEnv, conn_id, db, count);
+}
 
-    sCallbackEnv->DeleteLocalRef(gattDbElementClazz);
-    sCallbackEnv->DeleteLocalRef(uuidClazz);
+void btgattc_services_removed_cb(int conn_id, uint16_t start_handle, uint16_t end_handle)
+{
+    gattDbCacheInvalidateConn(conn_id);
+}
 
-    sCallbackEnv->CallVoidMethod(mCallbacksObj, method_onGetGattDb, conn_id, array);
-    sCallbackEnv->DeleteLocalRef(array);
+void btgattc_services_added_cb(int conn_id, btgatt_db_element_t *added, int added_count)
+{
+    gattDbCacheInvalidateConn(conn_id);
 }
 
 static const btgatt_client_callbacks_t sGattClientCallbacks = {
@@ -641,8 +3828,8 @@ static const btgatt_client_callbacks_t sGattClientCallbacks = {
     btgattc_track_adv_event_cb,
     btgattc_scan_parameter_setup_completed_cb,
     btgattc_get_gatt_db_cb,
-    NULL, /* services_removed_cb */
-    NULL  /* services_added_cb */
+    btgattc_services_removed_cb,
+    btgattc_services_added_cb
 };
 
 
@@ -654,107 +3841,140 @@ void btgatts_register_app_cb(int status, int server_if, bt_uuid_t *uuid)
 {
     CallbackEnv sCallbackEnv(__func__);
     if (!sCallbackEnv.valid()) return;
+    CALLBACK_TIMER();
+    CALLBACK_UPCALL();
     sCallbackEnv->CallVoidMethod(mCallbacksObj, method_onServerRegistered,
                                  status, server_if, UUID_PARAMS(uuid));
 }
 
 void btgatts_connection_cb(int conn_id, int server_if, int connected, bt_bdaddr_t *bda)
 {
-    CHECK_CALLBACK_ENV
+    CallbackEnv sCallbackEnv(__func__);
+    if (!sCallbackEnv.valid()) return;
+    CALLBACK_TIMER();
 
-    char c_address[32];
-    sprintf(c_address, "%02X:%02X:%02X:%02X:%02X:%02X",
-            bda->address[0], bda->address[1], bda->address[2],
-            bda->address[3], bda->address[4], bda->address[5]);
+    if (!connected) serverNotifyDisconnected(conn_id);
+    prepWriteConnection(conn_id, server_if, connected);
 
-    jstring address = sCallbackEnv->NewStringUTF(c_address);
+    jstring address = addrCacheGet(sCallbackEnv, bda);
+    CALLBACK_UPCALL();
     sCallbackEnv->CallVoidMethod(mCallbacksObj, method_onClientConnected,
                                  address, connected, conn_id, server_if);
-    sCallbackEnv->DeleteLocalRef(address);
-    checkAndClearExceptionFromCallback(sCallbackEnv, __FUNCTION__);
 }
 
 void btgatts_service_added_cb(int status, int server_if,
                               btgatt_srvc_id_t *srvc_id, int srvc_handle)
 {
-    CHECK_CALLBACK_ENV
+    CallbackEnv sCallbackEnv(__func__);
+    if (!sCallbackEnv.valid()) return;
+    CALLBACK_TIMER();
+    CALLBACK_UPCALL();
     sCallbackEnv->CallVoidMethod(mCallbacksObj, method_onServiceAdded, status,
                                  server_if, SRVC_ID_PARAMS(srvc_id),
                                  srvc_handle);
-    checkAndClearExceptionFromCallback(sCallbackEnv, __FUNCTION__);
 }
 
 void btgatts_included_service_added_cb(int status, int server_if,
                                    int srvc_handle,
                                    int incl_srvc_handle)
 {
-    CHECK_CALLBACK_ENV
+    CallbackEnv sCallbackEnv(__func__);
+    if (!sCallbackEnv.valid()) return;
+    CALLBACK_TIMER();
+    CALLBACK_UPCALL();
     sCallbackEnv->CallVoidMethod(mCallbacksObj, method_onIncludedServiceAdded,
                                  status, server_if, srvc_handle, incl_srvc_handle);
-    checkAndClearExceptionFromCallback(sCallbackEnv, __FUNCTION__);
 }
 
 void btgatts_characteristic_added_cb(int status, int server_if, bt_uuid_t *char_id,
                                      int srvc_handle, int char_handle)
 {
-    CHECK_CALLBACK_ENV
+    CallbackEnv sCallbackEnv(__func__);
+    if (!sCallbackEnv.valid()) return;
+    CALLBACK_TIMER();
+
+    pthread_mutex_lock(&sGattAttrLock);
+    gatt_attr_pending_t* pending = gattAttrPending(server_if, false);
+    if (pending != NULL) {
+        if (status == 0 && pending->value != NULL) {
+            gattAttrSet(server_if, srvc_handle, char_handle, pending->value, pending->len);
+        } else {
+            free(pending->value);
+        }
+        memset(pending, 0, sizeof(gatt_attr_pending_t));
+    }
+    pthread_mutex_unlock(&sGattAttrLock);
+
+    CALLBACK_UPCALL();
     sCallbackEnv->CallVoidMethod(mCallbacksObj, method_onCharacteristicAdded,
                                  status, server_if, UUID_PARAMS(char_id),
                                  srvc_handle, char_handle);
-    checkAndClearExceptionFromCallback(sCallbackEnv, __FUNCTION__);
 }
 
 void btgatts_descriptor_added_cb(int status, int server_if,
                                  bt_uuid_t *descr_id, int srvc_handle,
                                  int descr_handle)
 {
-    CHECK_CALLBACK_ENV
+    CallbackEnv sCallbackEnv(__func__);
+    if (!sCallbackEnv.valid()) return;
+    CALLBACK_TIMER();
+    CALLBACK_UPCALL();
     sCallbackEnv->CallVoidMethod(mCallbacksObj, method_onDescriptorAdded,
                                  status, server_if, UUID_PARAMS(descr_id),
                                  srvc_handle, descr_handle);
-    checkAndClearExceptionFromCallback(sCallbackEnv, __FUNCTION__);
 }
 
 void btgatts_service_started_cb(int status, int server_if, int srvc_handle)
 {
-    CHECK_CALLBACK_ENV
+    CallbackEnv sCallbackEnv(__func__);
+    if (!sCallbackEnv.valid()) return;
+    CALLBACK_TIMER();
+    CALLBACK_UPCALL();
     sCallbackEnv->CallVoidMethod(mCallbacksObj, method_onServiceStarted, status,
                                  server_if, srvc_handle);
-    checkAndClearExceptionFromCallback(sCallbackEnv, __FUNCTION__);
 }
 
 void btgatts_service_stopped_cb(int status, int server_if, int srvc_handle)
 {
-    CHECK_CALLBACK_ENV
+    CallbackEnv sCallbackEnv(__func__);
+    if (!sCallbackEnv.valid()) return;
+    CALLBACK_TIMER();
+    CALLBACK_UPCALL();
     sCallbackEnv->CallVoidMethod(mCallbacksObj, method_onServiceStopped, status,
                                  server_if, srvc_handle);
-    checkAndClearExceptionFromCallback(sCallbackEnv, __FUNCTION__);
 }
 
 void btgatts_service_deleted_cb(int status, int server_if, int srvc_handle)
 {
-    CHECK_CALLBACK_ENV
+    CallbackEnv sCallbackEnv(__func__);
+    if (!sCallbackEnv.valid()) return;
+    CALLBACK_TIMER();
+
+    if (status == 0) {
+        pthread_mutex_lock(&sGattAttrLock);
+        gattAttrClear(server_if, srvc_handle);
+        pthread_mutex_unlock(&sGattAttrLock);
+    }
+
+    CALLBACK_UPCALL();
     sCallbackEnv->CallVoidMethod(mCallbacksObj, method_onServiceDeleted, status,
                                  server_if, srvc_handle);
-    checkAndClearExceptionFromCallback(sCallbackEnv, __FUNCTION__);
 }
 
 void btgatts_request_read_cb(int conn_id, int trans_id, bt_bdaddr_t *bda,
                              int attr_handle, int offset, bool is_long)
 {
-    CHECK_CALLBACK_ENV
+    CallbackEnv sCallbackEnv(__func__);
+    if (!sCallbackEnv.valid()) return;
+    CALLBACK_TIMER();
 
-    char c_address[32];
-    sprintf(c_address, "%02X:%02X:%02X:%02X:%02X:%02X",
-            bda->address[0], bda->address[1], bda->address[2],
-            bda->address[3], bda->address[4], bda->address[5]);
+    if (sGattIf && gattAttrRespond(conn_id, trans_id, attr_handle, offset)) return;
 
-    jstring address = sCallbackEnv->NewStringUTF(c_address);
+    jstring address = addrCacheGet(sCallbackEnv, bda);
+    CALLBACK_UPCALL();
     sCallbackEnv->CallVoidMethod(mCallbacksObj, method_onAttributeRead,
                                  address, conn_id, trans_id, attr_handle,
                                  offset, is_long);
-    sCallbackEnv->DeleteLocalRef(address);
-    checkAndClearExceptionFromCallback(sCallbackEnv, __FUNCTION__);
 }
 
 void btgatts_request_write_cb(int conn_id, int trans_id,
@@ -762,70 +3982,103 @@ void btgatts_request_write_cb(int conn_id, int trans_id,
                               int offset, int length,
                               bool need_rsp, bool is_prep, uint8_t* value)
 {
-    CHECK_CALLBACK_ENV
+    CallbackEnv sCallbackEnv(__func__);
+    if (!sCallbackEnv.valid()) return;
+    CALLBACK_TIMER();
 
-    char c_address[32];
-    sprintf(c_address, "%02X:%02X:%02X:%02X:%02X:%02X",
-            bda->address[0], bda->address[1], bda->address[2],
-            bda->address[3], bda->address[4], bda->address[5]);
+    if (is_prep && prepWriteFragment(conn_id, trans_id, attr_handle, offset, length, value))
+        return;
 
-    jstring address = sCallbackEnv->NewStringUTF(c_address);
+    jstring address = addrCacheGet(sCallbackEnv, bda);
 
     jbyteArray val = sCallbackEnv->NewByteArray(length);
     if (val) sCallbackEnv->SetByteArrayRegion(val, 0, length, (jbyte*)value);
+    CALLBACK_UPCALL();
     sCallbackEnv->CallVoidMethod(mCallbacksObj, method_onAttributeWrite,
                                  address, conn_id, trans_id, attr_handle,
                                  offset, length, need_rsp, is_prep, val);
-    sCallbackEnv->DeleteLocalRef(address);
-    sCallbackEnv->DeleteLocalRef(val);
-    checkAndClearExceptionFromCallback(sCallbackEnv, __FUNCTION__);
 }
 
 void btgatts_request_exec_write_cb(int conn_id, int trans_id,
                                    bt_bdaddr_t *bda, int exec_write)
 {
-    CHECK_CALLBACK_ENV
+    CallbackEnv sCallbackEnv(__func__);
+    if (!sCallbackEnv.valid()) return;
+    CALLBACK_TIMER();
+
+    jstring address = addrCacheGet(sCallbackEnv, bda);
+
+    // Take the assembled values out of the table; their blocks stay allocated
+    // until they have been handed to Java.
+    prep_write_t writes[PREP_WRITE_POOL_BLOCKS];
+    int count = 0;
+    pthread_mutex_lock(&sPrepWriteLock);
+    for (int i = 0; i < PREP_WRITE_POOL_BLOCKS; i++) {
+        if (sPrepWrites[i].conn_id != conn_id) continue;
+        writes[count++] = sPrepWrites[i];
+        memset(&sPrepWrites[i], 0, sizeof(prep_write_t));
+    }
+    pthread_mutex_unlock(&sPrepWriteLock);
+
+    CALLBACK_UPCALL();
+    for (int i = 0; i < count && exec_write; i++) {
+        jbyteArray val = sCallbackEnv->NewByteArray(writes[i].len);
+        if (val == NULL) break;
+        sCallbackEnv->SetByteArrayRegion(val, 0, writes[i].len, (jbyte*) writes[i].block);
+        sCallbackEnv->CallVoidMethod(mCallbacksObj, method_onAttributeWriteAssembled,
+                                     address, conn_id, trans_id, writes[i].handle, val);
+        sCallbackEnv->DeleteLocalRef(val);
+    }
 
-    char c_address[32];
-    sprintf(c_address, "%02X:%02X:%02X:%02X:%02X:%02X",
-            bda->address[0], bda->address[1], bda->address[2],
-            bda->address[3], bda->address[4], bda->address[5]);
+    if (count > 0) {
+        pthread_mutex_lock(&sPrepWriteLock);
+        for (int i = 0; i < count; i++) prepWriteRelease(&writes[i]);
+        if (exec_write) sPrepWriteAssembled += count;
+        pthread_mutex_unlock(&sPrepWriteLock);
+    }
 
-    jstring address = sCallbackEnv->NewStringUTF(c_address);
     sCallbackEnv->CallVoidMethod(mCallbacksObj, method_onExecuteWrite,
                                  address, conn_id, trans_id, exec_write);
-    sCallbackEnv->DeleteLocalRef(address);
-    checkAndClearExceptionFromCallback(sCallbackEnv, __FUNCTION__);
 }
 
 void btgatts_response_confirmation_cb(int status, int handle)
 {
-    CHECK_CALLBACK_ENV
+    CallbackEnv sCallbackEnv(__func__);
+    if (!sCallbackEnv.valid()) return;
+    CALLBACK_TIMER();
+    CALLBACK_UPCALL();
     sCallbackEnv->CallVoidMethod(mCallbacksObj, method_onResponseSendCompleted,
                                  status, handle);
-    checkAndClearExceptionFromCallback(sCallbackEnv, __FUNCTION__);
 }
 
 void btgatts_indication_sent_cb(int conn_id, int status)
 {
-    CHECK_CALLBACK_ENV
+    CallbackEnv sCallbackEnv(__func__);
+    if (!sCallbackEnv.valid()) return;
+    CALLBACK_TIMER();
+    CALLBACK_UPCALL();
     sCallbackEnv->CallVoidMethod(mCallbacksObj, method_onNotificationSent,
                                  conn_id, status);
-    checkAndClearExceptionFromCallback(sCallbackEnv, __FUNCTION__);
 }
 
 void btgatts_congestion_cb(int conn_id, bool congested)
 {
-    CHECK_CALLBACK_ENV
+    CallbackEnv sCallbackEnv(__func__);
+    if (!sCallbackEnv.valid()) return;
+    CALLBACK_TIMER();
+
+    serverNotifyCongestion(conn_id, congested);
+    CALLBACK_UPCALL();
     sCallbackEnv->CallVoidMethod(mCallbacksObj, method_onServerCongestion, conn_id, congested);
-    checkAndClearExceptionFromCallback(sCallbackEnv, __FUNCTION__);
 }
 
 void btgatts_mtu_changed_cb(int conn_id, int mtu)
 {
-    CHECK_CALLBACK_ENV
+    CallbackEnv sCallbackEnv(__func__);
+    if (!sCallbackEnv.valid()) return;
+    CALLBACK_TIMER();
+    CALLBACK_UPCALL();
     sCallbackEnv->CallVoidMethod(mCallbacksObj, method_onServerMtuChanged, conn_id, mtu);
-    checkAndClearExceptionFromCallback(sCallbackEnv, __FUNCTION__);
 }
 
 static const btgatt_server_callbacks_t sGattServerCallbacks = {
@@ -865,7 +4118,8 @@ static void classInitNative(JNIEnv* env, jclass clazz) {
     // Client callbacks
 
     method_onClientRegistered = env->GetMethodID(clazz, "onClientRegistered", "(IIJJ)V");
-    method_onScanResult = env->GetMethodID(clazz, "onScanResult", "(Ljava/lang/String;I[B)V");
+    method_onScanResult = env->GetMethodID(clazz, "onScanResult", "(Ljava/lang/String;I[BI)V");
+    method_onBatchedScanResults = env->GetMethodID(clazz, "onBatchedScanResults", "(I[B[I[I[J[I)V");
     method_onConnected   = env->GetMethodID(clazz, "onConnected", "(IIILjava/lang/String;)V");
     method_onDisconnected = env->GetMethodID(clazz, "onDisconnected", "(IIILjava/lang/String;)V");
     method_onReadCharacteristic = env->GetMethodID(clazz, "onReadCharacteristic", "(III[B)V");
@@ -875,6 +4129,7 @@ static void classInitNative(JNIEnv* env, jclass clazz) {
     method_onReadDescriptor = env->GetMethodID(clazz, "onReadDescriptor", "(III[B)V");
     method_onWriteDescriptor = env->GetMethodID(clazz, "onWriteDescriptor", "(III)V");
     method_onNotify = env->GetMethodID(clazz, "onNotify", "(ILjava/lang/String;IZ[B)V");
+    method_onNotifyPooled = env->GetMethodID(clazz, "onNotifyPooled", "(IIZII)V");
     method_onRegisterForNotifications = env->GetMethodID(clazz, "onRegisterForNotifications", "(IIII)V");
     method_onReadRemoteRssi = env->GetMethodID(clazz, "onReadRemoteRssi", "(ILjava/lang/String;II)V");
     method_onConfigureMTU = env->GetMethodID(clazz, "onConfigureMTU", "(III)V");
@@ -887,16 +4142,48 @@ static void classInitNative(JNIEnv* env, jclass clazz) {
     method_onMultiAdvSetAdvData = env->GetMethodID(clazz, "onAdvertiseDataSet", "(II)V");
     method_onMultiAdvDisable = env->GetMethodID(clazz, "onAdvertiseInstanceDisabled", "(II)V");
     method_onClientCongestion = env->GetMethodID(clazz, "onClientCongestion", "(IZ)V");
+    method_onBulkWriteCompleted = env->GetMethodID(clazz, "onBulkWriteCompleted", "(IIII)V");
+    method_onReadBatchCompleted = env->GetMethodID(clazz, "onReadBatchCompleted", "(I[I[I[I[B)V");
     method_onBatchScanStorageConfigured = env->GetMethodID(clazz, "onBatchScanStorageConfigured", "(II)V");
     method_onBatchScanStartStopped = env->GetMethodID(clazz, "onBatchScanStartStopped", "(III)V");
-    method_onBatchScanReports = env->GetMethodID(clazz, "onBatchScanReports", "(IIII[B)V");
+    method_onBatchScanReports = env->GetMethodID(clazz, "onBatchScanReports",
+            "(IILcom/android/bluetooth/gatt/BatchScanReport;)V");
+
+    jclass reportClazz = env->FindClass("com/android/bluetooth/gatt/BatchScanReport");
+    class_BatchScanReport = (jclass) env->NewGlobalRef(reportClazz);
+    method_BatchScanReport_init = env->GetMethodID(reportClazz, "<init>", "(II[B[I[J[B[I)V");
+    env->DeleteLocalRef(reportClazz);
     method_onBatchScanThresholdCrossed = env->GetMethodID(clazz, "onBatchScanThresholdCrossed", "(I)V");
-    method_CreateonTrackAdvFoundLostObject = env->GetMethodID(clazz, "CreateonTrackAdvFoundLostObject", "(II[BI[BIIILjava/lang/String;IIII)Lcom/android/bluetooth/gatt/AdvtFilterOnFoundOnLostInfo;");
-    method_onTrackAdvFoundLost = env->GetMethodID(clazz, "onTrackAdvFoundLost",
-                                                         "(Lcom/android/bluetooth/gatt/AdvtFilterOnFoundOnLostInfo;)V");
+    method_onScanFilterProgrammed = env->GetMethodID(clazz, "onScanFilterProgrammed", "(II)V");
+    method_onProximityChanged = env->GetMethodID(clazz, "onProximityChanged",
+                                                 "(ILjava/lang/String;ZII[B)V");
+
+    jclass filtParamsClazz = env->FindClass("com/android/bluetooth/gatt/FilterParams");
+    method_FilterParams_getClientIf = env->GetMethodID(filtParamsClazz, "getClientIf", "()I");
+    method_FilterParams_getFiltIndex = env->GetMethodID(filtParamsClazz, "getFiltIndex", "()I");
+    method_FilterParams_getFeatSeln = env->GetMethodID(filtParamsClazz, "getFeatSeln", "()I");
+    method_FilterParams_getListLogicType =
+            env->GetMethodID(filtParamsClazz, "getListLogicType", "()I");
+    method_FilterParams_getFiltLogicType =
+            env->GetMethodID(filtParamsClazz, "getFiltLogicType", "()I");
+    method_FilterParams_getDelyMode = env->GetMethodID(filtParamsClazz, "getDelyMode", "()I");
+    method_FilterParams_getFoundTimeout =
+            env->GetMethodID(filtParamsClazz, "getFoundTimeout", "()I");
+    method_FilterParams_getLostTimeout =
+            env->GetMethodID(filtParamsClazz, "getLostTimeout", "()I");
+    method_FilterParams_getFoundTimeOutCnt =
+            env->GetMethodID(filtParamsClazz, "getFoundTimeOutCnt", "()I");
+    method_FilterParams_getNumOfTrackEntries =
+            env->GetMethodID(filtParamsClazz, "getNumOfTrackEntries", "()I");
+    method_FilterParams_getRSSIHighValue =
+            env->GetMethodID(filtParamsClazz, "getRSSIHighValue", "()I");
+    method_FilterParams_getRSSILowValue =
+            env->GetMethodID(filtParamsClazz, "getRSSILowValue", "()I");
+    env->DeleteLocalRef(filtParamsClazz);
+    method_onTrackAdvFoundLostEvent = env->GetMethodID(clazz, "onTrackAdvFoundLostEvent",
+                                                       "(II[BI[BIIILjava/lang/String;IIII)V");
     method_onScanParamSetupCompleted = env->GetMethodID(clazz, "onScanParamSetupCompleted", "(II)V");
-    method_getSampleGattDbElement = env->GetMethodID(clazz, "GetSampleGattDbElement", "()Lcom/android/bluetooth/gatt/GattDbElement;");
-    method_onGetGattDb = env->GetMethodID(clazz, "onGetGattDb", "(ILjava/util/ArrayList;)V");
+    method_onGetGattDb = env->GetMethodID(clazz, "onGetGattDb", "(I[I[I[I[I[J[J)V");
 
     // Server callbacks
 
@@ -913,6 +4200,8 @@ static void classInitNative(JNIEnv* env, jclass clazz) {
     method_onAttributeRead= env->GetMethodID(clazz, "onAttributeRead", "(Ljava/lang/String;IIIIZ)V");
     method_onAttributeWrite= env->GetMethodID(clazz, "onAttributeWrite", "(Ljava/lang/String;IIIIIZZ[B)V");
     method_onExecuteWrite= env->GetMethodID(clazz, "onExecuteWrite", "(Ljava/lang/String;III)V");
+    method_onAttributeWriteAssembled = env->GetMethodID(clazz, "onAttributeWriteAssembled",
+            "(Ljava/lang/String;III[B)V");
     method_onNotificationSent = env->GetMethodID(clazz, "onNotificationSent", "(II)V");
     method_onServerCongestion = env->GetMethodID(clazz, "onServerCongestion", "(IZ)V");
     method_onServerMtuChanged = env->GetMethodID(clazz, "onMtuChanged", "(II)V");
@@ -963,6 +4252,29 @@ static void initializeNative(JNIEnv *env, jobject object) {
 static void cleanupNative(JNIEnv *env, jobject object) {
     if (!btIf) return;
 
+    // The rotation thread calls into the stack; stop it first.
+    advRotationStopThread();
+    pthread_mutex_lock(&sAdvPayloadLock);
+    memset(sAdvRotations, 0, sizeof(sAdvRotations));
+    memset(sAdvRotationTombstones, 0, sizeof(sAdvRotationTombstones));
+    memset(sAdvPayloads, 0, sizeof(sAdvPayloads));
+    pthread_mutex_unlock(&sAdvPayloadLock);
+
+    pthread_mutex_lock(&sScanBatchLock);
+    sScanBatch.count = 0;
+    sScanBatch.max_results = 0;
+    pthread_mutex_unlock(&sScanBatchLock);
+
+    pthread_mutex_lock(&sScanPrefilterLock);
+    memset(sScanPrefilter, 0, sizeof(sScanPrefilter));
+    sScanPrefilterSlotsInUse = 0;
+    pthread_mutex_unlock(&sScanPrefilterLock);
+
+    pthread_mutex_lock(&sScanDedupeLock);
+    sScanDedupeWindowNs = 0;
+    memset(sScanDedupe, 0, sizeof(sScanDedupe));
+    pthread_mutex_unlock(&sScanDedupeLock);
+
     if (sGattIf != NULL) {
         sGattIf->cleanup();
         sGattIf = NULL;
@@ -972,9 +4284,112 @@ static void cleanupNative(JNIEnv *env, jobject object) {
         env->DeleteGlobalRef(mCallbacksObj);
         mCallbacksObj = NULL;
     }
+
+    addrCacheClear(env);
+
+    gattDbCacheStopThread();
+    pthread_mutex_lock(&sGattDbCacheLock);
+    memset(sGattConnAddrs, 0, sizeof(sGattConnAddrs));
+    pthread_mutex_unlock(&sGattDbCacheLock);
+
+    pthread_mutex_lock(&sNotifyPoolLock);
+    for (int i = 0; i < NOTIFY_POOL_MAX_CONN; i++) {
+        if (sNotifyPools[i].in_use) notifyPoolRelease(env, &sNotifyPools[i]);
+    }
+    pthread_mutex_unlock(&sNotifyPoolLock);
+
+    pthread_mutex_lock(&sServerNotifyLock);
+    for (int i = 0; i < SERVER_NOTIFY_MAX_CONN; i++) serverNotifyReset(&sServerNotifyConns[i]);
+    pthread_mutex_unlock(&sServerNotifyLock);
+
+    pthread_mutex_lock(&sPresenceLock);
+    memset(sPresence, 0, sizeof(sPresence));
+    sPresenceUsed = 0;
+    sPresenceCount = 0;
+    sPresenceVersion++;
+    pthread_mutex_unlock(&sPresenceLock);
+
+    pthread_mutex_lock(&sProximityLock);
+    memset(sProximityWatches, 0, sizeof(sProximityWatches));
+    sProximityWatchCount = 0;
+    pthread_mutex_unlock(&sProximityLock);
+
+    pthread_mutex_lock(&sScanFilterLock);
+    free(sScanFilterProgram.ops);
+    memset(&sScanFilterProgram, 0, sizeof(sScanFilterProgram));
+    memset(sScanFilterSlots, 0, sizeof(sScanFilterSlots));
+    pthread_mutex_unlock(&sScanFilterLock);
+
+    pthread_mutex_lock(&sPrepWriteLock);
+    for (int i = 0; i < PREP_WRITE_POOL_BLOCKS; i++) prepWriteRelease(&sPrepWrites[i]);
+    memset(sPrepWriteServers, 0, sizeof(sPrepWriteServers));
+    memset(sPrepWriteConns, 0, sizeof(sPrepWriteConns));
+    pthread_mutex_unlock(&sPrepWriteLock);
+
+    pthread_mutex_lock(&sClientReadLock);
+    for (int i = 0; i < CLIENT_READ_MAX_CONN; i++) clientReadBatchFree(&sClientReadBatches[i]);
+    pthread_mutex_unlock(&sClientReadLock);
+
+    pthread_mutex_lock(&sClientWriteLock);
+    for (int i = 0; i < CLIENT_WRITE_MAX_CONN; i++) free(sClientWriteConns[i].value);
+    memset(sClientWriteConns, 0, sizeof(sClientWriteConns));
+    pthread_mutex_unlock(&sClientWriteLock);
+
+    pthread_mutex_lock(&sGattAttrLock);
+    gattAttrClear(0, 0);
+    for (int i = 0; i < GATT_ATTR_MAX_SERVERS; i++) free(sGattAttrPending[i].value);
+    memset(sGattAttrPending, 0, sizeof(sGattAttrPending));
+    pthread_mutex_unlock(&sGattAttrLock);
+
     btIf = NULL;
 }
 
+// Returns { entries, hits, misses, evictions } of the remote address cache.
+static jlongArray gattGetAddressCacheStatsNative(JNIEnv *env, jobject object)
+{
+    pthread_mutex_lock(&sAddrCacheLock);
+    jlong stats[] = { sAddrCacheCount, (jlong) sAddrCacheHits, (jlong) sAddrCacheMisses,
+                      (jlong) sAddrCacheEvictions };
+    pthread_mutex_unlock(&sAddrCacheLock);
+
+    jlongArray result = env->NewLongArray(NELEM(stats));
+    if (result) env->SetLongArrayRegion(result, 0, NELEM(stats), stats);
+    return result;
+}
+
+static jlongArray gattGetScanDedupeStatsNative(JNIEnv *env, jobject object)
+{
+    pthread_mutex_lock(&sScanDedupeLock);
+    jlong stats[] = { (jlong) sScanDedupeForwarded, (jlong) sScanDedupeSuppressed };
+    pthread_mutex_unlock(&sScanDedupeLock);
+
+    jlongArray result = env->NewLongArray(NELEM(stats));
+    if (result) env->SetLongArrayRegion(result, 0, NELEM(stats), stats);
+    return result;
+}
+
+/**
+ * Value marshalling
+ *
+ * Attribute values are at most BTGATT_MAX_ATTR_LEN bytes, so they are copied
+ * out of the Java array with a single region copy into a buffer on the stack
+ * instead of pinning or copying the array with GetByteArrayElements().
+ */
+
+#define GATT_RESPONSE_FIELDS 5
+
+// Copies |val| into |buf|, which must hold BTGATT_MAX_ATTR_LEN bytes. Returns
+// the number of bytes copied; longer values are truncated as the stack would.
+static uint16_t gattValueCopy(JNIEnv* env, jbyteArray val, uint8_t* buf)
+{
+    if (val == NULL) return 0;
+
+    jsize len = env->GetArrayLength(val);
+    if (len > BTGATT_MAX_ATTR_LEN) len = BTGATT_MAX_ATTR_LEN;
+    env->GetByteArrayRegion(val, 0, len, (jbyte*) buf);
+    return (uint16_t) len;
+}
+
 /**
  * Native Client functions
  */
@@ -987,20 +4402,174 @@ static int gattClientGetDeviceTypeNative(JNIEnv* env, jobject object, jstring ad
     return sGattIf->client->get_device_type(&bda);
 }
 
-static void gattClientRegisterAppNative(JNIEnv* env, jobject object,
-                                        jlong app_uuid_lsb, jlong app_uuid_msb )
+static void gattClientRegisterAppNative(JNIEnv* env, jobject object,
+                                        jlong app_uuid_lsb, jlong app_uuid_msb )
+{
+    bt_uuid_t uuid;
+
+    if (!sGattIf) return;
+    set_uuid(uuid.uu, app_uuid_msb, app_uuid_lsb);
+    sGattIf->client->register_client(&uuid);
+}
+
+static void gattClientUnregisterAppNative(JNIEnv* env, jobject object, jint clientIf)
+{
+    if (!sGattIf) return;
+    sGattIf->client->unregister_client(clientIf);
+
+    pthread_mutex_lock(&sProximityLock);
+    for (int i = 0; i < PROXIMITY_MAX_WATCHES; i++) {
+        proximity_watch_t* watch = &sProximityWatches[i];
+        if (watch->in_use && watch->client_if == clientIf) proximityRemove(watch);
+    }
+    pthread_mutex_unlock(&sProximityLock);
+
+    // Entries stay allocated so probe runs remain intact; they only leave
+    // the present rows and are reused once the table fills up.
+    pthread_mutex_lock(&sPresenceLock);
+    for (int i = 0; i < PRESENCE_SLOTS; i++) {
+        presence_entry_t* entry = &sPresence[i];
+        if (!entry->in_use || entry->client_if != clientIf) continue;
+        if (entry->row >= 0) {
+            presenceRemoveRow(entry);
+            sPresenceVersion++;
+        }
+        entry->last_seen_ns = 0;
+    }
+    pthread_mutex_unlock(&sPresenceLock);
+}
+
+// Returns the presence version, which changes whenever an advertiser is
+// found or lost.
+static jlong gattClientGetPresenceVersionNative(JNIEnv* env, jobject object)
+{
+    pthread_mutex_lock(&sPresenceLock);
+    jlong version = sPresenceVersion;
+    pthread_mutex_unlock(&sPresenceLock);
+    return version;
+}
+
+// Returns the rows of all present advertisers, PRESENCE_FIELDS longs each.
+static jlongArray gattClientGetPresenceSnapshotNative(JNIEnv* env, jobject object)
+{
+    // Copied out under the lock, so the scan result path never waits for the
+    // Java allocation.
+    jlong* copy = (jlong*) malloc(sizeof(sPresenceRows));
+    if (copy == NULL) return NULL;
+    pthread_mutex_lock(&sPresenceLock);
+    int len = sPresenceCount * PRESENCE_FIELDS;
+    memcpy(copy, &sPresenceRows[0][0], len * sizeof(jlong));
+    pthread_mutex_unlock(&sPresenceLock);
+
+    jlongArray rows = env->NewLongArray(len);
+    if (rows) env->SetLongArrayRegion(rows, 0, len, copy);
+    free(copy);
+    return rows;
+}
+
+// Returns { advertisers known, present, transitions, events absorbed }.
+static jlongArray gattClientGetPresenceStatsNative(JNIEnv *env, jobject object)
+{
+    pthread_mutex_lock(&sPresenceLock);
+    jlong stats[] = { (jlong) sPresenceUsed, (jlong) sPresenceCount,
+                      (jlong) sPresenceTransitions, (jlong) sPresenceAbsorbed };
+    pthread_mutex_unlock(&sPresenceLock);
+
+    jlongArray result = env->NewLongArray(NELEM(stats));
+    if (result) env->SetLongArrayRegion(result, 0, NELEM(stats), stats);
+    return result;
+}
+
+// Starts reporting when |address| enters or leaves |near_cm| / |far_cm| for
+// |client_if|, replacing any earlier watch of the same pair. |ref_rssi| is the
+// RSSI at one meter used when the device does not advertise its TX power and
+// |path_loss_x10| ten times the path loss exponent.
+static jboolean gattClientStartProximityWatchNative(JNIEnv* env, jobject object,
+        jint client_if, jstring address, jint filter, jint near_cm, jint far_cm,
+        jint ref_rssi, jint path_loss_x10)
+{
+    if (filter < PROXIMITY_FILTER_EMA || filter > PROXIMITY_FILTER_KALMAN ||
+            near_cm <= 0 || far_cm < near_cm || path_loss_x10 <= 0)
+        return JNI_FALSE;
+
+    bt_bdaddr_t bda;
+    jstr2bdaddr(env, &bda, address);
+    uint64_t key = bdaddr_to_key(&bda);
+
+    pthread_mutex_lock(&sProximityLock);
+    proximity_watch_t* watch = NULL;
+    for (int i = 0; i < PROXIMITY_MAX_WATCHES; i++) {
+        proximity_watch_t* w = &sProximityWatches[i];
+        if (w->in_use && w->client_if == client_if && w->key == key) {
+            watch = w;
+            break;
+        }
+        if (!w->in_use && watch == NULL) watch = w;
+    }
+    if (watch == NULL) {
+        pthread_mutex_unlock(&sProximityLock);
+        warn("No proximity watch left for client %d", client_if);
+        return JNI_FALSE;
+    }
+    if (!watch->in_use) sProximityWatchCount++;
+    memset(watch, 0, sizeof(proximity_watch_t));
+    watch->in_use = true;
+    watch->client_if = client_if;
+    watch->key = key;
+    watch->bda = bda;
+    watch->filter = filter;
+    watch->near_cm = near_cm;
+    watch->far_cm = far_cm;
+    watch->ref_rssi = ref_rssi;
+    watch->path_loss_x10 = path_loss_x10;
+    watch->tx_power = PROXIMITY_TX_POWER_UNKNOWN;
+    pthread_mutex_unlock(&sProximityLock);
+    return JNI_TRUE;
+}
+
+// Stops the watch of |address|, or all watches of |client_if| if it is null.
+static void gattClientStopProximityWatchNative(JNIEnv* env, jobject object, jint client_if,
+                                               jstring address)
 {
-    bt_uuid_t uuid;
+    uint64_t key = 0;
+    if (address != NULL) {
+        bt_bdaddr_t bda;
+        jstr2bdaddr(env, &bda, address);
+        key = bdaddr_to_key(&bda);
+    }
 
-    if (!sGattIf) return;
-    set_uuid(uuid.uu, app_uuid_msb, app_uuid_lsb);
-    sGattIf->client->register_client(&uuid);
+    pthread_mutex_lock(&sProximityLock);
+    for (int i = 0; i < PROXIMITY_MAX_WATCHES; i++) {
+        proximity_watch_t* watch = &sProximityWatches[i];
+        if (!watch->in_use || watch->client_if != client_if) continue;
+        if (address == NULL || watch->key == key) proximityRemove(watch);
+    }
+    pthread_mutex_unlock(&sProximityLock);
 }
 
-static void gattClientUnregisterAppNative(JNIEnv* env, jobject object, jint clientIf)
+// Reports devices whose watch has had no sample for PROXIMITY_LOST_NS as
+// having left, through onProximityChanged on the calling thread. Returns the
+// number of watches, so the caller knows whether to keep checking.
+static jint gattClientCheckProximityNative(JNIEnv *env, jobject object)
 {
-    if (!sGattIf) return;
-    sGattIf->client->unregister_client(clientIf);
+    proximity_event_t events[PROXIMITY_MAX_WATCHES];
+    int watches = 0;
+    int num_events = proximityCheckLost(events, &watches);
+    if (num_events > 0 && mCallbacksObj != NULL) proximityDeliver(env, events, num_events);
+    return watches;
+}
+
+// Returns { watches, samples, zone changes } of the proximity tracking.
+static jlongArray gattClientGetProximityStatsNative(JNIEnv *env, jobject object)
+{
+    pthread_mutex_lock(&sProximityLock);
+    jlong stats[] = { (jlong) sProximityWatchCount.load(), (jlong) sProximitySamples,
+                      (jlong) sProximityEvents };
+    pthread_mutex_unlock(&sProximityLock);
+
+    jlongArray result = env->NewLongArray(NELEM(stats));
+    if (result) env->SetLongArrayRegion(result, 0, NELEM(stats), stats);
+    return result;
 }
 
 static void gattClientScanNative(JNIEnv* env, jobject object, jboolean start)
@@ -1056,6 +4625,65 @@ static void gattClientGetGattDbNative(JNIEnv* env, jobject object,
     sGattIf->client->get_gatt_db(conn_id);
 }
 
+static void gattClientInitDbCacheNative(JNIEnv* env, jobject object, jstring path)
+{
+    const char* c_path = env->GetStringUTFChars(path, NULL);
+    if (c_path == NULL) return;
+
+    pthread_mutex_lock(&sGattDbCacheLock);
+    for (int i = 0; i < GATT_DB_CACHE_MAX_DEVICES; i++) {
+        if (sGattDbCache[i].in_use) gattDbCacheDrop(&sGattDbCache[i]);
+    }
+    free(sGattDbCachePath);
+    sGattDbCachePath = strdup(c_path);
+    if (sGattDbCachePath != NULL) {
+        gattDbCacheLoad();
+        gattDbCacheStartThread();
+    }
+    pthread_mutex_unlock(&sGattDbCacheLock);
+
+    env->ReleaseStringUTFChars(path, c_path);
+}
+
+// Delivers the cached database of |address| through onGetGattDb() on the
+// calling thread. Returns false if there is no valid cache entry. The caller
+// still starts a discovery; its result is delivered only if it differs.
+static jboolean gattClientGetCachedGattDbNative(JNIEnv* env, jobject object,
+    jint conn_id, jstring address)
+{
+    bt_bdaddr_t bda;
+    jstr2bdaddr(env, &bda, address);
+
+    pthread_mutex_lock(&sGattDbCacheLock);
+    gatt_db_cache_entry_t* entry = gattDbCacheFind(&bda);
+    btgatt_db_element_t* db = NULL;
+    int count = 0;
+    if (entry != NULL) {
+        entry->last_used = elapsed_realtime_nanos();
+        count = entry->count;
+        db = (btgatt_db_element_t*) malloc(count * sizeof(btgatt_db_element_t));
+        if (db != NULL) memcpy(db, entry->db, count * sizeof(btgatt_db_element_t));
+    }
+    gatt_conn_addr_t* conn = gattConnFind(conn_id);
+    if (conn != NULL) {
+        conn->served_from_cache = db != NULL;
+        conn->served_hash = db != NULL ? entry->hash : 0;
+    }
+    pthread_mutex_unlock(&sGattDbCacheLock);
+
+    if (db == NULL) return JNI_FALSE;
+    sendGattDb(env, conn_id, db, count);
+    free(db);
+    return JNI_TRUE;
+}
+
+static void gattClientInvalidateGattDbCacheNative(JNIEnv* env, jobject object, jstring address)
+{
+    bt_bdaddr_t bda;
+    jstr2bdaddr(env, &bda, address);
+    gattDbCacheInvalidate(&bda);
+}
+
 static void gattClientReadCharacteristicNative(JNIEnv* env, jobject object,
     jint conn_id, jint handle, jint authReq)
 {
@@ -1064,6 +4692,71 @@ static void gattClientReadCharacteristicNative(JNIEnv* env, jobject object,
     sGattIf->client->read_characteristic(conn_id, handle, authReq);
 }
 
+// Reads every handle in |handles| back to back; the values come back in one
+// onReadBatchCompleted. Returns false if a batch is already running on the
+// connection or the first read could not be issued.
+static jboolean gattClientReadCharacteristicBatchNative(JNIEnv* env, jobject object,
+    jint conn_id, jintArray handles, jint auth_req)
+{
+    if (!sGattIf || handles == NULL) return JNI_FALSE;
+
+    jsize count = env->GetArrayLength(handles);
+    if (count == 0) return JNI_FALSE;
+
+    client_read_batch_t batch;
+    memset(&batch, 0, sizeof(batch));
+    batch.conn_id = conn_id;
+    batch.auth_req = auth_req;
+    batch.count = count;
+    batch.handles = (int*) malloc(count * sizeof(int));
+    batch.statuses = (int*) malloc(count * sizeof(int));
+    batch.offsets = (int*) calloc(count + 1, sizeof(int));
+    batch.values = (uint8_t*) malloc(CLIENT_READ_INITIAL_CAPACITY);
+    batch.capacity = CLIENT_READ_INITIAL_CAPACITY;
+    if (batch.handles == NULL || batch.statuses == NULL || batch.offsets == NULL ||
+            batch.values == NULL) {
+        clientReadBatchFree(&batch);
+        return JNI_FALSE;
+    }
+    env->GetIntArrayRegion(handles, 0, count, batch.handles);
+
+    pthread_mutex_lock(&sClientReadLock);
+    client_read_batch_t* slot = clientReadBatchFind(conn_id);
+    if (slot == NULL) slot = clientReadBatchFind(0);
+    if (slot == NULL || slot->conn_id != 0) {
+        pthread_mutex_unlock(&sClientReadLock);
+        warn("gattClientReadCharacteristicBatchNative() conn_id %d busy", conn_id);
+        clientReadBatchFree(&batch);
+        return JNI_FALSE;
+    }
+    *slot = batch;
+    sClientReadBatchCount++;
+    pthread_mutex_unlock(&sClientReadLock);
+
+    if (sGattIf->client->read_characteristic(conn_id, batch.handles[0], auth_req)
+            != BT_STATUS_SUCCESS) {
+        pthread_mutex_lock(&sClientReadLock);
+        slot = clientReadBatchFind(conn_id);
+        if (slot != NULL) clientReadBatchFree(slot);
+        pthread_mutex_unlock(&sClientReadLock);
+        return JNI_FALSE;
+    }
+    return JNI_TRUE;
+}
+
+// Returns { batches, reads, failed reads } of the client read batches.
+static jlongArray gattClientGetReadBatchStatsNative(JNIEnv *env, jobject object)
+{
+    pthread_mutex_lock(&sClientReadLock);
+    jlong stats[] = { (jlong) sClientReadBatchCount, (jlong) sClientReadCount,
+                      (jlong) sClientReadFailed };
+    pthread_mutex_unlock(&sClientReadLock);
+
+    jlongArray result = env->NewLongArray(NELEM(stats));
+    if (result) env->SetLongArrayRegion(result, 0, NELEM(stats), stats);
+    return result;
+}
+
 static void gattClientReadDescriptorNative(JNIEnv* env, jobject object,
     jint conn_id, jint  handle, jint authReq)
 {
@@ -1082,12 +4775,72 @@ static void gattClientWriteCharacteristicNative(JNIEnv* env, jobject object,
         return;
     }
 
-    uint16_t len = (uint16_t) env->GetArrayLength(value);
-    jbyte *p_value = env->GetByteArrayElements(value, NULL);
-    if (p_value == NULL) return;
+    uint8_t p_value[BTGATT_MAX_ATTR_LEN];
+    uint16_t len = gattValueCopy(env, value, p_value);
+
+    if (!clientWriteSingle(conn_id, handle, write_type, auth_req, p_value, len)) {
+        // Completes the write right away, as the stack would if it were busy.
+        env->CallVoidMethod(object, method_onWriteCharacteristic, conn_id, GATT_STATUS_BUSY,
+                            handle);
+        checkAndClearExceptionFromCallback(env, __FUNCTION__);
+    }
+}
+
+static jboolean gattClientWriteCharacteristicBulkNative(JNIEnv* env, jobject object,
+    jint conn_id, jint handle, jint auth_req, jbyteArray value)
+{
+    if (!sGattIf) return JNI_FALSE;
+
+    if (value == NULL) {
+        warn("gattClientWriteCharacteristicBulkNative() ignoring NULL array");
+        return JNI_FALSE;
+    }
+
+    jsize len = env->GetArrayLength(value);
+    if (len == 0) return JNI_FALSE;
+
+    uint8_t* copy = (uint8_t*) malloc(len);
+    if (copy == NULL) return JNI_FALSE;
+    env->GetByteArrayRegion(value, 0, len, (jbyte*) copy);
 
-    sGattIf->client->write_characteristic(conn_id, handle, write_type, len, auth_req, (char*)p_value);
-    env->ReleaseByteArrayElements(value, p_value, 0);
+    pthread_mutex_lock(&sClientWriteLock);
+    client_write_conn_t* conn = clientWriteConn(conn_id, true);
+    if (conn == NULL || conn->value != NULL || conn->issued_count > 0) {
+        pthread_mutex_unlock(&sClientWriteLock);
+        warn("gattClientWriteCharacteristicBulkNative() conn_id %d busy", conn_id);
+        free(copy);
+        return JNI_FALSE;
+    }
+    conn->handle = handle;
+    conn->auth_req = auth_req;
+    conn->status = 0;
+    conn->in_flight = 0;
+    conn->value = copy;
+    conn->len = len;
+    conn->seg_len = conn->mtu - 3;
+    if (conn->seg_len > BTGATT_MAX_ATTR_LEN) conn->seg_len = BTGATT_MAX_ATTR_LEN;
+    conn->offset = 0;
+    conn->acked = 0;
+    conn->start_ns = monotonic_nanos();
+    pthread_mutex_unlock(&sClientWriteLock);
+
+    clientWritePump(conn_id);
+    return JNI_TRUE;
+}
+
+// Returns { completed, failed, segments, bytes, congestion pauses, busy time
+// in ns } of the client write pipeline.
+static jlongArray gattClientGetWritePipelineStatsNative(JNIEnv *env, jobject object)
+{
+    pthread_mutex_lock(&sClientWriteLock);
+    jlong stats[] = { (jlong) sClientWriteCompleted, (jlong) sClientWriteFailed,
+                      (jlong) sClientWriteSegments, (jlong) sClientWriteBytes,
+                      (jlong) sClientWritePauses, (jlong) sClientWriteBusyNs };
+    pthread_mutex_unlock(&sClientWriteLock);
+
+    jlongArray result = env->NewLongArray(NELEM(stats));
+    if (result) env->SetLongArrayRegion(result, 0, NELEM(stats), stats);
+    return result;
 }
 
 static void gattClientExecuteWriteNative(JNIEnv* env, jobject object,
@@ -1107,12 +4860,10 @@ static void gattClientWriteDescriptorNative(JNIEnv* env, jobject object,
         return;
     }
 
-    uint16_t len = (uint16_t) env->GetArrayLength(value);
-    jbyte *p_value = env->GetByteArrayElements(value, NULL);
-    if (p_value == NULL) return;
+    uint8_t p_value[BTGATT_MAX_ATTR_LEN];
+    uint16_t len = gattValueCopy(env, value, p_value);
 
     sGattIf->client->write_descriptor(conn_id, handle, write_type, len, auth_req, (char*)p_value);
-    env->ReleaseByteArrayElements(value, p_value, 0);
 }
 
 static void gattClientRegisterForNotificationsNative(JNIEnv* env, jobject object,
@@ -1130,6 +4881,47 @@ static void gattClientRegisterForNotificationsNative(JNIEnv* env, jobject object
         sGattIf->client->deregister_for_notification(clientIf, &bd_addr, handle);
 }
 
+static jboolean gattClientRegisterNotifyBufferNative(JNIEnv* env, jobject object,
+    jint conn_id, jobject buffer, jint slot_size)
+{
+    uint8_t* base = (uint8_t*) env->GetDirectBufferAddress(buffer);
+    jlong capacity = env->GetDirectBufferCapacity(buffer);
+    if (base == NULL || slot_size <= 0 || capacity < slot_size) {
+        error("Invalid notification buffer for conn_id %d", conn_id);
+        return JNI_FALSE;
+    }
+
+    pthread_mutex_lock(&sNotifyPoolLock);
+    notify_pool_t* pool = notifyPoolFind(conn_id);
+    if (pool != NULL) notifyPoolRelease(env, pool);
+    for (int i = 0; pool == NULL && i < NOTIFY_POOL_MAX_CONN; i++) {
+        if (!sNotifyPools[i].in_use) pool = &sNotifyPools[i];
+    }
+    if (pool == NULL) {
+        pthread_mutex_unlock(&sNotifyPoolLock);
+        warn("No free notification pool for conn_id %d", conn_id);
+        return JNI_FALSE;
+    }
+
+    pool->in_use = true;
+    pool->conn_id = conn_id;
+    pool->buffer = env->NewGlobalRef(buffer);
+    pool->base = base;
+    pool->slot_size = slot_size;
+    pool->num_slots = (int) (capacity / slot_size);
+    pool->next_slot = 0;
+    pthread_mutex_unlock(&sNotifyPoolLock);
+    return JNI_TRUE;
+}
+
+static void gattClientUnregisterNotifyBufferNative(JNIEnv* env, jobject object, jint conn_id)
+{
+    pthread_mutex_lock(&sNotifyPoolLock);
+    notify_pool_t* pool = notifyPoolFind(conn_id);
+    if (pool != NULL) notifyPoolRelease(env, pool);
+    pthread_mutex_unlock(&sNotifyPoolLock);
+}
+
 static void gattClientReadRemoteRssiNative(JNIEnv* env, jobject object, jint clientif,
                                  jstring address)
 {
@@ -1173,6 +4965,72 @@ static void gattSetAdvDataNative(JNIEnv *env, jobject object, jint client_if,
     env->ReleaseByteArrayElements(serviceUuid, service_uuid, JNI_ABORT);
 }
 
+static void gattClientSetScanBatchingNative(JNIEnv* env, jobject object,
+                                            jint max_results, jint timeout_ms)
+{
+    if (max_results > SCAN_BATCH_MAX_RESULTS) max_results = SCAN_BATCH_MAX_RESULTS;
+    if (timeout_ms < 0) timeout_ms = 0;
+
+    // Drain whatever was queued under the previous configuration first.
+    scanBatchFlush(env);
+
+    pthread_mutex_lock(&sScanBatchLock);
+    sScanBatch.max_results = max_results;
+    sScanBatch.timeout_ns = (int64_t) timeout_ms * 1000000LL;
+    pthread_mutex_unlock(&sScanBatchLock);
+}
+
+static void gattClientFlushScanBatchNative(JNIEnv* env, jobject object)
+{
+    scanBatchFlush(env);
+}
+
+static void gattClientSetScanDedupeNative(JNIEnv* env, jobject object, jint window_ms,
+                                          jint rssi_delta)
+{
+    if (window_ms < 0 || rssi_delta < 0) {
+        warn("%s: invalid window %d ms or RSSI delta %d", __FUNCTION__, window_ms, rssi_delta);
+        return;
+    }
+
+    pthread_mutex_lock(&sScanDedupeLock);
+    sScanDedupeWindowNs = (int64_t) window_ms * 1000000LL;
+    sScanDedupeRssiDelta = rssi_delta;
+    memset(sScanDedupe, 0, sizeof(sScanDedupe));
+    pthread_mutex_unlock(&sScanDedupeLock);
+}
+
+static void gattClientSetScanPrefilterNative(JNIEnv* env, jobject object, jint slot,
+                                             jbyteArray program)
+{
+    if (slot < 0 || slot >= SCAN_PREFILTER_SLOTS) return;
+
+    jsize len = program ? env->GetArrayLength(program) : 0;
+    if (len > SCAN_PREFILTER_MAX_PROGRAM) {
+        warn("%s: program for slot %d too long (%d), matching all", __FUNCTION__, slot, len);
+        len = 0;
+    }
+
+    pthread_mutex_lock(&sScanPrefilterLock);
+    scan_prefilter_slot_t& entry = sScanPrefilter[slot];
+    if (len > 0) env->GetByteArrayRegion(program, 0, len, (jbyte *) entry.program);
+    entry.len = len;
+    entry.in_use = true;
+    sScanPrefilterSlotsInUse |= 1u << slot;
+    pthread_mutex_unlock(&sScanPrefilterLock);
+}
+
+static void gattClientClearScanPrefilterNative(JNIEnv* env, jobject object, jint slot)
+{
+    if (slot < 0 || slot >= SCAN_PREFILTER_SLOTS) return;
+
+    pthread_mutex_lock(&sScanPrefilterLock);
+    sScanPrefilter[slot].in_use = false;
+    sScanPrefilter[slot].len = 0;
+    sScanPrefilterSlotsInUse &= ~(1u << slot);
+    pthread_mutex_unlock(&sScanPrefilterLock);
+}
+
 static void gattSetScanParametersNative(JNIEnv* env, jobject object,
                                         jint client_if, jint scan_interval_unit,
                                         jint scan_window_unit)
@@ -1187,48 +5045,24 @@ static void gattClientScanFilterParamAddNative(JNIEnv* env, jobject object, jobj
     const int add_scan_filter_params_action = 0;
     btgatt_filt_param_setup_t filt_params;
 
-    jmethodID methodId = 0;
-    jclass filtparam = env->GetObjectClass(params);
-
-    methodId = env->GetMethodID(filtparam, "getClientIf", "()I");
-    filt_params.client_if = env->CallIntMethod(params, methodId);;
-
+    filt_params.client_if = env->CallIntMethod(params, method_FilterParams_getClientIf);
     filt_params.action = add_scan_filter_params_action;
+    filt_params.filt_index = env->CallIntMethod(params, method_FilterParams_getFiltIndex);
+    filt_params.feat_seln = env->CallIntMethod(params, method_FilterParams_getFeatSeln);
+    filt_params.list_logic_type =
+            env->CallIntMethod(params, method_FilterParams_getListLogicType);
+    filt_params.filt_logic_type =
+            env->CallIntMethod(params, method_FilterParams_getFiltLogicType);
+    filt_params.dely_mode = env->CallIntMethod(params, method_FilterParams_getDelyMode);
+    filt_params.found_timeout = env->CallIntMethod(params, method_FilterParams_getFoundTimeout);
+    filt_params.lost_timeout = env->CallIntMethod(params, method_FilterParams_getLostTimeout);
+    filt_params.found_timeout_cnt =
+            env->CallIntMethod(params, method_FilterParams_getFoundTimeOutCnt);
+    filt_params.num_of_tracking_entries =
+            env->CallIntMethod(params, method_FilterParams_getNumOfTrackEntries);
+    filt_params.rssi_high_thres = env->CallIntMethod(params, method_FilterParams_getRSSIHighValue);
+    filt_params.rssi_low_thres = env->CallIntMethod(params, method_FilterParams_getRSSILowValue);
 
-    methodId = env->GetMethodID(filtparam, "getFiltIndex", "()I");
-    filt_params.filt_index = env->CallIntMethod(params, methodId);;
-
-    methodId = env->GetMethodID(filtparam, "getFeatSeln", "()I");
-    filt_params.feat_seln = env->CallIntMethod(params, methodId);;
-
-    methodId = env->GetMethodID(filtparam, "getListLogicType", "()I");
-    filt_params.list_logic_type = env->CallIntMethod(params, methodId);
-
-    methodId = env->GetMethodID(filtparam, "getFiltLogicType", "()I");
-    filt_params.filt_logic_type = env->CallIntMethod(params, methodId);
-
-    methodId = env->GetMethodID(filtparam, "getDelyMode", "()I");
-    filt_params.dely_mode = env->CallIntMethod(params, methodId);
-
-    methodId = env->GetMethodID(filtparam, "getFoundTimeout", "()I");
-    filt_params.found_timeout = env->CallIntMethod(params, methodId);
-
-    methodId = env->GetMethodID(filtparam, "getLostTimeout", "()I");
-    filt_params.lost_timeout = env->CallIntMethod(params, methodId);
-
-    methodId = env->GetMethodID(filtparam, "getFoundTimeOutCnt", "()I");
-    filt_params.found_timeout_cnt = env->CallIntMethod(params, methodId);
-
-    methodId = env->GetMethodID(filtparam, "getNumOfTrackEntries", "()I");
-    filt_params.num_of_tracking_entries = env->CallIntMethod(params, methodId);
-
-    methodId = env->GetMethodID(filtparam, "getRSSIHighValue", "()I");
-    filt_params.rssi_high_thres = env->CallIntMethod(params, methodId);
-
-    methodId = env->GetMethodID(filtparam, "getRSSILowValue", "()I");
-    filt_params.rssi_low_thres = env->CallIntMethod(params, methodId);
-
-    env->DeleteLocalRef(filtparam);
     sGattIf->client->scan_filter_param_setup(filt_params);
 }
 
@@ -1341,6 +5175,7 @@ static void gattClientScanFilterAddNative(JNIEnv* env, jobject object, jint clie
 {
     if (!sGattIf) return;
     int action = 0;
+    scanFilterForget(filt_index);
     gattClientScanFilterAddRemoveNative(env, object, client_if, action, filt_type, filt_index,
                     company_id, company_id_mask, uuid_lsb, uuid_msb, uuid_mask_lsb, uuid_mask_msb,
                     name, address, addr_type, data, mask);
@@ -1354,6 +5189,7 @@ static void gattClientScanFilterDeleteNative(JNIEnv* env, jobject object, jint c
 {
     if (!sGattIf) return;
     int action = 1;
+    scanFilterForget(filt_index);
     gattClientScanFilterAddRemoveNative(env, object, client_if, action, filt_type, filt_index,
                     company_id, company_id_mask, uuid_lsb, uuid_msb, uuid_mask_lsb, uuid_mask_msb,
                     name, address, addr_type, data, mask);
@@ -1363,9 +5199,208 @@ static void gattClientScanFilterClearNative(JNIEnv* env, jobject object, jint cl
                         jint filt_index)
 {
     if (!sGattIf) return;
+    scanFilterForget(filt_index);
     sGattIf->client->scan_filter_clear(client_if, filt_index);
 }
 
+// Must be called with sScanFilterLock held. Places each of the |num_filters|
+// filters, with |counts[f]| entries starting at |wanted[f *
+// SCAN_FILTER_MAX_ENTRIES]| and the parameters at |params[f *
+// SCAN_FILTER_PARAM_FIELDS]|, on one of the |num_free| free indices and writes
+// the operations needed into |ops|. Returns the number of operations.
+static int scanFilterPlan(int client_if, int* free_indices, int num_free,
+                          const scan_filter_entry_t* wanted, const int* counts,
+                          const jint* params, int num_filters, jint* chosen,
+                          scan_filter_op_t* ops)
+{
+    int num_ops = 0;
+    for (int f = 0; f < num_filters; f++) {
+        const scan_filter_entry_t* entries = &wanted[f * SCAN_FILTER_MAX_ENTRIES];
+        int count = counts[f];
+
+        // Take the free index that needs the fewest entry operations.
+        int best = -1;
+        int best_cost = INT_MAX;
+        for (int i = 0; i < num_free; i++) {
+            if (free_indices[i] < 0) continue;
+            int cost = scanFilterCost(free_indices[i], entries, count);
+            if (cost < best_cost) {
+                best = i;
+                best_cost = cost;
+            }
+        }
+        int filt_index = free_indices[best];
+        free_indices[best] = -1;
+        chosen[f] = filt_index;
+        sScanFilterOpsSaved += count - (best_cost < count ? best_cost : count);
+
+        scan_filter_slot_t* slot = filt_index < SCAN_FILTER_MAX_INDEX ?
+                &sScanFilterSlots[filt_index] : NULL;
+        bool known = slot != NULL && slot->known;
+        if (known) {
+            for (int i = 0; i < slot->count; i++) {
+                if (scanFilterContains(entries, count, &slot->entries[i])) continue;
+                scan_filter_op_t& op = ops[num_ops++];
+                op.kind = SCAN_FILTER_OP_DELETE;
+                op.filt_index = filt_index;
+                op.entry = slot->entries[i];
+            }
+        }
+        for (int i = 0; i < count; i++) {
+            if (known && scanFilterContains(slot->entries, slot->count, &entries[i])) continue;
+            scan_filter_op_t& op = ops[num_ops++];
+            op.kind = SCAN_FILTER_OP_ADD;
+            op.filt_index = filt_index;
+            op.entry = entries[i];
+        }
+
+        const jint* p = &params[f * SCAN_FILTER_PARAM_FIELDS];
+        scan_filter_op_t& op = ops[num_ops++];
+        memset(&op.params, 0, sizeof(op.params));
+        op.kind = SCAN_FILTER_OP_PARAMS;
+        op.filt_index = filt_index;
+        op.params.client_if = client_if;
+        op.params.action = 0;
+        op.params.filt_index = filt_index;
+        op.params.feat_seln = p[0];
+        op.params.list_logic_type = p[1];
+        op.params.filt_logic_type = p[2];
+        op.params.rssi_high_thres = p[3];
+        op.params.rssi_low_thres = p[4];
+        op.params.dely_mode = p[5];
+        op.params.found_timeout = p[6];
+        op.params.lost_timeout = p[7];
+        op.params.found_timeout_cnt = p[8];
+        op.params.num_of_tracking_entries = p[9];
+
+        if (slot != NULL) {
+            slot->known = true;
+            slot->count = count;
+            memcpy(slot->entries, entries, count * sizeof(scan_filter_entry_t));
+        }
+    }
+    return num_ops;
+}
+
+// Installs the complete set of hardware filters of |client_if|. Filter f is
+// made of the entries whose |entry_filters| value is f, each encoded in
+// |entry_data| between two consecutive |entry_offsets|, and of
+// SCAN_FILTER_PARAM_FIELDS ints of |params|: feature selection, list logic,
+// filter logic, RSSI high and low, delivery mode, found timeout, lost timeout,
+// found count and tracking entries. Every filter is placed at one of
+// |free_indices|, reported back in |chosen|.
+//
+// Returns the number of controller operations started, which end with one
+// onScanFilterProgrammed, or -1 if nothing was started.
+static jint gattClientScanFilterProgramNative(JNIEnv* env, jobject object, jint client_if,
+        jintArray free_indices, jintArray entry_filters, jintArray entry_types,
+        jintArray entry_offsets, jbyteArray entry_data, jintArray params, jintArray chosen)
+{
+    if (!sGattIf) return -1;
+
+    jsize num_free = env->GetArrayLength(free_indices);
+    jsize num_entries = env->GetArrayLength(entry_types);
+    jsize num_filters = env->GetArrayLength(params) / SCAN_FILTER_PARAM_FIELDS;
+    jsize data_len = env->GetArrayLength(entry_data);
+    if (num_filters == 0 || num_filters > num_free ||
+            env->GetArrayLength(entry_filters) != num_entries ||
+            env->GetArrayLength(entry_offsets) != num_entries + 1 ||
+            env->GetArrayLength(chosen) != num_filters)
+        return -1;
+
+    jint* c_free = (jint*) malloc(num_free * sizeof(jint));
+    jint* c_offsets = (jint*) malloc((num_entries + 1) * sizeof(jint));
+    jint* c_params = (jint*) malloc(num_filters * SCAN_FILTER_PARAM_FIELDS * sizeof(jint));
+    jint* c_chosen = (jint*) malloc(num_filters * sizeof(jint));
+    uint8_t* c_data = (uint8_t*) malloc(data_len + 1);
+    int* counts = (int*) calloc(num_filters, sizeof(int));
+    scan_filter_entry_t* wanted = (scan_filter_entry_t*)
+            malloc(num_filters * SCAN_FILTER_MAX_ENTRIES * sizeof(scan_filter_entry_t));
+    scan_filter_op_t* ops = (scan_filter_op_t*)
+            malloc(num_filters * (2 * SCAN_FILTER_MAX_ENTRIES + 1) * sizeof(scan_filter_op_t));
+
+    bool valid = c_free != NULL && c_offsets != NULL && c_params != NULL &&
+            c_chosen != NULL && c_data != NULL && counts != NULL && wanted != NULL &&
+            ops != NULL;
+    if (valid) {
+        env->GetIntArrayRegion(free_indices, 0, num_free, c_free);
+        env->GetIntArrayRegion(entry_offsets, 0, num_entries + 1, c_offsets);
+        env->GetIntArrayRegion(params, 0, num_filters * SCAN_FILTER_PARAM_FIELDS, c_params);
+        env->GetByteArrayRegion(entry_data, 0, data_len, (jbyte*) c_data);
+    }
+
+    for (jsize i = 0; valid && i < num_entries; i++) {
+        jint f, type;
+        env->GetIntArrayRegion(entry_filters, i, 1, &f);
+        env->GetIntArrayRegion(entry_types, i, 1, &type);
+        int start = c_offsets[i];
+        int len = c_offsets[i + 1] - start;
+        if (f < 0 || f >= num_filters || counts[f] == SCAN_FILTER_MAX_ENTRIES ||
+                start < 0 || len < 0 || len > SCAN_FILTER_ENTRY_MAX_LEN ||
+                start + len > data_len) {
+            valid = false;
+            break;
+        }
+        scan_filter_entry_t& entry = wanted[f * SCAN_FILTER_MAX_ENTRIES + counts[f]++];
+        entry.type = type;
+        entry.len = len;
+        memcpy(entry.data, c_data + start, len);
+    }
+
+    jint result = -1;
+    if (valid) {
+        pthread_mutex_lock(&sScanFilterLock);
+        if (sScanFilterProgram.ops != NULL) {
+            warn("Scan filter program of client %d still running",
+                 sScanFilterProgram.client_if);
+        } else {
+            int num_ops = scanFilterPlan(client_if, c_free, num_free, wanted, counts,
+                                         c_params, num_filters, c_chosen, ops);
+            sScanFilterProgram.client_if = client_if;
+            sScanFilterProgram.count = num_ops;
+            sScanFilterProgram.next = 0;
+            sScanFilterProgram.status = 0;
+            sScanFilterProgram.ops = ops;
+            sScanFilterPrograms++;
+            sScanFilterOps += num_ops;
+            ops = NULL;
+            result = num_ops;
+        }
+        pthread_mutex_unlock(&sScanFilterLock);
+    }
+
+    if (result > 0) {
+        env->SetIntArrayRegion(chosen, 0, num_filters, c_chosen);
+        debug("client %d: %d filters, %d operations", client_if, num_filters, result);
+        int status;
+        if (scanFilterProgramRun(&status)) result = -1;
+    }
+
+    free(c_free);
+    free(c_offsets);
+    free(c_params);
+    free(c_chosen);
+    free(c_data);
+    free(counts);
+    free(wanted);
+    free(ops);
+    return result;
+}
+
+// Returns { programs, operations sent, entry operations saved } of the scan
+// filter programming.
+static jlongArray gattClientGetScanFilterProgramStatsNative(JNIEnv *env, jobject object)
+{
+    pthread_mutex_lock(&sScanFilterLock);
+    jlong stats[] = { (jlong) sScanFilterPrograms, (jlong) sScanFilterOps,
+                      (jlong) sScanFilterOpsSaved };
+    pthread_mutex_unlock(&sScanFilterLock);
+
+    jlongArray result = env->NewLongArray(NELEM(stats));
+    if (result) env->SetLongArrayRegion(result, 0, NELEM(stats), stats);
+    return result;
+}
+
 static void gattClientScanFilterEnableNative (JNIEnv* env, jobject object, jint client_if,
                           jboolean enable)
 {
@@ -1437,9 +5472,168 @@ static void gattClientSetAdvDataNative(JNIEnv* env, jobject object , jint client
 static void gattClientDisableAdvNative(JNIEnv* env, jobject object, jint client_if)
 {
     if (!sGattIf) return;
+
+    pthread_mutex_lock(&sAdvPayloadLock);
+    adv_rotation_t* rotation = advRotationFind(client_if);
+    if (rotation != NULL) advRotationRemove(rotation);
+    pthread_mutex_unlock(&sAdvPayloadLock);
+
     sGattIf->client->multi_adv_disable(client_if);
 }
 
+// Copies |array| into |buf| of |max_len| bytes. Returns the length, or -1 if
+// it does not fit.
+static int advPayloadCopy(JNIEnv* env, jbyteArray array, uint8_t* buf, int max_len)
+{
+    int len = env->GetArrayLength(array);
+    if (len > max_len) return -1;
+    env->GetByteArrayRegion(array, 0, len, (jbyte*) buf);
+    return len;
+}
+
+// Registers an advertising data or scan response set. Returns its handle, or
+// -1 if it does not fit in one AD payload or the cache is full.
+static jint gattClientRegisterAdvPayloadNative(JNIEnv* env, jobject object,
+        jboolean set_scan_rsp, jboolean incl_name, jboolean incl_txpower, jint appearance,
+        jbyteArray manufacturer_data, jbyteArray service_data, jbyteArray service_uuid)
+{
+    adv_payload_t payload;
+    memset(&payload, 0, sizeof(payload));
+    payload.refs = 1;
+    payload.set_scan_rsp = set_scan_rsp;
+    payload.incl_name = incl_name;
+    payload.incl_txpower = incl_txpower;
+    payload.appearance = appearance;
+
+    int manu_len = advPayloadCopy(env, manufacturer_data, payload.manu, ADV_MAX_DATA_LEN);
+    int serv_data_len = advPayloadCopy(env, service_data, payload.serv_data, ADV_MAX_DATA_LEN);
+    int serv_uuid_len = advPayloadCopy(env, service_uuid, payload.serv_uuid, ADV_UUID_MAX_LEN);
+    if (manu_len < 0 || serv_data_len < 0 || serv_uuid_len < 0) return -1;
+    payload.manu_len = manu_len;
+    payload.serv_data_len = serv_data_len;
+    payload.serv_uuid_len = serv_uuid_len;
+
+    int len = advPayloadEncodedLen(&payload);
+    if (len > ADV_MAX_DATA_LEN) {
+        warn("Advertising payload of %d bytes does not fit", len);
+        return -1;
+    }
+
+    pthread_mutex_lock(&sAdvPayloadLock);
+    int handle = -1;
+    for (int i = 0; i < ADV_PAYLOAD_MAX; i++) {
+        if (sAdvPayloads[i].refs > 0 && advPayloadEquals(&sAdvPayloads[i], &payload)) {
+            sAdvPayloads[i].refs++;
+            handle = i;
+            break;
+        }
+        if (sAdvPayloads[i].refs == 0 && handle < 0) handle = i;
+    }
+    if (handle >= 0 && sAdvPayloads[handle].refs == 0) sAdvPayloads[handle] = payload;
+    pthread_mutex_unlock(&sAdvPayloadLock);
+    return handle;
+}
+
+static void gattClientReleaseAdvPayloadNative(JNIEnv* env, jobject object, jint handle)
+{
+    if (handle < 0 || handle >= ADV_PAYLOAD_MAX) return;
+    pthread_mutex_lock(&sAdvPayloadLock);
+    if (sAdvPayloads[handle].refs > 0) sAdvPayloads[handle].refs--;
+    pthread_mutex_unlock(&sAdvPayloadLock);
+}
+
+// Sets a registered payload on the multi-advertising instance of |client_if|.
+// Completes through onAdvertiseDataSet like gattClientSetAdvDataNative().
+static jboolean gattClientSetAdvPayloadNative(JNIEnv* env, jobject object, jint client_if,
+                                              jint handle)
+{
+    if (!sGattIf || handle < 0 || handle >= ADV_PAYLOAD_MAX) return JNI_FALSE;
+
+    pthread_mutex_lock(&sAdvPayloadLock);
+    adv_payload_t payload = sAdvPayloads[handle];
+    pthread_mutex_unlock(&sAdvPayloadLock);
+    if (payload.refs == 0) return JNI_FALSE;
+
+    return advPayloadApply(client_if, &payload) == BT_STATUS_SUCCESS ? JNI_TRUE : JNI_FALSE;
+}
+
+// Cycles the instance of |client_if| through |handles|, one every
+// |interval_ms|, replacing any rotation it had. The rotation holds a
+// reference on each handle until it is stopped or the instance disabled.
+static jboolean gattClientStartAdvRotationNative(JNIEnv* env, jobject object, jint client_if,
+                                                 jintArray handles, jint interval_ms)
+{
+    int count = env->GetArrayLength(handles);
+    if (count == 0 || count > ADV_ROTATION_MAX_PAYLOADS ||
+            interval_ms < ADV_ROTATION_MIN_INTERVAL_MS)
+        return JNI_FALSE;
+    jint c_handles[ADV_ROTATION_MAX_PAYLOADS];
+    env->GetIntArrayRegion(handles, 0, count, c_handles);
+
+    pthread_mutex_lock(&sAdvPayloadLock);
+    for (int i = 0; i < count; i++) {
+        if (c_handles[i] < 0 || c_handles[i] >= ADV_PAYLOAD_MAX ||
+                sAdvPayloads[c_handles[i]].refs == 0) {
+            pthread_mutex_unlock(&sAdvPayloadLock);
+            return JNI_FALSE;
+        }
+    }
+
+    adv_rotation_t* rotation = advRotationFind(client_if);
+    if (rotation != NULL) advRotationRemove(rotation);
+    for (int i = 0; i < ADV_ROTATION_MAX && rotation == NULL; i++) {
+        if (sAdvRotations[i].count == 0) rotation = &sAdvRotations[i];
+    }
+    if (rotation == NULL || !advRotationStartThread()) {
+        pthread_mutex_unlock(&sAdvPayloadLock);
+        return JNI_FALSE;
+    }
+
+    rotation->client_if = client_if;
+    rotation->count = count;
+    rotation->next = 0;
+    rotation->pending = 0;
+    rotation->interval_ns = interval_ms * 1000000LL;
+    rotation->due_ns = monotonic_nanos();
+    for (int i = 0; i < count; i++) {
+        rotation->handles[i] = c_handles[i];
+        sAdvPayloads[c_handles[i]].refs++;
+    }
+    pthread_cond_signal(&sAdvRotationCond);
+    pthread_mutex_unlock(&sAdvPayloadLock);
+    return JNI_TRUE;
+}
+
+static void gattClientStopAdvRotationNative(JNIEnv* env, jobject object, jint client_if)
+{
+    pthread_mutex_lock(&sAdvPayloadLock);
+    adv_rotation_t* rotation = advRotationFind(client_if);
+    if (rotation != NULL) advRotationRemove(rotation);
+    pthread_mutex_unlock(&sAdvPayloadLock);
+}
+
+// Returns { payloads registered, rotations running, rotation writes, failed
+// writes, writes that timed out }.
+static jlongArray gattClientGetAdvPayloadStatsNative(JNIEnv *env, jobject object)
+{
+    pthread_mutex_lock(&sAdvPayloadLock);
+    jlong payloads = 0;
+    jlong rotations = 0;
+    for (int i = 0; i < ADV_PAYLOAD_MAX; i++) {
+        if (sAdvPayloads[i].refs > 0) payloads++;
+    }
+    for (int i = 0; i < ADV_ROTATION_MAX; i++) {
+        if (sAdvRotations[i].count > 0) rotations++;
+    }
+    jlong stats[] = { payloads, rotations, (jlong) sAdvRotationWrites,
+                      (jlong) sAdvRotationFailed, (jlong) sAdvRotationTimeouts };
+    pthread_mutex_unlock(&sAdvPayloadLock);
+
+    jlongArray result = env->NewLongArray(NELEM(stats));
+    if (result) env->SetLongArrayRegion(result, 0, NELEM(stats), stats);
+    return result;
+}
+
 static void gattClientConfigBatchScanStorageNative(JNIEnv* env, jobject object, jint client_if,
             jint max_full_reports_percent, jint max_trunc_reports_percent,
             jint notify_threshold_level_percent)
@@ -1486,6 +5680,22 @@ static void gattServerRegisterAppNative(JNIEnv* env, jobject object,
 static void gattServerUnregisterAppNative(JNIEnv* env, jobject object, jint serverIf)
 {
     if (!sGattIf) return;
+
+    pthread_mutex_lock(&sGattAttrLock);
+    gattAttrClear(serverIf, 0);
+    gatt_attr_pending_t* pending = gattAttrPending(serverIf, false);
+    if (pending != NULL) {
+        free(pending->value);
+        memset(pending, 0, sizeof(gatt_attr_pending_t));
+    }
+    pthread_mutex_unlock(&sGattAttrLock);
+
+    pthread_mutex_lock(&sPrepWriteLock);
+    for (int i = 0; i < GATT_ATTR_MAX_SERVERS; i++) {
+        if (sPrepWriteServers[i] == serverIf) sPrepWriteServers[i] = 0;
+    }
+    pthread_mutex_unlock(&sPrepWriteLock);
+
     sGattIf->server->unregister_server(serverIf);
 }
 
@@ -1536,13 +5746,30 @@ static void gattServerAddIncludedServiceNative (JNIEnv *env, jobject object,
 static void gattServerAddCharacteristicNative (JNIEnv *env, jobject object,
         jint server_if, jint svc_handle,
         jlong char_uuid_lsb, jlong char_uuid_msb,
-        jint properties, jint permissions)
+        jint properties, jint permissions, jbyteArray value)
 {
     if (!sGattIf) return;
 
     bt_uuid_t uuid;
     set_uuid(uuid.uu, char_uuid_msb, char_uuid_lsb);
 
+    // Characteristics are added one at a time per server, so the value only
+    // needs to be held until btgatts_characteristic_added_cb() reports the
+    // handle.
+    uint16_t len;
+    uint8_t* copy = gattAttrCopy(env, value, &len);
+    pthread_mutex_lock(&sGattAttrLock);
+    gatt_attr_pending_t* pending = gattAttrPending(server_if, copy != NULL);
+    if (pending != NULL) {
+        free(pending->value);
+        pending->value = copy;
+        pending->len = len;
+        if (copy == NULL) memset(pending, 0, sizeof(gatt_attr_pending_t));
+    } else {
+        free(copy);
+    }
+    pthread_mutex_unlock(&sGattAttrLock);
+
     sGattIf->server->add_characteristic(server_if, svc_handle,
                                         &uuid, properties, permissions);
 }
@@ -1581,17 +5808,71 @@ static void gattServerDeleteServiceNative (JNIEnv *env, jobject object,
     sGattIf->server->delete_service(server_if, svc_handle);
 }
 
+// A notified value replaces the registered one so reads stay consistent.
+static void gattAttrUpdateIfRegistered(JNIEnv* env, int handle, jbyteArray val)
+{
+    pthread_mutex_lock(&sGattAttrLock);
+    bool registered = handle > 0 && handle < sGattAttrCapacity &&
+            sGattAttrs[handle].value != NULL;
+    pthread_mutex_unlock(&sGattAttrLock);
+    if (!registered) return;
+
+    uint16_t len;
+    uint8_t* copy = gattAttrCopy(env, val, &len);
+    if (copy == NULL) return;
+
+    pthread_mutex_lock(&sGattAttrLock);
+    if (handle < sGattAttrCapacity && sGattAttrs[handle].value != NULL) {
+        gatt_attr_entry_t& entry = sGattAttrs[handle];
+        gattAttrSet(entry.server_if, entry.srvc_handle, handle, copy, len);
+    } else {
+        free(copy);
+    }
+    pthread_mutex_unlock(&sGattAttrLock);
+}
+
+static void gattServerSetAttributeValueNative(JNIEnv *env, jobject object,
+        jint server_if, jint svc_handle, jint attr_handle, jbyteArray value)
+{
+    uint16_t len;
+    uint8_t* copy = gattAttrCopy(env, value, &len);
+    if (value != NULL && copy == NULL) {
+        error("Unable to store value of attribute %d", attr_handle);
+        return;
+    }
+
+    pthread_mutex_lock(&sGattAttrLock);
+    gattAttrSet(server_if, svc_handle, attr_handle, copy, len);
+    pthread_mutex_unlock(&sGattAttrLock);
+}
+
+// Returns { entries, version, reads served } of the attribute table.
+static jlongArray gattServerGetAttributeTableStatsNative(JNIEnv *env, jobject object)
+{
+    pthread_mutex_lock(&sGattAttrLock);
+    jlong stats[] = { sGattAttrCount, sGattAttrVersion, (jlong) sGattAttrReads };
+    pthread_mutex_unlock(&sGattAttrLock);
+
+    jlongArray result = env->NewLongArray(NELEM(stats));
+    if (result) env->SetLongArrayRegion(result, 0, NELEM(stats), stats);
+    return result;
+}
+
 static void gattServerSendIndicationNative (JNIEnv *env, jobject object,
         jint server_if, jint attr_handle, jint conn_id, jbyteArray val)
 {
     if (!sGattIf) return;
 
-    jbyte* array = env->GetByteArrayElements(val, 0);
-    int val_len = env->GetArrayLength(val);
+    gattAttrUpdateIfRegistered(env, attr_handle, val);
 
-    sGattIf->server->send_indication(server_if, attr_handle, conn_id, val_len,
-                                     /*confirm*/ 1, (char*)array);
-    env->ReleaseByteArrayElements(val, array, JNI_ABORT);
+    uint8_t value[BTGATT_MAX_ATTR_LEN];
+    uint16_t val_len = gattValueCopy(env, val, value);
+
+    if (serverNotifySend(server_if, attr_handle, conn_id, /*confirm*/ true, value, val_len)) {
+        pthread_mutex_lock(&sServerNotifyLock);
+        sServerNotifySent++;
+        pthread_mutex_unlock(&sServerNotifyLock);
+    }
 }
 
 static void gattServerSendNotificationNative (JNIEnv *env, jobject object,
@@ -1599,12 +5880,87 @@ static void gattServerSendNotificationNative (JNIEnv *env, jobject object,
 {
     if (!sGattIf) return;
 
-    jbyte* array = env->GetByteArrayElements(val, 0);
-    int val_len = env->GetArrayLength(val);
+    gattAttrUpdateIfRegistered(env, attr_handle, val);
+
+    uint8_t value[BTGATT_MAX_ATTR_LEN];
+    uint16_t val_len = gattValueCopy(env, val, value);
+
+    if (serverNotifySend(server_if, attr_handle, conn_id, /*confirm*/ false, value, val_len)) {
+        pthread_mutex_lock(&sServerNotifyLock);
+        sServerNotifySent++;
+        pthread_mutex_unlock(&sServerNotifyLock);
+    }
+}
+
+// Sends |val| to every connection in |conn_ids|. Returns the number of
+// connections the value was sent to right away; congested ones get it queued.
+static jint gattServerSendNotificationMultiNative(JNIEnv *env, jobject object,
+        jint server_if, jint attr_handle, jintArray conn_ids, jboolean confirm,
+        jbyteArray val)
+{
+    if (!sGattIf || conn_ids == NULL || val == NULL) return 0;
+
+    uint8_t value[BTGATT_MAX_ATTR_LEN];
+    uint16_t len = gattValueCopy(env, val, value);
+
+    gattAttrUpdateIfRegistered(env, attr_handle, val);
+
+    jsize num_conns = env->GetArrayLength(conn_ids);
+    jint* ids = env->GetIntArrayElements(conn_ids, NULL);
+    if (ids == NULL) return 0;
+
+    int sent = 0;
+    for (jsize i = 0; i < num_conns; i++) {
+        if (serverNotifySend(server_if, attr_handle, ids[i], confirm, value, len)) sent++;
+    }
+    env->ReleaseIntArrayElements(conn_ids, ids, JNI_ABORT);
+
+    pthread_mutex_lock(&sServerNotifyLock);
+    sServerNotifySent += sent;
+    pthread_mutex_unlock(&sServerNotifyLock);
+    return sent;
+}
+
+// Returns { sent, queued, dropped } of the notification fan-out.
+static jlongArray gattServerGetNotifyStatsNative(JNIEnv *env, jobject object)
+{
+    pthread_mutex_lock(&sServerNotifyLock);
+    jlong stats[] = { (jlong) sServerNotifySent, (jlong) sServerNotifyQueued,
+                      (jlong) sServerNotifyDropped };
+    pthread_mutex_unlock(&sServerNotifyLock);
+
+    jlongArray result = env->NewLongArray(NELEM(stats));
+    if (result) env->SetLongArrayRegion(result, 0, NELEM(stats), stats);
+    return result;
+}
+
+// Makes |server_if| acknowledge and assemble prepared writes natively, see
+// onAttributeWriteAssembled.
+static void gattServerSetWriteAssemblyNative(JNIEnv *env, jobject object,
+        jint server_if, jboolean enable)
+{
+    pthread_mutex_lock(&sPrepWriteLock);
+    int* empty = NULL;
+    for (int i = 0; i < GATT_ATTR_MAX_SERVERS; i++) {
+        if (sPrepWriteServers[i] == server_if) sPrepWriteServers[i] = 0;
+        if (sPrepWriteServers[i] == 0 && empty == NULL) empty = &sPrepWriteServers[i];
+    }
+    if (enable && empty != NULL) *empty = server_if;
+    pthread_mutex_unlock(&sPrepWriteLock);
+}
 
-    sGattIf->server->send_indication(server_if, attr_handle, conn_id, val_len,
-                                     /*confirm*/ 0, (char*)array);
-    env->ReleaseByteArrayElements(val, array, JNI_ABORT);
+// Returns { fragments, values assembled, fragments rejected } of the prepared
+// write assembly.
+static jlongArray gattServerGetWriteAssemblyStatsNative(JNIEnv *env, jobject object)
+{
+    pthread_mutex_lock(&sPrepWriteLock);
+    jlong stats[] = { (jlong) sPrepWriteFragments, (jlong) sPrepWriteAssembled,
+                      (jlong) sPrepWriteRejected };
+    pthread_mutex_unlock(&sPrepWriteLock);
+
+    jlongArray result = env->NewLongArray(NELEM(stats));
+    if (result) env->SetLongArrayRegion(result, 0, NELEM(stats), stats);
+    return result;
 }
 
 static void gattServerSendResponseNative (JNIEnv *env, jobject object,
@@ -1618,20 +5974,136 @@ static void gattServerSendResponseNative (JNIEnv *env, jobject object,
     response.attr_value.handle = handle;
     response.attr_value.auth_req = auth_req;
     response.attr_value.offset = offset;
-    response.attr_value.len = 0;
+    response.attr_value.len = gattValueCopy(env, val, response.attr_value.value);
 
-    if (val != NULL)
-    {
-        response.attr_value.len = (uint16_t) env->GetArrayLength(val);
-        jbyte* array = env->GetByteArrayElements(val, 0);
+    sGattIf->server->send_response(conn_id, trans_id, status, &response);
+}
+
+// Marshals up to |count| responses described by |requests| (see
+// gattServerSendResponsesNative) in one critical section. Returns the number
+// of responses marshalled; fewer than |count| means a request was malformed.
+static jsize gattResponsesMarshal(JNIEnv *env, jintArray requests, jbyteArray values,
+        jint auth_req, jsize count, int* trans_ids, int* statuses,
+        btgatt_response_t* responses)
+{
+    jsize values_len = values != NULL ? env->GetArrayLength(values) : 0;
+    jint* c_requests = (jint*) env->GetPrimitiveArrayCritical(requests, NULL);
+    uint8_t* c_values = values != NULL ?
+            (uint8_t*) env->GetPrimitiveArrayCritical(values, NULL) : NULL;
+
+    jsize pos = 0;
+    jsize marshalled = 0;
+    if (c_requests != NULL && (values == NULL || c_values != NULL)) {
+        for (; marshalled < count; marshalled++) {
+            const jint* req = c_requests + marshalled * GATT_RESPONSE_FIELDS;
+            jint len = req[4];
+            if (len < 0 || len > values_len - pos) break;
+
+            btgatt_response_t& response = responses[marshalled];
+            trans_ids[marshalled] = req[0];
+            statuses[marshalled] = req[1];
+            response.attr_value.handle = req[2];
+            response.attr_value.offset = req[3];
+            response.attr_value.auth_req = auth_req;
+            response.attr_value.len =
+                    len > BTGATT_MAX_ATTR_LEN ? BTGATT_MAX_ATTR_LEN : len;
+            memcpy(response.attr_value.value, c_values + pos, response.attr_value.len);
+            pos += len;
+        }
+    }
+
+    if (c_values != NULL) env->ReleasePrimitiveArrayCritical(values, c_values, JNI_ABORT);
+    if (c_requests != NULL) env->ReleasePrimitiveArrayCritical(requests, c_requests, JNI_ABORT);
+    return marshalled;
+}
+
+// Answers several pending requests on one connection. |requests| holds
+// GATT_RESPONSE_FIELDS ints per response: trans_id, status, handle, offset and
+// value length; the values are concatenated in |values|. All responses are
+// marshalled in one critical section and sent once it has been left. Returns
+// the number of responses sent.
+static jint gattServerSendResponsesNative(JNIEnv *env, jobject object,
+        jint server_if, jint conn_id, jintArray requests, jbyteArray values,
+        jint auth_req)
+{
+    if (!sGattIf || requests == NULL) return 0;
+
+    jsize count = env->GetArrayLength(requests) / GATT_RESPONSE_FIELDS;
+    if (count == 0) return 0;
+
+    int* trans_ids = (int*) malloc(count * sizeof(int));
+    int* statuses = (int*) malloc(count * sizeof(int));
+    btgatt_response_t* responses =
+            (btgatt_response_t*) malloc(count * sizeof(btgatt_response_t));
+    if (trans_ids == NULL || statuses == NULL || responses == NULL) {
+        free(trans_ids);
+        free(statuses);
+        free(responses);
+        return 0;
+    }
+
+    jsize marshalled = gattResponsesMarshal(env, requests, values, auth_req, count,
+                                            trans_ids, statuses, responses);
+    if (marshalled < count) {
+        warn("gattServerSendResponsesNative() malformed request %d of %d", marshalled, count);
+    }
+
+    for (jsize i = 0; i < marshalled; i++) {
+        sGattIf->server->send_response(conn_id, trans_ids[i], statuses[i], &responses[i]);
+    }
+
+    free(trans_ids);
+    free(statuses);
+    free(responses);
+    return marshalled;
+}
+
+#ifdef BT_JNI_TEST_HOOKS
+// Marshals responses the way the response paths do, without sending them.
+// |mode| 0 is the element copy gattServerSendResponseNative() used to do for
+// |values|, 1 the region copy it does now, and 2 marshals every response in
+// |requests| as gattServerSendResponsesNative() does. Returns a checksum of
+// the marshalled bytes so no copy can be skipped.
+static jlong gattServerBenchmarkResponseNative(JNIEnv *env, jclass clazz,
+        jintArray requests, jbyteArray values, jint mode)
+{
+    if (values == NULL) return 0;
 
+    btgatt_response_t response;
+    jlong check = 0;
+    if (mode == 0) {
+        response.attr_value.len = (uint16_t) env->GetArrayLength(values);
+        if (response.attr_value.len > BTGATT_MAX_ATTR_LEN)
+            response.attr_value.len = BTGATT_MAX_ATTR_LEN;
+        jbyte* array = env->GetByteArrayElements(values, 0);
+        if (array == NULL) return 0;
         for (int i = 0; i != response.attr_value.len; ++i)
             response.attr_value.value[i] = (uint8_t) array[i];
-        env->ReleaseByteArrayElements(val, array, JNI_ABORT);
+        env->ReleaseByteArrayElements(values, array, JNI_ABORT);
+        check = response.attr_value.value[response.attr_value.len / 2];
+    } else if (mode == 1) {
+        response.attr_value.len = gattValueCopy(env, values, response.attr_value.value);
+        check = response.attr_value.value[response.attr_value.len / 2];
+    } else if (requests != NULL) {
+        jsize count = env->GetArrayLength(requests) / GATT_RESPONSE_FIELDS;
+        int* trans_ids = (int*) malloc(count * sizeof(int));
+        int* statuses = (int*) malloc(count * sizeof(int));
+        btgatt_response_t* responses =
+                (btgatt_response_t*) malloc(count * sizeof(btgatt_response_t));
+        if (trans_ids != NULL && statuses != NULL && responses != NULL) {
+            jsize marshalled = gattResponsesMarshal(env, requests, values, 0, count,
+                                                    trans_ids, statuses, responses);
+            for (jsize i = 0; i < marshalled; i++) {
+                check += responses[i].attr_value.value[responses[i].attr_value.len / 2];
+            }
+        }
+        free(trans_ids);
+        free(statuses);
+        free(responses);
     }
-
-    sGattIf->server->send_response(conn_id, trans_id, status, &response);
+    return check;
 }
+#endif
 
 static void gattTestNative(JNIEnv *env, jobject object, jint command,
                            jlong uuid1_lsb, jlong uuid1_msb, jstring bda1,
@@ -1668,6 +6140,11 @@ static JNINativeMethod sAdvertiseMethods[] = {
     {"gattClientDisableAdvNative", "(I)V", (void *) gattClientDisableAdvNative},
     {"gattSetAdvDataNative", "(IZZZIII[B[B[B)V", (void *) gattSetAdvDataNative},
     {"gattAdvertiseNative", "(IZ)V", (void *) gattAdvertiseNative},
+    {"gattClientRegisterAdvPayloadNative", "(ZZZI[B[B[B)I", (void *) gattClientRegisterAdvPayloadNative},
+    {"gattClientReleaseAdvPayloadNative", "(I)V", (void *) gattClientReleaseAdvPayloadNative},
+    {"gattClientSetAdvPayloadNative", "(II)Z", (void *) gattClientSetAdvPayloadNative},
+    {"gattClientStartAdvRotationNative", "(I[II)Z", (void *) gattClientStartAdvRotationNative},
+    {"gattClientStopAdvRotationNative", "(I)V", (void *) gattClientStopAdvRotationNative},
 };
 
 // JNI functions defined in ScanManager class.
@@ -1686,7 +6163,14 @@ static JNINativeMethod sScanMethods[] = {
     {"gattClientScanFilterDeleteNative", "(IIIIIJJJJLjava/lang/String;Ljava/lang/String;B[B[B)V", (void *) gattClientScanFilterDeleteNative},
     {"gattClientScanFilterClearNative", "(II)V", (void *) gattClientScanFilterClearNative},
     {"gattClientScanFilterEnableNative", "(IZ)V", (void *) gattClientScanFilterEnableNative},
+    {"gattClientScanFilterProgramNative", "(I[I[I[I[I[B[I[I)I", (void *) gattClientScanFilterProgramNative},
     {"gattSetScanParametersNative", "(III)V", (void *) gattSetScanParametersNative},
+    // Scan result batching JNI functions.
+    {"gattClientSetScanBatchingNative", "(II)V", (void *) gattClientSetScanBatchingNative},
+    {"gattClientFlushScanBatchNative", "()V", (void *) gattClientFlushScanBatchNative},
+    {"gattClientSetScanDedupeNative", "(II)V", (void *) gattClientSetScanDedupeNative},
+    {"gattClientSetScanPrefilterNative", "(I[B)V", (void *) gattClientSetScanPrefilterNative},
+    {"gattClientClearScanPrefilterNative", "(I)V", (void *) gattClientClearScanPrefilterNative},
 };
 
 // JNI functions defined in GattService class.
@@ -1694,6 +6178,17 @@ static JNINativeMethod sMethods[] = {
     {"classInitNative", "()V", (void *) classInitNative},
     {"initializeNative", "()V", (void *) initializeNative},
     {"cleanupNative", "()V", (void *) cleanupNative},
+    {"gattGetAddressCacheStatsNative", "()[J", (void *) gattGetAddressCacheStatsNative},
+    {"gattGetScanDedupeStatsNative", "()[J", (void *) gattGetScanDedupeStatsNative},
+    {"gattClientGetPresenceVersionNative", "()J", (void *) gattClientGetPresenceVersionNative},
+    {"gattClientGetPresenceSnapshotNative", "()[J", (void *) gattClientGetPresenceSnapshotNative},
+    {"gattClientGetPresenceStatsNative", "()[J", (void *) gattClientGetPresenceStatsNative},
+    {"gattClientGetAdvPayloadStatsNative", "()[J", (void *) gattClientGetAdvPayloadStatsNative},
+    {"gattClientStartProximityWatchNative", "(ILjava/lang/String;IIIII)Z", (void *) gattClientStartProximityWatchNative},
+    {"gattClientStopProximityWatchNative", "(ILjava/lang/String;)V", (void *) gattClientStopProximityWatchNative},
+    {"gattClientCheckProximityNative", "()I", (void *) gattClientCheckProximityNative},
+    {"gattClientGetProximityStatsNative", "()[J", (void *) gattClientGetProximityStatsNative},
+    {"gattClientGetScanFilterProgramStatsNative", "()[J", (void *) gattClientGetScanFilterProgramStatsNative},
     {"gattClientGetDeviceTypeNative", "(Ljava/lang/String;)I", (void *) gattClientGetDeviceTypeNative},
     {"gattClientRegisterAppNative", "(JJ)V", (void *) gattClientRegisterAppNative},
     {"gattClientUnregisterAppNative", "(I)V", (void *) gattClientUnregisterAppNative},
@@ -1702,12 +6197,21 @@ static JNINativeMethod sMethods[] = {
     {"gattClientRefreshNative", "(ILjava/lang/String;)V", (void *) gattClientRefreshNative},
     {"gattClientSearchServiceNative", "(IZJJ)V", (void *) gattClientSearchServiceNative},
     {"gattClientGetGattDbNative", "(I)V", (void *) gattClientGetGattDbNative},
+    {"gattClientInitDbCacheNative", "(Ljava/lang/String;)V", (void *) gattClientInitDbCacheNative},
+    {"gattClientGetCachedGattDbNative", "(ILjava/lang/String;)Z", (void *) gattClientGetCachedGattDbNative},
+    {"gattClientInvalidateGattDbCacheNative", "(Ljava/lang/String;)V", (void *) gattClientInvalidateGattDbCacheNative},
     {"gattClientReadCharacteristicNative", "(III)V", (void *) gattClientReadCharacteristicNative},
+    {"gattClientReadCharacteristicBatchNative", "(I[II)Z", (void *) gattClientReadCharacteristicBatchNative},
+    {"gattClientGetReadBatchStatsNative", "()[J", (void *) gattClientGetReadBatchStatsNative},
     {"gattClientReadDescriptorNative", "(III)V", (void *) gattClientReadDescriptorNative},
     {"gattClientWriteCharacteristicNative", "(IIII[B)V", (void *) gattClientWriteCharacteristicNative},
+    {"gattClientWriteCharacteristicBulkNative", "(III[B)Z", (void *) gattClientWriteCharacteristicBulkNative},
+    {"gattClientGetWritePipelineStatsNative", "()[J", (void *) gattClientGetWritePipelineStatsNative},
     {"gattClientWriteDescriptorNative", "(IIII[B)V", (void *) gattClientWriteDescriptorNative},
     {"gattClientExecuteWriteNative", "(IZ)V", (void *) gattClientExecuteWriteNative},
     {"gattClientRegisterForNotificationsNative", "(ILjava/lang/String;IZ)V", (void *) gattClientRegisterForNotificationsNative},
+    {"gattClientRegisterNotifyBufferNative", "(ILjava/nio/ByteBuffer;I)Z", (void *) gattClientRegisterNotifyBufferNative},
+    {"gattClientUnregisterNotifyBufferNative", "(I)V", (void *) gattClientUnregisterNotifyBufferNative},
     {"gattClientReadRemoteRssiNative", "(ILjava/lang/String;)V", (void *) gattClientReadRemoteRssiNative},
     {"gattClientConfigureMTUNative", "(II)V", (void *) gattClientConfigureMTUNative},
     {"gattConnectionParameterUpdateNative", "(ILjava/lang/String;IIII)V", (void *) gattConnectionParameterUpdateNative},
@@ -1717,7 +6221,7 @@ static JNINativeMethod sMethods[] = {
     {"gattServerDisconnectNative", "(ILjava/lang/String;I)V", (void *) gattServerDisconnectNative},
     {"gattServerAddServiceNative", "(IIIJJI)V", (void *) gattServerAddServiceNative},
     {"gattServerAddIncludedServiceNative", "(III)V", (void *) gattServerAddIncludedServiceNative},
-    {"gattServerAddCharacteristicNative", "(IIJJII)V", (void *) gattServerAddCharacteristicNative},
+    {"gattServerAddCharacteristicNative", "(IIJJII[B)V", (void *) gattServerAddCharacteristicNative},
     {"gattServerAddDescriptorNative", "(IIJJI)V", (void *) gattServerAddDescriptorNative},
     {"gattServerStartServiceNative", "(III)V", (void *) gattServerStartServiceNative},
     {"gattServerStopServiceNative", "(II)V", (void *) gattServerStopServiceNative},
@@ -1725,10 +6229,40 @@ static JNINativeMethod sMethods[] = {
     {"gattServerSendIndicationNative", "(III[B)V", (void *) gattServerSendIndicationNative},
     {"gattServerSendNotificationNative", "(III[B)V", (void *) gattServerSendNotificationNative},
     {"gattServerSendResponseNative", "(IIIIII[BI)V", (void *) gattServerSendResponseNative},
+    {"gattServerSendResponsesNative", "(II[I[BI)I", (void *) gattServerSendResponsesNative},
+    {"gattServerSetWriteAssemblyNative", "(IZ)V", (void *) gattServerSetWriteAssemblyNative},
+    {"gattServerGetWriteAssemblyStatsNative", "()[J", (void *) gattServerGetWriteAssemblyStatsNative},
+#ifdef BT_JNI_TEST_HOOKS
+    {"gattServerBenchmarkResponseNative", "([I[BI)J", (void *) gattServerBenchmarkResponseNative},
+#endif
+    {"gattServerSendNotificationMultiNative", "(II[IZ[B)I", (void *) gattServerSendNotificationMultiNative},
+    {"gattServerGetNotifyStatsNative", "()[J", (void *) gattServerGetNotifyStatsNative},
+    {"gattServerSetAttributeValueNative", "(III[B)V", (void *) gattServerSetAttributeValueNative},
+    {"gattServerGetAttributeTableStatsNative", "()[J", (void *) gattServerGetAttributeTableStatsNative},
 
     {"gattTestNative", "(IJJLjava/lang/String;IIIII)V", (void *) gattTestNative},
 };
 
+// Decodes a report handed in from Java; used to test and benchmark the parser.
+static jobject batchScanReportParseNative(JNIEnv* env, jclass clazz, jint report_type,
+                                          jint num_records, jbyteArray data)
+{
+    jsize len = env->GetArrayLength(data);
+    jbyte* c_data = env->GetByteArrayElements(data, NULL);
+    if (c_data == NULL) return NULL;
+
+    jmethodID init = env->GetMethodID(clazz, "<init>", "(II[B[I[J[B[I)V");
+    jobject report = parseBatchScanReport(env, clazz, init, report_type, num_records,
+                                          (uint8_t*) c_data, len);
+    env->ReleaseByteArrayElements(data, c_data, JNI_ABORT);
+    return report;
+}
+
+static JNINativeMethod sBatchScanReportMethods[] = {
+    {"parseNative", "(II[B)Lcom/android/bluetooth/gatt/BatchScanReport;",
+        (void *) batchScanReportParseNative},
+};
+
 int register_com_android_bluetooth_gatt(JNIEnv* env)
 {
     int register_success =
@@ -1737,6 +6271,9 @@ int register_com_android_bluetooth_gatt(JNIEnv* env)
     register_success &=
         jniRegisterNativeMethods(env, "com/android/bluetooth/gatt/AdvertiseManager$AdvertiseNative",
                 sAdvertiseMethods, NELEM(sAdvertiseMethods));
+    register_success &=
+        jniRegisterNativeMethods(env, "com/android/bluetooth/gatt/BatchScanReport",
+                sBatchScanReportMethods, NELEM(sBatchScanReportMethods));
     return register_success &
         jniRegisterNativeMethods(env, "com/android/bluetooth/gatt/GattService",
                 sMethods, NELEM(sMethods));
@@ -64,18 +64,6 @@ btsdp_callbacks_t sBluetoothSdpCallbacks = {
 };
 
 static jobject sCallbacksObj = NULL;
-static JNIEnv *sCallbackEnv = NULL;
-
-static bool checkCallbackThread() {
-    sCallbackEnv = getCallbackEnv();
-
-    JNIEnv* env = AndroidRuntime::getJNIEnv();
-    if (sCallbackEnv != env || sCallbackEnv == NULL) {
-        ALOGE("Callback env check fail: env: %p, callback: %p", env, sCallbackEnv);
-        return false;
-    }
-    return true;
-}
 
 static void initializeNative(JNIEnv *env, jobject object) {
     const bt_interface_t* btInf = getBluetoothInterface();
@@ -167,8 +155,9 @@ static void sdp_search_callback(bt_status_t status, bt_bdaddr_t *bd_addr, uint8_
 {
     CallbackEnv sCallbackEnv(__func__);
     if (!sCallbackEnv.valid()) return;
+    CALLBACK_TIMER();
 
-    jbyteArray addr = sCallbackEnv->NewByteArray(sizeof(bt_bdaddr_t));
+    jbyteArray addr = sCallbackEnv.bdaddr(bd_addr);
     if (addr == NULL) {
         return;
     }
@@ -179,7 +168,6 @@ static void sdp_search_callback(bt_status_t status, bt_bdaddr_t *bd_addr, uint8_
         return;
     }
 
-    sCallbackEnv->SetByteArrayRegion(addr, 0, sizeof(bt_bdaddr_t), (jbyte*)bd_addr);
     sCallbackEnv->SetByteArrayRegion(uuid, 0, sizeof(bt_uuid_t), (jbyte*)uuid_in);
 
     ALOGD("%s: Status is: %d, Record count: %d", __func__, status, count);
@@ -198,6 +186,7 @@ static void sdp_search_callback(bt_status_t status, bt_bdaddr_t *bd_addr, uint8_
         /* call the right callback according to the uuid*/
         if (IS_UUID(UUID_MAP_MAS,uuid_in)){
 
+            CALLBACK_UPCALL();
             sCallbackEnv->CallVoidMethod(sCallbacksObj, method_sdpMasRecordFoundCallback,
                     (jint) status,
                     addr,
@@ -213,6 +202,7 @@ static void sdp_search_callback(bt_status_t status, bt_bdaddr_t *bd_addr, uint8_
 
         }else if (IS_UUID(UUID_MAP_MNS,uuid_in)){
 
+            CALLBACK_UPCALL();
             sCallbackEnv->CallVoidMethod(sCallbacksObj, method_sdpMnsRecordFoundCallback,
                     (jint) status,
                     addr,
@@ -226,6 +216,7 @@ static void sdp_search_callback(bt_status_t status, bt_bdaddr_t *bd_addr, uint8_
 
         } else if (IS_UUID(UUID_PBAP_PSE, uuid_in)) {
 
+            CALLBACK_UPCALL();
             sCallbackEnv->CallVoidMethod(sCallbacksObj, method_sdpPseRecordFoundCallback,
                     (jint) status,
                     addr,
@@ -246,6 +237,7 @@ static void sdp_search_callback(bt_status_t status, bt_bdaddr_t *bd_addr, uint8_
             sCallbackEnv->SetByteArrayRegion(formats_list, 0, formats_list_size,
                     (jbyte*)record->ops.supported_formats_list);
 
+            CALLBACK_UPCALL();
             sCallbackEnv->CallVoidMethod(sCallbacksObj, method_sdpOppOpsRecordFoundCallback,
                     (jint) status,
                     addr,
@@ -259,6 +251,7 @@ static void sdp_search_callback(bt_status_t status, bt_bdaddr_t *bd_addr, uint8_
             sCallbackEnv->DeleteLocalRef(formats_list);
 
         } else if (IS_UUID(UUID_SAP, uuid_in)) {
+            CALLBACK_UPCALL();
             sCallbackEnv->CallVoidMethod(sCallbacksObj, method_sdpSapsRecordFoundCallback,
                     (jint) status,
                     addr,
@@ -277,6 +270,7 @@ static void sdp_search_callback(bt_status_t status, bt_bdaddr_t *bd_addr, uint8_
 
             sCallbackEnv->SetByteArrayRegion(record_data, 0, record_data_size,
                     (jbyte*)record->hdr.user1_ptr);
+            CALLBACK_UPCALL();
             sCallbackEnv->CallVoidMethod(sCallbacksObj, method_sdpRecordFoundCallback,
                     (jint) status, addr, uuid, record_data_size, record_data);
 
@@ -547,6 +541,4 @@ int register_com_android_bluetooth_sdp(JNIEnv* env)
     return jniRegisterNativeMethods(env, "com/android/bluetooth/sdp/SdpManager",
                                     sMethods, NELEM(sMethods));
 }
-
-
 }
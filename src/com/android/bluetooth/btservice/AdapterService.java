@@ -59,7 +59,6 @@ import android.util.EventLog;
 import android.util.Log;
 
 import android.util.Slog;
-import android.util.SparseArray;
 import com.android.bluetooth.a2dp.A2dpService;
 import com.android.bluetooth.a2dpsink.A2dpSinkService;
 import com.android.bluetooth.hid.HidService;
@@ -69,6 +68,7 @@ import com.android.bluetooth.pbapclient.PbapClientService;
 import com.android.bluetooth.sdp.SdpManager;
 import com.android.internal.R;
 import com.android.bluetooth.Utils;
+import com.android.internal.annotations.VisibleForTesting;
 import com.android.bluetooth.btservice.RemoteDevices.DeviceProperties;
 
 import java.io.FileDescriptor;
@@ -77,7 +77,6 @@ import java.io.IOException;
 import java.io.PrintWriter;
 import java.nio.charset.StandardCharsets;
 import java.util.ArrayList;
-import java.util.Arrays;
 import java.util.HashMap;
 import java.util.Map;
 import java.util.Iterator;
@@ -108,7 +107,8 @@ public class AdapterService extends Service {
     private long mRxTimeTotalMs;
     private long mIdleTimeTotalMs;
     private long mEnergyUsedTotalVoltAmpSecMicro;
-    private SparseArray<UidTraffic> mUidTraffic = new SparseArray<>();
+    // Cursor of the last read of the native UID traffic ledger.
+    private long mUidTrafficCursor;
 
     private final ArrayList<ProfileService> mProfiles = new ArrayList<ProfileService>();
 
@@ -154,6 +154,12 @@ public class AdapterService extends Service {
     };
 
     private static final int CONTROLLER_ENERGY_UPDATE_TIMEOUT_MILLIS = 30;
+    // Fields per UID in getUidTrafficNative(): uid, rx bytes, tx bytes.
+    private static final int UID_TRAFFIC_FIELDS = 3;
+
+    // Longest time a device found by discovery waits in native code to be
+    // passed up with the devices found after it.
+    private static final int DISCOVERY_BATCH_INTERVAL_MS = 250;
 
     static {
         System.load("/system/lib/libbluetooth_jni.so");
@@ -1660,6 +1666,7 @@ public class AdapterService extends Service {
             Log.i(TAG,"discovery already active, ignore startDiscovery");
             return false;
         }
+        setDiscoveryBatchingNative(DISCOVERY_BATCH_INTERVAL_MS);
         return startDiscoveryNative();
     }
 
@@ -2504,24 +2511,18 @@ public class AdapterService extends Service {
                     mTxTimeTotalMs, mRxTimeTotalMs, mIdleTimeTotalMs,
                     mEnergyUsedTotalVoltAmpSecMicro);
 
-            // Count the number of entries that have byte counts > 0
-            int arrayLen = 0;
-            for (int i = 0; i < mUidTraffic.size(); i++) {
-                final UidTraffic traffic = mUidTraffic.valueAt(i);
-                if (traffic.getTxBytes() != 0 || traffic.getRxBytes() != 0) {
-                    arrayLen++;
-                }
-            }
-
-            // Copy the traffic objects whose byte counts are > 0 and reset the originals.
-            final UidTraffic[] result = arrayLen > 0 ? new UidTraffic[arrayLen] : null;
-            int putIdx = 0;
-            for (int i = 0; i < mUidTraffic.size(); i++) {
-                final UidTraffic traffic = mUidTraffic.valueAt(i);
-                if (traffic.getTxBytes() != 0 || traffic.getRxBytes() != 0) {
-                    result[putIdx++] = traffic.clone();
-                    traffic.setRxBytes(0);
-                    traffic.setTxBytes(0);
+            // Native code sums the traffic per UID and only returns UIDs
+            // with traffic since the previous read.
+            final long[] traffic = getUidTrafficNative(mUidTrafficCursor);
+            UidTraffic[] result = null;
+            if (traffic != null) {
+                mUidTrafficCursor = traffic[0];
+                final int count = (traffic.length - 1) / UID_TRAFFIC_FIELDS;
+                result = count > 0 ? new UidTraffic[count] : null;
+                for (int i = 0; i < count; i++) {
+                    final int pos = 1 + i * UID_TRAFFIC_FIELDS;
+                    result[i] = new UidTraffic((int) traffic[pos], traffic[pos + 1],
+                            traffic[pos + 2]);
                 }
             }
 
@@ -2636,7 +2637,7 @@ public class AdapterService extends Service {
     }
 
     private void energyInfoCallback(int status, int ctrl_state, long tx_time, long rx_time,
-                                    long idle_time, long energy_used, UidTraffic[] data)
+                                    long idle_time, long energy_used)
             throws RemoteException {
         if (ctrl_state >= BluetoothActivityEnergyInfo.BT_STACK_STATE_INVALID &&
                 ctrl_state <= BluetoothActivityEnergyInfo.BT_STACK_STATE_STATE_IDLE) {
@@ -2680,16 +2681,6 @@ public class AdapterService extends Service {
                 mRxTimeTotalMs = totalRxTimeMs;
                 mIdleTimeTotalMs = totalIdleTimeMs;
                 mEnergyUsedTotalVoltAmpSecMicro = totalEnergy;
-
-                for (UidTraffic traffic : data) {
-                    UidTraffic existingTraffic = mUidTraffic.get(traffic.getUid());
-                    if (existingTraffic == null) {
-                        mUidTraffic.put(traffic.getUid(), traffic);
-                    } else {
-                        existingTraffic.addRxBytes(traffic.getRxBytes());
-                        existingTraffic.addTxBytes(traffic.getTxBytes());
-                    }
-                }
                 mEnergyInfoLock.notifyAll();
             }
         }
@@ -2698,8 +2689,7 @@ public class AdapterService extends Service {
                    "tx_time = " + tx_time + "rx_time = " + rx_time +
                    "idle_time = " + idle_time +
                    "energy_used = " + energy_used +
-                   "ctrl_state = " + ctrl_state +
-                   "traffic = " + Arrays.toString(data));
+                   "ctrl_state = " + ctrl_state);
     }
 
     private int getIdleCurrentMa() {
@@ -2872,6 +2862,7 @@ public class AdapterService extends Service {
     /*package*/ native boolean getRemoteMasInstancesNative(byte[] address);
 
     private native int readEnergyInfo();
+    private native long[] getUidTrafficNative(long cursor);
     // TODO(BT) move this to ../btsock dir
     private native int connectSocketNative(byte[] address, int type,
                                            byte[] uuid, int port, int flag, int callingUid);
@@ -2886,8 +2877,16 @@ public class AdapterService extends Service {
 
     /*package*/ native boolean configHciSnoopLogNative(boolean enable);
     /*package*/ native boolean factoryResetNative();
+    /*package*/ native void forgetRemoteDevicePropertiesNative(byte[] address);
+    private native boolean setDiscoveryBatchingNative(int intervalMs);
 
     private native void alarmFiredNative();
+    // Returns {alarms fired, calls to setWakeAlarm(), calls without the native
+    // scheduler, set avg ns, set max ns, late avg ns, late max ns, fires under
+    // the wake lock, wake locks left held}. Only registered in builds with test
+    // hooks, see jni/Android.mk.
+    @VisibleForTesting
+    static native long[] benchmarkAlarmsNative(int alarms, int periodMillis, int wakeEvery);
     private native void dumpNative(FileDescriptor fd, String[] arguments);
 
     private native void interopDatabaseClearNative();
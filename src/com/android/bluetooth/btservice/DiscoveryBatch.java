@@ -0,0 +1,83 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+package com.android.bluetooth.btservice;
+
+import com.android.internal.annotations.VisibleForTesting;
+
+import java.util.Arrays;
+
+/**
+ * Devices found by classic discovery and passed up by native code in one
+ * batch. Addresses are stored six bytes per device, and the properties of
+ * device i are types[j] and values[j] for offsets[i] <= j < offsets[i + 1].
+ * @hide
+ */
+/*package*/
+
+class DiscoveryBatch {
+    final int count;
+    final byte[] addresses;
+    final int[] offsets;
+    final int[] types;
+    final byte[][] values;
+
+    DiscoveryBatch(byte[] addresses, int[] offsets, int[] types, byte[][] values) {
+        this.count = offsets.length - 1;
+        this.addresses = addresses;
+        this.offsets = offsets;
+        this.types = types;
+        this.values = values;
+    }
+
+    byte[] getAddress(int index) {
+        return Arrays.copyOfRange(addresses, index * 6, index * 6 + 6);
+    }
+
+    int[] getTypes(int index) {
+        return Arrays.copyOfRange(types, offsets[index], offsets[index + 1]);
+    }
+
+    byte[][] getValues(int index) {
+        return Arrays.copyOfRange(values, offsets[index], offsets[index + 1]);
+    }
+
+    // The natives below are only registered in builds with test hooks, see
+    // jni/Android.mk.
+
+    /**
+     * Collects the given devices into a batch the way native code does during
+     * discovery, merging devices found more than once.
+     */
+    @VisibleForTesting
+    static native DiscoveryBatch coalesceNative(byte[] addresses, int[] offsets, int[] types,
+            byte[][] values);
+
+    /**
+     * Turns batching on as startDiscovery() does, with batches going to the
+     * devicesFoundCallback(byte[], int[], int[], byte[][]) method of sink
+     * instead of RemoteDevices.
+     */
+    @VisibleForTesting
+    static native boolean startTestNative(Object sink, int intervalMs);
+
+    /** Reports a device found with the given RSSI. Returns false if batching is off. */
+    @VisibleForTesting
+    static native boolean foundTestNative(byte[] address, int rssi);
+
+    /** Turns batching off as the end of discovery does. */
+    @VisibleForTesting
+    static native void stopTestNative();
+}
@@ -58,6 +58,15 @@ final class JniCallbacks {
         mRemoteDevices.deviceFoundCallback(address);
     }
 
+    void deviceFoundWithPropertiesCallback(byte[] address, int[] types, byte[][] val) {
+        if (types.length > 0) mRemoteDevices.devicePropertyChangedCallback(address, types, val);
+        mRemoteDevices.deviceFoundCallback(address);
+    }
+
+    void devicesFoundCallback(byte[] addresses, int[] offsets, int[] types, byte[][] values) {
+        mRemoteDevices.devicesFoundCallback(new DiscoveryBatch(addresses, offsets, types, values));
+    }
+
     void pinRequestCallback(byte[] address, byte[] name, int cod, boolean min16Digits) {
         mBondStateMachine.pinRequestCallback(address, name, cod, min16Digits);
     }
@@ -69,6 +69,10 @@ final class RemoteDevices {
 
         if (mDeviceQueue != null)
             mDeviceQueue.clear();
+
+        // Native code only passes up properties that changed since it last
+        // passed them up, so it has to forget whatever is dropped here.
+        mAdapterService.forgetRemoteDevicePropertiesNative(null);
     }
 
     @Override
@@ -97,7 +101,9 @@ final class RemoteDevices {
             String key = Utils.getAddressStringFromByte(address);
             DeviceProperties pv = mDevices.put(key, prop);
 
-            if (pv == null) {
+            if (pv != null) {
+                mAdapterService.forgetRemoteDevicePropertiesNative(address);
+            } else {
                 mDeviceQueue.offer(key);
                 if (mDeviceQueue.size() > MAX_DEVICE_QUEUE_SIZE) {
                     String deleteKey = mDeviceQueue.poll();
@@ -106,6 +112,8 @@ final class RemoteDevices {
                     }
                     debugLog("Removing device " + deleteKey + " from property map");
                     mDevices.remove(deleteKey);
+                    mAdapterService.forgetRemoteDevicePropertiesNative(
+                            Utils.getBytesFromAddress(deleteKey));
                 }
             }
             return prop;
@@ -255,9 +263,6 @@ final class RemoteDevices {
 
 
     void devicePropertyChangedCallback(byte[] address, int[] types, byte[][] values) {
-        Intent intent;
-        byte[] val;
-        int type;
         BluetoothDevice bdDevice = getDevice(address);
         DeviceProperties device;
         if (bdDevice == null) {
@@ -267,8 +272,24 @@ final class RemoteDevices {
         } else {
             device = getDeviceProperties(bdDevice);
         }
+        if (device == null) return;
 
-        for (int j = 0; j < types.length && device != null; j++) {
+        ArrayList<Intent> intents = new ArrayList<Intent>();
+        ArrayList<BluetoothDevice> uuidDevices = new ArrayList<BluetoothDevice>();
+        updateDeviceProperties(device, bdDevice, types, values, intents, uuidDevices);
+        sendPropertyIntents(intents, uuidDevices);
+    }
+
+    // Applies the given properties to device. The broadcasts they call for are
+    // added to intents, and bdDevice is added to uuidDevices if its UUIDs
+    // changed, for the caller to send once it holds no locks.
+    private void updateDeviceProperties(DeviceProperties device, BluetoothDevice bdDevice,
+            int[] types, byte[][] values, ArrayList<Intent> intents,
+            ArrayList<BluetoothDevice> uuidDevices) {
+        Intent intent;
+        byte[] val;
+        int type;
+        for (int j = 0; j < types.length; j++) {
             type = types[j];
             val = values[j];
             if (val.length <= 0)
@@ -284,7 +305,7 @@ final class RemoteDevices {
                             intent.putExtra(BluetoothDevice.EXTRA_DEVICE, bdDevice);
                             intent.putExtra(BluetoothDevice.EXTRA_NAME, device.mName);
                             intent.addFlags(Intent.FLAG_RECEIVER_REGISTERED_ONLY_BEFORE_BOOT);
-                            mAdapterService.sendBroadcast(intent, mAdapterService.BLUETOOTH_PERM);
+                            intents.add(intent);
                             debugLog("Remote Device name is: " + device.mName);
                             break;
                         case AbstractionLayer.BT_PROPERTY_REMOTE_FRIENDLY_NAME:
@@ -306,7 +327,7 @@ final class RemoteDevices {
                             intent.putExtra(BluetoothDevice.EXTRA_CLASS,
                                     new BluetoothClass(device.mBluetoothClass));
                             intent.addFlags(Intent.FLAG_RECEIVER_REGISTERED_ONLY_BEFORE_BOOT);
-                            mAdapterService.sendBroadcast(intent, mAdapterService.BLUETOOTH_PERM);
+                            intents.add(intent);
                             debugLog("Remote class is:" + device.mBluetoothClass);
                             break;
                         case AbstractionLayer.BT_PROPERTY_UUIDS:
@@ -314,7 +335,7 @@ final class RemoteDevices {
                             int state = mAdapterService.getState();
                             device.mUuids = Utils.byteArrayToUuid(val);
                             if (state == BluetoothAdapter.STATE_ON)
-                                sendUuidIntent(bdDevice);
+                                uuidDevices.add(bdDevice);
                             break;
                         case AbstractionLayer.BT_PROPERTY_TYPE_OF_DEVICE:
                             // The device type from hal layer, defined in bluetooth.h,
@@ -331,6 +352,51 @@ final class RemoteDevices {
         }
     }
 
+    private void sendPropertyIntents(ArrayList<Intent> intents,
+            ArrayList<BluetoothDevice> uuidDevices) {
+        for (Intent intent : intents) {
+            mAdapterService.sendBroadcast(intent, mAdapterService.BLUETOOTH_PERM);
+        }
+        for (BluetoothDevice device : uuidDevices) {
+            sendUuidIntent(device);
+        }
+    }
+
+    void devicesFoundCallback(DiscoveryBatch batch) {
+        debugLog("devicesFoundCallback: " + batch.count + " devices");
+        ArrayList<Intent> intents = new ArrayList<Intent>();
+        ArrayList<BluetoothDevice> uuidDevices = new ArrayList<BluetoothDevice>();
+        ArrayList<Intent> foundIntents = new ArrayList<Intent>(batch.count);
+
+        // Resolve the whole batch under one lock, and broadcast once it is
+        // released.
+        synchronized (mDevices) {
+            for (int i = 0; i < batch.count; i++) {
+                byte[] address = batch.getAddress(i);
+                int[] types = batch.getTypes(i);
+                DeviceProperties device = mDevices.get(Utils.getAddressStringFromByte(address));
+                if (device == null) {
+                    if (types.length == 0) {
+                        errorLog("Device Properties is null for Device:"
+                                + Utils.getAddressStringFromByte(address));
+                        continue;
+                    }
+                    debugLog("Added new device property");
+                    device = addDeviceProperties(address);
+                }
+                BluetoothDevice bdDevice = device.getDevice();
+                updateDeviceProperties(device, bdDevice, types, batch.getValues(i), intents,
+                        uuidDevices);
+                foundIntents.add(newFoundIntent(bdDevice, device));
+            }
+        }
+
+        sendPropertyIntents(intents, uuidDevices);
+        for (Intent intent : foundIntents) {
+            sendFoundIntent(intent);
+        }
+    }
+
     void deviceFoundCallback(byte[] address) {
         // The device properties are already registered - we can send the intent
         // now
@@ -342,13 +408,20 @@ final class RemoteDevices {
             return;
         }
 
+        sendFoundIntent(newFoundIntent(device, deviceProp));
+    }
+
+    private Intent newFoundIntent(BluetoothDevice device, DeviceProperties deviceProp) {
         Intent intent = new Intent(BluetoothDevice.ACTION_FOUND);
         intent.putExtra(BluetoothDevice.EXTRA_DEVICE, device);
         intent.putExtra(BluetoothDevice.EXTRA_CLASS,
                 new BluetoothClass(deviceProp.mBluetoothClass));
         intent.putExtra(BluetoothDevice.EXTRA_RSSI, deviceProp.mRssi);
         intent.putExtra(BluetoothDevice.EXTRA_NAME, deviceProp.mName);
+        return intent;
+    }
 
+    private void sendFoundIntent(Intent intent) {
         mAdapterService.sendBroadcastMultiplePermissions(intent,
                 new String[] {AdapterService.BLUETOOTH_PERM,
                         android.Manifest.permission.ACCESS_COARSE_LOCATION});
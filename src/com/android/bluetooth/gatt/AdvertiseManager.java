@@ -129,6 +129,56 @@ class AdvertiseManager {
         mHandler.sendMessage(message);
     }
 
+    /**
+     * Registers advertising data, or a scan response, with native code once so it can be set
+     * on an instance by handle. Registering the same data again returns the same handle.
+     *
+     * @return Handle of the payload, or -1 if it does not fit in one advertising packet.
+     */
+    int registerPayload(AdvertiseData data, boolean isScanResponse) {
+        return mAdvertiseNative.registerPayload(data, isScanResponse);
+    }
+
+    /**
+     * Drops a reference taken by {@link #registerPayload}.
+     */
+    void releasePayload(int handle) {
+        mAdvertiseNative.gattClientReleaseAdvPayloadNative(handle);
+    }
+
+    /**
+     * Sets a registered payload on the advertising instance of a client and waits for the
+     * stack to confirm it.
+     */
+    boolean setPayload(int clientIf, int handle) {
+        if (!mAdapterService.isMultiAdvertisementSupported()) {
+            return false;
+        }
+        return mAdvertiseNative.setPayload(clientIf, handle);
+    }
+
+    /**
+     * Cycles the advertising instance of a client through registered payloads, one every
+     * intervalMillis, without further calls from Java. The instance must be started and its
+     * data must not be set by other means until the rotation is stopped. Stopping advertising
+     * stops the rotation as well.
+     *
+     * @return false if multiple advertising is not supported or the rotation is invalid.
+     */
+    boolean startRotation(int clientIf, int[] handles, int intervalMillis) {
+        if (!mAdapterService.isMultiAdvertisementSupported()) {
+            return false;
+        }
+        logd("start rotation for client " + clientIf + " over " + handles.length
+                + " payloads");
+        return mAdvertiseNative.gattClientStartAdvRotationNative(clientIf, handles,
+                intervalMillis);
+    }
+
+    void stopRotation(int clientIf) {
+        mAdvertiseNative.gattClientStopAdvRotationNative(clientIf);
+    }
+
     /**
      * Signals the callback is received.
      *
@@ -376,24 +426,8 @@ class AdvertiseManager {
             boolean includeTxPower = data.getIncludeTxPowerLevel();
             int appearance = 0;
             byte[] manufacturerData = getManufacturerData(data);
-
             byte[] serviceData = getServiceData(data);
-            byte[] serviceUuids;
-            if (data.getServiceUuids() == null) {
-                serviceUuids = new byte[0];
-            } else {
-                ByteBuffer advertisingUuidBytes = ByteBuffer.allocate(
-                        data.getServiceUuids().size() * 16)
-                        .order(ByteOrder.LITTLE_ENDIAN);
-                for (ParcelUuid parcelUuid : data.getServiceUuids()) {
-                    UUID uuid = parcelUuid.getUuid();
-                    // Least significant bits first as the advertising UUID should be in
-                    // little-endian.
-                    advertisingUuidBytes.putLong(uuid.getLeastSignificantBits())
-                            .putLong(uuid.getMostSignificantBits());
-                }
-                serviceUuids = advertisingUuidBytes.array();
-            }
+            byte[] serviceUuids = getServiceUuids(data);
             if (mAdapterService.isMultiAdvertisementSupported()) {
                 gattClientSetAdvDataNative(client.clientIf, isScanResponse, includeName,
                         includeTxPower, appearance,
@@ -405,6 +439,38 @@ class AdvertiseManager {
             }
         }
 
+        int registerPayload(AdvertiseData data, boolean isScanResponse) {
+            int appearance = 0;
+            return gattClientRegisterAdvPayloadNative(isScanResponse,
+                    data.getIncludeDeviceName(), data.getIncludeTxPowerLevel(), appearance,
+                    getManufacturerData(data), getServiceData(data), getServiceUuids(data));
+        }
+
+        boolean setPayload(int clientIf, int handle) {
+            resetCountDownLatch();
+            if (!gattClientSetAdvPayloadNative(clientIf, handle)) {
+                return false;
+            }
+            return waitForCallback();
+        }
+
+        private byte[] getServiceUuids(AdvertiseData data) {
+            if (data.getServiceUuids() == null) {
+                return new byte[0];
+            }
+            ByteBuffer advertisingUuidBytes = ByteBuffer.allocate(
+                    data.getServiceUuids().size() * 16)
+                    .order(ByteOrder.LITTLE_ENDIAN);
+            for (ParcelUuid parcelUuid : data.getServiceUuids()) {
+                UUID uuid = parcelUuid.getUuid();
+                // Least significant bits first as the advertising UUID should be in
+                // little-endian.
+                advertisingUuidBytes.putLong(uuid.getLeastSignificantBits())
+                        .putLong(uuid.getMostSignificantBits());
+            }
+            return advertisingUuidBytes.array();
+        }
+
         // Combine manufacturer id and manufacturer data.
         private byte[] getManufacturerData(AdvertiseData advertiseData) {
             if (advertiseData.getManufacturerSpecificData().size() == 0) {
@@ -507,6 +573,19 @@ class AdvertiseManager {
                 int appearance, byte[] manufacturerData, byte[] serviceData, byte[] serviceUuid);
 
         private native void gattAdvertiseNative(int client_if, boolean start);
+
+        private native int gattClientRegisterAdvPayloadNative(boolean set_scan_rsp,
+                boolean incl_name, boolean incl_txpower, int appearance,
+                byte[] manufacturer_data, byte[] service_data, byte[] service_uuid);
+
+        private native void gattClientReleaseAdvPayloadNative(int handle);
+
+        private native boolean gattClientSetAdvPayloadNative(int client_if, int handle);
+
+        private native boolean gattClientStartAdvRotationNative(int client_if, int[] handles,
+                int interval_ms);
+
+        private native void gattClientStopAdvRotationNative(int client_if);
     }
 
     private void logd(String s) {
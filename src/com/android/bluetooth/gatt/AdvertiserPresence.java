@@ -0,0 +1,85 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+package com.android.bluetooth.gatt;
+
+/**
+ * An advertiser currently reported present by an on-found / on-lost tracking filter.
+ *
+ * @hide
+ */
+public class AdvertiserPresence {
+    private final String mAddress;
+    private final int mClientIf;
+    private final long mFirstSeenNanos;
+    private final long mLastSeenNanos;
+    private final int mRssi;
+    private final int mMinRssi;
+    private final int mMaxRssi;
+    private final int mAverageRssi;
+    private final int mTxPower;
+
+    public AdvertiserPresence(String address, int clientIf, long firstSeenNanos,
+            long lastSeenNanos, int rssi, int minRssi, int maxRssi, int averageRssi,
+            int txPower) {
+        mAddress = address;
+        mClientIf = clientIf;
+        mFirstSeenNanos = firstSeenNanos;
+        mLastSeenNanos = lastSeenNanos;
+        mRssi = rssi;
+        mMinRssi = minRssi;
+        mMaxRssi = maxRssi;
+        mAverageRssi = averageRssi;
+        mTxPower = txPower;
+    }
+
+    public String getAddress() {
+        return mAddress;
+    }
+
+    public int getClientIf() {
+        return mClientIf;
+    }
+
+    /** Elapsed realtime at which the advertiser was last found. */
+    public long getFirstSeenNanos() {
+        return mFirstSeenNanos;
+    }
+
+    public long getLastSeenNanos() {
+        return mLastSeenNanos;
+    }
+
+    public int getRssi() {
+        return mRssi;
+    }
+
+    public int getMinRssi() {
+        return mMinRssi;
+    }
+
+    public int getMaxRssi() {
+        return mMaxRssi;
+    }
+
+    public int getAverageRssi() {
+        return mAverageRssi;
+    }
+
+    public int getTxPower() {
+        return mTxPower;
+    }
+}
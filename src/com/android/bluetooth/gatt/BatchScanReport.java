@@ -0,0 +1,66 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+package com.android.bluetooth.gatt;
+
+import com.android.internal.annotations.VisibleForTesting;
+
+import java.util.Arrays;
+
+/**
+ * Batch scan report decoded by native code into columns, one entry per
+ * record. Addresses are stored most significant byte first, six bytes per
+ * record, and timestamps are already converted to elapsed realtime nanos.
+ *
+ * For full reports the advertising data and scan response of record i are
+ * concatenated in {@link #records} between recordOffsets[i] and
+ * recordOffsets[i + 1]. Truncated reports carry no scan records.
+ * @hide
+ */
+/*package*/
+
+class BatchScanReport {
+    final int reportType;
+    final int count;
+    final byte[] addresses;
+    final int[] rssi;
+    final long[] timestampsNanos;
+    final byte[] records;
+    final int[] recordOffsets;
+
+    BatchScanReport(int reportType, int count, byte[] addresses, int[] rssi,
+            long[] timestampsNanos, byte[] records, int[] recordOffsets) {
+        this.reportType = reportType;
+        this.count = count;
+        this.addresses = addresses;
+        this.rssi = rssi;
+        this.timestampsNanos = timestampsNanos;
+        this.records = records;
+        this.recordOffsets = recordOffsets;
+    }
+
+    byte[] getAddress(int index) {
+        return Arrays.copyOfRange(addresses, index * 6, index * 6 + 6);
+    }
+
+    /** Returns the combined advertising data and scan response of a record. */
+    byte[] getScanRecord(int index) {
+        if (records == null) return new byte[0];
+        return Arrays.copyOfRange(records, recordOffsets[index], recordOffsets[index + 1]);
+    }
+
+    @VisibleForTesting
+    static native BatchScanReport parseNative(int reportType, int numRecords, byte[] data);
+}
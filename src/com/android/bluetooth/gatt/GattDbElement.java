@@ -22,8 +22,9 @@ import java.util.List;
 import java.util.UUID;
 
 /**
- * Helper class for passing gatt db elements between java and JNI, equal to
- * native btgatt_db_element_t.
+ * Helper class describing gatt db elements, equal to native
+ * btgatt_db_element_t. The JNI layer passes the database as flat arrays, see
+ * GattService.onGetGattDb(); the TYPE_ constants match the native types.
  * @hide
  */
 public class GattDbElement {
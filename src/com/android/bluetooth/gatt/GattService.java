@@ -39,7 +39,9 @@ import android.bluetooth.le.ScanResult;
 import android.bluetooth.le.ScanSettings;
 import android.content.Intent;
 import android.os.Binder;
+import android.os.Handler;
 import android.os.IBinder;
+import android.os.Looper;
 import android.os.ParcelUuid;
 import android.os.RemoteException;
 import android.os.SystemClock;
@@ -53,9 +55,10 @@ import com.android.bluetooth.btservice.AdapterService;
 import com.android.bluetooth.btservice.BluetoothProto;
 import com.android.bluetooth.a2dp.A2dpService;
 import com.android.bluetooth.btservice.ProfileService;
-import com.android.bluetooth.util.NumberUtils;
 import com.android.internal.annotations.VisibleForTesting;
 
+import java.io.File;
+import java.nio.ByteBuffer;
 import java.util.ArrayList;
 import java.util.Arrays;
 import java.util.Collections;
@@ -65,7 +68,7 @@ import java.util.List;
 import java.util.Map;
 import java.util.Set;
 import java.util.UUID;
-import java.util.concurrent.TimeUnit;
+import java.util.concurrent.ConcurrentHashMap;
 
 import static android.content.pm.PackageManager.PERMISSION_GRANTED;
 /**
@@ -82,14 +85,32 @@ public class GattService extends ProfileService {
     static final int SCAN_FILTER_MODIFIED = 2;
 
     private static final int MAC_ADDRESS_LENGTH = 6;
-    // Batch scan related constants.
-    private static final int TRUNCATED_RESULT_SIZE = 11;
-    private static final int TIME_STAMP_LENGTH = 2;
+    // Size of the advertising data + scan response reported by the stack.
+    private static final int SCAN_ADV_DATA_LENGTH = 62;
+
+    /** File under the app data dir holding the persisted GATT database cache. */
+    private static final String GATT_DB_CACHE_FILE = "gatt_db_cache.bin";
+
+    // Ints per response passed to gattServerSendResponsesNative(): request id,
+    // status, handle, offset and value length.
+    private static final int RESPONSE_FIELDS = 5;
 
     // onFoundLost related constants
     private static final int ADVT_STATE_ONFOUND = 0;
     private static final int ADVT_STATE_ONLOST = 1;
 
+    // Longs per advertiser returned by gattClientGetPresenceSnapshotNative(): address,
+    // clientIf, first and last seen nanos, RSSI, min, max and mean RSSI, TX power.
+    private static final int PRESENCE_FIELDS = 9;
+
+    // RSSI smoothing filters of startProximityWatch().
+    static final int PROXIMITY_FILTER_EMA = 0;
+    static final int PROXIMITY_FILTER_MEDIAN = 1;
+    static final int PROXIMITY_FILTER_KALMAN = 2;
+
+    // How often proximity watches are checked for devices that went quiet.
+    private static final long PROXIMITY_CHECK_INTERVAL_MS = 2000;
+
     private static final UUID[] HID_UUIDS = {
         UUID.fromString("00002A4A-0000-1000-8000-00805F9B34FB"),
         UUID.fromString("00002A4B-0000-1000-8000-00805F9B34FB"),
@@ -130,6 +151,15 @@ public class GattService extends ProfileService {
     private Map<Integer, List<BluetoothGattService>> gattClientDatabases =
             new HashMap<Integer, List<BluetoothGattService>>();
 
+    /**
+     * Direct notification buffers registered with native code, by connection id.
+     */
+    private boolean mNotifyBufferPoolEnabled;
+    private boolean mGattDbCacheEnabled;
+    private boolean mGattDbCacheUnbonded;
+    private Map<Integer, NotifyBufferPool> mNotifyBufferPools =
+            new ConcurrentHashMap<Integer, NotifyBufferPool>();
+
     static final int NUM_SCAN_EVENTS_KEPT = 20;
     /**
      * Internal list of scan events to use with the proto
@@ -171,6 +201,16 @@ public class GattService extends ProfileService {
     private ScanManager mScanManager;
     private AppOpsManager mAppOps;
 
+    private final Handler mProximityHandler = new Handler(Looper.getMainLooper());
+    private final Runnable mProximityCheck = new Runnable() {
+        @Override
+        public void run() {
+            if (gattClientCheckProximityNative() > 0) {
+                mProximityHandler.postDelayed(this, PROXIMITY_CHECK_INTERVAL_MS);
+            }
+        }
+    };
+
     /**
      * Reliable write queue
      */
@@ -193,6 +233,12 @@ public class GattService extends ProfileService {
     protected boolean start() {
         if (DBG) Log.d(TAG, "start()");
         initializeNative();
+        mNotifyBufferPoolEnabled = getResources().getBoolean(R.bool.gatt_notify_buffer_pool);
+        mGattDbCacheEnabled = getResources().getBoolean(R.bool.gatt_db_cache);
+        mGattDbCacheUnbonded = getResources().getBoolean(R.bool.gatt_db_cache_unbonded);
+        if (mGattDbCacheEnabled) {
+            gattClientInitDbCacheNative(new File(getFilesDir(), GATT_DB_CACHE_FILE).getPath());
+        }
         mAppOps = getSystemService(AppOpsManager.class);
         mAdvertiseManager = new AdvertiseManager(this, AdapterService.getAdapterService());
         mAdvertiseManager.start();
@@ -210,6 +256,8 @@ public class GattService extends ProfileService {
         mHandleMap.clear();
         mServiceDeclarations.clear();
         mReliableQueue.clear();
+        mNotifyBufferPools.clear();
+        mProximityHandler.removeCallbacks(mProximityCheck);
         if (mAdvertiseManager != null) {
             mAdvertiseManager.cleanup();
             mAdvertiseManager = null;
@@ -630,14 +678,43 @@ public class GattService extends ProfileService {
      * Callback functions - CLIENT
      *************************************************************************/
 
-    void onScanResult(String address, int rssi, byte[] adv_data) {
+    void onScanResult(String address, int rssi, byte[] adv_data, int clientMask) {
+        handleScanResult(address, rssi, adv_data, SystemClock.elapsedRealtimeNanos(), clientMask);
+    }
+
+    // Callback for results coalesced by the native scan batching stage. Each
+    // record in |packed| is a 6 byte address followed by the significant part
+    // of the advertising data, bounded by |offsets[i]| and |offsets[i + 1]|.
+    void onBatchedScanResults(int count, byte[] packed, int[] offsets, int[] rssi,
+            long[] timestampsNanos, int[] clientMasks) {
+        if (VDBG) Log.d(TAG, "onBatchedScanResults() - count=" + count);
+        for (int i = 0; i < count; ++i) {
+            int start = offsets[i];
+            int advLen = offsets[i + 1] - start - MAC_ADDRESS_LENGTH;
+            String address = Utils.getAddressStringFromByte(
+                    extractBytes(packed, start, MAC_ADDRESS_LENGTH));
+            byte[] advData = new byte[SCAN_ADV_DATA_LENGTH];
+            System.arraycopy(packed, start + MAC_ADDRESS_LENGTH, advData, 0, advLen);
+            handleScanResult(address, rssi[i], advData, timestampsNanos[i], clientMasks[i]);
+        }
+    }
+
+    // |clientMask| holds the native pre-filter slots that may match this result; clients
+    // whose slot bit is clear are skipped without running their filters.
+    private void handleScanResult(String address, int rssi, byte[] adv_data,
+            long timestampNanos, int clientMask) {
         if (VDBG) Log.d(TAG, "onScanResult() - address=" + address
                     + ", rssi=" + rssi);
-        List<UUID> remoteUuids = parseUuids(adv_data);
+        List<UUID> remoteUuids = null;
         addScanResult();
 
         for (ScanClient client : mScanManager.getRegularScanQueue()) {
+            if (client.prefilterSlot >= 0 && (clientMask & (1 << client.prefilterSlot)) == 0) {
+                continue;
+            }
+
             if (client.uuids.length > 0) {
+                if (remoteUuids == null) remoteUuids = parseUuids(adv_data);
                 int matches = 0;
                 for (UUID search : client.uuids) {
                     for (UUID remote: remoteUuids) {
@@ -657,7 +734,7 @@ public class GattService extends ProfileService {
                     BluetoothDevice device = BluetoothAdapter.getDefaultAdapter()
                             .getRemoteDevice(address);
                     ScanResult result = new ScanResult(device, ScanRecord.parseFromBytes(adv_data),
-                            rssi, SystemClock.elapsedRealtimeNanos());
+                            rssi, timestampNanos);
                     // Do no report if location mode is OFF or the client has no location permission
                     // PEERS_MAC_ADDRESS permission holders always get results
                     if (hasScanResultPermission(client) && matchesFilters(client, result)) {
@@ -737,7 +814,16 @@ public class GattService extends ProfileService {
         if (DBG) Log.d(TAG, "onConnected() - clientIf=" + clientIf
             + ", connId=" + connId + ", address=" + address);
 
-        if (status == 0) mClientMap.addConnection(clientIf, connId, address);
+        if (status == 0) {
+            mClientMap.addConnection(clientIf, connId, address);
+            if (mNotifyBufferPoolEnabled) {
+                NotifyBufferPool pool = new NotifyBufferPool(connId);
+                if (gattClientRegisterNotifyBufferNative(connId, pool.buffer,
+                        NotifyBufferPool.SLOT_SIZE)) {
+                    mNotifyBufferPools.put(connId, pool);
+                }
+            }
+        }
         ClientMap.App app = mClientMap.getById(clientIf);
         if (app != null) {
             app.callback.onClientConnectionState(status, clientIf,
@@ -751,6 +837,9 @@ public class GattService extends ProfileService {
             + ", connId=" + connId + ", address=" + address);
 
         mClientMap.removeConnection(clientIf, connId);
+        if (mNotifyBufferPools.remove(connId) != null) {
+            gattClientUnregisterNotifyBufferNative(connId);
+        }
         ClientMap.App app = mClientMap.getById(clientIf);
         if (app != null) {
             app.callback.onClientConnectionState(status, clientIf, false, address);
@@ -771,11 +860,11 @@ public class GattService extends ProfileService {
         t.start();
     }
 
-    GattDbElement GetSampleGattDbElement() {
-        return new GattDbElement();
-    }
-
-    void onGetGattDb(int connId, ArrayList<GattDbElement> db) throws RemoteException {
+    // The database arrives as parallel arrays with one entry per element, see
+    // btgattc_get_gatt_db_cb(). |handles| holds the attribute, start and end
+    // handle of each element.
+    void onGetGattDb(int connId, int[] ids, int[] types, int[] handles, int[] properties,
+            long[] uuidMsb, long[] uuidLsb) throws RemoteException {
         String address = mClientMap.addressByConnId(connId);
 
         if (DBG) Log.d(TAG, "onGetGattDb() - address=" + address);
@@ -791,38 +880,39 @@ public class GattService extends ProfileService {
         BluetoothGattService currSrvc = null;
         BluetoothGattCharacteristic currChar = null;
 
-        for (GattDbElement el: db) {
-            switch (el.type)
+        for (int i = 0; i < ids.length; i++) {
+            UUID uuid = new UUID(uuidMsb[i], uuidLsb[i]);
+            switch (types[i])
             {
                 case GattDbElement.TYPE_PRIMARY_SERVICE:
                 case GattDbElement.TYPE_SECONDARY_SERVICE:
-                    if (DBG) Log.d(TAG, "got service with UUID=" + el.uuid);
+                    if (DBG) Log.d(TAG, "got service with UUID=" + uuid);
 
-                    currSrvc = new BluetoothGattService(el.uuid, el.id, el.type);
+                    currSrvc = new BluetoothGattService(uuid, ids[i], types[i]);
                     db_out.add(currSrvc);
                     break;
 
                 case GattDbElement.TYPE_CHARACTERISTIC:
-                    if (DBG) Log.d(TAG, "got characteristic with UUID=" + el.uuid);
+                    if (DBG) Log.d(TAG, "got characteristic with UUID=" + uuid);
 
-                    currChar = new BluetoothGattCharacteristic(el.uuid, el.id, el.properties, 0);
+                    currChar = new BluetoothGattCharacteristic(uuid, ids[i], properties[i], 0);
                     currSrvc.addCharacteristic(currChar);
                     break;
 
                 case GattDbElement.TYPE_DESCRIPTOR:
-                    if (DBG) Log.d(TAG, "got descriptor with UUID=" + el.uuid);
+                    if (DBG) Log.d(TAG, "got descriptor with UUID=" + uuid);
 
-                    currChar.addDescriptor(new BluetoothGattDescriptor(el.uuid, el.id, 0));
+                    currChar.addDescriptor(new BluetoothGattDescriptor(uuid, ids[i], 0));
                     break;
 
                 case GattDbElement.TYPE_INCLUDED_SERVICE:
-                    if (DBG) Log.d(TAG, "got included service with UUID=" + el.uuid);
+                    if (DBG) Log.d(TAG, "got included service with UUID=" + uuid);
 
-                    currSrvc.addIncludedService(new BluetoothGattService(el.uuid, el.id, el.type));
+                    currSrvc.addIncludedService(new BluetoothGattService(uuid, ids[i], types[i]));
                     break;
 
                 default:
-                    Log.e(TAG, "got unknown element with type=" + el.type + " and UUID=" + el.uuid);
+                    Log.e(TAG, "got unknown element with type=" + types[i] + " and UUID=" + uuid);
             }
         }
 
@@ -856,6 +946,23 @@ public class GattService extends ProfileService {
         }
     }
 
+    // Notification whose value was written by native code into |slot| of the
+    // direct buffer registered for |connId|.
+    void onNotifyPooled(int connId, int handle, boolean isNotify, int slot, int length)
+            throws RemoteException {
+        NotifyBufferPool pool = mNotifyBufferPools.get(connId);
+        ClientMap.App app = mClientMap.getByConnId(connId);
+        if (pool == null || app == null) return;
+
+        byte[] data = pool.read(slot, length);
+        // Remote callbacks marshal the value before returning, so the scratch
+        // array can be reused. In-process callbacks get their own copy.
+        if (app.callback.asBinder() instanceof Binder) {
+            data = data.clone();
+        }
+        onNotify(connId, mClientMap.addressByConnId(connId), handle, isNotify, data);
+    }
+
     void onReadCharacteristic(int connId, int status, int handle, byte[] data) throws RemoteException {
         String address = mClientMap.addressByConnId(connId);
 
@@ -868,6 +975,23 @@ public class GattService extends ProfileService {
         }
     }
 
+    void onReadBatchCompleted(int connId, int[] handles, int[] statuses, int[] offsets,
+            byte[] values) throws RemoteException {
+        String address = mClientMap.addressByConnId(connId);
+
+        if (VDBG) Log.d(TAG, "onReadBatchCompleted() - address=" + address
+            + ", count=" + handles.length + ", length=" + values.length);
+
+        ClientMap.App app = mClientMap.getByConnId(connId);
+        if (app == null) return;
+
+        for (int i = 0; i < handles.length; i++) {
+            byte[] data = statuses[i] == 0
+                    ? Arrays.copyOfRange(values, offsets[i], offsets[i + 1]) : new byte[1];
+            app.callback.onCharacteristicRead(address, statuses[i], handles[i], data);
+        }
+    }
+
     void onWriteCharacteristic(int connId, int status, int handle)
             throws RemoteException {
         String address = mClientMap.addressByConnId(connId);
@@ -889,6 +1013,19 @@ public class GattService extends ProfileService {
         }
     }
 
+    void onBulkWriteCompleted(int connId, int status, int handle, int bytesWritten)
+            throws RemoteException {
+        String address = mClientMap.addressByConnId(connId);
+
+        if (VDBG) Log.d(TAG, "onBulkWriteCompleted() - address=" + address
+            + ", status=" + status + ", bytesWritten=" + bytesWritten);
+
+        ClientMap.App app = mClientMap.getByConnId(connId);
+        if (app != null) {
+            app.callback.onCharacteristicWrite(address, status, handle);
+        }
+    }
+
     void onExecuteCompleted(int connId, int status) throws RemoteException {
         String address = mClientMap.addressByConnId(connId);
         if (VDBG) Log.d(TAG, "onExecuteCompleted() - address=" + address
@@ -952,6 +1089,13 @@ public class GattService extends ProfileService {
         mScanManager.callbackDone(clientIf, status);
     }
 
+    void onScanFilterProgrammed(int clientIf, int status) {
+        if (DBG) {
+            Log.d(TAG, "onScanFilterProgrammed() - clientIf=" + clientIf + ", status=" + status);
+        }
+        mScanManager.callbackDone(clientIf, status);
+    }
+
     void onScanFilterConfig(int action, int status, int clientIf, int filterType,
             int availableSpace) {
         if (DBG) {
@@ -979,15 +1123,17 @@ public class GattService extends ProfileService {
         mScanManager.callbackDone(clientIf, status);
     }
 
-    void onBatchScanReports(int status, int clientIf, int reportType, int numRecords,
-            byte[] recordData) throws RemoteException {
+    void onBatchScanReports(int status, int clientIf, BatchScanReport report)
+            throws RemoteException {
         if (DBG) {
             Log.d(TAG, "onBatchScanReports() - clientIf=" + clientIf + ", status=" + status
-                    + ", reportType=" + reportType + ", numRecords=" + numRecords);
+                    + ", reportType=" + (report == null ? -1 : report.reportType)
+                    + ", numRecords=" + (report == null ? 0 : report.count));
         }
         mScanManager.callbackDone(clientIf, status);
-        Set<ScanResult> results = parseBatchScanResults(numRecords, reportType, recordData);
-        if (reportType == ScanManager.SCAN_RESULT_TYPE_TRUNCATED) {
+        if (report == null) return;
+        Set<ScanResult> results = parseBatchScanResults(report);
+        if (report.reportType == ScanManager.SCAN_RESULT_TYPE_TRUNCATED) {
             // We only support single client for truncated mode.
             ClientMap.App app = mClientMap.getById(clientIf);
             if (app == null) return;
@@ -1018,91 +1164,20 @@ public class GattService extends ProfileService {
         app.callback.onBatchScanResults(results);
     }
 
-    private Set<ScanResult> parseBatchScanResults(int numRecords, int reportType,
-            byte[] batchRecord) {
-        if (numRecords == 0) {
+    private Set<ScanResult> parseBatchScanResults(BatchScanReport report) {
+        if (report.count == 0) {
             return Collections.emptySet();
         }
-        if (DBG) Log.d(TAG, "current time is " + SystemClock.elapsedRealtimeNanos());
-        if (reportType == ScanManager.SCAN_RESULT_TYPE_TRUNCATED) {
-            return parseTruncatedResults(numRecords, batchRecord);
-        } else {
-            return parseFullResults(numRecords, batchRecord);
-        }
-    }
-
-    private Set<ScanResult> parseTruncatedResults(int numRecords, byte[] batchRecord) {
-        if (DBG) Log.d(TAG, "batch record " + Arrays.toString(batchRecord));
-        Set<ScanResult> results = new HashSet<ScanResult>(numRecords);
-        long now = SystemClock.elapsedRealtimeNanos();
-        for (int i = 0; i < numRecords; ++i) {
-            byte[] record = extractBytes(batchRecord, i * TRUNCATED_RESULT_SIZE,
-                    TRUNCATED_RESULT_SIZE);
-            byte[] address = extractBytes(record, 0, 6);
-            reverse(address);
-            BluetoothDevice device = mAdapter.getRemoteDevice(address);
-            int rssi = record[8];
-            long timestampNanos = now - parseTimestampNanos(extractBytes(record, 9, 2));
-            results.add(new ScanResult(device, ScanRecord.parseFromBytes(new byte[0]),
-                    rssi, timestampNanos));
+        Set<ScanResult> results = new HashSet<ScanResult>(report.count);
+        for (int i = 0; i < report.count; ++i) {
+            BluetoothDevice device = mAdapter.getRemoteDevice(report.getAddress(i));
+            results.add(new ScanResult(device,
+                    ScanRecord.parseFromBytes(report.getScanRecord(i)),
+                    report.rssi[i], report.timestampsNanos[i]));
         }
         return results;
     }
 
-    @VisibleForTesting
-    long parseTimestampNanos(byte[] data) {
-        long timestampUnit = NumberUtils.littleEndianByteArrayToInt(data);
-        // Timestamp is in every 50 ms.
-        return TimeUnit.MILLISECONDS.toNanos(timestampUnit * 50);
-    }
-
-    private Set<ScanResult> parseFullResults(int numRecords, byte[] batchRecord) {
-        Log.d(TAG, "Batch record : " + Arrays.toString(batchRecord));
-        Set<ScanResult> results = new HashSet<ScanResult>(numRecords);
-        int position = 0;
-        long now = SystemClock.elapsedRealtimeNanos();
-        while (position < batchRecord.length) {
-            byte[] address = extractBytes(batchRecord, position, 6);
-            // TODO: remove temp hack.
-            reverse(address);
-            BluetoothDevice device = mAdapter.getRemoteDevice(address);
-            position += 6;
-            // Skip address type.
-            position++;
-            // Skip tx power level.
-            position++;
-            int rssi = batchRecord[position++];
-            long timestampNanos = now - parseTimestampNanos(extractBytes(batchRecord, position, 2));
-            position += 2;
-
-            // Combine advertise packet and scan response packet.
-            int advertisePacketLen = batchRecord[position++];
-            byte[] advertiseBytes = extractBytes(batchRecord, position, advertisePacketLen);
-            position += advertisePacketLen;
-            int scanResponsePacketLen = batchRecord[position++];
-            byte[] scanResponseBytes = extractBytes(batchRecord, position, scanResponsePacketLen);
-            position += scanResponsePacketLen;
-            byte[] scanRecord = new byte[advertisePacketLen + scanResponsePacketLen];
-            System.arraycopy(advertiseBytes, 0, scanRecord, 0, advertisePacketLen);
-            System.arraycopy(scanResponseBytes, 0, scanRecord,
-                    advertisePacketLen, scanResponsePacketLen);
-            Log.d(TAG, "ScanRecord : " + Arrays.toString(scanRecord));
-            results.add(new ScanResult(device, ScanRecord.parseFromBytes(scanRecord),
-                    rssi, timestampNanos));
-        }
-        return results;
-    }
-
-    // Reverse byte array.
-    private void reverse(byte[] address) {
-        int len = address.length;
-        for (int i = 0; i < len / 2; ++i) {
-            byte b = address[i];
-            address[i] = address[len - 1 - i];
-            address[len - 1 - i] = b;
-        }
-    }
-
     // Helper method to extract bytes from byte array.
     private static byte[] extractBytes(byte[] scanRecord, int start, int length) {
         byte[] bytes = new byte[length];
@@ -1118,15 +1193,19 @@ public class GattService extends ProfileService {
         flushPendingBatchResults(clientIf, isServer);
     }
 
-    AdvtFilterOnFoundOnLostInfo CreateonTrackAdvFoundLostObject(int client_if, int adv_pkt_len,
+    // Called by native code only when a tracked advertiser changes between found and lost.
+    void onTrackAdvFoundLostEvent(int client_if, int adv_pkt_len,
                     byte[] adv_pkt, int scan_rsp_len, byte[] scan_rsp, int filt_index, int adv_state,
                     int adv_info_present, String address, int addr_type, int tx_power, int rssi_value,
                     int time_stamp) {
-
-        return new AdvtFilterOnFoundOnLostInfo(client_if, adv_pkt_len, adv_pkt,
+        try {
+            onTrackAdvFoundLost(new AdvtFilterOnFoundOnLostInfo(client_if, adv_pkt_len, adv_pkt,
                     scan_rsp_len, scan_rsp, filt_index, adv_state,
                     adv_info_present, address, addr_type, tx_power,
-                    rssi_value, time_stamp);
+                    rssi_value, time_stamp));
+        } catch (RemoteException e) {
+            Log.e(TAG, "Exception: " + e);
+        }
     }
 
     void onTrackAdvFoundLost(AdvtFilterOnFoundOnLostInfo trackingInfo) throws RemoteException {
@@ -1167,6 +1246,28 @@ public class GattService extends ProfileService {
         }
     }
 
+    // Zone change of a proximity watch. It reaches the app as onFoundOrLost(), with the
+    // smoothed RSSI in place of a sample and the last advertising data of the device,
+    // which is empty if it was only seen through readRemoteRssi().
+    void onProximityChanged(int clientIf, String address, boolean inside, int rssi,
+            int distanceCm, byte[] advData) {
+        if (DBG) Log.d(TAG, "onProximityChanged() - clientIf=" + clientIf
+                    + ", address=" + address + ", inside=" + inside + ", rssi=" + rssi
+                    + ", distanceCm=" + distanceCm);
+
+        ClientMap.App app = mClientMap.getById(clientIf);
+        if (app == null || app.callback == null) return;
+
+        BluetoothDevice device = BluetoothAdapter.getDefaultAdapter().getRemoteDevice(address);
+        ScanResult result = new ScanResult(device, ScanRecord.parseFromBytes(advData), rssi,
+                SystemClock.elapsedRealtimeNanos());
+        try {
+            app.callback.onFoundOrLost(inside, result);
+        } catch (RemoteException e) {
+            Log.e(TAG, "Exception: " + e);
+        }
+    }
+
     void onScanParamSetupCompleted(int status, int clientIf) throws RemoteException {
         ClientMap.App app = mClientMap.getById(clientIf);
         if (app == null || app.callback == null) {
@@ -1438,6 +1539,76 @@ public class GattService extends ProfileService {
         gattClientUnregisterAppNative(clientIf);
     }
 
+    /**
+     * Tracks the RSSI of a device in native code and tells the client through
+     * onFoundOrLost() when its estimated distance drops to nearCm or grows to
+     * farCm, instead of sending every sample. refRssi is the RSSI at one meter,
+     * used when the device does not advertise its TX power, and pathLossX10 ten
+     * times the path loss exponent (20 in free space). Samples come from the
+     * scans that are running and from readRemoteRssi().
+     */
+    boolean startProximityWatch(int clientIf, String address, int filter, int nearCm,
+            int farCm, int refRssi, int pathLossX10) {
+        enforceCallingOrSelfPermission(BLUETOOTH_PERM, "Need BLUETOOTH permission");
+
+        if (DBG) Log.d(TAG, "startProximityWatch() - clientIf=" + clientIf
+            + ", address=" + address + ", filter=" + filter + ", near=" + nearCm
+            + ", far=" + farCm);
+
+        if (!gattClientStartProximityWatchNative(clientIf, address, filter, nearCm, farCm,
+                refRssi, pathLossX10)) {
+            return false;
+        }
+        mProximityHandler.removeCallbacks(mProximityCheck);
+        mProximityHandler.postDelayed(mProximityCheck, PROXIMITY_CHECK_INTERVAL_MS);
+        return true;
+    }
+
+    /** Stops the proximity watch of address, or all of the client's if it is null. */
+    void stopProximityWatch(int clientIf, String address) {
+        enforceCallingOrSelfPermission(BLUETOOTH_PERM, "Need BLUETOOTH permission");
+
+        if (DBG) Log.d(TAG, "stopProximityWatch() - clientIf=" + clientIf
+            + ", address=" + address);
+
+        gattClientStopProximityWatchNative(clientIf, address);
+    }
+
+    /**
+     * Returns a value that changes whenever an advertiser tracked by an on-found / on-lost
+     * filter is found or lost, so a poller can skip {@link #getPresentAdvertisers} when
+     * nothing moved.
+     */
+    long getPresenceVersion() {
+        enforceCallingOrSelfPermission(BLUETOOTH_PERM, "Need BLUETOOTH permission");
+        return gattClientGetPresenceVersionNative();
+    }
+
+    /**
+     * Returns the advertisers the on-found / on-lost filters of a client currently report
+     * present, or those of all clients if clientIf is negative.
+     */
+    List<AdvertiserPresence> getPresentAdvertisers(int clientIf) {
+        enforceCallingOrSelfPermission(BLUETOOTH_PERM, "Need BLUETOOTH permission");
+
+        long[] rows = gattClientGetPresenceSnapshotNative();
+        List<AdvertiserPresence> present = new ArrayList<AdvertiserPresence>();
+        if (rows == null) return present;
+
+        byte[] address = new byte[MAC_ADDRESS_LENGTH];
+        for (int i = 0; i + PRESENCE_FIELDS <= rows.length; i += PRESENCE_FIELDS) {
+            int rowClientIf = (int) rows[i + 1];
+            if (clientIf >= 0 && rowClientIf != clientIf) continue;
+            for (int j = 0; j < MAC_ADDRESS_LENGTH; j++) {
+                address[j] = (byte) (rows[i] >> (8 * (MAC_ADDRESS_LENGTH - 1 - j)));
+            }
+            present.add(new AdvertiserPresence(Utils.getAddressStringFromByte(address),
+                    rowClientIf, rows[i + 2], rows[i + 3], (int) rows[i + 4], (int) rows[i + 5],
+                    (int) rows[i + 6], (int) rows[i + 7], (int) rows[i + 8]));
+        }
+        return present;
+    }
+
     void clientConnect(int clientIf, String address, boolean isDirect, int transport) {
         enforceCallingOrSelfPermission(BLUETOOTH_PERM, "Need BLUETOOTH permission");
 
@@ -1494,6 +1665,7 @@ public class GattService extends ProfileService {
         enforceCallingOrSelfPermission(BLUETOOTH_PERM, "Need BLUETOOTH permission");
 
         if (DBG) Log.d(TAG, "refreshDevice() - address=" + address);
+        if (mGattDbCacheEnabled) gattClientInvalidateGattDbCacheNative(address);
         gattClientRefreshNative(clientIf, address);
     }
 
@@ -1503,12 +1675,29 @@ public class GattService extends ProfileService {
         Integer connId = mClientMap.connIdByAddress(clientIf, address);
         if (DBG) Log.d(TAG, "discoverServices() - address=" + address + ", connId=" + connId);
 
-        if (connId != null)
+        if (connId != null) {
+            // A cached database is delivered right away, but the stack still runs discovery
+            // to validate it; its result only reaches the app if the database changed.
+            if (canUseGattDbCache(address) && gattClientGetCachedGattDbNative(connId, address)) {
+                if (DBG) Log.d(TAG, "discoverServices() - served from cache");
+            }
             gattClientSearchServiceNative(connId, true, 0, 0);
-        else
+        } else
             Log.e(TAG, "discoverServices() - No connection for " + address + "...");
     }
 
+    /**
+     * A cached database is only trusted for bonded devices by default, since
+     * only those are guaranteed to send a Service Changed indication when
+     * their attributes change while disconnected.
+     */
+    private boolean canUseGattDbCache(String address) {
+        if (!mGattDbCacheEnabled) return false;
+        if (mGattDbCacheUnbonded) return true;
+        BluetoothDevice device = mAdapter.getRemoteDevice(address);
+        return device.getBondState() == BluetoothDevice.BOND_BONDED;
+    }
+
     void readCharacteristic(int clientIf, String address, int handle, int authReq) {
         enforceCallingOrSelfPermission(BLUETOOTH_PERM, "Need BLUETOOTH permission");
 
@@ -1528,6 +1717,33 @@ public class GattService extends ProfileService {
         gattClientReadCharacteristicNative(connId, handle, authReq);
     }
 
+    /**
+     * Reads several characteristics back to back in native code. The app gets
+     * the usual onCharacteristicRead() for each handle once all of them have
+     * been read. Returns false if a batch is already running on the connection.
+     */
+    boolean readCharacteristics(int clientIf, String address, int[] handles, int authReq) {
+        enforceCallingOrSelfPermission(BLUETOOTH_PERM, "Need BLUETOOTH permission");
+
+        if (VDBG) Log.d(TAG, "readCharacteristics() - address=" + address
+            + ", count=" + handles.length);
+
+        Integer connId = mClientMap.connIdByAddress(clientIf, address);
+        if (connId == null) {
+            Log.e(TAG, "readCharacteristics() - No connection for " + address + "...");
+            return false;
+        }
+
+        for (int handle : handles) {
+            if (!permissionCheck(connId, handle)) {
+                Log.w(TAG, "readCharacteristics() - permission check failed!");
+                return false;
+            }
+        }
+
+        return gattClientReadCharacteristicBatchNative(connId, handles, authReq);
+    }
+
     void writeCharacteristic(int clientIf, String address, int handle, int writeType,
                              int authReq, byte[] value) {
         enforceCallingOrSelfPermission(BLUETOOTH_PERM, "Need BLUETOOTH permission");
@@ -1550,6 +1766,38 @@ public class GattService extends ProfileService {
         gattClientWriteCharacteristicNative(connId, handle, writeType, authReq, value);
     }
 
+    /**
+     * Writes a buffer larger than the MTU as a stream of write-without-response
+     * packets. Segmentation and flow control are done natively and the app gets
+     * a single onCharacteristicWrite() once the whole buffer has been sent.
+     * Returns false if a bulk write is already in progress on the connection.
+     */
+    boolean writeCharacteristicBulk(int clientIf, String address, int handle, int authReq,
+                                    byte[] value) {
+        enforceCallingOrSelfPermission(BLUETOOTH_PERM, "Need BLUETOOTH permission");
+
+        if (VDBG) Log.d(TAG, "writeCharacteristicBulk() - address=" + address
+            + ", length=" + (value == null ? 0 : value.length));
+
+        if (mReliableQueue.contains(address)) {
+            Log.e(TAG, "writeCharacteristicBulk() - reliable write in progress for " + address);
+            return false;
+        }
+
+        Integer connId = mClientMap.connIdByAddress(clientIf, address);
+        if (connId == null) {
+            Log.e(TAG, "writeCharacteristicBulk() - No connection for " + address + "...");
+            return false;
+        }
+
+        if (!permissionCheck(connId, handle)) {
+            Log.w(TAG, "writeCharacteristicBulk() - permission check failed!");
+            return false;
+        }
+
+        return gattClientWriteCharacteristicBulkNative(connId, handle, authReq, value);
+    }
+
     void readDescriptor(int clientIf, String address, int handle, int authReq) {
         enforceCallingOrSelfPermission(BLUETOOTH_PERM, "Need BLUETOOTH permission");
 
@@ -1801,6 +2049,27 @@ public class GattService extends ProfileService {
 
         mHandleMap.addRequest(transId, attrHandle);
 
+        deliverAttributeWrite(address, transId, entry, offset, length, needRsp, isPrep, data);
+    }
+
+    // Called on execute write with a prepared write that was assembled in
+    // native code. It reaches the app as a single prepared write at offset 0
+    // that needs no response, followed by the usual onExecuteWrite.
+    void onAttributeWriteAssembled(String address, int connId, int transId,
+                                   int attrHandle, byte[] data) throws RemoteException {
+        if (VDBG) Log.d(TAG, "onAttributeWriteAssembled() connId=" + connId
+            + ", address=" + address + ", handle=" + attrHandle
+            + ", length=" + data.length);
+
+        HandleMap.Entry entry = mHandleMap.getByHandle(attrHandle);
+        if (entry == null) return;
+
+        deliverAttributeWrite(address, transId, entry, 0, data.length, false, true, data);
+    }
+
+    private void deliverAttributeWrite(String address, int transId, HandleMap.Entry entry,
+                                       int offset, int length, boolean needRsp,
+                                       boolean isPrep, byte[] data) throws RemoteException {
         ServerMap.App app = mServerMap.getById(entry.serverIf);
         if (app == null) return;
 
@@ -1955,6 +2224,20 @@ public class GattService extends ProfileService {
                                     uuid.getMostSignificantBits());
     }
 
+    /**
+     * Lets native code acknowledge the fragments of long writes to this server
+     * and assemble them, so the app sees one prepared write per attribute when
+     * the execute write arrives instead of one per fragment.
+     */
+    void setPreparedWriteAssembly(int serverIf, boolean enable) {
+        enforceCallingOrSelfPermission(BLUETOOTH_PERM, "Need BLUETOOTH permission");
+
+        if (DBG) Log.d(TAG, "setPreparedWriteAssembly() - serverIf=" + serverIf
+            + ", enable=" + enable);
+
+        gattServerSetWriteAssemblyNative(serverIf, enable);
+    }
+
     void unregisterServer(int serverIf) {
         enforceCallingOrSelfPermission(BLUETOOTH_PERM, "Need BLUETOOTH permission");
 
@@ -2002,10 +2285,39 @@ public class GattService extends ProfileService {
 
     void addCharacteristic(int serverIf, UUID charUuid, int properties,
                            int permissions) {
+        addCharacteristic(serverIf, charUuid, properties, permissions, null);
+    }
+
+    /**
+     * Adds a characteristic with a constant value. Reads of it are answered
+     * by native code without calling back into the server app.
+     */
+    void addCharacteristic(int serverIf, UUID charUuid, int properties,
+                           int permissions, byte[] staticValue) {
         enforceCallingOrSelfPermission(BLUETOOTH_PERM, "Need BLUETOOTH permission");
 
-        if (DBG) Log.d(TAG, "addCharacteristic() - uuid=" + charUuid);
-        getActiveDeclaration().addCharacteristic(charUuid, properties, permissions);
+        if (DBG) Log.d(TAG, "addCharacteristic() - uuid=" + charUuid
+                + ", static=" + (staticValue != null));
+        getActiveDeclaration().addCharacteristic(charUuid, properties, permissions,
+                staticValue);
+    }
+
+    /**
+     * Replaces the constant value of a characteristic, or hands its reads
+     * back to the server app if |value| is null.
+     */
+    void setStaticCharacteristicValue(int serverIf, int srvcType, int srvcInstanceId,
+                                      UUID srvcUuid, int charInstanceId, UUID charUuid,
+                                      byte[] value) {
+        enforceCallingOrSelfPermission(BLUETOOTH_PERM, "Need BLUETOOTH permission");
+
+        int srvcHandle = mHandleMap.getServiceHandle(srvcUuid, srvcType, srvcInstanceId);
+        if (srvcHandle == 0) return;
+
+        int charHandle = mHandleMap.getCharacteristicHandle(srvcHandle, charUuid, charInstanceId);
+        if (charHandle == 0) return;
+
+        gattServerSetAttributeValueNative(serverIf, srvcHandle, charHandle, value);
     }
 
     void addDescriptor(int serverIf, UUID descUuid, int permissions) {
@@ -2063,6 +2375,68 @@ public class GattService extends ProfileService {
         mHandleMap.deleteRequest(requestId);
     }
 
+    /**
+     * Answers several pending requests from one device in a single native call.
+     * {@code values[i]} may be null for a response without a value.
+     */
+    void sendResponses(int serverIf, String address, int[] requestIds, int[] statuses,
+                       int[] offsets, byte[][] values) {
+        enforceCallingOrSelfPermission(BLUETOOTH_PERM, "Need BLUETOOTH permission");
+
+        if (requestIds == null || statuses == null || offsets == null || values == null
+                || statuses.length != requestIds.length || offsets.length != requestIds.length
+                || values.length != requestIds.length) {
+            Log.e(TAG, "sendResponses() - response arrays missing or of different lengths");
+            return;
+        }
+
+        if (VDBG) Log.d(TAG, "sendResponses() - address=" + address
+            + ", count=" + requestIds.length);
+
+        Integer connId = mServerMap.connIdByAddress(serverIf, address);
+        if (connId == null) {
+            Log.e(TAG, "sendResponses() - No connection for " + address + "...");
+            // The requests died with the connection.
+            for (int requestId : requestIds) {
+                mHandleMap.deleteRequest(requestId);
+            }
+            return;
+        }
+
+        int totalLength = 0;
+        for (byte[] value : values) {
+            if (value != null) totalLength += value.length;
+        }
+
+        int[] requests = new int[requestIds.length * RESPONSE_FIELDS];
+        byte[] packed = new byte[totalLength];
+        int pos = 0;
+        for (int i = 0; i < requestIds.length; i++) {
+            int handle = 0;
+            HandleMap.Entry entry = mHandleMap.getByRequestId(requestIds[i]);
+            if (entry != null) handle = entry.handle;
+
+            int length = values[i] == null ? 0 : values[i].length;
+            if (length > 0) System.arraycopy(values[i], 0, packed, pos, length);
+            pos += length;
+
+            int base = i * RESPONSE_FIELDS;
+            requests[base] = requestIds[i];
+            requests[base + 1] = (byte) statuses[i];
+            requests[base + 2] = handle;
+            requests[base + 3] = offsets[i];
+            requests[base + 4] = length;
+        }
+
+        int sent = gattServerSendResponsesNative(serverIf, connId, requests, packed, (byte) 0);
+        if (sent != requestIds.length) {
+            Log.w(TAG, "sendResponses() - sent " + sent + " of " + requestIds.length);
+        }
+        for (int requestId : requestIds) {
+            mHandleMap.deleteRequest(requestId);
+        }
+    }
+
     void sendNotification(int serverIf, String address, int srvcType,
                                  int srvcInstanceId, UUID srvcUuid,
                                  int charInstanceId, UUID charUuid,
@@ -2087,6 +2461,47 @@ public class GattService extends ProfileService {
         }
     }
 
+    /**
+     * Sends one notification or indication to several devices with a single
+     * native call. A null address list targets every device connected to the
+     * server. Returns the number of devices the value was sent to right away;
+     * devices on a congested link get it once the congestion clears.
+     */
+    int sendNotification(int serverIf, List<String> addresses, int srvcType,
+                         int srvcInstanceId, UUID srvcUuid,
+                         int charInstanceId, UUID charUuid,
+                         boolean confirm, byte[] value) {
+        enforceCallingOrSelfPermission(BLUETOOTH_PERM, "Need BLUETOOTH permission");
+
+        int srvcHandle = mHandleMap.getServiceHandle(srvcUuid, srvcType, srvcInstanceId);
+        if (srvcHandle == 0) return 0;
+
+        int charHandle = mHandleMap.getCharacteristicHandle(srvcHandle, charUuid, charInstanceId);
+        if (charHandle == 0) return 0;
+
+        int[] connIds;
+        if (addresses == null) {
+            List<ContextMap.Connection> connections = mServerMap.getConnectionByApp(serverIf);
+            connIds = new int[connections.size()];
+            for (int i = 0; i < connIds.length; i++) {
+                connIds[i] = connections.get(i).connId;
+            }
+        } else {
+            connIds = new int[addresses.size()];
+            int count = 0;
+            for (String address : addresses) {
+                Integer connId = mServerMap.connIdByAddress(serverIf, address);
+                if (connId != null && connId != 0) connIds[count++] = connId;
+            }
+            if (count != connIds.length) connIds = Arrays.copyOf(connIds, count);
+        }
+        if (connIds.length == 0) return 0;
+
+        if (VDBG) Log.d(TAG, "sendNotification() - " + connIds.length + " connections");
+        return gattServerSendNotificationMultiNative(serverIf, charHandle, connIds, confirm,
+                value);
+    }
+
 
     /**************************************************************************
      * Private functions
@@ -2184,7 +2599,7 @@ public class GattService extends ProfileService {
                     gattServerAddCharacteristicNative(serverIf, srvcHandle,
                         entry.uuid.getLeastSignificantBits(),
                         entry.uuid.getMostSignificantBits(),
-                        entry.properties, entry.permissions);
+                        entry.properties, entry.permissions, entry.value);
                     break;
 
                 case ServiceDeclaration.TYPE_DESCRIPTOR:
@@ -2324,6 +2739,87 @@ public class GattService extends ProfileService {
 
         sb.append("GATT Handle Map\n");
         mHandleMap.dump(sb);
+
+        long[] addrStats = gattGetAddressCacheStatsNative();
+        if (addrStats != null && addrStats.length == 4) {
+            sb.append("GATT Address Cache\n");
+            println(sb, "  entries: " + addrStats[0] + ", hits: " + addrStats[1]
+                    + ", misses: " + addrStats[2] + ", evictions: " + addrStats[3]);
+        }
+
+        long[] dedupeStats = gattGetScanDedupeStatsNative();
+        if (dedupeStats != null && dedupeStats.length == 2) {
+            sb.append("GATT Scan Duplicate Suppression\n");
+            println(sb, "  forwarded: " + dedupeStats[0] + ", suppressed: " + dedupeStats[1]);
+        }
+
+        long[] filterStats = gattClientGetScanFilterProgramStatsNative();
+        if (filterStats != null && filterStats.length == 3) {
+            sb.append("GATT Scan Filter Programming\n");
+            println(sb, "  programs: " + filterStats[0] + ", operations: " + filterStats[1]
+                    + ", saved: " + filterStats[2]);
+        }
+
+        long[] advStats = gattClientGetAdvPayloadStatsNative();
+        if (advStats != null && advStats.length == 5) {
+            sb.append("GATT Advertising Payload Cache\n");
+            println(sb, "  payloads: " + advStats[0] + ", rotations: " + advStats[1]
+                    + ", rotation writes: " + advStats[2] + ", failed: " + advStats[3]
+                    + ", timed out: " + advStats[4]);
+        }
+
+        long[] presenceStats = gattClientGetPresenceStatsNative();
+        if (presenceStats != null && presenceStats.length == 4) {
+            sb.append("GATT Advertiser Presence\n");
+            println(sb, "  known: " + presenceStats[0] + ", present: " + presenceStats[1]
+                    + ", transitions: " + presenceStats[2] + ", absorbed: " + presenceStats[3]);
+        }
+
+        long[] proximityStats = gattClientGetProximityStatsNative();
+        if (proximityStats != null && proximityStats.length == 3) {
+            sb.append("GATT Proximity Watches\n");
+            println(sb, "  watches: " + proximityStats[0] + ", samples: " + proximityStats[1]
+                    + ", zone changes: " + proximityStats[2]);
+        }
+
+        long[] readStats = gattClientGetReadBatchStatsNative();
+        if (readStats != null && readStats.length == 3) {
+            sb.append("GATT Client Read Batches\n");
+            println(sb, "  batches: " + readStats[0] + ", reads: " + readStats[1]
+                    + ", failed: " + readStats[2]);
+        }
+
+        long[] writeStats = gattClientGetWritePipelineStatsNative();
+        if (writeStats != null && writeStats.length == 6) {
+            sb.append("GATT Client Write Pipeline\n");
+            println(sb, "  completed: " + writeStats[0] + ", failed: " + writeStats[1]
+                    + ", segments: " + writeStats[2] + ", bytes: " + writeStats[3]
+                    + ", congestion pauses: " + writeStats[4]);
+            long busyMs = writeStats[5] / 1000000;
+            println(sb, "  busy: " + busyMs + "ms, throughput: "
+                    + (busyMs > 0 ? writeStats[3] * 1000 / busyMs : 0) + " bytes/s");
+        }
+
+        long[] notifyStats = gattServerGetNotifyStatsNative();
+        if (notifyStats != null && notifyStats.length == 3) {
+            sb.append("GATT Server Notification Fan-out\n");
+            println(sb, "  sent: " + notifyStats[0] + ", queued: " + notifyStats[1]
+                    + ", dropped: " + notifyStats[2]);
+        }
+
+        long[] prepStats = gattServerGetWriteAssemblyStatsNative();
+        if (prepStats != null && prepStats.length == 3) {
+            sb.append("GATT Server Prepared Write Assembly\n");
+            println(sb, "  fragments: " + prepStats[0] + ", assembled: " + prepStats[1]
+                    + ", rejected: " + prepStats[2]);
+        }
+
+        long[] attrStats = gattServerGetAttributeTableStatsNative();
+        if (attrStats != null && attrStats.length == 3) {
+            sb.append("GATT Server Attribute Table\n");
+            println(sb, "  entries: " + attrStats[0] + ", version: " + attrStats[1]
+                    + ", reads served: " + attrStats[2]);
+        }
     }
 
     void addScanResult() {
@@ -2377,6 +2873,29 @@ public class GattService extends ProfileService {
     private native void initializeNative();
     private native void cleanupNative();
 
+    private native long[] gattGetAddressCacheStatsNative();
+
+    private native long[] gattGetScanDedupeStatsNative();
+
+    private native long[] gattClientGetScanFilterProgramStatsNative();
+
+    private native boolean gattClientStartProximityWatchNative(int client_if, String address,
+            int filter, int near_cm, int far_cm, int ref_rssi, int path_loss_x10);
+
+    private native void gattClientStopProximityWatchNative(int client_if, String address);
+
+    private native int gattClientCheckProximityNative();
+
+    private native long[] gattClientGetProximityStatsNative();
+
+    private native long[] gattClientGetAdvPayloadStatsNative();
+
+    private native long gattClientGetPresenceVersionNative();
+
+    private native long[] gattClientGetPresenceSnapshotNative();
+
+    private native long[] gattClientGetPresenceStatsNative();
+
     private native int gattClientGetDeviceTypeNative(String address);
 
     private native void gattClientRegisterAppNative(long app_uuid_lsb,
@@ -2397,13 +2916,29 @@ public class GattService extends ProfileService {
 
     private native void gattClientGetGattDbNative(int conn_id);
 
+    private native void gattClientInitDbCacheNative(String path);
+
+    private native boolean gattClientGetCachedGattDbNative(int conn_id, String address);
+
+    private native void gattClientInvalidateGattDbCacheNative(String address);
+
     private native void gattClientReadCharacteristicNative(int conn_id, int handle, int authReq);
 
+    private native boolean gattClientReadCharacteristicBatchNative(int conn_id,
+            int[] handles, int auth_req);
+
+    private native long[] gattClientGetReadBatchStatsNative();
+
     private native void gattClientReadDescriptorNative(int conn_id, int handle, int authReq);
 
     private native void gattClientWriteCharacteristicNative(int conn_id,
             int handle, int write_type, int auth_req, byte[] value);
 
+    private native boolean gattClientWriteCharacteristicBulkNative(int conn_id,
+            int handle, int auth_req, byte[] value);
+
+    private native long[] gattClientGetWritePipelineStatsNative();
+
     private native void gattClientWriteDescriptorNative(int conn_id, int handle,
             int write_type, int auth_req, byte[] value);
 
@@ -2415,6 +2950,11 @@ public class GattService extends ProfileService {
     private native void gattClientReadRemoteRssiNative(int clientIf,
             String address);
 
+    private native boolean gattClientRegisterNotifyBufferNative(int conn_id,
+            ByteBuffer buffer, int slot_size);
+
+    private native void gattClientUnregisterNotifyBufferNative(int conn_id);
+
     private native void gattClientConfigureMTUNative(int conn_id, int mtu);
 
     private native void gattConnectionParameterUpdateNative(int client_if, String address,
@@ -2441,7 +2981,7 @@ public class GattService extends ProfileService {
 
     private native void gattServerAddCharacteristicNative (int server_if,
             int svc_handle, long char_uuid_lsb, long char_uuid_msb,
-            int properties, int permissions);
+            int properties, int permissions, byte[] value);
 
     private native void gattServerAddDescriptorNative (int server_if,
             int svc_handle, long desc_uuid_lsb, long desc_uuid_msb,
@@ -2465,4 +3005,26 @@ public class GattService extends ProfileService {
     private native void gattServerSendResponseNative (int server_if,
             int conn_id, int trans_id, int status, int handle, int offset,
             byte[] val, int auth_req);
+
+    private native int gattServerSendResponsesNative (int server_if, int conn_id,
+            int[] requests, byte[] values, int auth_req);
+
+    // Only registered in builds with test hooks, see jni/Android.mk.
+    @VisibleForTesting
+    static native long gattServerBenchmarkResponseNative(int[] requests, byte[] values,
+            int mode);
+
+    private native int gattServerSendNotificationMultiNative (int server_if,
+            int attr_handle, int[] conn_ids, boolean confirm, byte[] val);
+
+    private native long[] gattServerGetNotifyStatsNative();
+
+    private native void gattServerSetAttributeValueNative (int server_if,
+            int svc_handle, int attr_handle, byte[] value);
+
+    private native long[] gattServerGetAttributeTableStatsNative();
+
+    private native void gattServerSetWriteAssemblyNative(int server_if, boolean enable);
+
+    private native long[] gattServerGetWriteAssemblyStatsNative();
 }
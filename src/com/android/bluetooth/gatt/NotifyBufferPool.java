@@ -0,0 +1,62 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+package com.android.bluetooth.gatt;
+
+import java.nio.ByteBuffer;
+
+/**
+ * Direct buffer shared with native code for the notifications of one GATT
+ * client connection. The native layer writes each notification payload into
+ * the next slot and only passes the slot index and length up, so no Java
+ * array is allocated per notification on the JNI side.
+ *
+ * Slot contents are only valid for the duration of the upcall that reported
+ * them. Payloads are copied into per-length scratch arrays that are reused
+ * across notifications; callers must not hold on to the returned array.
+ * @hide
+ */
+/*package*/
+
+class NotifyBufferPool {
+    // Largest notification value is ATT_MTU (517) - 3 bytes of header.
+    static final int SLOT_SIZE = 520;
+    static final int NUM_SLOTS = 4;
+
+    final int connId;
+    final ByteBuffer buffer;
+
+    private final byte[][] mScratch = new byte[SLOT_SIZE + 1][];
+
+    NotifyBufferPool(int connId) {
+        this.connId = connId;
+        this.buffer = ByteBuffer.allocateDirect(SLOT_SIZE * NUM_SLOTS);
+    }
+
+    /**
+     * Returns the payload stored in |slot|. The returned array is reused by
+     * the next call with the same length.
+     */
+    byte[] read(int slot, int length) {
+        byte[] data = mScratch[length];
+        if (data == null) {
+            data = new byte[length];
+            mScratch[length] = data;
+        }
+        buffer.position(slot * SLOT_SIZE);
+        buffer.get(data, 0, length);
+        return data;
+    }
+}
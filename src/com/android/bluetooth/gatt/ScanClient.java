@@ -49,6 +49,9 @@ import java.util.UUID;
 
     AppScanStats stats = null;
 
+    // Native pre-filter slot assigned by ScanManager, or -1 if results are not pre-filtered.
+    int prefilterSlot = -1;
+
     private static final ScanSettings DEFAULT_SCAN_SETTINGS = new ScanSettings.Builder()
             .setScanMode(ScanSettings.SCAN_MODE_LOW_LATENCY).build();
 
@@ -30,22 +30,28 @@ import android.os.Handler;
 import android.os.HandlerThread;
 import android.os.Looper;
 import android.os.Message;
+import android.os.ParcelUuid;
 import android.os.RemoteException;
 import android.os.ServiceManager;
 import android.os.SystemClock;
 import android.util.Log;
 
+import com.android.bluetooth.R;
 import com.android.bluetooth.Utils;
 import com.android.bluetooth.btservice.AdapterService;
 import com.android.internal.app.IBatteryStats;
 
+import java.io.ByteArrayOutputStream;
+import java.nio.charset.StandardCharsets;
 import java.util.ArrayDeque;
+import java.util.Arrays;
 import java.util.Collections;
 import java.util.Deque;
 import java.util.HashMap;
 import java.util.HashSet;
 import java.util.Map;
 import java.util.Set;
+import java.util.UUID;
 import java.util.concurrent.ConcurrentHashMap;
 import java.util.concurrent.CountDownLatch;
 import java.util.concurrent.TimeUnit;
@@ -69,6 +75,7 @@ public class ScanManager {
     private static final int MSG_STOP_BLE_SCAN = 1;
     private static final int MSG_FLUSH_BATCH_RESULTS = 2;
     private static final int MSG_SCAN_TIMEOUT = 3;
+    private static final int MSG_FLUSH_SCAN_RESULTS = 4;
 
     // Maximum msec before scan gets downgraded to opportunistic
     private static final int SCAN_TIMEOUT_MS = 30 * 60 * 1000;
@@ -96,6 +103,14 @@ public class ScanManager {
 
     private CountDownLatch mLatch;
 
+    // Native scan result batching. Results are delivered once this many are pending or the
+    // oldest one is older than the timeout. A batch size of 0 or 1 disables batching.
+    private int mScanResultBatchSize;
+    private int mScanResultBatchTimeoutMs;
+
+    // Whether regular scan results are pre-filtered in native code against the clients' filters.
+    private boolean mScanPrefilterEnabled;
+
     ScanManager(GattService service) {
         mRegularScanClients = Collections.newSetFromMap(new ConcurrentHashMap<ScanClient, Boolean>());
         mBatchClients = Collections.newSetFromMap(new ConcurrentHashMap<ScanClient, Boolean>());
@@ -109,11 +124,24 @@ public class ScanManager {
         HandlerThread thread = new HandlerThread("BluetoothScanManager");
         thread.start();
         mHandler = new ClientHandler(thread.getLooper());
+
+        mScanResultBatchSize =
+                mService.getResources().getInteger(R.integer.gatt_scan_result_batch_size);
+        mScanResultBatchTimeoutMs =
+                mService.getResources().getInteger(R.integer.gatt_scan_result_batch_timeout_ms);
+        mScanNative.configureScanResultBatching(mScanResultBatchSize, mScanResultBatchTimeoutMs);
+        mScanPrefilterEnabled = mService.getResources().getBoolean(R.bool.gatt_scan_prefilter);
+        mScanNative.configureScanDedupe(
+                mService.getResources().getInteger(R.integer.gatt_scan_dedupe_window_ms),
+                mService.getResources().getInteger(R.integer.gatt_scan_dedupe_rssi_delta));
     }
 
     void cleanup() {
         mRegularScanClients.clear();
         mBatchClients.clear();
+        mScanNative.configureScanResultBatching(0, 0);
+        mScanNative.clearScanPrefilters();
+        mScanNative.configureScanDedupe(0, 0);
         mScanNative.cleanup();
 
         if (mHandler != null) {
@@ -211,6 +239,9 @@ public class ScanManager {
                 case MSG_SCAN_TIMEOUT:
                     mScanNative.regularScanTimeout();
                     break;
+                case MSG_FLUSH_SCAN_RESULTS:
+                    handleFlushScanResults();
+                    break;
                 default:
                     // Shouldn't happen.
                     Log.e(TAG, "received an unkown message : " + msg.what);
@@ -235,8 +266,10 @@ public class ScanManager {
                 mBatchClients.add(client);
                 mScanNative.startBatchScan(client);
             } else {
+                mScanNative.assignScanPrefilter(client);
                 mRegularScanClients.add(client);
                 mScanNative.startRegularScan(client);
+                scheduleScanResultFlush();
                 if (!mScanNative.isOpportunisticScanClient(client)) {
                     mScanNative.configureRegularScanParams();
 
@@ -270,6 +303,11 @@ public class ScanManager {
                     mHandler.removeMessages(MSG_SCAN_TIMEOUT);
                 }
 
+                if (mRegularScanClients.isEmpty()) {
+                    removeMessages(MSG_FLUSH_SCAN_RESULTS);
+                    mScanNative.flushScanResults();
+                }
+
                 if (!mScanNative.isOpportunisticScanClient(client)) {
                     mScanNative.configureRegularScanParams();
                 }
@@ -293,6 +331,19 @@ public class ScanManager {
             }
         }
 
+        // Pushes out results held by native batching so a quiet scan does not
+        // hold on to a partial batch longer than the configured timeout.
+        void handleFlushScanResults() {
+            mScanNative.flushScanResults();
+            scheduleScanResultFlush();
+        }
+
+        void scheduleScanResultFlush() {
+            if (mScanResultBatchSize <= 1 || mRegularScanClients.isEmpty()) return;
+            if (hasMessages(MSG_FLUSH_SCAN_RESULTS)) return;
+            sendEmptyMessageDelayed(MSG_FLUSH_SCAN_RESULTS, mScanResultBatchTimeoutMs);
+        }
+
         void handleFlushBatchResults(ScanClient client) {
             Utils.enforceAdminPermission(mService);
             if (!mBatchClients.contains(client)) {
@@ -403,6 +454,10 @@ public class ScanManager {
         // The logic is AND for each filter field.
         private static final int LIST_LOGIC_TYPE = 0x1111111;
         private static final int FILTER_LOGIC_TYPE = 1;
+        // Limits of gattClientScanFilterProgramNative().
+        private static final int SCAN_FILTER_MAX_ENTRIES = 8;
+        private static final int SCAN_FILTER_ENTRY_MAX_LEN = 64;
+        private static final int SCAN_FILTER_PARAM_FIELDS = 10;
         // Filter indices that are available to user. It's sad we need to maintain filter index.
         private final Deque<Integer> mFilterIndexStack;
         // Map of clientIf and Filter indices used by client.
@@ -411,6 +466,18 @@ public class ScanManager {
         private final Set<Integer> mAllPassRegularClients = new HashSet<>();
         private final Set<Integer> mAllPassBatchClients = new HashSet<>();
 
+        // Native pre-filter slots, see assignScanPrefilter(). The last slot is shared by clients
+        // that did not get one of their own and always matches.
+        private static final int PREFILTER_SLOTS = 32;
+        private static final int PREFILTER_SHARED_SLOT = PREFILTER_SLOTS - 1;
+        private static final int PREFILTER_ADDRESS = 0x01;
+        private static final int PREFILTER_SERVICE_UUID = 0x02;
+        private static final int PREFILTER_MANUFACTURER = 0x04;
+        private static final int PREFILTER_SERVICE_DATA = 0x08;
+        private static final int PREFILTER_MAX_DATA_LENGTH = 255;
+        private int mUsedPrefilterSlots;
+        private int mSharedPrefilterClients;
+
         private AlarmManager mAlarmManager;
         private PendingIntent mBatchScanIntervalIntent;
 
@@ -681,6 +748,7 @@ public class ScanManager {
                     }
                 }
             }
+            releaseScanPrefilter(getRegularScanClient(client.clientIf));
             mRegularScanClients.remove(client);
             if (numRegularScanClients() == 0) {
                 logd("stop scan");
@@ -753,6 +821,142 @@ public class ScanManager {
             setBatchAlarm();
         }
 
+        void configureScanResultBatching(int maxResults, int timeoutMs) {
+            logd("configureScanResultBatching() - maxResults=" + maxResults
+                    + ", timeoutMs=" + timeoutMs);
+            gattClientSetScanBatchingNative(maxResults, timeoutMs);
+        }
+
+        void flushScanResults() {
+            gattClientFlushScanBatchNative();
+        }
+
+        void configureScanDedupe(int windowMs, int rssiDelta) {
+            logd("configureScanDedupe() - windowMs=" + windowMs + ", rssiDelta=" + rssiDelta);
+            if (windowMs < 0 || rssiDelta < 0) {
+                Log.e(TAG, "Invalid scan dedupe config, dedupe disabled");
+                windowMs = 0;
+                rssiDelta = 0;
+            }
+            gattClientSetScanDedupeNative(windowMs, rssiDelta);
+        }
+
+        /**
+         * Gives a regular scan client a native pre-filter slot programmed with its filters.
+         * GattService only considers a result for the client if the slot's bit is set in the
+         * mask that comes with the result.
+         */
+        void assignScanPrefilter(ScanClient client) {
+            if (!mScanPrefilterEnabled) return;
+            int slot = Integer.numberOfTrailingZeros(~mUsedPrefilterSlots);
+            if (slot >= PREFILTER_SHARED_SLOT) {
+                client.prefilterSlot = PREFILTER_SHARED_SLOT;
+                if (mSharedPrefilterClients++ == 0) {
+                    gattClientSetScanPrefilterNative(PREFILTER_SHARED_SLOT, null);
+                }
+                return;
+            }
+            mUsedPrefilterSlots |= 1 << slot;
+            client.prefilterSlot = slot;
+            gattClientSetScanPrefilterNative(slot, buildScanPrefilter(client));
+        }
+
+        void releaseScanPrefilter(ScanClient client) {
+            if (client == null || client.prefilterSlot < 0) return;
+            int slot = client.prefilterSlot;
+            client.prefilterSlot = -1;
+            if (slot == PREFILTER_SHARED_SLOT) {
+                if (--mSharedPrefilterClients > 0) return;
+            } else {
+                mUsedPrefilterSlots &= ~(1 << slot);
+            }
+            gattClientClearScanPrefilterNative(slot);
+        }
+
+        void clearScanPrefilters() {
+            for (int slot = 0; slot < PREFILTER_SLOTS; slot++) {
+                gattClientClearScanPrefilterNative(slot);
+            }
+            mUsedPrefilterSlots = 0;
+            mSharedPrefilterClients = 0;
+        }
+
+        // Compiles the filters of a client into the format read by the native pre-filter. Null
+        // lets every result through and is used whenever a filter has no field the native side
+        // can evaluate.
+        private byte[] buildScanPrefilter(ScanClient client) {
+            if (client.isServer || client.uuids.length > 0) return null;
+            if (client.filters == null || client.filters.isEmpty()) return null;
+
+            ByteArrayOutputStream out = new ByteArrayOutputStream();
+            for (ScanFilter filter : client.filters) {
+                int flags = 0;
+                if (filter.getDeviceAddress() != null) flags |= PREFILTER_ADDRESS;
+                if (filter.getServiceUuid() != null) flags |= PREFILTER_SERVICE_UUID;
+                if (filter.getManufacturerId() >= 0 && filter.getManufacturerData() != null) {
+                    if (filter.getManufacturerData().length > PREFILTER_MAX_DATA_LENGTH) {
+                        return null;
+                    }
+                    flags |= PREFILTER_MANUFACTURER;
+                }
+                if (filter.getServiceDataUuid() != null && filter.getServiceData() != null) {
+                    if (filter.getServiceData().length > PREFILTER_MAX_DATA_LENGTH) return null;
+                    flags |= PREFILTER_SERVICE_DATA;
+                }
+                if (flags == 0) return null;
+
+                out.write(flags);
+                if ((flags & PREFILTER_ADDRESS) != 0) {
+                    byte[] address = Utils.getBytesFromAddress(filter.getDeviceAddress());
+                    out.write(address, 0, address.length);
+                }
+                if ((flags & PREFILTER_SERVICE_UUID) != 0) {
+                    writeUuid(out, filter.getServiceUuid());
+                    ParcelUuid mask = filter.getServiceUuidMask();
+                    if (mask != null) {
+                        writeUuid(out, mask);
+                    } else {
+                        writeOnes(out, 16);
+                    }
+                }
+                if ((flags & PREFILTER_MANUFACTURER) != 0) {
+                    int id = filter.getManufacturerId();
+                    out.write(id & 0xFF);
+                    out.write((id >> 8) & 0xFF);
+                    writeMaskedData(out, filter.getManufacturerData(),
+                            filter.getManufacturerDataMask());
+                }
+                if ((flags & PREFILTER_SERVICE_DATA) != 0) {
+                    writeUuid(out, filter.getServiceDataUuid());
+                    writeMaskedData(out, filter.getServiceData(), filter.getServiceDataMask());
+                }
+            }
+            return out.toByteArray();
+        }
+
+        // UUIDs are written little endian, as they appear in advertising data.
+        private void writeUuid(ByteArrayOutputStream out, ParcelUuid parcelUuid) {
+            UUID uuid = parcelUuid.getUuid();
+            long lsb = uuid.getLeastSignificantBits();
+            long msb = uuid.getMostSignificantBits();
+            for (int i = 0; i < 8; i++) out.write((int) (lsb >> (8 * i)) & 0xFF);
+            for (int i = 0; i < 8; i++) out.write((int) (msb >> (8 * i)) & 0xFF);
+        }
+
+        private void writeMaskedData(ByteArrayOutputStream out, byte[] data, byte[] mask) {
+            out.write(data.length);
+            out.write(data, 0, data.length);
+            if (mask != null && mask.length == data.length) {
+                out.write(mask, 0, mask.length);
+            } else {
+                writeOnes(out, data.length);
+            }
+        }
+
+        private void writeOnes(ByteArrayOutputStream out, int count) {
+            for (int i = 0; i < count; i++) out.write(0xFF);
+        }
+
         void cleanup() {
             mAlarmManager.cancel(mBatchScanIntervalIntent);
             // Protect against multiple calls of cleanup.
@@ -797,7 +1001,12 @@ public class ScanManager {
                                 filterIndex, 0);
                 waitForCallback();
             } else {
-                Deque<Integer> clientFilterIndices = new ArrayDeque<Integer>();
+                Deque<Integer> clientFilterIndices = programScanFilters(client, deliveryMode);
+                if (clientFilterIndices != null) {
+                    mClientFilterIndexMap.put(clientIf, clientFilterIndices);
+                    return;
+                }
+                clientFilterIndices = new ArrayDeque<Integer>();
                 for (ScanFilter filter : client.filters) {
                     ScanFilterQueue queue = new ScanFilterQueue();
                     queue.addScanFilter(filter);
@@ -831,6 +1040,139 @@ public class ScanManager {
             }
         }
 
+        // Installs all filters of the client with a single native call, which reuses the entries
+        // already in the controller at the free indices it picks. Returns the indices used, or
+        // null if the filters have to be added one entry at a time. Tracking entries are only
+        // allocated once the filters are programmed, so a null return leaves them untouched.
+        private Deque<Integer> programScanFilters(ScanClient client, int deliveryMode) {
+            int clientIf = client.clientIf;
+            int numFilters = client.filters.size();
+            int[] entryFilters = new int[SCAN_FILTER_MAX_ENTRIES * numFilters];
+            int[] entryTypes = new int[entryFilters.length];
+            int[] entryOffsets = new int[entryFilters.length + 1];
+            int[] params = new int[SCAN_FILTER_PARAM_FIELDS * numFilters];
+            ByteArrayOutputStream entryData = new ByteArrayOutputStream();
+            int numEntries = 0;
+            for (int f = 0; f < numFilters; f++) {
+                ScanFilterQueue queue = new ScanFilterQueue();
+                queue.addScanFilter(client.filters.get(f));
+                int featureSelection = queue.getFeatureSelection();
+                while (!queue.isEmpty()) {
+                    ScanFilterQueue.Entry entry = queue.pop();
+                    int start = entryData.size();
+                    if (!writeFilterEntry(entryData, entry)) continue;
+                    if (entryData.size() - start > SCAN_FILTER_ENTRY_MAX_LEN
+                            || numEntries == entryFilters.length) {
+                        return null;
+                    }
+                    entryFilters[numEntries] = f;
+                    entryTypes[numEntries] = entry.type;
+                    entryOffsets[++numEntries] = entryData.size();
+                }
+                int trackEntries = 0;
+                if (deliveryMode == DELIVERY_MODE_ON_FOUND_LOST) {
+                    trackEntries = getNumOfTrackingAdvertisements(client.settings);
+                }
+                FilterParams filterParams = getFilterParams(clientIf, client, featureSelection,
+                        0, trackEntries);
+                int p = SCAN_FILTER_PARAM_FIELDS * f;
+                params[p] = filterParams.getFeatSeln();
+                params[p + 1] = filterParams.getListLogicType();
+                params[p + 2] = filterParams.getFiltLogicType();
+                params[p + 3] = filterParams.getRSSIHighValue();
+                params[p + 4] = filterParams.getRSSILowValue();
+                params[p + 5] = filterParams.getDelyMode();
+                params[p + 6] = filterParams.getFoundTimeout();
+                params[p + 7] = filterParams.getLostTimeout();
+                params[p + 8] = filterParams.getFoundTimeOutCnt();
+                params[p + 9] = filterParams.getNumOfTrackEntries();
+            }
+
+            int[] freeIndices = new int[mFilterIndexStack.size()];
+            int i = 0;
+            for (Integer filterIndex : mFilterIndexStack) freeIndices[i++] = filterIndex;
+            int[] chosen = new int[numFilters];
+
+            resetCountDownLatch();
+            int numOps = gattClientScanFilterProgramNative(clientIf, freeIndices,
+                    Arrays.copyOf(entryFilters, numEntries), Arrays.copyOf(entryTypes, numEntries),
+                    Arrays.copyOf(entryOffsets, numEntries + 1), entryData.toByteArray(), params,
+                    chosen);
+            if (numOps < 0) return null;
+            waitForCallback();
+            logd("programScanFilters() - clientIf=" + clientIf + ", filters=" + numFilters
+                    + ", operations=" + numOps);
+
+            // stopRegularScan() frees the tracking entries of every filter.
+            for (int f = 0; deliveryMode == DELIVERY_MODE_ON_FOUND_LOST && f < numFilters; f++) {
+                int trackEntries = getNumOfTrackingAdvertisements(client.settings);
+                if (!manageAllocationOfTrackingAdvertisement(trackEntries, true)) {
+                    Log.e(TAG, "No hardware resources for onfound/onlost filter " +
+                            trackEntries);
+                    try {
+                        mService.onScanManagerErrorCallback(clientIf,
+                                    ScanCallback.SCAN_FAILED_INTERNAL_ERROR);
+                    } catch (RemoteException e) {
+                        Log.e(TAG, "failed on onScanManagerCallback", e);
+                    }
+                }
+            }
+
+            Deque<Integer> clientFilterIndices = new ArrayDeque<Integer>();
+            for (int filterIndex : chosen) {
+                mFilterIndexStack.remove(filterIndex);
+                clientFilterIndices.add(filterIndex);
+            }
+            return clientFilterIndices;
+        }
+
+        // Encodes a filter entry the way gattClientScanFilterProgramNative() expects. Returns
+        // false for entries addFilterToController() would not add either.
+        private boolean writeFilterEntry(ByteArrayOutputStream out, ScanFilterQueue.Entry entry) {
+            switch (entry.type) {
+                case ScanFilterQueue.TYPE_DEVICE_ADDRESS:
+                    byte[] address = Utils.getBytesFromAddress(entry.address);
+                    out.write(address, 0, address.length);
+                    out.write(entry.addr_type);
+                    return true;
+
+                case ScanFilterQueue.TYPE_SERVICE_UUID:
+                case ScanFilterQueue.TYPE_SOLICIT_UUID:
+                    writeLong(out, entry.uuid.getLeastSignificantBits());
+                    writeLong(out, entry.uuid.getMostSignificantBits());
+                    writeLong(out, entry.uuid_mask.getLeastSignificantBits());
+                    writeLong(out, entry.uuid_mask.getMostSignificantBits());
+                    return true;
+
+                case ScanFilterQueue.TYPE_LOCAL_NAME:
+                    if (entry.name == null || entry.name.isEmpty()) return false;
+                    byte[] name = entry.name.getBytes(StandardCharsets.UTF_8);
+                    out.write(name, 0, name.length);
+                    return true;
+
+                case ScanFilterQueue.TYPE_MANUFACTURER_DATA:
+                    if (entry.data_mask.length != entry.data.length) return false;
+                    out.write(entry.company & 0xFF);
+                    out.write((entry.company >> 8) & 0xFF);
+                    out.write(entry.company_mask & 0xFF);
+                    out.write((entry.company_mask >> 8) & 0xFF);
+                    out.write(entry.data, 0, entry.data.length);
+                    out.write(entry.data_mask, 0, entry.data_mask.length);
+                    return true;
+
+                case ScanFilterQueue.TYPE_SERVICE_DATA:
+                    if (entry.data_mask.length != entry.data.length) return false;
+                    out.write(entry.data, 0, entry.data.length);
+                    out.write(entry.data_mask, 0, entry.data_mask.length);
+                    return true;
+            }
+            return false;
+        }
+
+        private void writeLong(ByteArrayOutputStream out, long value) {
+            for (int i = 0; i < 8; i++) out.write((int) (value >> (8 * i)) & 0xFF);
+        }
+
         // Check whether the filter should be added to controller.
         // Note only on ALL_PASS filter should be added.
         private boolean shouldAddAllPassFilterToController(ScanClient client, int deliveryMode) {
@@ -974,6 +1316,12 @@ public class ScanManager {
         // Configure filter parameters.
         private void configureFilterParamter(int clientIf, ScanClient client, int featureSelection,
                 int filterIndex, int numOfTrackingEntries) {
+            gattClientScanFilterParamAddNative(getFilterParams(clientIf, client, featureSelection,
+                    filterIndex, numOfTrackingEntries));
+        }
+
+        private FilterParams getFilterParams(int clientIf, ScanClient client,
+                int featureSelection, int filterIndex, int numOfTrackingEntries) {
             int deliveryMode = getDeliveryMode(client);
             int rssiThreshold = Byte.MIN_VALUE;
             ScanSettings settings = client.settings;
@@ -983,10 +1331,9 @@ public class ScanManager {
             onLostTimeout = 10000;
             logd("configureFilterParamter " + onFoundTimeout + " " + onLostTimeout + " "
                     + onFoundCount + " " + numOfTrackingEntries);
-            FilterParams FiltValue = new FilterParams(clientIf, filterIndex, featureSelection,
+            return new FilterParams(clientIf, filterIndex, featureSelection,
                     LIST_LOGIC_TYPE, FILTER_LOGIC_TYPE, rssiThreshold, rssiThreshold, deliveryMode,
                     onFoundTimeout, onLostTimeout, onFoundCount, numOfTrackingEntries);
-            gattClientScanFilterParamAddNative(FiltValue);
         }
 
         // Get delivery mode based on scan settings.
@@ -1119,6 +1466,18 @@ public class ScanManager {
         private native void gattSetScanParametersNative(int client_if, int scan_interval,
                 int scan_window);
 
+        /************************** Scan result batching native methods **************************/
+        private native void gattClientSetScanBatchingNative(int max_results, int timeout_ms);
+
+        private native void gattClientFlushScanBatchNative();
+
+        private native void gattClientSetScanDedupeNative(int window_ms, int rssi_delta);
+
+        /************************** Scan result pre-filter native methods ************************/
+        private native void gattClientSetScanPrefilterNative(int slot, byte[] program);
+
+        private native void gattClientClearScanPrefilterNative(int slot);
+
         /************************** Filter related native methods ********************************/
         private native void gattClientScanFilterAddNative(int client_if,
                 int filter_type, int filter_index, int company_id,
@@ -1144,6 +1503,10 @@ public class ScanManager {
         private native void gattClientScanFilterClearNative(int client_if,
                 int filter_index);
 
+        private native int gattClientScanFilterProgramNative(int client_if, int[] free_indices,
+                int[] entry_filters, int[] entry_types, int[] entry_offsets, byte[] entry_data,
+                int[] params, int[] chosen);
+
         private native void gattClientScanFilterEnableNative(int client_if,
                 boolean enable);
 
@@ -38,6 +38,7 @@ class ServiceDeclaration {
         int serviceType = 0;
         int serviceHandle = 0;
         boolean advertisePreferred = false;
+        byte[] value = null;
 
         Entry(UUID uuid, int serviceType, int instance) {
             this.type = TYPE_SERVICE;
@@ -54,12 +55,13 @@ class ServiceDeclaration {
             this.advertisePreferred = advertisePreferred;
         }
 
-        Entry(UUID uuid, int properties, int permissions, int instance) {
+        Entry(UUID uuid, int properties, int permissions, int instance, byte[] value) {
             this.type = TYPE_CHARACTERISTIC;
             this.uuid = uuid;
             this.instance = instance;
             this.permissions = permissions;
             this.properties = properties;
+            this.value = value;
         }
 
         Entry(UUID uuid, int permissions) {
@@ -96,8 +98,17 @@ class ServiceDeclaration {
     }
 
     void addCharacteristic(UUID uuid, int properties, int permissions) {
+        addCharacteristic(uuid, properties, permissions, null);
+    }
+
+    /**
+     * Adds a characteristic whose reads are answered with |value| by the
+     * native attribute table instead of the app. A null value keeps the
+     * read requests going to the app.
+     */
+    void addCharacteristic(UUID uuid, int properties, int permissions, byte[] value) {
         synchronized (mLock) {
-            mEntries.add(new Entry(uuid, properties, permissions, 0 /*instance*/));
+            mEntries.add(new Entry(uuid, properties, permissions, 0 /*instance*/, value));
             mNumHandles += 2;
         }
     }
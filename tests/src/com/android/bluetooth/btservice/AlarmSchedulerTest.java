@@ -0,0 +1,68 @@
+
+package com.android.bluetooth.btservice;
+
+import android.test.AndroidTestCase;
+import android.test.suitebuilder.annotation.LargeTest;
+import android.test.suitebuilder.annotation.SmallTest;
+import android.util.Log;
+
+/**
+ * Test cases for the native alarm scheduler behind the stack's wake alarm
+ * callout.
+ */
+public class AlarmSchedulerTest extends AndroidTestCase {
+    private static final String TAG = "AlarmSchedulerTest";
+
+    // The A2DP media timer fires every 20 ms while streaming.
+    private static final int STREAMING_ALARMS = 500;
+    private static final int STREAMING_PERIOD_MS = 20;
+    private static final int STREAMING_WAKE_EVERY = 50;
+
+    private static final int FIRED = 0;
+    private static final int JAVA_CALLS = 1;
+    private static final int LEGACY_JAVA_CALLS = 2;
+    private static final int SET_AVG_NS = 3;
+    private static final int SET_MAX_NS = 4;
+    private static final int LATE_AVG_NS = 5;
+    private static final int LATE_MAX_NS = 6;
+    private static final int WAKE_HOLDS = 7;
+    private static final int WAKE_HELD = 8;
+
+    @SmallTest
+    public void testNonWakingAlarmsStayNative() {
+        long[] stats = AdapterService.benchmarkAlarmsNative(20, 1, 0);
+
+        assertEquals(20, stats[FIRED]);
+        assertEquals(0, stats[JAVA_CALLS]);
+        assertEquals(0, stats[WAKE_HOLDS]);
+    }
+
+    @SmallTest
+    public void testWakingAlarmsReachJava() {
+        long[] stats = AdapterService.benchmarkAlarmsNative(10, 1, 1);
+
+        assertEquals(10, stats[FIRED]);
+        assertEquals(10, stats[JAVA_CALLS]);
+        // The fake Java alarms never fire, so the timerfd runs every one.
+        assertEquals(10, stats[WAKE_HOLDS]);
+        assertEquals(0, stats[WAKE_HELD]);
+    }
+
+    /**
+     * Replays the alarms of 10 s of A2DP streaming, one waking alarm in 50,
+     * and logs set and fire latency and the Java calls made against the
+     * Java call per alarm the AlarmManager path took.
+     */
+    @LargeTest
+    public void testStreamingBenchmark() {
+        long[] stats = AdapterService.benchmarkAlarmsNative(STREAMING_ALARMS,
+                STREAMING_PERIOD_MS, STREAMING_WAKE_EVERY);
+
+        assertEquals(STREAMING_ALARMS, stats[FIRED]);
+        assertEquals(STREAMING_ALARMS / STREAMING_WAKE_EVERY, stats[JAVA_CALLS]);
+        Log.i(TAG, "Fired " + stats[FIRED] + " alarms: java calls=" + stats[JAVA_CALLS]
+                + " (was " + stats[LEGACY_JAVA_CALLS] + ") set avg=" + stats[SET_AVG_NS] / 1000
+                + "us max=" + stats[SET_MAX_NS] / 1000 + "us late avg="
+                + stats[LATE_AVG_NS] / 1000 + "us max=" + stats[LATE_MAX_NS] / 1000 + "us");
+    }
+}
@@ -0,0 +1,176 @@
+
+package com.android.bluetooth.btservice;
+
+import android.os.SystemClock;
+import android.test.AndroidTestCase;
+import android.test.suitebuilder.annotation.LargeTest;
+import android.test.suitebuilder.annotation.MediumTest;
+import android.test.suitebuilder.annotation.SmallTest;
+import android.util.Log;
+
+import java.util.Arrays;
+import java.util.concurrent.LinkedBlockingQueue;
+import java.util.concurrent.TimeUnit;
+
+/**
+ * Test cases for {@link DiscoveryBatch}.
+ */
+public class DiscoveryBatchTest extends AndroidTestCase {
+    private static final String TAG = "DiscoveryBatchTest";
+
+    private static final int STRESS_DEVICES = 500;
+    private static final int STRESS_REPEATS = 3;
+
+    private static final int DEADLINE_INTERVAL_MS = 200;
+    private static final int STOP_INTERVAL_MS = 60000;
+
+    private static final int TYPE_BDNAME = AbstractionLayer.BT_PROPERTY_BDNAME;
+    private static final int TYPE_BDADDR = AbstractionLayer.BT_PROPERTY_BDADDR;
+    private static final int TYPE_CLASS = AbstractionLayer.BT_PROPERTY_CLASS_OF_DEVICE;
+    private static final int TYPE_RSSI = AbstractionLayer.BT_PROPERTY_REMOTE_RSSI;
+
+    @SmallTest
+    public void testCoalesceMergesRepeatedDevice() {
+        byte[] addresses = new byte[] { 1, 2, 3, 4, 5, 6, 1, 2, 3, 4, 5, 6 };
+        int[] offsets = new int[] { 0, 2, 4 };
+        int[] types = new int[] { TYPE_BDNAME, TYPE_RSSI, TYPE_RSSI, TYPE_CLASS };
+        byte[][] values = new byte[][] {
+                "speaker".getBytes(), new byte[] { -70 }, new byte[] { -50 },
+                new byte[] { 0x14, 0x04, 0x24, 0x00 } };
+        DiscoveryBatch batch = DiscoveryBatch.coalesceNative(addresses, offsets, types, values);
+
+        assertEquals(1, batch.count);
+        assertTrue(Arrays.equals(new byte[] { 1, 2, 3, 4, 5, 6 }, batch.getAddress(0)));
+        assertTrue(Arrays.equals(new int[] { TYPE_BDNAME, TYPE_RSSI, TYPE_CLASS },
+                batch.getTypes(0)));
+        assertTrue(Arrays.equals(new byte[] { -50 }, batch.getValues(0)[1]));
+    }
+
+    @SmallTest
+    public void testCoalesceKeepsDeviceWithoutProperties() {
+        byte[] addresses = new byte[] { 1, 2, 3, 4, 5, 6, 6, 5, 4, 3, 2, 1 };
+        int[] offsets = new int[] { 0, 0, 1 };
+        int[] types = new int[] { TYPE_RSSI };
+        byte[][] values = new byte[][] { new byte[] { -60 } };
+        DiscoveryBatch batch = DiscoveryBatch.coalesceNative(addresses, offsets, types, values);
+
+        assertEquals(2, batch.count);
+        assertEquals(0, batch.getTypes(0).length);
+        assertTrue(Arrays.equals(new int[] { TYPE_RSSI }, batch.getTypes(1)));
+    }
+
+    /**
+     * Collects 500 synthetic devices, each found several times with a new
+     * RSSI, into one batch and checks every device comes out once with its
+     * last RSSI.
+     */
+    @LargeTest
+    public void testCoalesceStress() {
+        int found = STRESS_DEVICES * STRESS_REPEATS;
+        byte[] addresses = new byte[found * 6];
+        int[] offsets = new int[found + 1];
+        int[] types = new int[found * 4];
+        byte[][] values = new byte[found * 4][];
+        int n = 0;
+        for (int r = 0; r < STRESS_REPEATS; r++) {
+            for (int d = 0; d < STRESS_DEVICES; d++) {
+                int i = r * STRESS_DEVICES + d;
+                byte[] address = address(d);
+                System.arraycopy(address, 0, addresses, i * 6, 6);
+                offsets[i] = n;
+                types[n] = TYPE_BDADDR;
+                values[n++] = address;
+                types[n] = TYPE_BDNAME;
+                values[n++] = ("device " + d).getBytes();
+                types[n] = TYPE_CLASS;
+                values[n++] = new byte[] { (byte) d, 0x04, 0x24, 0x00 };
+                types[n] = TYPE_RSSI;
+                values[n++] = new byte[] { (byte) -(40 + r) };
+            }
+        }
+        offsets[found] = n;
+
+        long start = SystemClock.elapsedRealtimeNanos();
+        DiscoveryBatch batch = DiscoveryBatch.coalesceNative(addresses, offsets, types, values);
+        long nanos = SystemClock.elapsedRealtimeNanos() - start;
+
+        assertEquals(STRESS_DEVICES, batch.count);
+        assertEquals(STRESS_DEVICES * 4, batch.types.length);
+        for (int d = 0; d < STRESS_DEVICES; d++) {
+            assertTrue(Arrays.equals(address(d), batch.getAddress(d)));
+            assertTrue(Arrays.equals(new int[] { TYPE_BDADDR, TYPE_BDNAME, TYPE_CLASS, TYPE_RSSI },
+                    batch.getTypes(d)));
+            byte[][] deviceValues = batch.getValues(d);
+            assertEquals("device " + d, new String(deviceValues[1]));
+            assertEquals(-(40 + STRESS_REPEATS - 1), deviceValues[3][0]);
+        }
+        Log.i(TAG, "Coalesced " + found + " results into " + batch.count + " devices in "
+                + nanos / 1000 + "us");
+    }
+
+    /**
+     * Checks that devices found during discovery go up in one batch once the
+     * interval has passed, without anything else flushing them.
+     */
+    @MediumTest
+    public void testDeadlineDeliversBatch() throws InterruptedException {
+        Sink sink = new Sink();
+        assertTrue(DiscoveryBatch.startTestNative(sink, DEADLINE_INTERVAL_MS));
+        try {
+            long start = SystemClock.elapsedRealtime();
+            assertTrue(DiscoveryBatch.foundTestNative(address(1), -60));
+            assertTrue(DiscoveryBatch.foundTestNative(address(2), -70));
+            assertTrue(DiscoveryBatch.foundTestNative(address(1), -50));
+
+            DiscoveryBatch batch = sink.batches.poll(DEADLINE_INTERVAL_MS * 10,
+                    TimeUnit.MILLISECONDS);
+            long elapsed = SystemClock.elapsedRealtime() - start;
+            assertNotNull(batch);
+            assertTrue("delivered after " + elapsed + "ms", elapsed >= DEADLINE_INTERVAL_MS);
+            assertEquals(2, batch.count);
+            assertTrue(Arrays.equals(address(1), batch.getAddress(0)));
+            int[] types = batch.getTypes(0);
+            assertEquals(TYPE_RSSI, types[types.length - 1]);
+            assertEquals(-50, batch.getValues(0)[types.length - 1][0]);
+            assertTrue(sink.batches.isEmpty());
+        } finally {
+            DiscoveryBatch.stopTestNative();
+        }
+    }
+
+    /**
+     * Checks that the end of discovery passes the pending batch up right away
+     * and turns batching off.
+     */
+    @SmallTest
+    public void testStopFlushesAndDisables() {
+        Sink sink = new Sink();
+        assertTrue(DiscoveryBatch.startTestNative(sink, STOP_INTERVAL_MS));
+        try {
+            assertTrue(DiscoveryBatch.foundTestNative(address(3), -40));
+            assertTrue(sink.batches.isEmpty());
+        } finally {
+            DiscoveryBatch.stopTestNative();
+        }
+
+        DiscoveryBatch batch = sink.batches.poll();
+        assertNotNull(batch);
+        assertEquals(1, batch.count);
+        assertFalse(DiscoveryBatch.foundTestNative(address(4), -40));
+    }
+
+    private static class Sink {
+        final LinkedBlockingQueue<DiscoveryBatch> batches =
+                new LinkedBlockingQueue<DiscoveryBatch>();
+
+        // Called from native code in place of JniCallbacks.devicesFoundCallback().
+        void devicesFoundCallback(byte[] addresses, int[] offsets, int[] types,
+                byte[][] values) {
+            batches.add(new DiscoveryBatch(addresses, offsets, types, values));
+        }
+    }
+
+    private static byte[] address(int device) {
+        return new byte[] { 0x00, 0x11, 0x22, 0x33, (byte) (device >> 8), (byte) device };
+    }
+}
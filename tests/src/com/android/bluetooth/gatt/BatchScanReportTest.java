@@ -0,0 +1,156 @@
+
+package com.android.bluetooth.gatt;
+
+import android.os.SystemClock;
+import android.test.AndroidTestCase;
+import android.test.suitebuilder.annotation.LargeTest;
+import android.test.suitebuilder.annotation.SmallTest;
+import android.util.Log;
+
+import java.util.Arrays;
+
+/**
+ * Test cases for {@link BatchScanReport}.
+ */
+public class BatchScanReportTest extends AndroidTestCase {
+    private static final String TAG = "BatchScanReportTest";
+
+    private static final int BENCHMARK_RECORDS = 10000;
+    private static final int BENCHMARK_ITERATIONS = 20;
+
+    @SmallTest
+    public void testParseTruncated() {
+        byte[] data = new byte[] {
+                0x06, 0x05, 0x04, 0x03, 0x02, 0x01, 0x00, 0x00, -60, 0x02, 0x00 };
+        long before = SystemClock.elapsedRealtimeNanos();
+        BatchScanReport report = BatchScanReport.parseNative(
+                ScanManager.SCAN_RESULT_TYPE_TRUNCATED, 1, data);
+
+        assertEquals(1, report.count);
+        assertTrue(Arrays.equals(new byte[] { 1, 2, 3, 4, 5, 6 }, report.getAddress(0)));
+        assertEquals(-60, report.rssi[0]);
+        assertTrue(report.timestampsNanos[0] >= before - 100000000L);
+        assertEquals(0, report.getScanRecord(0).length);
+    }
+
+    @SmallTest
+    public void testParseFull() {
+        byte[] data = new byte[] {
+                0x06, 0x05, 0x04, 0x03, 0x02, 0x01, 0x00, 0x00, -70, 0x00, 0x00,
+                0x03, 0x02, 0x01, 0x06,
+                0x02, 0x01, 0x0a,
+                0x0b, 0x0a, 0x09, 0x08, 0x07, 0x06, 0x00, 0x00, -80, 0x00, 0x00,
+                0x00,
+                0x00 };
+        BatchScanReport report = BatchScanReport.parseNative(
+                ScanManager.SCAN_RESULT_TYPE_FULL, 2, data);
+
+        assertEquals(2, report.count);
+        assertTrue(Arrays.equals(new byte[] { 6, 7, 8, 9, 10, 11 }, report.getAddress(1)));
+        assertEquals(-80, report.rssi[1]);
+        assertTrue(Arrays.equals(new byte[] { 0x02, 0x01, 0x06, 0x01, 0x0a },
+                report.getScanRecord(0)));
+        assertEquals(0, report.getScanRecord(1).length);
+    }
+
+    @SmallTest
+    public void testParseFullStopsAtTruncatedRecord() {
+        byte[] data = new byte[] {
+                0x06, 0x05, 0x04, 0x03, 0x02, 0x01, 0x00, 0x00, -70, 0x00, 0x00,
+                0x1f, 0x02, 0x01 };
+        BatchScanReport report = BatchScanReport.parseNative(
+                ScanManager.SCAN_RESULT_TYPE_FULL, 1, data);
+
+        assertEquals(0, report.count);
+    }
+
+    /**
+     * Compares the native parser with the per-field Java walk it replaced on a
+     * report of 10k full records.
+     */
+    @LargeTest
+    public void testParseFullBenchmark() {
+        byte[] data = buildFullReport(BENCHMARK_RECORDS);
+
+        long javaNanos = Long.MAX_VALUE;
+        long nativeNanos = Long.MAX_VALUE;
+        for (int i = 0; i < BENCHMARK_ITERATIONS; i++) {
+            long start = SystemClock.elapsedRealtimeNanos();
+            int javaCount = parseFullInJava(data);
+            javaNanos = Math.min(javaNanos, SystemClock.elapsedRealtimeNanos() - start);
+
+            start = SystemClock.elapsedRealtimeNanos();
+            BatchScanReport report = BatchScanReport.parseNative(
+                    ScanManager.SCAN_RESULT_TYPE_FULL, BENCHMARK_RECORDS, data);
+            nativeNanos = Math.min(nativeNanos, SystemClock.elapsedRealtimeNanos() - start);
+
+            assertEquals(BENCHMARK_RECORDS, javaCount);
+            assertEquals(BENCHMARK_RECORDS, report.count);
+        }
+        Log.i(TAG, "Parsed " + BENCHMARK_RECORDS + " full records: java=" + javaNanos / 1000
+                + "us native=" + nativeNanos / 1000 + "us");
+    }
+
+    private static byte[] buildFullReport(int numRecords) {
+        final int advLen = 31;
+        final int rspLen = 20;
+        final int recordLen = 11 + 1 + advLen + 1 + rspLen;
+        byte[] data = new byte[numRecords * recordLen];
+        for (int i = 0; i < numRecords; i++) {
+            int pos = i * recordLen;
+            data[pos] = (byte) i;
+            data[pos + 1] = (byte) (i >> 8);
+            data[pos + 8] = (byte) -(40 + i % 50);
+            data[pos + 9] = (byte) i;
+            data[pos + 11] = (byte) advLen;
+            data[pos + 12 + advLen] = (byte) rspLen;
+        }
+        return data;
+    }
+
+    // Mirrors the Java parser that GattService used before parsing moved to
+    // native code: one array allocation per field plus a merged scan record.
+    private static int parseFullInJava(byte[] batchRecord) {
+        int count = 0;
+        int position = 0;
+        long now = SystemClock.elapsedRealtimeNanos();
+        while (position < batchRecord.length) {
+            byte[] address = extractBytes(batchRecord, position, 6);
+            reverse(address);
+            position += 8;
+            int rssi = batchRecord[position++];
+            byte[] timestamp = extractBytes(batchRecord, position, 2);
+            long timestampNanos = now - ((timestamp[0] & 0xff) | ((timestamp[1] & 0xff) << 8))
+                    * 50000000L;
+            position += 2;
+
+            int advertisePacketLen = batchRecord[position++];
+            byte[] advertiseBytes = extractBytes(batchRecord, position, advertisePacketLen);
+            position += advertisePacketLen;
+            int scanResponsePacketLen = batchRecord[position++];
+            byte[] scanResponseBytes = extractBytes(batchRecord, position, scanResponsePacketLen);
+            position += scanResponsePacketLen;
+            byte[] scanRecord = new byte[advertisePacketLen + scanResponsePacketLen];
+            System.arraycopy(advertiseBytes, 0, scanRecord, 0, advertisePacketLen);
+            System.arraycopy(scanResponseBytes, 0, scanRecord,
+                    advertisePacketLen, scanResponsePacketLen);
+            count++;
+        }
+        return count;
+    }
+
+    private static void reverse(byte[] address) {
+        int len = address.length;
+        for (int i = 0; i < len / 2; ++i) {
+            byte b = address[i];
+            address[i] = address[len - 1 - i];
+            address[len - 1 - i] = b;
+        }
+    }
+
+    private static byte[] extractBytes(byte[] scanRecord, int start, int length) {
+        byte[] bytes = new byte[length];
+        System.arraycopy(scanRecord, start, bytes, 0, length);
+        return bytes;
+    }
+}
@@ -2,7 +2,8 @@
 package com.android.bluetooth.gatt;
 
 import android.test.AndroidTestCase;
-import android.test.suitebuilder.annotation.SmallTest;
+import android.test.suitebuilder.annotation.LargeTest;
+import android.util.Log;
 
 import com.android.bluetooth.gatt.GattService;
 
@@ -10,13 +11,75 @@ import com.android.bluetooth.gatt.GattService;
  * Test cases for {@link GattService}.
  */
 public class GattServiceTest extends AndroidTestCase {
+    private static final String TAG = "GattServiceTest";
 
-    @SmallTest
-    public void testParseBatchTimestamp() {
-        GattService service = new GattService();
-        long timestampNanos = service.parseTimestampNanos(new byte[] {
-                -54, 7 });
-        assertEquals(99700000000L, timestampNanos);
+    private static final int RESPONSE_BENCHMARK_ITERATIONS = 100000;
+    private static final int RESPONSE_BENCHMARK_BATCH = 16;
+    private static final int RESPONSE_LENGTH = 512;
+
+    private static final int MODE_ELEMENT_COPY = 0;
+    private static final int MODE_REGION_COPY = 1;
+    private static final int MODE_BATCHED = 2;
+
+    /**
+     * Compares marshalling 512 byte long-read responses one per JNI call with
+     * the element copy the response path used to do, one per call with the
+     * region copy it does now, and several per call through the batched
+     * response path.
+     */
+    @LargeTest
+    public void testResponseMarshallingBenchmark() {
+        byte[] value = new byte[RESPONSE_LENGTH];
+        for (int i = 0; i < value.length; i++) value[i] = (byte) (i * 7 + 3);
+
+        int[] requests = new int[RESPONSE_BENCHMARK_BATCH * 5];
+        byte[] values = new byte[RESPONSE_BENCHMARK_BATCH * RESPONSE_LENGTH];
+        for (int i = 0; i < RESPONSE_BENCHMARK_BATCH; i++) {
+            requests[i * 5] = i;
+            requests[i * 5 + 2] = 0x10;
+            requests[i * 5 + 4] = RESPONSE_LENGTH;
+            System.arraycopy(value, 0, values, i * RESPONSE_LENGTH, RESPONSE_LENGTH);
+        }
+
+        // Warm up all paths first.
+        runSingle(value, MODE_ELEMENT_COPY, 1024);
+        runSingle(value, MODE_REGION_COPY, 1024);
+        runBatched(requests, values, 1024);
+
+        long elementNanos = runSingle(value, MODE_ELEMENT_COPY, RESPONSE_BENCHMARK_ITERATIONS);
+        long regionNanos = runSingle(value, MODE_REGION_COPY, RESPONSE_BENCHMARK_ITERATIONS);
+        long batchedNanos = runBatched(requests, values, RESPONSE_BENCHMARK_ITERATIONS);
+
+        Log.i(TAG, "Marshalled " + RESPONSE_BENCHMARK_ITERATIONS + " x " + RESPONSE_LENGTH
+                + " byte responses: element copy="
+                + elementNanos / RESPONSE_BENCHMARK_ITERATIONS
+                + "ns region copy=" + regionNanos / RESPONSE_BENCHMARK_ITERATIONS
+                + "ns batched by " + RESPONSE_BENCHMARK_BATCH + "="
+                + batchedNanos / RESPONSE_BENCHMARK_ITERATIONS + "ns per response");
+        assertTrue("region copy slower than element copy", regionNanos < elementNanos);
+        assertTrue("batched responses slower than single ones", batchedNanos < regionNanos);
+    }
+
+    private static long runSingle(byte[] value, int mode, int responses) {
+        long check = 0;
+        long start = System.nanoTime();
+        for (int i = 0; i < responses; i++) {
+            check += GattService.gattServerBenchmarkResponseNative(null, value, mode);
+        }
+        long elapsed = System.nanoTime() - start;
+        assertEquals((long) (value[RESPONSE_LENGTH / 2] & 0xFF) * responses, check);
+        return elapsed;
     }
 
+    private static long runBatched(int[] requests, byte[] values, int responses) {
+        long check = 0;
+        long start = System.nanoTime();
+        for (int i = 0; i < responses; i += RESPONSE_BENCHMARK_BATCH) {
+            check += GattService.gattServerBenchmarkResponseNative(requests, values,
+                    MODE_BATCHED);
+        }
+        long elapsed = System.nanoTime() - start;
+        assertEquals((long) (values[RESPONSE_LENGTH / 2] & 0xFF) * responses, check);
+        return elapsed;
+    }
 }